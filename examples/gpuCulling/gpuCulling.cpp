@@ -0,0 +1,341 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Vookoo GPU driven rendering example
+//
+// A compute shader culls instance bounding spheres against the view frustum
+// and writes indirect draw commands. The CPU never touches the instances
+// after the initial upload, it just issues one drawIndexedIndirectCount.
+//
+// Occlusion culling uses a vku::DepthPyramid built from the depth buffer at
+// the end of each frame. The next frame tests against it using the previous
+// frame's matrix, so instances hidden last frame are skipped.
+//
+// Usage: gpuCulling [number of instances]   (default 100000, try 1000000)
+//
+// GPU times for the cull and draw are printed every 256 frames.
+//
+
+#include <vku/vku_framework.hpp>
+#include <vku/vku.hpp>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <random>
+
+int main(int argc, char *argv[]) {
+  uint32_t numInstances = argc > 1 ? (uint32_t)std::atoi(argv[1]) : 100000;
+
+  // Initialise the GLFW framework.
+  glfwInit();
+  glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
+
+  // Make a window
+  auto *title = "gpuCulling";
+  auto glfwwindow = glfwCreateWindow(800, 800, title, nullptr, nullptr);
+
+  // drawIndexedIndirectCount is core in Vulkan 1.2 but must be enabled.
+  // Non-zero firstInstance in indirect commands is also an optional feature.
+  vku::InstanceMaker im{};
+  im.defaultLayers();
+  im.apiVersion(VK_API_VERSION_1_2);
+  vku::DeviceMaker dm{};
+  dm.defaultLayers();
+  dm.physicalDeviceFeatures().enableDrawIndirectFirstInstance();
+  dm.vulkan12Features().enableDrawIndirectCount();
+
+  // Initialise the Vookoo demo framework.
+  vku::Framework fw{im, dm};
+  if (!fw.ok()) {
+    std::cout << "Framework creation failed" << std::endl;
+    exit(1);
+  }
+
+  vk::Device device = fw.device();
+
+  // Create a window to draw into
+  vku::Window window{fw.instance(), fw.device(), fw.physicalDevice(), fw.graphicsQueueFamilyIndex(), glfwwindow};
+  if (!window.ok()) {
+    std::cout << "Window creation failed" << std::endl;
+    exit(1);
+  }
+  window.clearColorValue() = {0.0f, 0.0f, 0.0f, 1.0f};
+
+  ////////////////////////////////////////
+  //
+  // A cube which fits in a sphere of radius one.
+
+  struct Vertex {
+    glm::vec3 pos;
+    glm::vec3 normal;
+  };
+
+  std::vector<Vertex> vertices;
+  std::vector<uint32_t> indices;
+  for (int face = 0; face != 6; ++face) {
+    glm::vec3 n{0, 0, 0}, u{0, 0, 0}, v{0, 0, 0};
+    float sign = face & 1 ? -1.0f : 1.0f;
+    n[face/2] = sign;
+    u[(face/2+1)%3] = 1.0f;
+    v[(face/2+2)%3] = sign;
+    uint32_t base = (uint32_t)vertices.size();
+    vertices.push_back(Vertex{(n - u - v) * 0.5f, n});
+    vertices.push_back(Vertex{(n + u - v) * 0.5f, n});
+    vertices.push_back(Vertex{(n + u + v) * 0.5f, n});
+    vertices.push_back(Vertex{(n - u + v) * 0.5f, n});
+    for (uint32_t i : {0, 1, 2, 0, 2, 3}) indices.push_back(base + i);
+  }
+
+  vku::VertexBuffer vbo(device, fw.memprops(), vertices.size() * sizeof(Vertex));
+  vbo.upload(device, fw.memprops(), window.commandPool(), fw.graphicsQueue(), vertices);
+  vku::IndexBuffer ibo(device, fw.memprops(), indices.size() * sizeof(uint32_t));
+  ibo.upload(device, fw.memprops(), window.commandPool(), fw.graphicsQueue(), indices);
+
+  ////////////////////////////////////////
+  //
+  // Instances: bounding sphere and colour, scattered through a large box.
+
+  struct Instance {
+    glm::vec4 sphere;
+    glm::vec4 colour;
+  };
+
+  std::vector<Instance> instances(numInstances);
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<float> posdist(-1.0f, 1.0f);
+  std::uniform_real_distribution<float> coldist(0.25f, 1.0f);
+  float extent = std::cbrt((float)numInstances) * 2.0f;
+  for (auto &inst : instances) {
+    inst.sphere = glm::vec4(posdist(rng) * extent, posdist(rng) * extent, posdist(rng) * extent, 0.5f);
+    inst.colour = glm::vec4(coldist(rng), coldist(rng), coldist(rng), 1.0f);
+  }
+
+  vku::InstanceBuffer instanceBuffer(device, fw.memprops(), instances.size() * sizeof(Instance));
+  instanceBuffer.upload(device, fw.memprops(), window.commandPool(), fw.graphicsQueue(), instances);
+
+  // One command per instance at worst, written by the compute shader.
+  // The draw count lives in its own small buffer.
+  vku::IndirectBuffer drawBuffer(device, fw.memprops(), numInstances * sizeof(vk::DrawIndexedIndirectCommand));
+  vku::IndirectBuffer countBuffer(device, fw.memprops(), sizeof(uint32_t));
+
+  // std140 layout, see gpuCulling.comp
+  struct Uniform {
+    glm::mat4 worldToPerspective;
+    glm::mat4 prevWorldToPerspective;
+    glm::vec4 frustumPlanes[6];
+    glm::vec2 pyramidSize;
+    uint32_t numInstances;
+    uint32_t indexCount;
+    uint32_t useOcclusion;
+    uint32_t pad[3];
+  };
+
+  vku::UniformBuffer ubo(device, fw.memprops(), sizeof(Uniform));
+
+  ////////////////////////////////////////
+  //
+  // Descriptor sets shared by the culling and drawing pipelines.
+
+  vku::DescriptorSetLayoutMaker dslm{};
+  dslm.buffer(0, vk::DescriptorType::eUniformBuffer, vk::ShaderStageFlagBits::eVertex|vk::ShaderStageFlagBits::eCompute, 1);
+  dslm.buffer(1, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute, 1);
+  dslm.buffer(2, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute, 1);
+  dslm.buffer(3, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute, 1);
+  dslm.image(4, vk::DescriptorType::eCombinedImageSampler, vk::ShaderStageFlagBits::eCompute, 1);
+  auto layout = dslm.createUnique(device);
+
+  vku::DescriptorSetMaker dsm{};
+  dsm.layout(*layout);
+  auto descriptorSets = dsm.create(device, fw.descriptorPool());
+
+  vku::DescriptorSetUpdater update;
+  update.beginDescriptorSet(descriptorSets[0]);
+  update.beginBuffers(0, 0, vk::DescriptorType::eUniformBuffer);
+  update.buffer(ubo.buffer(), 0, sizeof(Uniform));
+  update.beginBuffers(1, 0, vk::DescriptorType::eStorageBuffer);
+  update.buffer(instanceBuffer.buffer(), 0, instanceBuffer.size());
+  update.beginBuffers(2, 0, vk::DescriptorType::eStorageBuffer);
+  update.buffer(drawBuffer.buffer(), 0, drawBuffer.size());
+  update.beginBuffers(3, 0, vk::DescriptorType::eStorageBuffer);
+  update.buffer(countBuffer.buffer(), 0, countBuffer.size());
+  update.update(device);
+
+  vku::PipelineLayoutMaker plm{};
+  plm.descriptorSetLayout(*layout);
+  auto pipelineLayout = plm.createUnique(device);
+
+  ////////////////////////////////////////
+  //
+  // Pipelines
+
+  vku::ShaderModule comp{device, BINARY_DIR "gpuCulling.comp.spv"};
+  vku::ShaderModule vert{device, BINARY_DIR "gpuCulling.vert.spv"};
+  vku::ShaderModule frag{device, BINARY_DIR "gpuCulling.frag.spv"};
+  vku::ShaderModule pyramidShader{device, BINARY_DIR "depthPyramid.comp.spv"};
+
+  // Min/max depth pyramid, rebuilt from the depth buffer every frame.
+  vku::DepthPyramid pyramid(device, fw.memprops(), fw.pipelineCache(), fw.descriptorPool(), pyramidShader);
+  glm::mat4 prevWorldToPerspective{1.0f};
+
+  vku::ComputePipelineMaker cpm{};
+  cpm.shader(vk::ShaderStageFlagBits::eCompute, comp);
+  auto cullPipeline = cpm.createUnique(device, fw.pipelineCache(), *pipelineLayout);
+
+  auto buildPipeline = [&]() {
+    vku::PipelineMaker pm{window.width(), window.height()};
+    return pm
+      .shader(vk::ShaderStageFlagBits::eVertex, vert)
+      .shader(vk::ShaderStageFlagBits::eFragment, frag)
+      .vertexBinding(0, sizeof(Vertex), vk::VertexInputRate::eVertex)
+      .vertexAttribute(0, 0, vk::Format::eR32G32B32Sfloat, offsetof(Vertex, pos))
+      .vertexAttribute(1, 0, vk::Format::eR32G32B32Sfloat, offsetof(Vertex, normal))
+      .vertexBinding(1, sizeof(Instance), vk::VertexInputRate::eInstance)
+      .vertexAttribute(2, 1, vk::Format::eR32G32B32A32Sfloat, offsetof(Instance, sphere))
+      .vertexAttribute(3, 1, vk::Format::eR32G32B32A32Sfloat, offsetof(Instance, colour))
+      .depthTestEnable(VK_TRUE)
+      .cullMode(vk::CullModeFlagBits::eBack)
+      .frontFace(vk::FrontFace::eCounterClockwise)
+      .createUnique(device, fw.pipelineCache(), *pipelineLayout, window.renderPass());
+  };
+
+  auto drawPipeline = buildPipeline();
+
+  // This matrix converts between OpenGL perspective and Vulkan perspective.
+  // It flips the Y axis and shrinks the Z value to [0,1]
+  glm::mat4 leftHandCorrection(
+    1.0f,  0.0f, 0.0f, 0.0f,
+    0.0f, -1.0f, 0.0f, 0.0f,
+    0.0f,  0.0f, 0.5f, 0.0f,
+    0.0f,  0.0f, 0.5f, 1.0f
+  );
+
+  ////////////////////////////////////////
+  //
+  // Timestamps: start, after culling, after drawing for each swap chain image.
+
+  vk::QueryPoolCreateInfo qpci{{}, vk::QueryType::eTimestamp, (uint32_t)window.numImageIndices() * 3};
+  auto queryPool = device.createQueryPoolUnique(qpci);
+  float timestampPeriod = fw.physicalDevice().getProperties().limits.timestampPeriod;
+  std::vector<bool> timesWritten(window.numImageIndices());
+  double cullTime = 0, drawTime = 0;
+  int numTimes = 0;
+
+  int iFrame = 0;
+  while (!glfwWindowShouldClose(glfwwindow)) {
+    glfwPollEvents();
+
+    window.draw(device, fw.graphicsQueue(),
+      [&](vk::CommandBuffer cb, int imageIndex, vk::RenderPassBeginInfo &rpbi) {
+        static auto ww = window.width();
+        static auto wh = window.height();
+        if (ww != window.width() || wh != window.height()) {
+          ww = window.width();
+          wh = window.height();
+          drawPipeline = buildPipeline();
+        }
+
+        // (Re)create the pyramid to match the depth buffer and point the culling shader at it.
+        auto &depth = window.depthStencilImage();
+        if (pyramid.resize(depth.extent().width, depth.extent().height)) {
+          vku::DescriptorSetUpdater pyramidUpdate;
+          pyramidUpdate.beginDescriptorSet(descriptorSets[0]);
+          pyramidUpdate.beginImages(4, 0, vk::DescriptorType::eCombinedImageSampler);
+          pyramidUpdate.image(pyramid.sampler(), pyramid.imageView(), pyramid.layout());
+          pyramidUpdate.update(device);
+        }
+
+        // The fence for this image has signalled, so its timestamps are ready.
+        uint64_t times[3];
+        if (timesWritten[imageIndex] && device.getQueryPoolResults(*queryPool, imageIndex * 3, 3, sizeof(times), times, sizeof(uint64_t), vk::QueryResultFlagBits::e64) == vk::Result::eSuccess) {
+          cullTime += (times[1] - times[0]) * timestampPeriod * 1e-6;
+          drawTime += (times[2] - times[1]) * timestampPeriod * 1e-6;
+          if (++numTimes == 256) {
+            std::cout << numInstances << " instances: cull " << cullTime / numTimes << "ms draw " << drawTime / numTimes << "ms\n";
+            cullTime = drawTime = 0;
+            numTimes = 0;
+          }
+        }
+
+        // Fly the camera through the field of instances.
+        float t = iFrame * 0.002f;
+        glm::vec3 eye{std::sin(t) * extent * 0.5f, std::cos(t * 0.7f) * extent * 0.25f, std::cos(t) * extent * 0.5f};
+        glm::vec3 target = eye + glm::vec3{std::cos(t), 0.0f, -std::sin(t)};
+        glm::mat4 worldToCamera = glm::lookAt(eye, target, glm::vec3{0, 1, 0});
+        glm::mat4 cameraToPerspective = leftHandCorrection * glm::perspective(glm::radians(60.0f), (float)window.width()/window.height(), 0.1f, extent * 2.0f);
+
+        Uniform uniform{};
+        uniform.worldToPerspective = cameraToPerspective * worldToCamera;
+        uniform.numInstances = numInstances;
+        uniform.indexCount = (uint32_t)indices.size();
+
+        // The pyramid holds last frame's depth, so test against last frame's view.
+        uniform.prevWorldToPerspective = prevWorldToPerspective;
+        uniform.pyramidSize = glm::vec2((float)pyramid.width(), (float)pyramid.height());
+        uniform.useOcclusion = pyramid.ready();
+        prevWorldToPerspective = uniform.worldToPerspective;
+
+        // Extract the frustum planes from the rows of the matrix (depth is 0..w).
+        glm::mat4 m = glm::transpose(uniform.worldToPerspective);
+        uniform.frustumPlanes[0] = m[3] + m[0];
+        uniform.frustumPlanes[1] = m[3] - m[0];
+        uniform.frustumPlanes[2] = m[3] + m[1];
+        uniform.frustumPlanes[3] = m[3] - m[1];
+        uniform.frustumPlanes[4] = m[2];
+        uniform.frustumPlanes[5] = m[3] - m[2];
+        for (auto &p : uniform.frustumPlanes) {
+          p /= glm::length(glm::vec3(p));
+        }
+
+        vk::CommandBufferBeginInfo bi{};
+        cb.begin(bi);
+        cb.resetQueryPool(*queryPool, imageIndex * 3, 3);
+        cb.writeTimestamp(vk::PipelineStageFlagBits::eTopOfPipe, *queryPool, imageIndex * 3 + 0);
+
+        // The uniforms, count and draws are shared by all frames in flight, so wait for
+        // earlier frames to finish reading them before overwriting them.
+        cb.pipelineBarrier(vk::PipelineStageFlagBits::eDrawIndirect|vk::PipelineStageFlagBits::eVertexShader|vk::PipelineStageFlagBits::eComputeShader, vk::PipelineStageFlagBits::eTransfer, {}, nullptr, nullptr, nullptr);
+
+        cb.updateBuffer(ubo.buffer(), 0, sizeof(Uniform), (void*)&uniform);
+        cb.fillBuffer(countBuffer.buffer(), 0, sizeof(uint32_t), 0);
+
+        vk::MemoryBarrier toCompute{vk::AccessFlagBits::eTransferWrite, vk::AccessFlagBits::eUniformRead|vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite};
+        cb.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eComputeShader|vk::PipelineStageFlagBits::eVertexShader, {}, toCompute, nullptr, nullptr);
+
+        // Cull and compact.
+        cb.bindPipeline(vk::PipelineBindPoint::eCompute, *cullPipeline);
+        cb.bindDescriptorSets(vk::PipelineBindPoint::eCompute, *pipelineLayout, 0, descriptorSets, nullptr);
+        cb.dispatch((numInstances + 63) / 64, 1, 1);
+
+        vk::MemoryBarrier toIndirect{vk::AccessFlagBits::eShaderWrite, vk::AccessFlagBits::eIndirectCommandRead};
+        cb.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader, vk::PipelineStageFlagBits::eDrawIndirect, {}, toIndirect, nullptr, nullptr);
+        cb.writeTimestamp(vk::PipelineStageFlagBits::eComputeShader, *queryPool, imageIndex * 3 + 1);
+
+        // Draw the survivors.
+        cb.beginRenderPass(rpbi, vk::SubpassContents::eInline);
+        cb.bindPipeline(vk::PipelineBindPoint::eGraphics, *drawPipeline);
+        cb.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, *pipelineLayout, 0, descriptorSets, nullptr);
+        cb.bindVertexBuffers(0, vbo.buffer(), vk::DeviceSize(0));
+        cb.bindVertexBuffers(1, instanceBuffer.buffer(), vk::DeviceSize(0));
+        cb.bindIndexBuffer(ibo.buffer(), vk::DeviceSize(0), vk::IndexType::eUint32);
+        cb.drawIndexedIndirectCount(drawBuffer.buffer(), 0, countBuffer.buffer(), 0, numInstances, sizeof(vk::DrawIndexedIndirectCommand));
+        cb.endRenderPass();
+
+        // Build the depth pyramid for the next frame.
+        pyramid.build(cb, depth);
+
+        cb.writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe, *queryPool, imageIndex * 3 + 2);
+        cb.end();
+        timesWritten[imageIndex] = true;
+      }
+    );
+
+    ++iFrame;
+  }
+
+  // Wait until all drawing is done and then kill the window.
+  device.waitIdle();
+  glfwDestroyWindow(glfwwindow);
+  glfwTerminate();
+
+  // The Framework and Window objects will be destroyed here.
+
+  return 0;
+}
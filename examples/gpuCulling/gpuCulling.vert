@@ -0,0 +1,27 @@
+#version 460
+
+layout(std140, binding = 0) uniform Uniform {
+  mat4 worldToPerspective;
+} u;
+
+// Vertex attributes
+layout(location = 0) in vec3 inPosition;
+layout(location = 1) in vec3 inNormal;
+
+// Per-instance attributes, fetched using the firstInstance of the indirect command.
+layout(location = 2) in vec4 instanceSphere;
+layout(location = 3) in vec4 instanceColour;
+
+layout(location = 0) out vec3 fragColour;
+
+out gl_PerVertex {
+  vec4 gl_Position;
+};
+
+void main() {
+  vec3 pos = inPosition * instanceSphere.w + instanceSphere.xyz;
+  gl_Position = u.worldToPerspective * vec4(pos, 1.0);
+
+  float light = dot(inNormal, normalize(vec3(1, 2, 3))) * 0.4 + 0.6;
+  fragColour = instanceColour.rgb * light;
+}
@@ -36,62 +36,45 @@ int main() {
   // Up to 256 bytes of immediate data.
   struct PushConstants {
     float value;   // The shader just adds this to the buffer.
-    float pad[3];  // Buffers are usually 16 byte aligned.
+    uint32_t count; // Number of values, the last workgroup may be partly used.
+    float pad[2];  // Buffers are usually 16 byte aligned.
   };
 
   ////////////////////////////////////////
   //
   // Create a buffer to store the results in.
-  // Note: this won't work for everyone. With some devices you
-  // may need to explictly upload and download data.
-  static constexpr int N = 128;
+  // This lives in device memory, the results are copied back to the host later.
+  static constexpr int N = 1000;
   auto mybuf = vku::GenericBuffer(
       device, 
       memprops, 
-      vk::BufferUsageFlagBits::eStorageBuffer, 
-      N * sizeof(float), 
-      vk::MemoryPropertyFlagBits::eHostVisible
+      vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferSrc, 
+      N * sizeof(float)
   );
 
+  // A ring of host cached memory to read results back into.
+  auto limits = fw.physicalDevice().getProperties().limits;
+  vku::ReadbackRing readbackRing{device, memprops, 65536, limits.nonCoherentAtomSize};
+
   ////////////////////////////////////////
   //
-  // Build the descriptor sets
-  // Shader has access to a single storage buffer.
+  // Build the kernel.
+  // Shader has access to a single storage buffer and some push constants.
   vku::DescriptorSetLayoutMaker dsetlm{};
   dsetlm.buffer(0U, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute, 1);
 
-  auto dsetLayout = dsetlm.createUnique(device);
-
-  // The descriptor set itself.
-  vku::DescriptorSetMaker dsm{};
-  dsm.layout(*dsetLayout);
-
-  auto dsets = dsm.create(device, descriptorPool);
-  auto descriptorSet = dsets[0];
-
-  // Pipeline layout.
-  // Shader has one descriptor set and some push constants.
-  vku::PipelineLayoutMaker plm{};
-  plm.descriptorSetLayout(*dsetLayout)
-     .pushConstantRange(vk::ShaderStageFlagBits::eCompute, 0, sizeof(PushConstants));
-
-  auto pipelineLayout = plm.createUnique(device);
- 
-  ////////////////////////////////////////
-  //
-  // Build the final pipeline 
   auto shader = vku::ShaderModule{device, BINARY_DIR "helloCompute.comp.spv"};
 
-  vku::ComputePipelineMaker cpm{};
-  cpm.shader(vk::ShaderStageFlagBits::eCompute, shader);
-
-  auto pipeline = cpm.createUnique(device, cache, *pipelineLayout);
+  // The kernel makes the pipeline, layout and descriptor set and picks
+  // a workgroup size for this device (the shader uses local_size_x_id).
+  vku::ComputeKernel kernel{device, fw.physicalDevice(), cache, descriptorPool, shader, dsetlm, sizeof(PushConstants)};
+  std::cout << "workgroup size " << kernel.localSize(0) << std::endl;
 
   ////////////////////////////////////////
   //
   // Update the descriptor sets for the shader uniforms.
   vku::DescriptorSetUpdater update;
-  update.beginDescriptorSet(descriptorSet)
+  update.beginDescriptorSet(kernel.descriptorSet())
         .beginBuffers(0, 0, vk::DescriptorType::eStorageBuffer)
         .buffer(mybuf.buffer(), 0, N * sizeof(float))
         .update(device); // this only copies the pointer, not any data.
@@ -109,30 +92,42 @@ int main() {
 
   ////////////////////////////////////////
   //
-  // Run compute shader on the GPU.
-  vku::executeImmediately(device, *commandPool, fw.computeQueue(), 
-    [&](vk::CommandBuffer cb) {
-      PushConstants cu{
-        .value = 2.0f,
-        .pad = {0.0f, 0.0f, 0.0f}
-      };
-      cb.pushConstants(*pipelineLayout, vk::ShaderStageFlagBits::eCompute, 0, sizeof(PushConstants), &cu);
-
-      cb.bindDescriptorSets(vk::PipelineBindPoint::eCompute, *pipelineLayout, 0, descriptorSet, nullptr);
-      cb.bindPipeline(vk::PipelineBindPoint::eCompute, *pipeline);
-      cb.dispatch(N, 1, 1);
-    }
-  );
-
-  device.waitIdle();
+  // Run compute shader on the GPU and copy the results back.
+  vk::CommandBufferAllocateInfo cbai{*commandPool, vk::CommandBufferLevel::ePrimary, 1};
+  auto cbs = device.allocateCommandBuffersUnique(cbai);
+  vk::CommandBuffer cb = *cbs[0];
+
+  cb.begin(vk::CommandBufferBeginInfo{});
+  PushConstants cu{
+    .value = 2.0f,
+    .count = N,
+    .pad = {0.0f, 0.0f}
+  };
+  kernel.bind(cb);
+  kernel.pushConstants(cb, cu);
+  kernel.dispatch(cb, N);
+  auto result = readbackRing.readback(cb, mybuf.buffer(), 0, N * sizeof(float));
+  cb.end();
+
+  auto fence = device.createFenceUnique(vk::FenceCreateInfo{});
+  vk::SubmitInfo submit{};
+  submit.commandBufferCount = 1;
+  submit.pCommandBuffers = &cb;
+  fw.computeQueue().submit(submit, *fence);
+  readbackRing.submitted(*fence);
+
+  // The CPU is free to do other work here. In a frame loop, call poll() once a frame.
+  while (!readbackRing.poll()) {
+    std::this_thread::yield();
+  }
 
   ////////////////////////////////////////
   //
-  // Show result of compute shader -> (2.0f + 0..127)
-  float *values = static_cast<float*>( mybuf.map(device) );
-  std::for_each(values, values+N, [](float &value){ 
+  // Show result of compute shader -> (2.0f + 0..999)
+  std::vector<uint8_t> bytes = result.get();
+  const float *values = reinterpret_cast<const float*>(bytes.data());
+  std::for_each(values, values+N, [](float value){ 
     std::cout << value << " "; 
   });
   std::cout << std::endl;
-  mybuf.unmap(device);
 }
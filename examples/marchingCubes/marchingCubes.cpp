@@ -0,0 +1,259 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Vookoo GPU marching cubes example
+//
+// A gyroid in a sphere is sampled once on the CPU and polygonised every frame by
+// vku::MarchingCubes with an animated iso level. The mesh goes straight from the
+// compute shader to an indirect draw.
+//
+// Usage: marchingCubes [grid size] [--validate]   (default 128, try 256)
+//
+// --validate builds one mesh on the GPU, reads it back and compares it with
+// gilgamesh's CPU marching cubes: the triangles must be identical and the
+// vertices within rounding. This is useful on a software driver such as lavapipe.
+//
+// GPU times for the build are printed every 256 frames.
+//
+
+#include <vku/vku_framework.hpp>
+#include <vku/vku.hpp>
+#include <gilgamesh/mesh.hpp>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <cstring>
+
+int main(int argc, char *argv[]) {
+  uint32_t gridSize = 128;
+  bool validate = false;
+  for (int i = 1; i != argc; ++i) {
+    if (!strcmp(argv[i], "--validate")) {
+      validate = true;
+    } else {
+      gridSize = std::max(2, std::atoi(argv[i]));
+    }
+  }
+
+  // Initialise the GLFW framework.
+  glfwInit();
+  glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
+
+  // Make a window
+  auto *title = "marchingCubes";
+  auto glfwwindow = glfwCreateWindow(800, 800, title, nullptr, nullptr);
+
+  vku::InstanceMaker im{};
+  im.defaultLayers();
+  vku::DeviceMaker dm{};
+  dm.defaultLayers();
+
+  // Initialise the Vookoo demo framework.
+  vku::Framework fw{im, dm};
+  if (!fw.ok()) {
+    std::cout << "Framework creation failed" << std::endl;
+    exit(1);
+  }
+
+  vk::Device device = fw.device();
+
+  // Create a window to draw into
+  vku::Window window{fw.instance(), fw.device(), fw.physicalDevice(), fw.graphicsQueueFamilyIndex(), glfwwindow};
+  if (!window.ok()) {
+    std::cout << "Window creation failed" << std::endl;
+    exit(1);
+  }
+  window.clearColorValue() = {0.0f, 0.0f, 0.0f, 1.0f};
+
+  ////////////////////////////////////////
+  //
+  // The field: a gyroid, cut off by a sphere. Samples outside the surface are negative.
+
+  uint32_t n = gridSize;
+  auto field = [n](float *dest, int count, int j, int k) {
+    float scale = 12.0f / n;
+    float y = j * scale, z = k * scale;
+    float dy = j - n * 0.5f, dz = k - n * 0.5f;
+    for (int i = 0; i != count; ++i) {
+      float x = i * scale, dx = i - n * 0.5f;
+      float gyroid = std::sin(x) * std::cos(y) + std::sin(y) * std::cos(z) + std::sin(z) * std::cos(x);
+      float sphere = (n * 0.45f) - std::sqrt(dx * dx + dy * dy + dz * dz);
+      dest[i] = std::min(gyroid + 1.0f, sphere);
+    }
+  };
+
+  std::vector<float> samples(n * n * n);
+  for (uint32_t k = 0; k != n; ++k) {
+    for (uint32_t j = 0; j != n; ++j) {
+      field(samples.data() + (k * n + j) * n, (int)n, (int)j, (int)k);
+    }
+  }
+
+  // Fit the grid in a cube of side two.
+  std::array<float, 3> origin{-1.0f, -1.0f, -1.0f};
+  float step = 2.0f / (n - 1);
+  std::array<float, 3> scale{step, step, step};
+
+  vku::ShaderModule comp{device, BINARY_DIR "marchingCubes.comp.spv"};
+  vku::ShaderModule vert{device, BINARY_DIR "marchingCubes.vert.spv"};
+  vku::ShaderModule frag{device, BINARY_DIR "marchingCubes.frag.spv"};
+
+  // Room for the gyroid at its thickest, roughly.
+  uint32_t maxTriangles = std::max(n * n * 24, 0x10000U);
+  vku::MarchingCubes mc(device, fw.physicalDevice(), fw.memprops(), fw.pipelineCache(), fw.descriptorPool(), comp, gilgamesh::pos_mesh::mc_triangles(), n, n, n, maxTriangles / 2, maxTriangles);
+  mc.samples().upload(device, fw.memprops(), window.commandPool(), fw.graphicsQueue(), samples);
+
+  if (validate) {
+    vku::executeImmediately(device, window.commandPool(), fw.graphicsQueue(), [&](vk::CommandBuffer cb) {
+      mc.build(cb, origin, scale);
+    });
+
+    vku::MarchingCubes::Result result;
+    mc.indirectBuffer().download(device, fw.memprops(), window.commandPool(), fw.graphicsQueue(), &result, sizeof(result));
+
+    gilgamesh::pos_mesh cpu((int)n, (int)n, (int)n, field, [&](float x, float y, float z) {
+      return gilgamesh::pos_mesh::vertex_t(glm::vec3(origin[0], origin[1], origin[2]) + glm::vec3(x, y, z) * step);
+    });
+    std::cout << n << "^3 samples: GPU " << result.numVertices << " vertices " << result.numTriangles << " triangles, CPU " << cpu.vertices().size() << " vertices " << cpu.indices().size() / 3 << " triangles\n";
+
+    bool ok = result.numVertices == cpu.vertices().size() && result.numTriangles * 3 == cpu.indices().size();
+    if (ok && (result.numVertices > mc.maxVertices() || result.numTriangles > mc.maxTriangles())) {
+      std::cout << "The mesh does not fit, try a smaller grid\n";
+      ok = false;
+    }
+
+    if (ok && result.numTriangles) {
+      std::vector<vku::MarchingCubes::Vertex> vertices(result.numVertices);
+      std::vector<uint32_t> indices(result.numTriangles * 3);
+      mc.vertexBuffer().download(device, fw.memprops(), window.commandPool(), fw.graphicsQueue(), vertices);
+      mc.indexBuffer().download(device, fw.memprops(), window.commandPool(), fw.graphicsQueue(), indices);
+
+      size_t badIndices = 0;
+      for (size_t i = 0; i != indices.size(); ++i) {
+        if (indices[i] != cpu.indices()[i]) ++badIndices;
+      }
+
+      // The GPU's division may differ by a few ulps.
+      float maxError = 0;
+      for (size_t v = 0; v != vertices.size(); ++v) {
+        glm::vec3 pos(vertices[v].pos[0], vertices[v].pos[1], vertices[v].pos[2]);
+        maxError = std::max(maxError, glm::length(pos - cpu.vertices()[v].pos()));
+      }
+      std::cout << badIndices << " indices differ, largest vertex error " << maxError / step << " cells\n";
+      ok = badIndices == 0 && maxError < step * 1e-3f;
+    }
+
+    std::cout << (ok ? "Validation passed" : "Validation FAILED") << std::endl;
+    device.waitIdle();
+    glfwDestroyWindow(glfwwindow);
+    glfwTerminate();
+    return ok ? 0 : 1;
+  }
+
+  ////////////////////////////////////////
+  //
+  // Pipeline
+
+  struct PushConstants {
+    glm::mat4 worldToPerspective;
+  };
+
+  vku::PipelineLayoutMaker plm{};
+  plm.pushConstantRange(vk::ShaderStageFlagBits::eVertex, 0, sizeof(PushConstants));
+  auto pipelineLayout = plm.createUnique(device);
+
+  auto buildPipeline = [&]() {
+    using Vertex = vku::MarchingCubes::Vertex;
+    vku::PipelineMaker pm{window.width(), window.height()};
+    return pm
+      .shader(vk::ShaderStageFlagBits::eVertex, vert)
+      .shader(vk::ShaderStageFlagBits::eFragment, frag)
+      .vertexBinding(0, sizeof(Vertex), vk::VertexInputRate::eVertex)
+      .vertexAttribute(0, 0, vk::Format::eR32G32B32Sfloat, offsetof(Vertex, pos))
+      .vertexAttribute(1, 0, vk::Format::eR32G32B32Sfloat, offsetof(Vertex, normal))
+      .depthTestEnable(VK_TRUE)
+      .createUnique(device, fw.pipelineCache(), *pipelineLayout, window.renderPass());
+  };
+
+  auto drawPipeline = buildPipeline();
+
+  // This matrix converts between OpenGL perspective and Vulkan perspective.
+  // It flips the Y axis and shrinks the Z value to [0,1]
+  glm::mat4 leftHandCorrection(
+    1.0f,  0.0f, 0.0f, 0.0f,
+    0.0f, -1.0f, 0.0f, 0.0f,
+    0.0f,  0.0f, 0.5f, 0.0f,
+    0.0f,  0.0f, 0.5f, 1.0f
+  );
+
+  ////////////////////////////////////////
+  //
+  // Timestamps: start and end of the build for each swap chain image.
+
+  vk::QueryPoolCreateInfo qpci{{}, vk::QueryType::eTimestamp, (uint32_t)window.numImageIndices() * 2};
+  auto queryPool = device.createQueryPoolUnique(qpci);
+  float timestampPeriod = fw.physicalDevice().getProperties().limits.timestampPeriod;
+  std::vector<bool> timesWritten(window.numImageIndices());
+  double buildTime = 0;
+  int numTimes = 0;
+
+  int iFrame = 0;
+  while (!glfwWindowShouldClose(glfwwindow)) {
+    glfwPollEvents();
+
+    window.draw(device, fw.graphicsQueue(),
+      [&](vk::CommandBuffer cb, int imageIndex, vk::RenderPassBeginInfo &rpbi) {
+        static auto ww = window.width();
+        static auto wh = window.height();
+        if (ww != window.width() || wh != window.height()) {
+          ww = window.width();
+          wh = window.height();
+          drawPipeline = buildPipeline();
+        }
+
+        // The fence for this image has signalled, so its timestamps are ready.
+        uint64_t times[2];
+        if (timesWritten[imageIndex] && device.getQueryPoolResults(*queryPool, imageIndex * 2, 2, sizeof(times), times, sizeof(uint64_t), vk::QueryResultFlagBits::e64) == vk::Result::eSuccess) {
+          buildTime += (times[1] - times[0]) * timestampPeriod * 1e-6;
+          if (++numTimes == 256) {
+            std::cout << n << "^3 samples: build " << buildTime / numTimes << "ms\n";
+            buildTime = 0;
+            numTimes = 0;
+          }
+        }
+
+        float t = iFrame * 0.01f;
+        glm::mat4 worldToCamera = glm::lookAt(glm::vec3{std::sin(t * 0.3f) * 3.5f, 1.0f, std::cos(t * 0.3f) * 3.5f}, glm::vec3{0, 0, 0}, glm::vec3{0, 1, 0});
+        glm::mat4 cameraToPerspective = leftHandCorrection * glm::perspective(glm::radians(45.0f), (float)window.width()/window.height(), 0.1f, 10.0f);
+        PushConstants pc{cameraToPerspective * worldToCamera};
+
+        vk::CommandBufferBeginInfo bi{};
+        cb.begin(bi);
+        cb.resetQueryPool(*queryPool, imageIndex * 2, 2);
+        cb.writeTimestamp(vk::PipelineStageFlagBits::eTopOfPipe, *queryPool, imageIndex * 2 + 0);
+
+        // Thicken and thin the gyroid.
+        mc.build(cb, origin, scale, std::sin(t) * 0.6f);
+        cb.writeTimestamp(vk::PipelineStageFlagBits::eComputeShader, *queryPool, imageIndex * 2 + 1);
+
+        cb.beginRenderPass(rpbi, vk::SubpassContents::eInline);
+        cb.bindPipeline(vk::PipelineBindPoint::eGraphics, *drawPipeline);
+        cb.pushConstants(*pipelineLayout, vk::ShaderStageFlagBits::eVertex, 0, sizeof(pc), &pc);
+        mc.draw(cb);
+        cb.endRenderPass();
+
+        cb.end();
+        timesWritten[imageIndex] = true;
+      }
+    );
+
+    ++iFrame;
+  }
+
+  // Wait until all drawing is done and then kill the window.
+  device.waitIdle();
+  glfwDestroyWindow(glfwwindow);
+  glfwTerminate();
+
+  // The Framework and Window objects will be destroyed here.
+
+  return 0;
+}
@@ -0,0 +1,23 @@
+#version 460
+
+layout(push_constant) uniform PushConstants {
+  mat4 worldToPerspective;
+} pc;
+
+// vku::MarchingCubes::Vertex
+layout(location = 0) in vec3 inPosition;
+layout(location = 1) in vec3 inNormal;
+
+layout(location = 0) out vec3 fragColour;
+
+out gl_PerVertex {
+  vec4 gl_Position;
+};
+
+void main() {
+  gl_Position = pc.worldToPerspective * vec4(inPosition, 1.0);
+
+  // The surface is seen from both sides, so light both.
+  float light = abs(dot(inNormal, normalize(vec3(1, 2, 3)))) * 0.7 + 0.3;
+  fragColour = (inPosition * 0.25 + 0.75) * light;
+}
@@ -6,6 +6,7 @@
 #include <glm/gtx/io.hpp>
 
 #include <gilgamesh/mesh.hpp>
+#include <gilgamesh/optimizer.hpp>
 #include <gilgamesh/scene.hpp>
 #include <gilgamesh/shapes/teapot.hpp>
 #include <gilgamesh/decoders/fbx_decoder.hpp>
@@ -88,6 +89,7 @@ int main(int argc, char *argv[]) {
     gilgamesh::teapot shape;
     shape.build(mesh);
     mesh.reindex(true);
+    gilgamesh::optimize(mesh);
 
     std::vector<Vertex> vertices;
 
@@ -118,32 +118,9 @@ int main() {
   // allocate array of threads to be reused from frame to frame
   std::vector<std::thread> v( Nthreads );
   
-  // allocate command pools and secondary buffers, required to be separate pools per thread
-  std::vector<vk::UniqueCommandPool> scp;
-  std::vector<std::vector<vk::UniqueCommandBuffer>> scb;
-  for (int i=0; i<Nthreads; ++i) {
-    // add pool
-    scp.emplace_back( 
-      fw.device().createCommandPoolUnique(
-        vk::CommandPoolCreateInfo{ 
-          vk::CommandPoolCreateFlagBits::eResetCommandBuffer,
-          fw.graphicsQueueFamilyIndex()
-        }
-      )
-    );
-    // add secondary command buffer(s) per pool
-    scb.emplace_back( 
-      std::move(
-        fw.device().allocateCommandBuffersUnique( 
-          vk::CommandBufferAllocateInfo{
-            *scp.back(), // per thread pool 
-            vk::CommandBufferLevel::eSecondary,
-            (uint32_t)window.numImageIndices() // a secondary command buffer per each swap image, access via *scb[i_th thread][j_th imageindex]
-          }
-        )
-      )
-    );
-  }
+  // allocate command pools for secondary buffers, required to be separate pools per thread
+  // and per swap image so that a pool is never reset while the GPU is still using it.
+  vku::CommandBufferAllocator allocator(fw.device(), fw.graphicsQueueFamilyIndex(), (uint32_t)window.numImageIndices(), Nthreads);
 
   // begin rendering frames
   int frame = 0;
@@ -158,6 +135,9 @@ int main() {
       fw.device(), fw.graphicsQueue(),
       [&](vk::CommandBuffer cb, int imageIndex, vk::RenderPassBeginInfo &rpbi) {
 
+        // window.draw has already waited for this image's fence, so recycle its secondary buffers.
+        allocator.beginFrame(imageIndex);
+
         // shared state used by each kernel thread
         vk::CommandBufferInheritanceInfo inheritanceInfo;
         inheritanceInfo.setRenderPass( rpbi.renderPass );
@@ -182,10 +162,11 @@ int main() {
         //   2  5  8  B  on Thread i=2: j=2;j<N;j+=Nthreads
 
         // build (multi-threaded) list of secondary command buffers to be executed later
-        std::vector<vk::CommandBuffer> commandBuffers;
+        std::vector<vk::CommandBuffer> commandBuffers(Nthreads);
         { // threadRenderCode
           auto kernel = [&](const int i)->void{  
-            vk::CommandBuffer cmdBuffer = *scb[i][imageIndex];
+            vk::CommandBuffer cmdBuffer = allocator.allocate(imageIndex, i, vk::CommandBufferLevel::eSecondary);
+            commandBuffers[i] = cmdBuffer;
             cmdBuffer.begin(commandBufferBeginInfo);
             cmdBuffer.bindPipeline(vk::PipelineBindPoint::eGraphics, *pipeline);
             cmdBuffer.bindVertexBuffers(0, buffer.buffer(), vk::DeviceSize(0));
@@ -217,11 +198,6 @@ int main() {
           for (int i=0; i<Nthreads; ++i) {
             v[i].join();
           }
-          
-          // accumulate secondary command buffers built by kernel threads
-          for (int i=0; i<Nthreads; ++i) {
-            commandBuffers.push_back( *scb[i][imageIndex] );
-          }
         } 
 
         // execute accumlated commandBuffers
@@ -3,30 +3,209 @@
 //
 // (C) Andy Thomason 2012-2016
 //
-// Autocorrelation entropy test
-
+// Compressibility analysis.
+//
+// Vertex and texture data compress much better after a delta filter of the
+// right stride (the size of a vertex or pixel). These functions estimate the
+// order-0 entropy of a block before and after each candidate filter so that an
+// asset packer can pick one before deflating.
+//
 
-#ifndef MINIZIP_ALGORITHM_INCLUDED
-#define MINIZIP_ALGORITHM_INCLUDED
+#ifndef ANDYZIP_ALGORITHM_HPP_
+#define ANDYZIP_ALGORITHM_HPP_
 
 #include <cstdint>
+#include <cstddef>
 #include <cstring>
 #include <cmath>
-#include <vector>
+#include <algorithm>
+#include <initializer_list>
+#include <vector>
+#include <andyzip/parallel_for.hpp>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+  #include <emmintrin.h>
+  #define ANDYZIP_ALGORITHM_SSE2 1
+#endif
 
 namespace andyzip {
-  // Get a measure of how correlated the data is at various stride levels.
-  void abs_correlation(std::vector<int> &result, const uint8_t *begin, const uint8_t *end, const std::initializer_list<int> &values) {
+  /// Sum of |p[i+stride] - p[i]| over the block, with differences taken as signed bytes.
+  /// Small sums mean the data is strongly correlated at this stride.
+  static inline uint64_t abs_difference_sum(const uint8_t *begin, const uint8_t *end, size_t stride) {
+    size_t size = end - begin;
+    if (stride == 0 || stride >= size) return 0;
+    size_t n = size - stride;
+    const uint8_t *a = begin + stride;
+    const uint8_t *b = begin;
+    uint64_t value = 0;
+    size_t i = 0;
+
+    #if defined(ANDYZIP_ALGORITHM_SSE2)
+      // min(d, -d) as unsigned bytes is |(int8_t)d|, and psadbw sums it eight bytes at a time.
+      const __m128i zero = _mm_setzero_si128();
+      __m128i acc = zero;
+      for (; i + 16 <= n; i += 16) {
+        __m128i d = _mm_sub_epi8(_mm_loadu_si128((const __m128i *)(a + i)), _mm_loadu_si128((const __m128i *)(b + i)));
+        d = _mm_min_epu8(d, _mm_sub_epi8(zero, d));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(d, zero));
+      }
+      uint64_t lanes[2];
+      _mm_storeu_si128((__m128i *)lanes, acc);
+      value = lanes[0] + lanes[1];
+    #endif
+
+    for (; i != n; ++i) {
+      uint8_t d = (uint8_t)(a[i] - b[i]);
+      value += std::min(d, (uint8_t)-d);
+    }
+    return value;
+  }
+
+  /// Get a measure of how correlated the data is at various strides.
+  static inline void abs_correlation(std::vector<uint64_t> &result, const uint8_t *begin, const uint8_t *end, const std::initializer_list<int> &values) {
     result.clear();
     for (auto n : values) {
-      int value = 0;
-      for (auto p = begin; p < end - n; ++p) {
-        value += std::abs((int8_t)(p[0] - p[n]));
-      }
-      result.push_back(value);
+      result.push_back(abs_difference_sum(begin, end, (size_t)n));
+    }
+  }
+
+  /// Count the bytes of a block. Four tables avoid stalls on runs of the same byte.
+  static inline void byte_histogram(uint32_t hist[256], const uint8_t *begin, const uint8_t *end) {
+    uint32_t h[4][256] = {};
+    const uint8_t *p = begin;
+    for (; end - p >= 4; p += 4) {
+      h[0][p[0]]++;
+      h[1][p[1]]++;
+      h[2][p[2]]++;
+      h[3][p[3]]++;
+    }
+    for (; p != end; ++p) h[0][*p]++;
+    for (int i = 0; i != 256; ++i) hist[i] = h[0][i] + h[1][i] + h[2][i] + h[3][i];
+  }
+
+  /// Count the bytes of a block after a delta filter of stride (see delta_encode).
+  /// A stride of zero counts the unfiltered bytes.
+  static inline void delta_histogram(uint32_t hist[256], const uint8_t *begin, const uint8_t *end, size_t stride) {
+    size_t size = end - begin;
+    stride = stride ? std::min(stride, size) : size;
+    uint32_t h[4][256] = {};
+    for (size_t i = 0; i != stride; ++i) h[0][begin[i]]++;
+    const uint8_t *a = begin + stride;
+    size_t n = size - stride, i = 0;
+    for (; i + 4 <= n; i += 4) {
+      h[0][(uint8_t)(a[i+0] - begin[i+0])]++;
+      h[1][(uint8_t)(a[i+1] - begin[i+1])]++;
+      h[2][(uint8_t)(a[i+2] - begin[i+2])]++;
+      h[3][(uint8_t)(a[i+3] - begin[i+3])]++;
+    }
+    for (; i != n; ++i) h[0][(uint8_t)(a[i] - begin[i])]++;
+    for (int i = 0; i != 256; ++i) hist[i] = h[0][i] + h[1][i] + h[2][i] + h[3][i];
+  }
+
+  /// Order-0 entropy of a histogram in bits per symbol.
+  static inline double entropy(const uint32_t *hist, size_t num_symbols) {
+    double total = 0;
+    for (size_t i = 0; i != num_symbols; ++i) total += hist[i];
+    if (total == 0) return 0;
+    double bits = 0;
+    for (size_t i = 0; i != num_symbols; ++i) {
+      if (hist[i]) bits -= hist[i] * std::log2(hist[i] / total);
     }
+    return bits / total;
+  }
+
+  /// Order-0 entropy of a block in bits per byte.
+  static inline double byte_entropy(const uint8_t *begin, const uint8_t *end) {
+    uint32_t hist[256];
+    byte_histogram(hist, begin, end);
+    return entropy(hist, 256);
+  }
+
+  /// dest[i] = src[i] - src[i-stride]. The first stride bytes are copied.
+  /// A stride of zero copies the data unfiltered.
+  static inline void delta_encode(uint8_t *dest, const uint8_t *src, size_t size, size_t stride) {
+    stride = stride ? std::min(stride, size) : size;
+    if (stride) memcpy(dest, src, stride);
+    for (size_t i = stride; i != size; ++i) {
+      dest[i] = (uint8_t)(src[i] - src[i - stride]);
+    }
+  }
+
+  /// Undo delta_encode in place.
+  static inline void delta_decode(uint8_t *data, size_t size, size_t stride) {
+    if (stride == 0) return;
+    for (size_t i = stride; i < size; ++i) {
+      data[i] = (uint8_t)(data[i] + data[i - stride]);
+    }
+  }
+
+  /// The result of analysing a block.
+  struct block_analysis {
+    size_t offset = 0;           ///< start of the block
+    size_t size = 0;
+    double entropy = 0;          ///< bits per byte with no filter
+    unsigned stride = 0;         ///< best delta filter stride, or zero for none
+    double filtered_entropy = 0; ///< bits per byte after the delta filter
+
+    /// Estimated bytes saved by the filter.
+    double gain() const { return (entropy - filtered_entropy) * size / 8; }
   };
 
+  /// Strides of common vertex and pixel formats.
+  static inline const std::initializer_list<unsigned> &default_delta_strides() {
+    static const std::initializer_list<unsigned> strides = { 1, 2, 3, 4, 6, 8, 12, 16, 20, 24, 32 };
+    return strides;
+  }
+
+  /// Choose a delta filter for a block.
+  /// Candidates are ranked by abs_difference_sum and the best few are checked by entropy.
+  /// A filter is only chosen if it saves at least min_gain bits per byte.
+  static inline block_analysis analyse_block(const uint8_t *begin, const uint8_t *end, const std::initializer_list<unsigned> &strides = default_delta_strides(), double min_gain = 0.1) {
+    enum { num_checked = 3 };
+    block_analysis result;
+    result.size = end - begin;
+    result.entropy = result.filtered_entropy = byte_entropy(begin, end);
+
+    // Rank the strides by mean difference.
+    std::vector<std::pair<double, unsigned>> ranked;
+    for (unsigned stride : strides) {
+      if (stride == 0 || stride >= result.size) continue;
+      double mean = (double)abs_difference_sum(begin, end, stride) / (result.size - stride);
+      ranked.emplace_back(mean, stride);
+    }
+    size_t num = std::min(ranked.size(), (size_t)num_checked);
+    std::partial_sort(ranked.begin(), ranked.begin() + num, ranked.end());
+
+    for (size_t i = 0; i != num; ++i) {
+      uint32_t hist[256];
+      delta_histogram(hist, begin, end, ranked[i].second);
+      double e = entropy(hist, 256);
+      if (e < result.filtered_entropy) {
+        result.filtered_entropy = e;
+        result.stride = ranked[i].second;
+      }
+    }
+
+    if (result.entropy - result.filtered_entropy < min_gain) {
+      result.stride = 0;
+      result.filtered_entropy = result.entropy;
+    }
+    return result;
+  }
+
+  /// Analyse [begin, end) in blocks of block_size on up to num_threads threads (0 = one per core).
+  static inline std::vector<block_analysis> analyse(const uint8_t *begin, const uint8_t *end, size_t block_size = 0x10000, unsigned num_threads = 0, const std::initializer_list<unsigned> &strides = default_delta_strides()) {
+    size_t size = end - begin;
+    block_size = std::max(block_size, (size_t)1);
+    std::vector<block_analysis> result((size + block_size - 1) / block_size);
+    parallel_for(result.size(), [&](size_t i) {
+      size_t offset = i * block_size;
+      const uint8_t *b = begin + offset;
+      result[i] = analyse_block(b, b + std::min(block_size, size - offset), strides);
+      result[i].offset = offset;
+    }, num_threads);
+    return result;
+  }
 }
 
 #endif
@@ -6,11 +6,12 @@
 // Autocorrelation entropy test
 
 
-#ifndef MINIZIP_ALGORITHM_INCLUDED
-#define MINIZIP_ALGORITHM_INCLUDED
+#ifndef ANDYZIP_AUTOCORR_HPP_
+#define ANDYZIP_AUTOCORR_HPP_
 
 #include <cstdint>
 #include <cstring>
+#include <andyzip/algorithm.hpp>
 
 namespace andyzip {
   template<class T>
@@ -26,15 +27,13 @@ namespace andyzip {
   };
 
 
-  // result[n] is the autocorrelation of sequence [begin,end)
-  void autocorrelate(size_t *result, size_t num_results, const uint8_t *begin, const uint8_t *end) {
-    for (size_t n : range((size_t)0, num_results)) {
-      for (auto p = begin; p != end; p += n) {
-        
-      }
+  // result[n] is the sum of absolute differences of [begin,end) and itself shifted by n.
+  // Small values mean the data repeats with period n. result[0] is zero.
+  static inline void autocorrelate(size_t *result, size_t num_results, const uint8_t *begin, const uint8_t *end) {
+    for (size_t n = 0; n != num_results; ++n) {
+      result[n] = (size_t)abs_difference_sum(begin, end, n);
     }
-    
-  };
+  }
 
 }
 
@@ -3,793 +3,983 @@
 // (C) Andy Thomason 2012-2016
 //
 //
-// Brotli decoder.
+// Brotli decoder (RFC7932).
 //
-// Note this is far from optimal but is relatively simple compared with the reference to understand.
-// 
-// Given time we could make this far faster.
+// The decoder is a resumable state machine, so input may arrive in chunks of any
+// size and output is produced into a caller buffer of any size. Output is decoded
+// into a ring buffer the size of the stream's window, which keeps the history
+// that backward references use, then copied to the caller.
 //
 
 #ifndef _ANDYZIP_BROTLI_DECODER_HPP_
 #define _ANDYZIP_BROTLI_DECODER_HPP_
 
 #include <andyzip/huffman_table.hpp>
+#include <andyzip/copy_match.hpp>
+#include <andyzip/deflate_decoder.hpp>
 
 #include <cstdint>
 #include <cstring>
 #include <vector>
-#include <array>
 #include <algorithm>
 
 #include <andyzip/brotli_data.hpp>
 
 namespace andyzip {
-  struct brotli_decoder_state {
-    enum class error_code {
-      ok = 0,
-      need_more_input = 1,
-      syntax_error = 2,
-      end = 3,
-      huffman_length_error = 4,
-      context_map_error = 5,
-    };
-
-    enum {
-      max_types = 256,
-      dump_bits = 0,
+  /// Resumable brotli decoder.
+  ///
+  ///   andyzip::brotli_decoder dec;
+  ///   for (;;) {
+  ///     auto status = dec.decode(src, src_max, dest, dest_max);
+  ///     if (status == need_more_input) { get more input }
+  ///     else if (status == need_more_output) { use and reset dest }
+  ///     else break;
+  ///   }
+  ///
+  /// Every field is bounds checked, so corrupt streams give status::error.
+  class brotli_decoder {
+  public:
+    enum class status {
+      done,
+      need_more_input,
+      need_more_output,
+      error,
     };
 
-    FILE *log_file = nullptr;
-    const char *src = nullptr;
-    std::uint32_t bitptr = 0;
-    std::uint32_t bitptr_max = 0;
-    char *dest = 0;
-    char *dest_max = 0;
-    error_code error;
-    int max_backward_distance = 0;
-    int num_types[3];
-    int last_block_type[3];
-    int block_type[3];
-    int block_len[3];
-    uint8_t context_mode[max_types];
-    uint8_t literal_context_map[256]; // todo: what is the max size?
-    uint8_t distance_context_map[256];
-    uint64_t bytes_written = 0;
-    std::vector<uint8_t> ring_buffer;
-    andyzip::huffman_table<256+2> block_type_tables[3];
-    andyzip::huffman_table<26> block_count_tables[3];
-
-    int read(int bits) {
-      int value = peek(bits);
-      if (dump_bits) {
-        fprintf(log_file, "[BrotliReadBits]  %d %d %d val: %6x\n", (bitptr_max - bitptr - bits)/8, 24+(bitptr&7), bits, value);
-      }
-      bitptr += bits;
-      return value;
+    brotli_decoder() {
+      reset();
     }
 
-    int peek(int bits) {
-      //if (bitptr + bits > bitptr_max) { error = error_code::need_more_input; return 0; }
-      auto i = bitptr >> 3, j = bitptr & 7;
-      int value = (int)( (unsigned&)src[i] >> j ) & ( (1u << bits) - 1 );
-      return value;
+    /// Start a new stream.
+    void reset() {
+      state_ = state::stream_header;
+      header_index_ = 0;
+      is_last_ = false;
+      dist_rb_[0] = 16;
+      dist_rb_[1] = 15;
+      dist_rb_[2] = 11;
+      dist_rb_[3] = 4;
+      dist_rb_idx_ = 0;
+      input_.clear();
+      bit_position_ = 0;
+      ring_.clear();
+      ring_size_ = 0;
+      ring_mask_ = 0;
+      pos_ = 0;
+      flushed_ = 0;
+      ring_base_ = 0;
     }
 
-    void drop(int bits) {
-      bitptr += bits;
+    /// Decode as much as possible. src and dest are advanced past the input
+    /// consumed and the output produced. Unused bits of the input are kept
+    /// internally, so src is usually advanced to src_max.
+    status decode(const uint8_t *&src, const uint8_t *src_max, uint8_t *&dest, uint8_t *dest_max) {
+      // Keep a bounded amount of unconsumed input.
+      input_.erase(input_.begin(), input_.begin() + (bit_position_ >> 3));
+      bit_position_ &= 7;
+      size_t take = input_.size() < max_input ? std::min((size_t)(src_max - src), max_input - input_.size()) : 0;
+      input_.insert(input_.end(), src, src + take);
+      src += take;
+
+      for (;;) {
+        flush(dest, dest_max);
+        if (flushed_ != pos_) return status::need_more_output;
+        if (state_ == state::done) return status::done;
+        if (state_ == state::error) return status::error;
+
+        // Everything has been copied out, so move writes that ran past the end of the ring to the start.
+        if (ring_size_ && pos_ >= ring_size_) {
+          memcpy(ring_.data(), ring_.data() + ring_size_, pos_ - ring_size_);
+          pos_ = flushed_ = pos_ - ring_size_;
+          ring_base_ += ring_size_;
+        }
+
+        status result = run();
+        if (result != status::need_more_output) {
+          flush(dest, dest_max);
+          if (result != status::error && flushed_ != pos_) return status::need_more_output;
+          return result;
+        }
+      }
     }
-  };
 
-  class brotli_decoder {
-    enum {
-      debug = 0,
+    /// Total bytes of output produced.
+    uint64_t total_out() const { return ring_base_ + pos_; }
+
+  private:
+    enum class state {
+      stream_header,
+      metablock_header,
+      block_types,       // NBLTYPES and the block switch codes of category header_index_
+      literal_context,   // NPOSTFIX, NDIRECT, context modes and the literal context map
+      distance_context,  // the distance context map
+      literal_codes,     // HTREEL[header_index_]
+      command_codes,     // HTREEI[header_index_]
+      distance_codes,    // HTREED[header_index_]
+      metadata,
+      uncompressed,
+      command,
+      literals,
+      distance,
+      copy,
+      done,
+      error,
+    };
+
+    enum : size_t {
+      max_input = 65536,
       window_gap = 16,
+      // Writes start before the end of the ring and may run on into this.
+      // The longest transformed dictionary word is 37 bytes and copy_match_fast() overruns by 16.
+      ring_slack = 64,
+      max_types = 256,
       literal_context_bits = 6,
       distance_context_bits = 2,
-      block_len_symbols = 26,
-
-      num_distance_short_codes = 16,
+      max_command_symbols = 704,
     };
-    typedef brotli_decoder_state::error_code error_code;
 
     enum {
       idx_L, idx_I, idx_D
     };
 
-    static unsigned read_window_size(brotli_decoder_state &s) {
-      auto w0 = s.read(1);
-      if (s.error != error_code::ok) return 0; 
-      if (w0 == 0) {
-        return 16;
+    // Worst case table sizes with 8 root bits, from the reference decoder.
+    typedef deflate_table<8, 630> literal_table;
+    typedef deflate_table<8, 1080> command_table;
+    typedef deflate_table<8, 920> dist_table;
+    typedef deflate_table<8, 662> type_table;    // block types and context maps, up to 272 symbols
+    typedef deflate_table<8, 402> count_table;
+    typedef deflate_table<5, 32> code_length_table;
+
+    /// Entries for symbols 0-703 of any table.
+    static const uint32_t *symbol_entries() {
+      static const struct symbols {
+        uint32_t entries[max_command_symbols];
+        symbols() {
+          for (unsigned i = 0; i != max_command_symbols; ++i) entries[i] = literal_table::make(literal_table::literal, 0, i);
+        }
+      } table;
+      return table.entries;
+    }
+
+    /// Context ID lookup (7.1) for each context mode: Context ID = lut[p1] | lut[256 + p2].
+    static const uint8_t *context_lookup(unsigned mode) {
+      static const struct lookup {
+        uint8_t lut[4][512];
+        lookup() {
+          for (unsigned i = 0; i != 256; ++i) {
+            lut[0][i] = (uint8_t)(i & 0x3f);
+            lut[0][256 + i] = 0;
+            lut[1][i] = (uint8_t)(i >> 2);
+            lut[1][256 + i] = 0;
+            lut[2][i] = brotli_data::Lut0[i];
+            lut[2][256 + i] = brotli_data::Lut1[i];
+            lut[3][i] = (uint8_t)(brotli_data::Lut2[i] << 3);
+            lut[3][256 + i] = brotli_data::Lut2[i];
+          }
+        }
+      } table;
+      return table.lut[mode];
+    }
+
+    // Copy decoded bytes to the caller.
+    void flush(uint8_t *&dest, uint8_t *dest_max) {
+      size_t bytes = std::min((size_t)(dest_max - dest), pos_ - flushed_);
+      if (bytes) {
+        memcpy(dest, ring_.data() + flushed_, bytes);
+        dest += bytes;
+        flushed_ += bytes;
       }
+    }
 
-      auto w13 = s.read(3);
-      if (s.error != error_code::ok) return 0; 
-      if (w13 != 0) {
-        return w13 + 17;
+    // Decode until the ring is full (need_more_output), the input runs out or the stream ends.
+    // Each header field, prefix code and symbol is a checkpoint: if it needed bits we
+    // don't have yet, the bit reader is rolled back to the start of it.
+    status run() {
+      const uint8_t *base = input_.data();
+      deflate_bit_reader in(base + (bit_position_ >> 3), base + input_.size());
+      in.refill();
+      in.consume(bit_position_ & 7);
+
+      status result;
+      for (;;) {
+        if (state_ == state::done) {
+          result = status::done;
+          break;
+        } else if (state_ == state::error) {
+          result = status::error;
+          break;
+        } else if (state_ == state::metadata || state_ == state::uncompressed) {
+          result = copy_bytes(in);
+          if (state_ != state::metablock_header) break;
+        } else if (state_ >= state::command) {
+          result = decode_commands(in);
+          if (state_ != state::metablock_header) break;
+        } else {
+          deflate_bit_reader saved = in;
+          state last_state = state_;
+          unsigned last_index = header_index_;
+          bool last_is_last = is_last_;
+          bool ok = read_header(in);
+          if (!in.ok()) {
+            in = saved;
+            state_ = last_state;
+            header_index_ = last_index;
+            is_last_ = last_is_last;
+            result = status::need_more_input;
+            break;
+          } else if (!ok) {
+            state_ = state::error;
+            result = status::error;
+            break;
+          }
+        }
       }
 
-      auto w47 = s.read(4);
-      if (s.error != error_code::ok) return 0; 
+      bit_position_ = in.bit_position(base);
+      return result;
+    }
 
-      return w47 ? w47 + 10 - 2 : 17;
+    // Read one header step and move to the next state. Returns false for a syntax error.
+    bool read_header(deflate_bit_reader &in) {
+      switch (state_) {
+        case state::stream_header: return read_stream_header(in);
+        case state::metablock_header: return read_metablock_header(in);
+        case state::block_types: return read_block_types(in);
+        case state::literal_context: return read_literal_context(in);
+        case state::distance_context: return read_distance_context(in);
+        default: return read_codes(in);
+      }
     }
 
-    // read a value from 1 to 256
-    int read_256(brotli_decoder_state &s) {
-      int nlt0 = s.read(1);
-      if (s.error != error_code::ok) return 0; 
+    // 9.1.  Format of the Stream Header
+    bool read_stream_header(deflate_bit_reader &in) {
+      in.refill();
+      unsigned window_bits = 16;
+      if (in.get(1)) {
+        unsigned n = in.get(3);
+        if (n) {
+          window_bits = 17 + n;
+        } else {
+          n = in.get(3);
+          // 1 is the large window extension, which isn't part of RFC7932.
+          if (n == 1) return false;
+          window_bits = n ? 8 + n : 17;
+        }
+      }
+      window_bits_ = window_bits;
+      max_distance_ = ((size_t)1 << window_bits) - window_gap;
+      state_ = state::metablock_header;
+      return true;
+    }
 
-      if (!nlt0) return 1;
+    // 9.2.  Format of the Meta-Block Header, up to NBLTYPESL.
+    bool read_metablock_header(deflate_bit_reader &in) {
+      in.refill();
+      if (is_last_) {
+        // The stream ends at the next byte boundary and the padding must be zero.
+        state_ = state::done;
+        return in.align() == 0;
+      }
 
-      int nlt14 = s.read(3);
-      if (s.error != error_code::ok) return 0; 
+      is_last_ = in.get(1) != 0;
+      if (is_last_ && in.get(1)) {
+        // ISLASTEMPTY
+        state_ = state::done;
+        return in.align() == 0;
+      }
 
-      if (!nlt14) return 2;
+      unsigned nibbles = in.get(2);
+      if (nibbles == 3) {
+        // Metadata: a reserved bit, MSKIPBYTES and MSKIPLEN - 1.
+        if (in.get(1)) return false;
+        unsigned skip_bytes = in.get(2);
+        uint32_t skip = 0;
+        for (unsigned i = 0; i != skip_bytes; ++i) {
+          uint32_t byte = in.get(8);
+          if (i + 1 == skip_bytes && skip_bytes > 1 && byte == 0) return false;
+          skip |= byte << (i * 8);
+        }
+        meta_remaining_ = skip_bytes ? skip + 1 : 0;
+        state_ = state::metadata;
+        return in.align() == 0;
+      }
 
-      int nlt5x = s.read(nlt14);
-      if (s.error != error_code::ok) return 0; 
+      nibbles += 4;
+      uint32_t mlen = 0;
+      for (unsigned i = 0; i != nibbles; ++i) {
+        uint32_t nibble = in.get(4);
+        if (i + 1 == nibbles && nibbles > 4 && nibble == 0) return false;
+        mlen |= nibble << (i * 4);
+      }
+      meta_remaining_ = mlen + 1;
+
+      // Don't size the ring from bits that ran past the end of the input.
+      if (ring_.empty() && in.ok()) {
+        // A stream of one meta-block needs no more ring than its length.
+        size_t size = (size_t)1 << window_bits_;
+        while (is_last_ && size > 1024 && size / 2 >= meta_remaining_) size /= 2;
+        ring_.assign(size + ring_slack, 0);
+        ring_size_ = size;
+        ring_mask_ = size - 1;
+      }
 
-      return (1 << nlt14) + nlt5x + 1;
+      if (!is_last_ && in.get(1)) {
+        // ISUNCOMPRESSED
+        state_ = state::uncompressed;
+        return in.align() == 0;
+      }
+
+      header_index_ = 0;
+      state_ = state::block_types;
+      return true;
+    }
+
+    // A value from 1 to 256, for NBLTYPESx, NTREESL and NTREESD.
+    static unsigned read_count(deflate_bit_reader &in) {
+      in.refill();
+      if (!in.get(1)) return 1;
+      unsigned bits = in.get(3);
+      return bits ? (1u << bits) + in.get(bits) + 1 : 2;
     }
 
-    // From reference inplementation.
-    static int log2_floor(int x) {
-      int result = 0;
-      while (x) {
-        x >>= 1;
-        ++result;
+    // NBLTYPESx, HTREE_BTYPE_x, HTREE_BLEN_x and BLEN_x for one category.
+    bool read_block_types(deflate_bit_reader &in) {
+      unsigned i = header_index_;
+      unsigned num_types = read_count(in);
+      num_types_[i] = num_types;
+      block_type_[i] = 0;
+      last_block_type_[i] = 1;
+      block_len_[i] = 1 << 24;
+      if (num_types >= 2) {
+        if (!read_code(in, type_tables_[i], num_types + 2)) return false;
+        if (!read_code(in, count_tables_[i], 26)) return false;
+        in.refill();
+        block_len_[i] = read_block_length(in, i);
       }
-      return result;
+      if (++header_index_ == 3) {
+        header_index_ = 0;
+        state_ = state::literal_context;
+      }
+      return true;
     }
 
-    // From 7.3.  Encoding of the Context Map
-    static void inverse_move_to_front(uint8_t values[], int num_values) {
-      uint8_t mtf[256];
-      for (int i = 0; i < 256; ++i) {
-        mtf[i] = (uint8_t)i;
+    // NPOSTFIX, NDIRECT, CMODE[], NTREESL and CMAPL[].
+    bool read_literal_context(deflate_bit_reader &in) {
+      in.refill();
+      unsigned pbits = in.get(6);
+      npostfix_ = pbits & 3;
+      ndirect_ = (pbits >> 2) << npostfix_;
+      for (unsigned i = 0; i != num_types_[idx_L]; ++i) {
+        in.refill();
+        context_mode_[i] = (uint8_t)in.get(2);
       }
-      for (int i = 0; i < num_values; ++i) {
-        uint8_t index = values[i];
-        uint8_t value = mtf[index];
-        values[i] = value;
-        for (; index; --index) {
-          mtf[index] = mtf[index - 1];
+      num_literal_trees_ = read_count(in);
+      state_ = state::distance_context;
+      return read_context_map(in, literal_context_map_, num_types_[idx_L] << literal_context_bits, num_literal_trees_);
+    }
+
+    // NTREESD and CMAPD[].
+    bool read_distance_context(deflate_bit_reader &in) {
+      num_distance_trees_ = read_count(in);
+      state_ = state::literal_codes;
+      return read_context_map(in, distance_context_map_, num_types_[idx_D] << distance_context_bits, num_distance_trees_);
+    }
+
+    // One of HTREEL[], HTREEI[] or HTREED[].
+    bool read_codes(deflate_bit_reader &in) {
+      unsigned count;
+      state next;
+      bool ok;
+      if (state_ == state::literal_codes) {
+        count = num_literal_trees_;
+        next = state::command_codes;
+        if (literal_tables_.size() < count) literal_tables_.resize(count);
+        ok = read_code(in, literal_tables_[header_index_], 256);
+      } else if (state_ == state::command_codes) {
+        count = num_types_[idx_I];
+        next = state::distance_codes;
+        if (command_tables_.size() < count) command_tables_.resize(count);
+        ok = read_code(in, command_tables_[header_index_], max_command_symbols);
+      } else {
+        count = num_distance_trees_;
+        next = state::command;
+        if (distance_tables_.size() < count) distance_tables_.resize(count);
+        ok = read_code(in, distance_tables_[header_index_], 16 + ndirect_ + (48 << npostfix_));
+      }
+
+      if (++header_index_ == count) {
+        header_index_ = 0;
+        state_ = next;
+        if (next == state::command) {
+          set_literal_block(0);
+          distance_map_ = distance_context_map_;
         }
-        mtf[0] = value;
       }
+      return ok;
     }
 
+    // 3.4.  Simple Prefix Codes and 3.5.  Complex Prefix Codes
     template <class Table>
-    static void read_huffman_code(brotli_decoder_state &s, Table &table, int alphabet_size) {
-      int code_type = s.read(2);
-      if (s.error != error_code::ok) return;
-      alphabet_size &= 1023;
-      if (debug) fprintf(s.log_file, "[ReadHuffmanCode] s->sub_loop_counter = %d\n", code_type);
-      if (code_type == 1) {
-        // 3.4.  Simple Prefix Codes
-        int num_symbols = s.read(2) + 1;
-        int alphabet_bits = log2_floor(alphabet_size - 1);
-        uint16_t symbols[Table::max_codes];
-        for (int i = 0; i != num_symbols; ++i) {
-          symbols[i] = (uint16_t)s.read(alphabet_bits);
-          if (debug) fprintf(s.log_file, "[ReadSimpleHuffmanSymbols] s->symbols_lists_array[i] = %d\n", symbols[i]);
+    static bool read_code(deflate_bit_reader &in, Table &table, unsigned alphabet_size) {
+      in.refill();
+      unsigned hskip = in.get(2);
+      if (hskip == 1) {
+        unsigned num_symbols = in.get(2) + 1;
+        unsigned alphabet_bits = 0;
+        while ((alphabet_size - 1) >> alphabet_bits) ++alphabet_bits;
+
+        unsigned symbols[4];
+        for (unsigned i = 0; i != num_symbols; ++i) {
+          in.refill();
+          symbols[i] = in.get(alphabet_bits);
+          if (symbols[i] >= alphabet_size) return false;
+          for (unsigned j = 0; j != i; ++j) {
+            if (symbols[i] == symbols[j]) return false;
+          }
         }
-        if (debug) fprintf(s.log_file, "[ReadHuffmanCode] s->symbol = %d\n", num_symbols-1);
+
+        if (num_symbols == 1) {
+          table.build_single(symbol_entries()[symbols[0]]);
+          return true;
+        }
+
+        // Lengths are given to the symbols in the order they were sent.
         static const uint8_t simple_lengths[][4] = {
-          {0},
           {1, 1},
           {1, 2, 2},
           {2, 2, 2, 2},
           {1, 2, 3, 3},
         };
-        int tree_select = num_symbols == 4 ? s.read(1) : 0;
-        table.init(simple_lengths[num_symbols - 1 + tree_select], symbols, num_symbols);
-      } else {
-        // 3.5.  Complex Prefix Codes
-        andyzip::huffman_table<18> complex_table;
-        {
-          uint8_t lengths[18] = {0};
-          int space = 0;
-          int num_codes = 0;
-          for (int i = code_type; i != 18; ++i) {
-            int bits = s.peek(4);
-            if (s.error != error_code::ok) return;
-
-            static const uint8_t kCodeLengthCodeOrder[18] = {
-              1, 2, 3, 4, 0, 5, 17, 6, 16, 7, 8, 9, 10, 11, 12, 13, 14, 15,
-            };
-
-            // Static prefix code for the complex code length code lengths.
-            static const uint8_t kCodeLengthPrefixLength[16] = {
-              2, 2, 2, 3, 2, 2, 2, 4, 2, 2, 2, 3, 2, 2, 2, 4,
-            };
-
-            static const uint8_t kCodeLengthPrefixValue[16] = {
-              0, 4, 3, 2, 0, 4, 3, 1, 0, 4, 3, 2, 0, 4, 3, 5,
-            };
-
-            s.drop(kCodeLengthPrefixLength[bits]);
-            uint8_t length = kCodeLengthPrefixValue[bits];
-            lengths[kCodeLengthCodeOrder[i]] = length;
-            if (debug) fprintf(s.log_file, "[ReadCodeLengthCodeLengths] s->code_length_code_lengths[%d] = %d\n", kCodeLengthCodeOrder[i], lengths[kCodeLengthCodeOrder[i]]);
-            if (length) {
-              ++num_codes;
-              space += 32 >> length;
-              if (space >= 32) break;
-            }
-          }
-          if (num_codes != 1 && space != 32) {
-            if (debug) fprintf(s.log_file, "bad\n");
-            s.error = error_code::huffman_length_error;
-            return;
-          }
-
-          complex_table.init(lengths, nullptr, 18);
-          if (complex_table.invalid()) {
-            if (debug) fprintf(s.log_file, "bad2\n");
-            s.error = error_code::huffman_length_error;
-            return;
-          }
+        unsigned tree_select = num_symbols == 4 ? in.get(1) : 0;
+        uint8_t lengths[max_command_symbols];
+        memset(lengths, 0, alphabet_size);
+        for (unsigned i = 0; i != num_symbols; ++i) {
+          lengths[symbols[i]] = simple_lengths[num_symbols - 2 + tree_select][i];
         }
+        return table.build(lengths, alphabet_size, symbol_entries());
+      }
 
-        {
-          int space = 0;
-          uint8_t lengths[Table::max_codes];
-          uint8_t nzcl = 8;
-          int prev_code_len = 8;
-          int repeat = 0;
-          int repeat_code_len = 0;
-          int i = 0;
-          for(; i < alphabet_size && space < 32768;) {
-            auto code = complex_table.decode(s.peek(16));
-            s.drop(code.first);
-            int code_len = code.second;
-            if (code_len < 16) {
-              if (code_len) {
-                if (debug) fprintf(s.log_file, "[ReadHuffmanCode] code_length[%d] = %d\n", i, code_len);
-              }
-              if (i + 1 > alphabet_size) {
-                s.error = error_code::huffman_length_error;
-                if (debug) fprintf(s.log_file, "bad3\n");
-                return;
-              }
-              lengths[i++] = (uint8_t)code_len;
-              if (code_len) {
-                space += 32768 >> code_len;
-                prev_code_len = code_len;
-              }
-              repeat = 0;
-            } else {
-              int extra_bits = code_len == 16 ? 2 : 3;
-              int new_len = code_len == 16 ? prev_code_len : 0;
-              int repeat_delta = s.peek(extra_bits);
-              s.drop(extra_bits);
-
-              if (repeat_code_len != new_len) {
-                repeat = 0;
-                repeat_code_len = new_len;
-              }
-
-              int old_repeat = repeat;
-              if (repeat > 0) {
-                repeat -= 2;
-                repeat <<= extra_bits;
-              }
+      static const uint8_t code_length_order[18] = {
+        1, 2, 3, 4, 0, 5, 17, 6, 16, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+      };
+
+      // Static prefix code for the code length code lengths, indexed by the next four bits.
+      static const uint8_t prefix_length[16] = {
+        2, 2, 2, 3, 2, 2, 2, 4, 2, 2, 2, 3, 2, 2, 2, 4,
+      };
+      static const uint8_t prefix_value[16] = {
+        0, 4, 3, 2, 0, 4, 3, 1, 0, 4, 3, 2, 0, 4, 3, 5,
+      };
+
+      uint8_t code_lengths[18] = {0};
+      unsigned space = 0;
+      unsigned num_codes = 0;
+      unsigned last_code = 0;
+      for (unsigned i = hskip; i != 18; ++i) {
+        in.refill();
+        unsigned bits = (unsigned)in.bits() & 15;
+        in.consume(prefix_length[bits]);
+        unsigned length = prefix_value[bits];
+        code_lengths[code_length_order[i]] = (uint8_t)length;
+        if (length) {
+          ++num_codes;
+          last_code = code_length_order[i];
+          space += 32 >> length;
+          if (space >= 32) break;
+        }
+      }
+      if (num_codes != 1 && space != 32) return false;
 
-              repeat += repeat_delta + 3;
-              repeat_delta = repeat - old_repeat;
+      code_length_table code_length_code;
+      if (num_codes == 1) {
+        code_length_code.build_single(symbol_entries()[last_code]);
+      } else if (!code_length_code.build(code_lengths, 18, symbol_entries())) {
+        return false;
+      }
 
-              if (debug) fprintf(s.log_file, "[ReadHuffmanCode] code_length[%d..%d] = %d\n", i, i + repeat_delta - 1, new_len);
-              if (i + repeat_delta > alphabet_size) {
-                if (debug) fprintf(s.log_file, "bad4 %d %d %d\n", i, repeat_delta, alphabet_size);
-                s.error = error_code::huffman_length_error;
-                return;
-              }
-              for (int j = 0; j != repeat_delta; ++j) {
-                lengths[i++] = new_len;
-              }
-              if (new_len) {
-                space += (32768 >> new_len) * repeat_delta;
-              }
-            }
+      // Read the symbol code lengths until the code is complete.
+      uint8_t lengths[max_command_symbols];
+      unsigned i = 0;
+      space = 0;
+      unsigned prev_length = 8;
+      unsigned repeat = 0;
+      unsigned repeat_length = 0;
+      while (i < alphabet_size && space < 32768) {
+        in.refill();
+        uint32_t entry = code_length_code.lookup(in.bits());
+        in.consume(code_length_table::length(entry));
+        unsigned code = code_length_table::value(entry);
+        if (code < 16) {
+          lengths[i++] = (uint8_t)code;
+          repeat = 0;
+          if (code) {
+            prev_length = code;
+            space += 32768 >> code;
+          }
+        } else {
+          // Consecutive repeat codes of the same kind extend the previous repeat.
+          unsigned extra_bits = code == 16 ? 2 : 3;
+          unsigned new_length = code == 16 ? prev_length : 0;
+          if (repeat_length != new_length) {
+            repeat = 0;
+            repeat_length = new_length;
           }
-          if (space > 32768) {
-            if (debug) fprintf(s.log_file, "bad5\n");
-            s.error = error_code::huffman_length_error;
-            return;
+          unsigned old_repeat = repeat;
+          if (repeat > 0) {
+            repeat = (repeat - 2) << extra_bits;
           }
-          memset(lengths + i, 0, alphabet_size - i);
-          table.init(lengths, nullptr, alphabet_size);
-          if (table.invalid()) {
-            if (debug) fprintf(s.log_file, "bad6\n");
-            s.error = error_code::huffman_length_error;
-            return;
+          repeat += in.get(extra_bits) + 3;
+          unsigned delta = repeat - old_repeat;
+          if (i + delta > alphabet_size) return false;
+          memset(lengths + i, (int)new_length, delta);
+          i += delta;
+          if (new_length) {
+            space += (32768 >> new_length) * delta;
           }
         }
       }
-    }
+      if (space != 32768) return false;
 
-    static int read_block_length(brotli_decoder_state &s, int index) {
-      unsigned code = s.peek(16);
-      auto length_code = s.block_count_tables[index].decode(code);
-      s.drop(length_code.first);
-      int extra_bits = brotli_data::kBlockLengthPrefixCode[length_code.second].nbits;
-      int value = s.read(extra_bits);
-      return brotli_data::kBlockLengthPrefixCode[length_code.second].offset + value;
+      memset(lengths + i, 0, alphabet_size - i);
+      return table.build(lengths, alphabet_size, symbol_entries());
     }
 
-    static void read_block_switch_command(brotli_decoder_state &s, int index) {
-      int num_types = s.num_types[index];
-      if (num_types == 1) return;
+    // 7.3.  Encoding of the Context Map
+    static bool read_context_map(deflate_bit_reader &in, uint8_t *context_map, unsigned size, unsigned num_trees) {
+      if (num_trees < 2) {
+        memset(context_map, 0, size);
+        return true;
+      }
 
-      //  read block type using HTREE_BTYPE_D and set BTYPE_D
-      // 6.  Encoding of Block-Switch Commands
-      unsigned bits = s.peek(16);
-      auto length_code = s.block_type_tables[index].decode(bits);
-      s.drop(length_code.first);
-      int code = length_code.second;
-      int cur = s.block_type[index];
-      int last = s.last_block_type[index];
+      in.refill();
+      unsigned rle_max = in.get(1) ? in.get(4) + 1 : 0;
+      type_table table;
+      if (!read_code(in, table, num_trees + rle_max)) return false;
+
+      for (unsigned i = 0; i < size;) {
+        in.refill();
+        uint32_t entry = table.lookup(in.bits());
+        in.consume(type_table::length(entry));
+        unsigned code = type_table::value(entry);
+        if (code == 0) {
+          context_map[i++] = 0;
+        } else if (code > rle_max) {
+          context_map[i++] = (uint8_t)(code - rle_max);
+        } else {
+          unsigned run = (1u << code) + in.get(code);
+          if (run > size - i) return false;
+          memset(context_map + i, 0, run);
+          i += run;
+        }
+      }
 
-      int block_type = code == 0 ? last : code == 1 ? cur + 1 : code - 2;
-      if (block_type > num_types) {
-        block_type -= num_types;
+      in.refill();
+      if (in.get(1)) {
+        inverse_move_to_front(context_map, size);
       }
+      return true;
+    }
 
-      //   save previous block type
-      s.last_block_type[index] = cur;
-      s.block_type[index] = block_type;
+    // Values below num_trees stay below num_trees, so the map needs no further checks.
+    static void inverse_move_to_front(uint8_t *values, unsigned num_values) {
+      uint8_t mtf[256];
+      for (unsigned i = 0; i != 256; ++i) {
+        mtf[i] = (uint8_t)i;
+      }
+      for (unsigned i = 0; i != num_values; ++i) {
+        unsigned index = values[i];
+        uint8_t value = mtf[index];
+        values[i] = value;
+        for (; index; --index) {
+          mtf[index] = mtf[index - 1];
+        }
+        mtf[0] = value;
+      }
+    }
 
-      //if (debug) fprintf(s.log_file, "block_type[%d] = {%d, %d}\n", index, cur, block_type);
+    ALWAYS_INLINE unsigned read_block_length(deflate_bit_reader &in, unsigned i) {
+      uint32_t entry = count_tables_[i].lookup(in.bits());
+      in.consume(count_table::length(entry));
+      auto &range = brotli_data::kBlockLengthPrefixCode[count_table::value(entry)];
+      return range.offset + in.get(range.nbits);
+    }
 
-      //  read block count using HTREE_BLEN_D and set BLEN_D
-      s.block_len[index] = read_block_length(s, index);
+    void set_literal_block(unsigned type) {
+      literal_map_ = literal_context_map_ + (type << literal_context_bits);
+      context_lut_ = context_lookup(context_mode_[type]);
     }
 
-    static void read_context_map(brotli_decoder_state &s, uint8_t *context_map, int context_map_size, int num_trees) {
-      if (debug) fprintf(s.log_file, "[DecodeContextMap] context_map_size = %d\n", context_map_size);
-      if (debug) fprintf(s.log_file, "[DecodeContextMap] *num_htrees = %d\n", num_trees);
-
-      // if NTREESL >= 2
-      if (num_trees >= 2) {
-        //  read literal context map, CMAPL[]
-        int bits = s.peek(5);
-        if (s.error != error_code::ok) return; 
-        int rlemax = (bits & 1) ? (bits >> 1) + 1 : 0;
-        s.drop((bits & 1) ? 5 : 1);
-        if (debug) fprintf(s.log_file, "[DecodeContextMap] s->max_run_length_prefix = %d\n", rlemax);
-        andyzip::huffman_table<256> table;
-        read_huffman_code(s, table, num_trees + rlemax);
-        if (s.error != error_code::ok) return;
-        for (int i = 0; i != context_map_size;) {
-          unsigned bits = s.peek(16);
-          auto length_value = table.decode(bits);
-          s.drop(length_value.first);
-          int code = length_value.second;
-          if (debug) fprintf(s.log_file, "[DecodeContextMap] code = %d\n", code);
-          if (code == 0) {
-            context_map[i++] = (uint8_t)code;
-          } else if (code > rlemax) {
-            context_map[i++] = (uint8_t)code - rlemax;
-          } else {
-            int repeat = s.read(code) + (1 << code);
-            if (debug) fprintf(s.log_file, "[DecodeContextMap] reps = %d\n", repeat);
-            if (i + repeat > context_map_size) {
-              s.error = error_code::context_map_error;
-              return;
-            }
-            for (int j = 0; j != repeat; ++j) {
-              context_map[i++] = 0;
-            }
-          }
-        }
+    // 6.  Encoding of Block-Switch Commands
+    // This is a checkpoint of its own. Returns false if the input ran out.
+    ALWAYS_INLINE bool switch_block(deflate_bit_reader &in, unsigned i) {
+      if (num_types_[i] == 1) {
+        block_len_[i] = 1 << 24;
+        return true;
+      }
 
-        int imtf = s.read(1);
-        if (s.error != error_code::ok) return; 
-        if (imtf) {
-          inverse_move_to_front(context_map, context_map_size);
-        }
-      } else {
-        //  fill CMAPL[] with zeros
-        std::fill(context_map, context_map + context_map_size, 0);
+      deflate_bit_reader saved = in;
+      in.refill();
+      uint32_t entry = type_tables_[i].lookup(in.bits());
+      in.consume(type_table::length(entry));
+      unsigned code = type_table::value(entry);
+      in.refill();
+      unsigned length = read_block_length(in, i);
+      if (!in.ok()) {
+        in = saved;
+        return false;
       }
+
+      unsigned type = code == 0 ? last_block_type_[i] : code == 1 ? block_type_[i] + 1 : code - 2;
+      if (type >= num_types_[i]) type -= num_types_[i];
+      last_block_type_[i] = block_type_[i];
+      block_type_[i] = type;
+      block_len_[i] = length;
+      if (i == idx_L) {
+        set_literal_block(type);
+      } else if (i == idx_D) {
+        distance_map_ = distance_context_map_ + (type << distance_context_bits);
+      }
+      return true;
     }
 
-    int transform_dictionary_word(char *buffer, const uint8_t *src, int transform_idx, int copy_len, int ringbuffer_mask) {
-      char *dest = buffer;
-      auto &t = brotli_data::table[transform_idx];
-      for (const char *psrc = t.prefix; *psrc; ++psrc) {
-        *dest++ = *psrc;
+    // Skip metadata or copy an uncompressed meta-block into the ring.
+    status copy_bytes(deflate_bit_reader &in) {
+      const uint8_t *src = in.byte_position();
+      size_t bytes = std::min((size_t)meta_remaining_, (size_t)(in.src_max() - src));
+      if (state_ == state::uncompressed) {
+        if (pos_ >= ring_size_) return status::need_more_output;
+        bytes = std::min(bytes, ring_size_ - pos_);
+        memcpy(ring_.data() + pos_, src, bytes);
+        pos_ += bytes;
+      }
+      meta_remaining_ -= (uint32_t)bytes;
+      in.reset(src + bytes);
+
+      if (meta_remaining_ == 0) {
+        state_ = state::metablock_header;
+        return status::need_more_input;
+      }
+      return state_ == state::uncompressed && pos_ == ring_size_ ? status::need_more_output : status::need_more_input;
+    }
+
+    // 8.  Static Dictionary. Write a transformed word and return its length.
+    // The ring has room for the longest one.
+    static unsigned transform_word(uint8_t *dest, const uint8_t *word, int length, unsigned transform) {
+      auto &t = brotli_data::table[transform];
+      uint8_t *start = dest;
+      for (const char *p = t.prefix; *p; ++p) {
+        *dest++ = (uint8_t)*p;
       }
 
       if (t.id >= brotli_data::OmitLast1) {
-        copy_len -= t.id - brotli_data::OmitLast1 + 1;
+        length -= t.id - brotli_data::OmitLast1 + 1;
       } else if (t.id >= brotli_data::OmitFirst1) {
-        copy_len -= t.id - brotli_data::OmitFirst1 + 1;
-        src += t.id - brotli_data::OmitFirst1 + 1;
+        int skip = t.id - brotli_data::OmitFirst1 + 1;
+        word += skip;
+        length -= skip;
       }
 
-      // fermentation (aka. case conversion)
-      if (t.id == brotli_data::FermentFirst || t.id == brotli_data::FermentAll) {
-        uint8_t fermented[24];
-        if (copy_len <= 24) {
-          memcpy(fermented, src, copy_len);
-        }
-  
-        for (int i = 0; i < copy_len;) {
-          uint8_t chr = src[i];
-          if (chr < 192) {
-            if (chr >= 97 && chr <= 122) {
-              fermented[i] ^= 32;
-            }
-            ++i;
-          } else if (chr < 224) {
-            if (i + 1 < copy_len) {
-              fermented[i+1] ^= 32;
-            }
-            i += 2;
-          } else {
-            if (i + 2 < copy_len) {
-              fermented[i+2] ^= 32;
+      if (length > 0) {
+        memcpy(dest, word, length);
+        if (t.id == brotli_data::FermentFirst || t.id == brotli_data::FermentAll) {
+          // Upper case the first (or every) UTF-8 character.
+          // This may flip bits just past the word, which are either overwritten or unused.
+          for (int i = 0; i < length;) {
+            uint8_t *p = dest + i;
+            if (p[0] < 0xc0) {
+              if (p[0] >= 'a' && p[0] <= 'z') p[0] ^= 32;
+              i += 1;
+            } else if (p[0] < 0xe0) {
+              p[1] ^= 32;
+              i += 2;
+            } else {
+              p[2] ^= 5;
+              i += 3;
             }
-            i += 3;
+            if (t.id == brotli_data::FermentFirst) break;
           }
-          if (t.id == brotli_data::FermentFirst) break;
         }
-        src = fermented;
-      }
-
-      for (int i = 0; i != copy_len; ++i) {
-        *dest++ = *src++;
+        dest += length;
       }
 
-      for (const char *dsrc = t.suffix; *dsrc; ++dsrc) {
-        *dest++ = *dsrc;
+      for (const char *p = t.suffix; *p; ++p) {
+        *dest++ = (uint8_t)*p;
       }
-
-      return (int)(dest - buffer);
-    }
-  public:
-    brotli_decoder() {
+      return (unsigned)(dest - start);
     }
 
-    // decode some input bits and return -1 if we need more input.
-    brotli_decoder_state::error_code decode(brotli_decoder_state &s) {
-      typedef brotli_decoder_state::error_code error_code;
-      // https://tools.ietf.org/html/rfc7932
-      s.error = error_code::ok;
-
-      // read window size
-      unsigned lg_window_size = read_window_size(s);
-      if (s.error != error_code::ok) return s.error;
-      s.max_backward_distance = (1 << lg_window_size) - window_gap;
-      if (debug) fprintf(s.log_file, "[BrotliDecoderDecompressStream] s->window_bits = %d\n", lg_window_size);
-      if (debug) fprintf(s.log_file, "[BrotliDecoderDecompressStream] s->pos = %d\n", 0);
-
-      s.ring_buffer.resize(1 << lg_window_size);
-      int ringbuffer_mask = (1 << lg_window_size) - 1;
-
-      //  do
-      {
-          // read ISLAST bit
-          int is_last = s.read(1);
-          if (s.error != error_code::ok) return s.error;
-
-          // if ISLAST
-          if (is_last) {
-            //  read ISLASTEMPTY bit
-            int is_last_empty = s.read(1);
-            if (s.error != error_code::ok) return s.error;
-
-            //  if ISLASTEMPTY break from loop
-            if (is_last_empty) { s.error = error_code::end; return s.error; }
-          }
+    // 9.3.  Format of the Meta-Block Data
+    // Decode commands into the ring until the meta-block ends, the ring is full or the input runs out.
+    // Each command is split into checkpoints: the insert and copy lengths, each literal, the distance
+    // and pieces of the copy.
+    status decode_commands(deflate_bit_reader &reader) {
+      // A private copy of the reader stays in registers. Stores to the ring could alias the caller's.
+      deflate_bit_reader in = reader;
+      uint8_t *ring = ring_.data();
+      size_t mask = ring_mask_;
+      size_t pos = pos_;
+      status result = status::need_more_output;
+
+      for (;;) {
+        if (pos >= ring_size_) {
+          result = status::need_more_output;
+          break;
+        }
 
-          // read MNIBBLES
-          int nibbles_code = s.read(2);
-          if (s.error != error_code::ok) return s.error;
-
-          // if MNIBBLES is zero
-          int mlen = 0;
-          if (nibbles_code == 3) {
-            //  verify reserved bit is zero
-            //  read MSKIPLEN
-            //  skip any bits up to the next byte boundary
-            //  skip MSKIPLEN bytes
-            //  continue to the next meta-block
-            s.error = error_code::syntax_error;
-            return s.error;
-          } else {
-            //  read MLEN
-            for (int i = 0; i != nibbles_code + 4; ++i) {
-              int val = s.read(4);
-              if (s.error != error_code::ok) return s.error;
-              mlen |= val << (i*4);
-            }
-            ++mlen;
+        if (state_ == state::command) {
+          if (block_len_[idx_I] == 0 && !switch_block(in, idx_I)) {
+            result = status::need_more_input;
+            break;
           }
-
-          // if not ISLAST
-          if (!is_last) {
-            //  read ISUNCOMPRESSED bit
-            int is_uncompressed = s.read(1);
-            //  if ISUNCOMPRESSED
-            if (is_uncompressed) {
-              // skip any bits up to the next byte boundary
-              // copy MLEN bytes of compressed data as literals
-              // continue to the next meta-block
-              s.error = error_code::syntax_error;
-              return s.error;
-            }
+          deflate_bit_reader saved = in;
+          in.refill();
+          uint32_t entry = command_tables_[block_type_[idx_I]].lookup(in.bits());
+          in.consume(command_table::length(entry));
+          const brotli_data::CmdLutElement &cmd = brotli_data::kCmdLut[command_table::value(entry)];
+          in.refill();
+          uint32_t insert_len = cmd.insert_len_offset + in.get(cmd.insert_len_extra_bits);
+          uint32_t copy_len = cmd.copy_len_offset + in.get(cmd.copy_len_extra_bits);
+          if (!in.ok()) {
+            in = saved;
+            result = status::need_more_input;
+            break;
           }
-
-          if (debug) fprintf(s.log_file, "[BrotliDecoderDecompressStream] s->is_last_metablock = %d\n", is_last);
-          if (debug) fprintf(s.log_file, "[BrotliDecoderDecompressStream] s->meta_block_remaining_len = %d\n", mlen);
-          if (debug) fprintf(s.log_file, "[BrotliDecoderDecompressStream] s->is_metadata = %d\n", 0);
-          if (debug) fprintf(s.log_file, "[BrotliDecoderDecompressStream] s->is_uncompressed = %d\n", 0);
-
-          enum {
-            idx_L, idx_I, idx_D
-          };
-
-          // loop for each three block categories (i = L, I, D)
-          for (int i = 0; i != 3; ++i) {
-            //  read NBLTYPESi
-            int nbltypesi = read_256(s);
-            if (s.error != error_code::ok) return s.error;
-            if (debug) fprintf(s.log_file, "[BrotliDecoderDecompressStream] s->num_block_types[s->loop_counter] = %d\n", nbltypesi);
-
-            s.num_types[i] = nbltypesi;
-
-            //  if NBLTYPESi >= 2
-            if (nbltypesi >= 2) {
-              // read prefix code for block types, HTREE_BTYPE_i
-              read_huffman_code(s, s.block_type_tables[i], nbltypesi + 2);
-              if (s.error != error_code::ok) return s.error;
-              // read prefix code for block counts, HTREE_BLEN_i
-              read_huffman_code(s, s.block_count_tables[i], block_len_symbols);
-              if (s.error != error_code::ok) return s.error;
-              // read block count, BLEN_i
-              s.block_len[i] = read_block_length(s, i);
-              // set block type, BTYPE_i to 0
-              s.block_type[i] = 0;
-              // initialize second-to-last and last block types to 0 and 1
-              s.last_block_type[i] = 1;
-              if (debug) fprintf(s.log_file, "[BrotliDecoderDecompressStream] s->block_length[s->loop_counter] = %d\n", s.block_len[i]);
-            } else {
-              // set block type, BTYPE_i to 0
-              s.block_type[i] = 0;
-              // set block count, BLEN_i to 16777216
-              s.block_len[i] = 16777216;
-            }
+          if (insert_len > meta_remaining_) {
+            state_ = state::error;
+            result = status::error;
+            break;
           }
-
-          // read NPOSTFIX and NDIRECT
-          int pbits = s.read(6);
-          if (s.error != error_code::ok) return s.error;
-          int NPOSTFIX = pbits & 3;
-          int NDIRECT = (pbits >> 2) << NPOSTFIX;
-          if (s.error != error_code::ok) return s.error;
-          if (debug) fprintf(s.log_file, "[BrotliDecoderDecompressStream] s->num_direct_distance_codes = %d\n", NDIRECT + 16);
-          if (debug) fprintf(s.log_file, "[BrotliDecoderDecompressStream] s->distance_postfix_bits = %d\n", NPOSTFIX);
-
-          // read array of literal context modes, CMODE[]
-          for (int i = 0; i != s.num_types[idx_L]; ++i) {
-            int ctxt = s.read(2) * 2;
-            if (s.error != error_code::ok) return s.error;
-            s.context_mode[i & (brotli_decoder_state::max_types-1)] = ctxt;
-            if (debug) fprintf(s.log_file, "[ReadContextModes] s->context_modes[%d] = %d\n", i, s.context_mode[i]);
+          block_len_[idx_I]--;
+          meta_remaining_ -= insert_len;
+          insert_remaining_ = insert_len;
+          copy_len_ = copy_len;
+          implicit_distance_ = cmd.distance_code == 0;
+          distance_context_ = cmd.context;
+          state_ = state::literals;
+        } else if (state_ == state::literals) {
+          while (insert_remaining_ != 0 && pos < ring_size_) {
+            if (block_len_[idx_L] == 0 && !switch_block(in, idx_L)) break;
+
+            // Run of literals in one block type, using locals as the ring may alias members.
+            size_t todo = std::min(std::min((size_t)insert_remaining_, (size_t)block_len_[idx_L]), ring_size_ - pos);
+            const literal_table *tables = literal_tables_.data();
+            const uint8_t *context_map = literal_map_;
+            const uint8_t *lut = context_lut_;
+            unsigned p1 = ring[(pos - 1) & mask];
+            unsigned p2 = ring[(pos - 2) & mask];
+            size_t done = 0;
+            if ((size_t)(in.src_max() - in.byte_position()) > todo * 2) {
+              // Literal codes are at most 15 bits, so none of these can run out of input.
+              for (; done != todo; ++done) {
+                in.refill();
+                const literal_table &table = tables[context_map[lut[p1] | lut[256 + p2]]];
+                uint32_t entry = table.lookup(in.bits());
+                in.consume(literal_table::length(entry));
+                p2 = p1;
+                p1 = literal_table::value(entry);
+                ring[pos++] = (uint8_t)p1;
+              }
+            }
+            for (; done != todo; ++done) {
+              deflate_bit_reader saved = in;
+              in.refill();
+              const literal_table &table = tables[context_map[lut[p1] | lut[256 + p2]]];
+              uint32_t entry = table.lookup(in.bits());
+              in.consume(literal_table::length(entry));
+              if (!in.ok()) {
+                in = saved;
+                break;
+              }
+              p2 = p1;
+              p1 = literal_table::value(entry);
+              ring[pos++] = (uint8_t)p1;
+            }
+            insert_remaining_ -= (uint32_t)done;
+            block_len_[idx_L] -= (uint32_t)done;
+            if (done != todo) break;
           }
 
-          // read NTREESL
-          int num_literal_htrees = read_256(s);
-          if (s.error != error_code::ok) return s.error;
-          read_context_map(s, s.literal_context_map, s.num_types[idx_L] << literal_context_bits, num_literal_htrees);
-          if (s.error != error_code::ok) return s.error;
-
-          // read NTREESD
-          int num_distance_htrees = read_256(s);
-          if (s.error != error_code::ok) return s.error;
-          read_context_map(s, s.distance_context_map, s.num_types[idx_D] << distance_context_bits, num_distance_htrees);
-          if (s.error != error_code::ok) return s.error;
-
-          // read array of literal prefix codes, HTREEL[]
-          std::vector<andyzip::huffman_table<256>> literal_tables(num_literal_htrees);
-          for (int i = 0; i != literal_tables.size(); ++i) {
-            read_huffman_code(s, literal_tables[i], 256);
-            if (s.error != error_code::ok) return s.error;
+          if (insert_remaining_ != 0) {
+            result = pos < ring_size_ ? status::need_more_input : status::need_more_output;
+            break;
           }
 
-          // read array of insert-and-copy length prefix codes, HTREEI[]
-          std::vector<andyzip::huffman_table<704>> iandc_tables(s.num_types[idx_I]);
-          for (int i = 0; i != iandc_tables.size(); ++i) {
-            read_huffman_code(s, iandc_tables[i], 704);
-            if (s.error != error_code::ok) return s.error;
+          // The copy length is ignored if the literals end the meta-block.
+          if (meta_remaining_ == 0) {
+            state_ = state::metablock_header;
+            break;
           }
-
-          // read array of distance prefix codes, HTREED[]
-          static const int max_distance_alphabet_size = num_distance_short_codes + (15 << 3) + (48 << 3);
-          std::vector<andyzip::huffman_table<256>> distance_tables(num_distance_htrees);
-          int distance_alphabet_size = 16 + NDIRECT + (48 << NPOSTFIX);
-          for (int i = 0; i != distance_tables.size(); ++i) {
-            read_huffman_code(s, distance_tables[i], distance_alphabet_size);
-            if (s.error != error_code::ok) return s.error;
+          state_ = state::distance;
+        } else if (state_ == state::distance) {
+          // 4.  Encoding of Distances
+          uint32_t distance;
+          bool push = false;
+          if (implicit_distance_) {
+            distance = dist_rb_[(dist_rb_idx_ - 1) & 3];
+          } else {
+            if (block_len_[idx_D] == 0 && !switch_block(in, idx_D)) {
+              result = status::need_more_input;
+              break;
+            }
+            deflate_bit_reader saved = in;
+            in.refill();
+            uint32_t entry = distance_tables_[distance_map_[distance_context_]].lookup(in.bits());
+            in.consume(dist_table::length(entry));
+            unsigned dcode = dist_table::value(entry);
+            if (dcode < 16) {
+              // Short codes are relative to the last four distances. Code 0 isn't pushed again.
+              uint8_t subst = brotli_data::distance_table[dcode];
+              int value = (int)dist_rb_[(dist_rb_idx_ - (subst >> 4)) & 3] + (subst & 0x0f) - 4;
+              distance = value > 0 ? (uint32_t)value : 0;
+              push = dcode != 0;
+            } else if (dcode < 16 + ndirect_) {
+              distance = dcode - 15;
+              push = true;
+            } else {
+              // At most 41 bits have been read since the refill, leaving room for 24 extra bits.
+              unsigned code = dcode - ndirect_ - 16;
+              unsigned ndistbits = 1 + (code >> (npostfix_ + 1));
+              unsigned hcode = code >> npostfix_;
+              unsigned lcode = code & ((1u << npostfix_) - 1);
+              uint32_t offset = ((2 + (hcode & 1)) << ndistbits) - 4;
+              distance = ((offset + in.get(ndistbits)) << npostfix_) + lcode + ndirect_ + 1;
+              push = true;
+            }
+            if (!in.ok()) {
+              in = saved;
+              result = status::need_more_input;
+              break;
+            }
+            block_len_[idx_D]--;
+            if (distance == 0) {
+              state_ = state::error;
+              result = status::error;
+              break;
+            }
           }
 
-          // do
-          int last_distances[4] = { 16, 15, 11, 4 };
-          int last_distance_idx = 0;
-
-          for (int pos = 0; pos < mlen; ) {
-            //  if BLEN_I is zero
-            if (s.block_len[idx_I] == 0) {
-              read_block_switch_command(s, idx_I);
+          size_t max_distance = (size_t)std::min((uint64_t)max_distance_, ring_base_ + pos);
+          if (distance > max_distance) {
+            // Distances beyond the output so far refer to the static dictionary.
+            uint32_t word_id = distance - (uint32_t)max_distance - 1;
+            unsigned shift = copy_len_ >= 4 && copy_len_ <= 24 ? brotli_data::kBrotliDictionarySizeBitsByLength[copy_len_] : 0;
+            unsigned transform = shift ? word_id >> shift : 0;
+            if (!shift || transform >= sizeof(brotli_data::table) / sizeof(brotli_data::table[0])) {
+              state_ = state::error;
+              result = status::error;
+              break;
             }
-            //  decrement BLEN_I
-            s.block_len[idx_I]--;
-
-            //  read insert-and-copy length symbol using HTREEI[BTYPE_I]
-            int peek16 = s.peek(16);
-            auto iandc = iandc_tables[s.block_type[idx_I]].decode(peek16);
-            s.drop(iandc.first);
-
-            //  compute insert length, ILEN, and copy length, CLEN
-            brotli_data::CmdLutElement cmd = brotli_data::kCmdLut[iandc.second];
-            int insert_len =
-              cmd.insert_len_offset + 
-              (cmd.insert_len_extra_bits ? s.read(cmd.insert_len_extra_bits) : 0)
-            ;
-            int copy_len =
-              cmd.copy_len_offset + 
-              (cmd.copy_len_extra_bits ? s.read(cmd.copy_len_extra_bits) : 0)
-            ;
-            //if (debug) fprintf(s.log_file, "{%d %d %d %d} %d\n", last_distances[0], last_distances[1], last_distances[2], last_distances[3], last_distance_idx);
-            if (debug) fprintf(s.log_file, "[ProcessCommandsInternal] pos = %d insert = %d copy = %d\n", pos, insert_len, copy_len);
-
-            //  loop for ILEN
-            int p2 = pos < 2 ? 0 : s.ring_buffer[(pos - 2) & ringbuffer_mask];
-            int p1 = pos < 1 ? 0 : s.ring_buffer[(pos - 1) & ringbuffer_mask];
-            for (int i = 0; i != insert_len && pos < mlen; ++i) {
-              // if BLEN_L is zero
-              if (s.block_len[idx_L] == 0) {
-                read_block_switch_command(s, idx_L);
-              }
-              // decrement BLEN_L
-              s.block_len[idx_L]--;
-
-              // look up context mode CMODE[BTYPE_L]
-              uint8_t cmode = s.context_mode[s.block_type[idx_L]];
-
-              // compute context ID, CIDL from last two uncompressed bytes
-              // 7.1.  Context Modes and Context ID Lookup for Literals
-              // For LSB6:    Context ID = p1 & 0x3f
-              // For MSB6:    Context ID = p1 >> 2
-              // For UTF8:    Context ID = Lut0[p1] | Lut1[p2]
-              // For Signed:  Context ID = (Lut2[p1] << 3) | Lut2[p2]
-              int context_id =
-                cmode < 2 ? (p1 >> cmode*2) & 63 :
-                cmode == 2 ? brotli_data::Lut0[p1] | brotli_data::Lut1[p2] : (brotli_data::Lut2[p1] << 3) | brotli_data::Lut2[p2]
-              ;
-              if (debug) fprintf(s.log_file, "[ProcessCommandsInternal] context = %d\n", context_id);
-
-              // read literal using HTREEL[CMAPL[64*BTYPE_L + CIDL]]
-              int peek16 = s.peek(16);
-              if (debug) fprintf(s.log_file, "%04x\n", peek16);
-              int table = s.literal_context_map[64 * s.block_type[idx_L] + context_id];
-              if (debug) fprintf(s.log_file, "[ProcessCommandsInternal] s->context_map_slice[context] = %d\n", table);
-              auto lit = literal_tables[table].decode(peek16);
-              s.drop(lit.first);
-
-              // write literal to uncompressed stream
-              uint8_t value = (uint8_t)lit.second;
-              if (debug) fprintf(s.log_file, "[ProcessCommandsInternal] s->ringbuffer[%d] = %d\n", pos, value);
-              s.ring_buffer[pos & ringbuffer_mask] = value;
-              p2 = p1;
-              p1 = value;
-              pos++;
+            uint32_t word_index = word_id & ((1u << shift) - 1);
+            const uint8_t *word = brotli_data::kBrotliDictionary + brotli_data::kBrotliDictionaryOffsetsByLength[copy_len_] + word_index * copy_len_;
+            unsigned length = transform_word(ring + pos, word, (int)copy_len_, transform);
+            if (length > meta_remaining_) {
+              state_ = state::error;
+              result = status::error;
+              break;
             }
-
-            // if number of uncompressed bytes produced in the loop for
-            if (pos >= mlen) {
-              // this meta-block is MLEN, then break from loop (in this
-              // case the copy length is ignored and can have any value)
+            pos += length;
+            meta_remaining_ -= length;
+            state_ = meta_remaining_ ? state::command : state::metablock_header;
+          } else {
+            if (copy_len_ > meta_remaining_) {
+              state_ = state::error;
+              result = status::error;
               break;
             }
-
-            // 4.  Encoding of Distances
-
-            // if distance code is implicit zero from insert-and-copy code
-            int distance = 0;
-            bool is_dictionary_ref = false;
-            if (cmd.distance_code == 0) {
-              // set backward distance to the last distance
-              distance = last_distances[(last_distance_idx-1) & 3];
-            } else {
-              // if BLEN_D is zero
-              if (s.block_len[idx_D] == 0) {
-                read_block_switch_command(s, idx_D);
-              }
-              // decrement BLEN_D
-              s.block_len[idx_D]--;
-
-              // compute context ID, CIDD from CLEN
-              // read distance code using HTREED[CMAPD[4*BTYPE_D + CIDD]]
-              int peek16 = s.peek(16);
-              int table = s.distance_context_map[4 * s.block_type[idx_D] + cmd.context];
-              auto dist = distance_tables[table].decode(peek16);
-              int dcode = dist.second;
-              s.drop(dist.first);
-
-              if (dcode < 16) {
-                // compute distance by distance short code substitution
-                uint8_t subst = brotli_data::distance_table[dcode];
-                int base = last_distances[(last_distance_idx - (subst >> 4)) & 3];
-                distance = base + (subst & 0x0f) - 4;
-              } else if (dcode - NDIRECT - 16 < 0) {
-                distance = dcode - 15;
-              } else {
-                int ndistbits = 1 + ((dcode - NDIRECT - 16) >> (NPOSTFIX + 1));
-                int dextra = s.read(ndistbits);
-                int POSTFIX_MASK = (1 << NPOSTFIX) - 1;
-                int hcode = (dcode - NDIRECT - 16) >> NPOSTFIX;
-                int lcode = (dcode - NDIRECT - 16) & POSTFIX_MASK;
-                int offset = ((2 + (hcode & 1)) << ndistbits) - 4;
-                distance = ((offset + dextra) << NPOSTFIX) + lcode + NDIRECT + 1;
-              }
-
-              is_dictionary_ref = distance > pos;
-
-              // if distance code is not zero,
-              if (dcode != 0 && !is_dictionary_ref) {
-                //  and distance is not a static dictionary reference,
-                //  push distance to the ring buffer of last distances
-                last_distances[last_distance_idx++ & 3] = distance;
-              }
+            if (push) {
+              dist_rb_[dist_rb_idx_++ & 3] = distance;
             }
-            if (insert_len) if (debug) fprintf(s.log_file, "[ProcessCommandsInternal] s->meta_block_remaining_len = %d\n", mlen - pos);
-            if (debug) fprintf(s.log_file, "[ProcessCommandsInternal] pos = %d distance = %d\n", pos, distance);
-  
-            //  if distance is less than the max allowed distance plus one
-            if (!is_dictionary_ref) {
-              // move backwards distance bytes in the uncompressed data,
-              // and copy CLEN bytes from this position to
-              // the uncompressed stream
-              for (int i = 0; i != copy_len; ++i) {
-                s.ring_buffer[pos & ringbuffer_mask] = s.ring_buffer[(pos-distance) & ringbuffer_mask];
-                ++pos;
-              }
-            } else {
-              if (copy_len < 4 || copy_len > 24) {
-                s.error = error_code::syntax_error;
-                return s.error;
-              }
-              // look up the static dictionary word, transform the word as
-              // directed, and copy the result to the uncompressed stream
-              int offset = brotli_data::kBrotliDictionaryOffsetsByLength[copy_len];
-              int word_id = distance - pos - 1;
-              uint8_t shift = brotli_data::kBrotliDictionarySizeBitsByLength[copy_len];
-              int word_idx = word_id & ((1 << shift)-1);
-              int transform_idx = word_id >> shift;
-              const uint8_t *src = brotli_data::kBrotliDictionary + offset + word_idx * copy_len;
-              char buffer[128];
-              int len = transform_dictionary_word(buffer, src, transform_idx, copy_len, ringbuffer_mask);
-              if (debug) fprintf(s.log_file, "[ProcessCommandsInternal] dictionary word: [%.*s]\n", len, buffer);
-              for (int i = 0; i != len; ++i) {
-                s.ring_buffer[pos & ringbuffer_mask] = buffer[i];
-                ++pos;
-              }
+            meta_remaining_ -= copy_len_;
+            copy_remaining_ = copy_len_;
+            distance_ = distance;
+            state_ = state::copy;
+          }
+          if (state_ == state::metablock_header) break;
+        } else {
+          // Copy as much of the match as fits before the end of the ring.
+          size_t bytes = std::min((size_t)copy_remaining_, ring_size_ - pos);
+          size_t src = (pos - distance_) & mask;
+          if (src < pos) {
+            // Nothing wraps. Any overrun lands in the slack or in the window gap.
+            copy_match_fast(ring + pos, distance_, bytes);
+          } else if (src >= pos + bytes && src + bytes <= ring_size_) {
+            memcpy(ring + pos, ring + src, bytes);
+          } else {
+            for (size_t i = 0; i != bytes; ++i) {
+              ring[pos + i] = ring[(pos + i - distance_) & mask];
             }
-            if (debug) fprintf(s.log_file, "[ProcessCommandsInternal] s->meta_block_remaining_len = %d\n", mlen - pos);
-          } // while number of uncompressed bytes for this meta-block < MLEN
-          s.bytes_written += mlen;
-      } //  while not ISLAST
+          }
+          pos += bytes;
+          copy_remaining_ -= (uint32_t)bytes;
+          if (copy_remaining_ == 0) {
+            state_ = meta_remaining_ ? state::command : state::metablock_header;
+            if (state_ == state::metablock_header) break;
+          }
+        }
+      }
 
-      return s.error;
+      pos_ = pos;
+      reader = in;
+      return result;
     }
 
+    state state_;
+    unsigned header_index_;
+    bool is_last_;
+    unsigned window_bits_ = 16;
+    size_t max_distance_ = 0;
+    uint32_t meta_remaining_ = 0;
+
+    // Block types of the literal, insert-and-copy and distance categories.
+    unsigned num_types_[3];
+    unsigned block_type_[3];
+    unsigned last_block_type_[3];
+    uint32_t block_len_[3];
+    type_table type_tables_[3];
+    count_table count_tables_[3];
+
+    uint8_t context_mode_[max_types];
+    uint8_t literal_context_map_[max_types << literal_context_bits];
+    uint8_t distance_context_map_[max_types << distance_context_bits];
+    unsigned num_literal_trees_ = 0;
+    unsigned num_distance_trees_ = 0;
+    unsigned npostfix_ = 0;
+    unsigned ndirect_ = 0;
+
+    std::vector<literal_table> literal_tables_;
+    std::vector<command_table> command_tables_;
+    std::vector<dist_table> distance_tables_;
+
+    // Context map slices and context lookup of the current block types.
+    const uint8_t *literal_map_ = nullptr;
+    const uint8_t *context_lut_ = nullptr;
+    const uint8_t *distance_map_ = nullptr;
+
+    // The command being decoded.
+    uint32_t insert_remaining_ = 0;
+    uint32_t copy_len_ = 0;
+    uint32_t copy_remaining_ = 0;
+    uint32_t distance_ = 0;
+    bool implicit_distance_ = false;
+    unsigned distance_context_ = 0;
+
+    // The last four distances.
+    uint32_t dist_rb_[4];
+    unsigned dist_rb_idx_;
+
+    // Unconsumed input and the position of the next bit in it.
+    std::vector<uint8_t> input_;
+    size_t bit_position_;
+
+    // Decoded bytes. Bytes from flushed_ to pos_ have not been copied out yet.
+    // ring_base_ is the stream position of the start of the ring.
+    std::vector<uint8_t> ring_;
+    size_t ring_size_;
+    size_t ring_mask_;
+    size_t pos_;
+    size_t flushed_;
+    uint64_t ring_base_;
   };
-
 }
 
 #endif
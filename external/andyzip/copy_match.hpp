@@ -0,0 +1,100 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2016
+//
+// LZ77 match copy shared by the deflate and brotli decoders.
+//
+// Matches overlap their source when the distance is less than the length,
+// so memcpy can't be used directly. Long distances are copied in 16 byte
+// chunks and short ones by repeating a 16 byte pattern of the period.
+//
+
+#ifndef ANDYZIP_COPY_MATCH_HPP_
+#define ANDYZIP_COPY_MATCH_HPP_
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <andyzip/huffman_table.hpp>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+  #include <emmintrin.h>
+  #define ANDYZIP_COPY_SSE2 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+  #include <arm_neon.h>
+  #define ANDYZIP_COPY_NEON 1
+#endif
+
+namespace andyzip {
+  /// copy_match_fast() may write up to this many bytes past the end of the match.
+  static const size_t copy_match_overrun = 16;
+
+  /// Copy 16 bytes. The ranges must not overlap.
+  static inline ALWAYS_INLINE void copy16(uint8_t *dest, const uint8_t *src) {
+    #if defined(ANDYZIP_COPY_SSE2)
+      _mm_storeu_si128((__m128i*)dest, _mm_loadu_si128((const __m128i*)src));
+    #elif defined(ANDYZIP_COPY_NEON)
+      vst1q_u8(dest, vld1q_u8(src));
+    #else
+      uint64_t a, b;
+      memcpy(&a, src, 8);
+      memcpy(&b, src + 8, 8);
+      memcpy(dest, &a, 8);
+      memcpy(dest + 8, &b, 8);
+    #endif
+  }
+
+  /// Copy a match of length bytes from dest - distance to dest and return the new dest.
+  /// This may write up to copy_match_overrun bytes beyond the end of the match,
+  /// so the caller must have a guard band or check for space. distance must be at least one.
+  static inline ALWAYS_INLINE uint8_t *copy_match_fast(uint8_t *dest, size_t distance, size_t length) {
+    const uint8_t *src = dest - distance;
+    uint8_t *end = dest + length;
+    if (distance >= 16) {
+      // Each chunk reads bytes that are already written.
+      do {
+        copy16(dest, src);
+        dest += 16;
+        src += 16;
+      } while (dest < end);
+    } else if (distance == 1) {
+      memset(dest, src[0], length);
+    } else {
+      // Repeat the period (eg. "ab" for distance 2) to fill 16 bytes and store it
+      // every whole number of periods.
+      uint8_t pattern[16];
+      for (size_t i = 0; i != distance; ++i) pattern[i] = src[i];
+      for (size_t i = distance; i != 16; ++i) pattern[i] = pattern[i - distance];
+      size_t step = 16 / distance * distance;
+      do {
+        copy16(dest, pattern);
+        dest += step;
+      } while (dest < end);
+    }
+    return end;
+  }
+
+  /// Copy a match without writing past its end.
+  static inline uint8_t *copy_match_exact(uint8_t *dest, size_t distance, size_t length) {
+    const uint8_t *src = dest - distance;
+    if (distance >= length) {
+      memcpy(dest, src, length);
+    } else {
+      for (size_t i = 0; i != length; ++i) {
+        dest[i] = src[i];
+      }
+    }
+    return dest + length;
+  }
+
+  /// Copy a match, using the fast path when it is not close to dest_max.
+  static inline ALWAYS_INLINE uint8_t *copy_match(uint8_t *dest, uint8_t *dest_max, size_t distance, size_t length) {
+    if ((size_t)(dest_max - dest) >= length + copy_match_overrun) {
+      return copy_match_fast(dest, distance, length);
+    } else {
+      return copy_match_exact(dest, distance, length);
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,199 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2016
+//
+// CRC-32 as used by zip, gzip and png (reflected polynomial 0xedb88320).
+//
+// x86 CPUs with PCLMULQDQ fold 64 bytes per step with carry-less multiplies.
+// ARMv8 builds with the CRC extension use the crc32 instructions.
+// Everything else uses slicing-by-16 tables.
+//
+
+#ifndef ANDYZIP_CRC32_HPP_
+#define ANDYZIP_CRC32_HPP_
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+  #include <cpuid.h>
+  #include <immintrin.h>
+  #define ANDYZIP_CRC32_CLMUL 1
+  #define ANDYZIP_CRC32_CLMUL_TARGET __attribute__((target("pclmul,sse4.1")))
+#elif defined(_M_X64) || defined(_M_IX86)
+  #include <intrin.h>
+  #include <immintrin.h>
+  #define ANDYZIP_CRC32_CLMUL 1
+  #define ANDYZIP_CRC32_CLMUL_TARGET
+#elif defined(__ARM_FEATURE_CRC32)
+  #include <arm_acle.h>
+  #define ANDYZIP_CRC32_ARM 1
+#endif
+
+namespace andyzip {
+  /// Slicing-by-16 tables. Entry [k][b] is the CRC of byte b followed by k zero bytes.
+  static inline const uint32_t (&crc32_tables())[16][256] {
+    static const struct tables {
+      uint32_t t[16][256];
+      tables() {
+        for (uint32_t i = 0; i != 256; ++i) {
+          uint32_t c = i;
+          for (int j = 0; j != 8; ++j) {
+            c = c & 1 ? (c >> 1) ^ 0xedb88320 : c >> 1;
+          }
+          t[0][i] = c;
+        }
+        for (int k = 1; k != 16; ++k) {
+          for (uint32_t i = 0; i != 256; ++i) {
+            t[k][i] = (t[k-1][i] >> 8) ^ t[0][t[k-1][i] & 0xff];
+          }
+        }
+      }
+    } tables;
+    return tables.t;
+  }
+
+  /// Update a CRC state (the inverted CRC) one byte at a time.
+  static inline uint32_t crc32_bytes(uint32_t state, const uint8_t *p, size_t size) {
+    const uint32_t (&t)[16][256] = crc32_tables();
+    for (size_t i = 0; i != size; ++i) {
+      state = (state >> 8) ^ t[0][(state ^ p[i]) & 0xff];
+    }
+    return state;
+  }
+
+  /// Update a CRC state sixteen bytes at a time.
+  static inline uint32_t crc32_slice16(uint32_t state, const uint8_t *p, size_t size) {
+    const uint32_t (&t)[16][256] = crc32_tables();
+    auto load = [](const uint8_t *p) {
+      return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+    };
+    for (; size >= 16; size -= 16, p += 16) {
+      uint32_t a = load(p) ^ state;
+      uint32_t b = load(p + 4);
+      uint32_t c = load(p + 8);
+      uint32_t d = load(p + 12);
+      state =
+        t[15][a & 0xff] ^ t[14][(a >> 8) & 0xff] ^ t[13][(a >> 16) & 0xff] ^ t[12][a >> 24] ^
+        t[11][b & 0xff] ^ t[10][(b >> 8) & 0xff] ^ t[ 9][(b >> 16) & 0xff] ^ t[ 8][b >> 24] ^
+        t[ 7][c & 0xff] ^ t[ 6][(c >> 8) & 0xff] ^ t[ 5][(c >> 16) & 0xff] ^ t[ 4][c >> 24] ^
+        t[ 3][d & 0xff] ^ t[ 2][(d >> 8) & 0xff] ^ t[ 1][(d >> 16) & 0xff] ^ t[ 0][d >> 24];
+    }
+    return crc32_bytes(state, p, size);
+  }
+
+  #if defined(ANDYZIP_CRC32_CLMUL)
+    /// Fold 128 bits of CRC state over the next 128 bits of data.
+    ANDYZIP_CRC32_CLMUL_TARGET static inline __m128i crc32_clmul_fold(__m128i x, __m128i k, __m128i next) {
+      __m128i lo = _mm_clmulepi64_si128(x, k, 0x00);
+      __m128i hi = _mm_clmulepi64_si128(x, k, 0x11);
+      return _mm_xor_si128(_mm_xor_si128(hi, next), lo);
+    }
+
+    /// Fold four 128 bit lanes by 512 bits per step with carry-less multiplies,
+    /// then reduce to 32 bits with a Barrett reduction.
+    /// "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction", Intel 2009.
+    /// size must be a multiple of 16 and at least 64.
+    ANDYZIP_CRC32_CLMUL_TARGET static inline uint32_t crc32_clmul_blocks(uint32_t state, const uint8_t *p, size_t size) {
+      const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+      const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+      const __m128i k5k0 = _mm_set_epi64x(0x0000000000, 0x0163cd6124);
+      const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+
+      __m128i x1 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+      __m128i x2 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+      __m128i x3 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+      __m128i x4 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+      x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)state));
+      p += 64;
+      size -= 64;
+
+      for (; size >= 64; size -= 64, p += 64) {
+        x1 = crc32_clmul_fold(x1, k1k2, _mm_loadu_si128((const __m128i *)(p + 0x00)));
+        x2 = crc32_clmul_fold(x2, k1k2, _mm_loadu_si128((const __m128i *)(p + 0x10)));
+        x3 = crc32_clmul_fold(x3, k1k2, _mm_loadu_si128((const __m128i *)(p + 0x20)));
+        x4 = crc32_clmul_fold(x4, k1k2, _mm_loadu_si128((const __m128i *)(p + 0x30)));
+      }
+
+      // Fold the four lanes into one, then any remaining 16 byte blocks.
+      x1 = crc32_clmul_fold(x1, k3k4, x2);
+      x1 = crc32_clmul_fold(x1, k3k4, x3);
+      x1 = crc32_clmul_fold(x1, k3k4, x4);
+      for (; size >= 16; size -= 16, p += 16) {
+        x1 = crc32_clmul_fold(x1, k3k4, _mm_loadu_si128((const __m128i *)p));
+      }
+
+      // Fold 128 bits to 64 bits.
+      const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+      x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+      x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+      x2 = _mm_srli_si128(x1, 4);
+      x1 = _mm_and_si128(x1, mask32);
+      x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+      x1 = _mm_xor_si128(x1, x2);
+
+      // Barrett reduction to 32 bits.
+      x2 = _mm_and_si128(x1, mask32);
+      x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+      x2 = _mm_and_si128(x2, mask32);
+      x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+      x1 = _mm_xor_si128(x1, x2);
+      return (uint32_t)_mm_extract_epi32(x1, 1);
+    }
+
+    static inline uint32_t crc32_clmul(uint32_t state, const uint8_t *p, size_t size) {
+      if (size >= 64) {
+        size_t blocks = size & ~(size_t)15;
+        state = crc32_clmul_blocks(state, p, blocks);
+        p += blocks;
+        size -= blocks;
+      }
+      return crc32_slice16(state, p, size);
+    }
+
+    static inline bool crc32_has_clmul() {
+      #if defined(_MSC_VER) && !defined(__clang__)
+        int regs[4];
+        __cpuid(regs, 1);
+        unsigned ecx = (unsigned)regs[2];
+      #else
+        unsigned eax, ebx, ecx = 0, edx;
+        if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+      #endif
+      // PCLMULQDQ is bit 1 and SSE4.1 is bit 19.
+      return (ecx & (1u << 1)) && (ecx & (1u << 19));
+    }
+  #endif
+
+  #if defined(ANDYZIP_CRC32_ARM)
+    static inline uint32_t crc32_arm(uint32_t state, const uint8_t *p, size_t size) {
+      for (; size >= 8; size -= 8, p += 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        state = __crc32d(state, v);
+      }
+      for (; size; --size) {
+        state = __crc32b(state, *p++);
+      }
+      return state;
+    }
+  #endif
+
+  /// CRC-32 of size bytes. Pass a previous result as crc to continue it over more data.
+  /// The implementation is chosen on first use from the features of the CPU.
+  static inline uint32_t crc32(const void *data, size_t size, uint32_t crc = 0) {
+    typedef uint32_t (*impl_t)(uint32_t state, const uint8_t *p, size_t size);
+    static const impl_t impl = []() -> impl_t {
+      #if defined(ANDYZIP_CRC32_CLMUL)
+        if (crc32_has_clmul()) return crc32_clmul;
+      #elif defined(ANDYZIP_CRC32_ARM)
+        return crc32_arm;
+      #endif
+      return crc32_slice16;
+    }();
+    return ~impl(~crc, (const uint8_t *)data, size);
+  }
+}
+
+#endif
@@ -2,365 +2,725 @@
 //
 // (C) Andy Thomason 2012-2016
 //
-// 
+//
 
 
 #ifndef ANDYZIP_DEFLATE_DECODER_HPP_
 #define ANDYZIP_DEFLATE_DECODER_HPP_
 
 #include <cstdint>
+#include <cstddef>
 #include <cstring>
+#include <vector>
+#include <algorithm>
+#include <andyzip/huffman_table.hpp>
+#include <andyzip/copy_match.hpp>
 
 namespace andyzip {
 
-  class deflate_decoder {
-    enum { debug = 0 };
-
-    struct huffman_table {
-      uint8_t min_lit_length;
-      uint8_t max_lit_length;
-      uint8_t min_dist_length;
-      uint8_t max_dist_length;
-
-      //uint8_t lit_lengths[288];
-      uint16_t lit_codes[288];
-      uint16_t lit_limits[18];
-      uint16_t lit_base[18];
-
-      //uint8_t dist_lengths[32];
-      uint16_t dist_codes[32];
-      uint16_t dist_limits[18];
-      uint16_t dist_base[18];
+  /// Little-endian bit buffer for deflate streams.
+  /// refill() tops up the buffer to at least 56 bits with a single unaligned load.
+  /// Near the end of the input it shifts in zero bytes and counts them so that
+  /// reading past the end can be detected with ok().
+  /// note: the unaligned load will have to be byte swapped on big-endian devices
+  class deflate_bit_reader {
+  public:
+    deflate_bit_reader(const uint8_t *src, const uint8_t *src_max) : src_(src), src_max_(src_max) {
+    }
+
+    ALWAYS_INLINE void refill() {
+      if (src_max_ - src_ >= 8) {
+        uint64_t value;
+        memcpy(&value, src_, 8);
+        bits_ |= value << count_;
+        src_ += (63 - count_) >> 3;
+        count_ |= 56;
+      } else {
+        while (count_ <= 56) {
+          if (src_ != src_max_) {
+            bits_ |= (uint64_t)*src_++ << count_;
+          } else {
+            ++overrun_;
+          }
+          count_ += 8;
+        }
+      }
+    }
+
+    /// The buffered bits, next bit in the stream first.
+    uint64_t bits() const { return bits_; }
+
+    /// Discard bits from the buffer.
+    ALWAYS_INLINE void consume(unsigned bits) {
+      bits_ >>= bits;
+      count_ -= bits;
+    }
+
+    /// Read a field of up to 32 bits. There must be enough bits buffered.
+    ALWAYS_INLINE unsigned get(unsigned bits) {
+      unsigned value = (unsigned)bits_ & ((1u << bits) - 1);
+      consume(bits);
+      return value;
+    }
+
+    /// Discard bits up to the next byte boundary and return them.
+    unsigned align() {
+      return get(count_ & 7);
+    }
+
+    /// True if every bit read so far came from the input.
+    bool ok() const { return count_ >= overrun_ * 8; }
+
+    /// Address of the next unread byte. Only valid after align() and when ok().
+    const uint8_t *byte_position() const { return src_ - (count_ >> 3) + overrun_; }
+
+    /// Continue reading from a new byte position, eg. after a stored block.
+    void reset(const uint8_t *src) {
+      src_ = src;
+      bits_ = 0;
+      count_ = 0;
+      overrun_ = 0;
+    }
+
+    const uint8_t *src_max() const { return src_max_; }
+
+    /// Position of the next unread bit relative to base. Only valid when ok().
+    size_t bit_position(const uint8_t *base) const { return (size_t)(src_ - base + overrun_) * 8 - count_; }
+
+  private:
+    uint64_t bits_ = 0;
+    unsigned count_ = 0;
+    unsigned overrun_ = 0;
+    const uint8_t *src_;
+    const uint8_t *src_max_;
+  };
+
+  /// Two level lookup table for a canonical huffman code, as used by deflate and brotli.
+  ///
+  /// The next RootBits of the stream index the primary table. Codes longer than
+  /// RootBits go through a subtable indexed by the following bits.
+  /// Each entry holds the code length in bits 0-7, the kind in bits 8-11,
+  /// a small field in bits 12-15 and a value in bits 16-31.
+  /// For literal/length codes, two short literals may share one entry.
+  template <unsigned RootBits, unsigned Size>
+  class deflate_table {
+  public:
+    enum : uint32_t {
+      literal = 0,  // field = number of literals (1 or 2), value = literal bytes
+      match = 1,    // field = number of extra bits, value = base length or distance
+      end = 2,      // end of block
+      subtable = 3, // field = subtable bits, value = subtable offset
+      invalid = 4,  // not a code or not a valid symbol
     };
 
-    huffman_table fixed_;
-
-    // on ARM we can do this faster with the "rev" instruction
-    inline static uint16_t rev16(uint16_t value) {
-      // small table version.
-      //static const uint8_t r16[] = { 0x0, 0x8, 0x4, 0xc, 0x2, 0xa, 0x6, 0xe, 0x1, 0x9, 0x5, 0xd, 0x3, 0xb, 0x7, 0xf };
-      //return r16[value&0x0f] * 0x1000 | r16[(value>>4)&0x0f] * 0x100 | r16[(value>>8)&0x0f] * 0x10 | r16[value>>12];
-
-      // this table is probably too big to be efficient. L1 cache misses are very expensive.
-      static const uint8_t r256[] = {
-        0x00, 0x80, 0x40, 0xc0, 0x20, 0xa0, 0x60, 0xe0, 
-        0x00+0x10, 0x80+0x10, 0x40+0x10, 0xc0+0x10, 0x20+0x10, 0xa0+0x10, 0x60+0x10, 0xe0+0x10, 
-        0x00+8, 0x80+8, 0x40+8, 0xc0+8, 0x20+8, 0xa0+8, 0x60+8, 0xe0+8, 
-        0x00+0x10+8, 0x80+0x10+8, 0x40+0x10+8, 0xc0+0x10+8, 0x20+0x10+8, 0xa0+0x10+8, 0x60+0x10+8, 0xe0+0x10+8, 
-        0x00+ 4, 0x80+ 4, 0x40+ 4, 0xc0+ 4, 0x20+ 4, 0xa0+ 4, 0x60+ 4, 0xe0+ 4, 
-        0x00+0x10+ 4, 0x80+0x10+ 4, 0x40+0x10+ 4, 0xc0+0x10+ 4, 0x20+0x10+ 4, 0xa0+0x10+ 4, 0x60+0x10+ 4, 0xe0+0x10+ 4, 
-        0x00+8+ 4, 0x80+8+ 4, 0x40+8+ 4, 0xc0+8+ 4, 0x20+8+ 4, 0xa0+8+ 4, 0x60+8+ 4, 0xe0+8+ 4, 
-        0x00+0x10+8+ 4, 0x80+0x10+8+ 4, 0x40+0x10+8+ 4, 0xc0+0x10+8+ 4, 0x20+0x10+8+ 4, 0xa0+0x10+8+ 4, 0x60+0x10+8+ 4, 0xe0+0x10+8+ 4, 
-        0x00+ 2, 0x80+ 2, 0x40+ 2, 0xc0+ 2, 0x20+ 2, 0xa0+ 2, 0x60+ 2, 0xe0+ 2, 
-        0x00+0x10+ 2, 0x80+0x10+ 2, 0x40+0x10+ 2, 0xc0+0x10+ 2, 0x20+0x10+ 2, 0xa0+0x10+ 2, 0x60+0x10+ 2, 0xe0+0x10+ 2, 
-        0x00+8+ 2, 0x80+8+ 2, 0x40+8+ 2, 0xc0+8+ 2, 0x20+8+ 2, 0xa0+8+ 2, 0x60+8+ 2, 0xe0+8+ 2, 
-        0x00+0x10+8+ 2, 0x80+0x10+8+ 2, 0x40+0x10+8+ 2, 0xc0+0x10+8+ 2, 0x20+0x10+8+ 2, 0xa0+0x10+8+ 2, 0x60+0x10+8+ 2, 0xe0+0x10+8+ 2, 
-        0x00+ 4+ 2, 0x80+ 4+ 2, 0x40+ 4+ 2, 0xc0+ 4+ 2, 0x20+ 4+ 2, 0xa0+ 4+ 2, 0x60+ 4+ 2, 0xe0+ 4+ 2, 
-        0x00+0x10+ 4+ 2, 0x80+0x10+ 4+ 2, 0x40+0x10+ 4+ 2, 0xc0+0x10+ 4+ 2, 0x20+0x10+ 4+ 2, 0xa0+0x10+ 4+ 2, 0x60+0x10+ 4+ 2, 0xe0+0x10+ 4+ 2, 
-        0x00+8+ 4+ 2, 0x80+8+ 4+ 2, 0x40+8+ 4+ 2, 0xc0+8+ 4+ 2, 0x20+8+ 4+ 2, 0xa0+8+ 4+ 2, 0x60+8+ 4+ 2, 0xe0+8+ 4+ 2, 
-        0x00+0x10+8+ 4+ 2, 0x80+0x10+8+ 4+ 2, 0x40+0x10+8+ 4+ 2, 0xc0+0x10+8+ 4+ 2, 0x20+0x10+8+ 4+ 2, 0xa0+0x10+8+ 4+ 2, 0x60+0x10+8+ 4+ 2, 0xe0+0x10+8+ 4+ 2, 
-        0x00+ 1, 0x80+ 1, 0x40+ 1, 0xc0+ 1, 0x20+ 1, 0xa0+ 1, 0x60+ 1, 0xe0+ 1, 
-        0x00+0x10+ 1, 0x80+0x10+ 1, 0x40+0x10+ 1, 0xc0+0x10+ 1, 0x20+0x10+ 1, 0xa0+0x10+ 1, 0x60+0x10+ 1, 0xe0+0x10+ 1, 
-        0x00+8+ 1, 0x80+8+ 1, 0x40+8+ 1, 0xc0+8+ 1, 0x20+8+ 1, 0xa0+8+ 1, 0x60+8+ 1, 0xe0+8+ 1, 
-        0x00+0x10+8+ 1, 0x80+0x10+8+ 1, 0x40+0x10+8+ 1, 0xc0+0x10+8+ 1, 0x20+0x10+8+ 1, 0xa0+0x10+8+ 1, 0x60+0x10+8+ 1, 0xe0+0x10+8+ 1, 
-        0x00+ 4+ 1, 0x80+ 4+ 1, 0x40+ 4+ 1, 0xc0+ 4+ 1, 0x20+ 4+ 1, 0xa0+ 4+ 1, 0x60+ 4+ 1, 0xe0+ 4+ 1, 
-        0x00+0x10+ 4+ 1, 0x80+0x10+ 4+ 1, 0x40+0x10+ 4+ 1, 0xc0+0x10+ 4+ 1, 0x20+0x10+ 4+ 1, 0xa0+0x10+ 4+ 1, 0x60+0x10+ 4+ 1, 0xe0+0x10+ 4+ 1, 
-        0x00+8+ 4+ 1, 0x80+8+ 4+ 1, 0x40+8+ 4+ 1, 0xc0+8+ 4+ 1, 0x20+8+ 4+ 1, 0xa0+8+ 4+ 1, 0x60+8+ 4+ 1, 0xe0+8+ 4+ 1, 
-        0x00+0x10+8+ 4+ 1, 0x80+0x10+8+ 4+ 1, 0x40+0x10+8+ 4+ 1, 0xc0+0x10+8+ 4+ 1, 0x20+0x10+8+ 4+ 1, 0xa0+0x10+8+ 4+ 1, 0x60+0x10+8+ 4+ 1, 0xe0+0x10+8+ 4+ 1, 
-        0x00+ 2+ 1, 0x80+ 2+ 1, 0x40+ 2+ 1, 0xc0+ 2+ 1, 0x20+ 2+ 1, 0xa0+ 2+ 1, 0x60+ 2+ 1, 0xe0+ 2+ 1, 
-        0x00+0x10+ 2+ 1, 0x80+0x10+ 2+ 1, 0x40+0x10+ 2+ 1, 0xc0+0x10+ 2+ 1, 0x20+0x10+ 2+ 1, 0xa0+0x10+ 2+ 1, 0x60+0x10+ 2+ 1, 0xe0+0x10+ 2+ 1, 
-        0x00+8+ 2+ 1, 0x80+8+ 2+ 1, 0x40+8+ 2+ 1, 0xc0+8+ 2+ 1, 0x20+8+ 2+ 1, 0xa0+8+ 2+ 1, 0x60+8+ 2+ 1, 0xe0+8+ 2+ 1, 
-        0x00+0x10+8+ 2+ 1, 0x80+0x10+8+ 2+ 1, 0x40+0x10+8+ 2+ 1, 0xc0+0x10+8+ 2+ 1, 0x20+0x10+8+ 2+ 1, 0xa0+0x10+8+ 2+ 1, 0x60+0x10+8+ 2+ 1, 0xe0+0x10+8+ 2+ 1, 
-        0x00+ 4+ 2+ 1, 0x80+ 4+ 2+ 1, 0x40+ 4+ 2+ 1, 0xc0+ 4+ 2+ 1, 0x20+ 4+ 2+ 1, 0xa0+ 4+ 2+ 1, 0x60+ 4+ 2+ 1, 0xe0+ 4+ 2+ 1, 
-        0x00+0x10+ 4+ 2+ 1, 0x80+0x10+ 4+ 2+ 1, 0x40+0x10+ 4+ 2+ 1, 0xc0+0x10+ 4+ 2+ 1, 0x20+0x10+ 4+ 2+ 1, 0xa0+0x10+ 4+ 2+ 1, 0x60+0x10+ 4+ 2+ 1, 0xe0+0x10+ 4+ 2+ 1, 
-        0x00+8+ 4+ 2+ 1, 0x80+8+ 4+ 2+ 1, 0x40+8+ 4+ 2+ 1, 0xc0+8+ 4+ 2+ 1, 0x20+8+ 4+ 2+ 1, 0xa0+8+ 4+ 2+ 1, 0x60+8+ 4+ 2+ 1, 0xe0+8+ 4+ 2+ 1, 
-        0x00+0x10+8+ 4+ 2+ 1, 0x80+0x10+8+ 4+ 2+ 1, 0x40+0x10+8+ 4+ 2+ 1, 0xc0+0x10+8+ 4+ 2+ 1, 0x20+0x10+8+ 4+ 2+ 1, 0xa0+0x10+8+ 4+ 2+ 1, 0x60+0x10+8+ 4+ 2+ 1, 0xe0+0x10+8+ 4+ 2+ 1, 
-      };
-      return r256[value&0xff] << 8 | r256[(value>>8)&0xff];
-
-      //value = ( ( value >> 1 ) & 0x5555 ) | ( ( value & 0x5555 ) << 1 );
-      //value = ( ( value >> 2 ) & 0x3333 ) | ( ( value & 0x3333 ) << 2 );
-      //value = ( ( value >> 4 ) & 0x0f0f ) | ( ( value & 0x0f0f ) << 4 );
-      //value = ( ( value >> 8 ) & 0x00ff ) | ( ( value & 0x00ff ) << 8 );
-      //return value;
+    static constexpr uint32_t make(uint32_t kind, uint32_t field, uint32_t value) {
+      return kind << 8 | field << 12 | value << 16;
     }
 
-    static bool build_huffman(uint8_t *lengths, unsigned num_lengths, uint8_t &min_length, uint8_t &max_length, uint16_t *codes, uint16_t *limits, uint16_t *base) {
-      min_length = 16;
-      max_length = 0;
+    static unsigned kind(uint32_t entry) { return (entry >> 8) & 0x0f; }
+    static unsigned field(uint32_t entry) { return (entry >> 12) & 0x0f; }
+    static unsigned value(uint32_t entry) { return entry >> 16; }
+    static unsigned length(uint32_t entry) { return entry & 0xff; }
+
+    /// Build from code lengths (0 = unused). symbols[i] is the entry for symbol i
+    /// without the code length. Returns false for over-subscribed or incomplete codes.
+    /// Unused codes of an incomplete single code decode as invalid.
+    bool build(const uint8_t *lengths, unsigned num_lengths, const uint32_t *symbols) {
+      unsigned count[16] = {0};
+      unsigned max_length = 0;
       for (unsigned i = 0; i != num_lengths; ++i) {
-        if (debug) printf("%d,", lengths[i]);
-        if (lengths[i]) {
-          if (min_length > lengths[i]) min_length = lengths[i];
-          if (max_length < lengths[i]) max_length = lengths[i];
-        }
+        if (lengths[i] > 15) return false;
+        count[lengths[i]]++;
+        if (max_length < lengths[i]) max_length = lengths[i];
       }
-      if (debug) printf("\n");
-
-      if (debug) printf("min_length=%d\n", min_length);
-      if (debug) printf("max_length=%d\n", max_length);
+      count[0] = 0;
 
-      if ( min_length <= 0 || min_length > max_length || max_length > 16 ) {
-        return false;
+      int left = 1;
+      for (unsigned length = 1; length <= 15; ++length) {
+        left = left * 2 - (int)count[length];
+        if (left < 0) return false;
       }
 
+      // Like zlib, only a single one bit code may be incomplete.
+      if (left > 0 && max_length > 1) return false;
+
+      unsigned next_code[16];
       unsigned code = 0;
-      unsigned huffcode = 0;
-      for (unsigned length = min_length; length <= max_length; ++length) {
-        base[length-min_length] = huffcode - code;
+      for (unsigned length = 1; length <= 15; ++length) {
+        code = (code + count[length-1]) << 1;
+        next_code[length] = code;
+      }
+
+      const uint32_t bad = make(invalid, 0, 0) | RootBits;
+      for (unsigned i = 0; i != (1u << RootBits); ++i) entries_[i] = bad;
+
+      unsigned used = 1u << RootBits;
+      unsigned sub_prefix = ~0u;
+      unsigned sub_offset = 0;
+      unsigned sub_bits = 0;
+
+      // Visit the codes in canonical order so that codes sharing a subtable are adjacent.
+      for (unsigned length = 1; length <= max_length; ++length) {
         for (unsigned i = 0; i != num_lengths; ++i) {
-          if (lengths[i] == length) {
-            codes[code++] = i;
-            //dump_bits(huffcode << (16-length), 16, "huffcode");
-            huffcode++;
+          if (lengths[i] != length) continue;
+          unsigned code = next_code[length]++;
+          uint32_t entry = symbols[i] | length;
+          if (length <= RootBits) {
+            for (unsigned j = reverse(code, length); j < (1u << RootBits); j += 1u << length) {
+              entries_[j] = entry;
+            }
+          } else {
+            unsigned drop = length - RootBits;
+            unsigned prefix = reverse(code >> drop, RootBits);
+            if (prefix != sub_prefix) {
+              // Make the subtable big enough for the remaining codes with this prefix.
+              sub_bits = drop;
+              int sub_left = 1 << sub_bits;
+              while (sub_bits + RootBits < max_length) {
+                sub_left -= (int)count[sub_bits + RootBits];
+                if (sub_left <= 0) break;
+                sub_bits++;
+                sub_left <<= 1;
+              }
+              if (used + (1u << sub_bits) > Size) return false;
+              sub_prefix = prefix;
+              sub_offset = used;
+              used += 1u << sub_bits;
+              entries_[prefix] = make(subtable, sub_bits, sub_offset) | RootBits;
+              for (unsigned j = 0; j != (1u << sub_bits); ++j) entries_[sub_offset + j] = bad;
+            }
+            for (unsigned j = reverse(code & ((1u << drop) - 1), drop); j < (1u << sub_bits); j += 1u << drop) {
+              entries_[sub_offset + j] = entry;
+            }
           }
+          count[length]--;
         }
-        limits[length-min_length] = (uint16_t)( ( huffcode << (16-length) ) - 1 );
-        if (debug) printf("length %d: lim=%04x base=%04x\n", length, ( huffcode << (16-length) ) - 1, base[length-min_length]);
-        if (( huffcode << (16-length) ) - 1 > 0xffff) {
-          if (debug) printf("invalid huffman table\n");
-          return false;
-        }
-        huffcode *= 2;
       }
-
-      // prevent escape from bitstream decoding loop.
-      limits[max_length+1-min_length] = 0xffff;
       return true;
     }
 
-    /// debug function for dumping bit fields
-    static void dump_bits(unsigned value, unsigned bits, const char *name) {
-      char tmp[64];
-      if (bits < sizeof(tmp)-1) {
-        for (unsigned i = 0; i != bits; ++i) tmp[i] = ( ( value >> (bits-1-i) ) & 1 ) + '0';
-        tmp[bits] = 0;
-        printf("[%s] %s\n", tmp, name);
+    /// A code with a single symbol, which takes no bits.
+    void build_single(uint32_t symbol) {
+      for (unsigned i = 0; i != (1u << RootBits); ++i) entries_[i] = symbol;
+    }
+
+    /// Combine pairs of literals whose codes fit in the primary table together.
+    void pair_literals() {
+      // Descending order: entry i >> length is always read before it is changed.
+      for (unsigned i = (1u << RootBits); i-- != 0; ) {
+        uint32_t first = entries_[i];
+        unsigned length0 = length(first);
+        if (kind(first) != literal || field(first) != 1 || length0 >= RootBits) continue;
+        uint32_t second = entries_[i >> length0];
+        unsigned length1 = length(second);
+        if (kind(second) != literal || field(second) != 1 || length0 + length1 > RootBits) continue;
+        entries_[i] = make(literal, 2, value(first) | value(second) << 8) | (length0 + length1);
       }
     }
 
-    /// peek a fixed number of little-endian bits from the bitstream
-    /// note: this will have to be fixed on PPC and other big-endian devices
-    static unsigned peek(const uint8_t *src, unsigned bitptr, unsigned bits, const char *name) {
-      unsigned i = bitptr >> 3, j = bitptr & 7;
-      unsigned value = ( (unsigned&)src[i] >> j ) & ( (1u << bits) - 1 );
-      if (debug && name) dump_bits(value, bits, name);
-      return value;
+    /// Find the entry for the next code in the bit buffer.
+    ALWAYS_INLINE uint32_t lookup(uint64_t bits) const {
+      uint32_t entry = entries_[bits & ((1u << RootBits) - 1)];
+      if (kind(entry) == subtable) {
+        entry = entries_[value(entry) + ((bits >> RootBits) & ((1u << field(entry)) - 1))];
+      }
+      return entry;
     }
 
-    unsigned decode_uncompressed(uint8_t *&dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max, unsigned bitptr) const {
-      bitptr = ( bitptr + 7 ) & ~7;
-      unsigned bytes_to_copy = peek(src, bitptr, 16, "bytes_to_copy");
-      unsigned clength = peek(src, bitptr + 16, 16, "store length check");
-      bitptr += 32;
+  private:
+    static unsigned reverse(unsigned code, unsigned length) {
+      return rev16((uint16_t)code) >> (16 - length);
+    }
 
-      if (bytes_to_copy != (clength^0xffff)) return ~0;
-      if (dest + bytes_to_copy > dest_max) return ~0;
-      if ((src + bitptr/8) + bytes_to_copy > src_max) return ~0;
+    uint32_t entries_[Size];
+  };
 
-      memcpy(dest, src + bitptr/8, bytes_to_copy);
-      dest += bytes_to_copy;
-      bitptr += bytes_to_copy * 8;
-      return bitptr;
+  /// Huffman tables for one deflate block.
+  /// The sizes are the worst cases for 288 literal/length codes with 10 root bits
+  /// and 32 distance codes with 8 root bits.
+  struct deflate_block_tables {
+    typedef deflate_table<10, 1334> litlen_table;
+    typedef deflate_table<8, 402> dist_table;
+    typedef deflate_table<7, 128> codelen_table;
+
+    litlen_table litlen;
+    dist_table dist;
+
+    /// Entries for the 288 literal/length symbols.
+    static const uint32_t *litlen_symbols() {
+      static const struct symbols {
+        uint32_t entries[288];
+        symbols() {
+          static const uint8_t extra[] = {
+            0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+          };
+          static const uint16_t base[] = {
+            3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+            35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+          };
+          for (unsigned i = 0; i != 256; ++i) entries[i] = litlen_table::make(litlen_table::literal, 1, i);
+          entries[256] = litlen_table::make(litlen_table::end, 0, 0);
+          for (unsigned i = 257; i != 286; ++i) entries[i] = litlen_table::make(litlen_table::match, extra[i-257], base[i-257]);
+          entries[286] = entries[287] = litlen_table::make(litlen_table::invalid, 0, 0);
+        }
+      } table;
+      return table.entries;
     }
 
-    static unsigned decode_lz77(uint8_t *&dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max, unsigned bitptr, const huffman_table *table_) {
-      for(;;) {
-        if (src + bitptr/8 > src_max) return ~0;
-        unsigned peek16 = peek(src, bitptr, 16, NULL);
-        unsigned value = rev16(peek16);
-        unsigned index = 0;
-        while (value > table_->lit_limits[index]) {
-          index++;
+    /// Entries for the 32 distance symbols.
+    static const uint32_t *dist_symbols() {
+      static const struct symbols {
+        uint32_t entries[32];
+        symbols() {
+          static const uint8_t extra[] = {
+            0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+          };
+          static const uint16_t base[] = {
+            1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+          };
+          for (unsigned i = 0; i != 30; ++i) entries[i] = dist_table::make(dist_table::match, extra[i], base[i]);
+          entries[30] = entries[31] = dist_table::make(dist_table::invalid, 0, 0);
         }
-        unsigned length = table_->min_lit_length + index;
-        unsigned offset = ( value >> ( 16 - length ) );
-        unsigned code = table_->lit_codes[offset - table_->lit_base[index]];
-        bitptr += length;
-        if (debug) dump_bits(peek16, length, "code");
-
-        if (code < 256) {
-          if (dest+1 > dest_max) return ~0;
-          *dest++ = code;
-          if (debug) printf("%02x\n", code);
-        } else if (code == 256) {
-          return bitptr;
-        } else {
-          unsigned block_length;
-          unsigned distance;
-          {
-            if (debug) printf("[%d]\n", code);
-            static const uint8_t extra[] = {
-              0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
-            };
-            static const uint8_t base[] = {
-              3-3, 4-3, 5-3, 6-3, 7-3, 8-3, 9-3, 10-3,
-              11-3, 13-3, 15-3, 17-3, 19-3, 23-3, 27-3, 31-3,
-              35-3, 43-3, 51-3, 59-3, 67-3, 83-3, 99-3, 115-3,
-              131-3, 163-3, 195-3, 227-3, 258-3,
-            };
-            if (code-257 > sizeof(extra)) return ~0;
-            unsigned extra_length = extra[ code-257 ];
-            block_length = base[ code-257 ] + 3 + peek(src, bitptr, extra_length, "extra");
-            bitptr += extra_length;
-          }
-          {
-            //if (src + (bitptr + table_->max_dist_length)/8 > src_max ) return ~0;
-            unsigned peek16 = peek(src, bitptr, 16, NULL);
-            unsigned value = rev16(peek16);
-            unsigned index = 0;
-            while (value > table_->dist_limits[index]) {
-              index++;
-            }
-            unsigned length = table_->min_dist_length + index;
-            unsigned offset = ( value >> ( 16 - length ) );
-            unsigned code = table_->dist_codes[offset - table_->dist_base[index]];
-            bitptr += length;
-
-            if (debug) printf("{%d}\n", code);
-            static const uint8_t extra[] = {
-              0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13, 0, 0, 0,
-            };
-            static const uint16_t base[] = {
-              1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
-            };
-            if (code > sizeof(extra)) return ~0;
-            unsigned extra_length = extra[ code ];
-            distance = base[ code ] + peek(src, bitptr, extra_length, "extra");
-            bitptr += extra_length;
-          }
-
-          if (debug) printf("length=%d distance=%d\n", block_length, distance);
-
-          if (dest+block_length > dest_max) return ~0;
+      } table;
+      return table.entries;
+    }
 
-          for(unsigned i = 0; i != block_length; ++i) {
-            dest[0] = dest[-(int)distance];
-            dest++;
-          }
+    /// Entries for the 19 code length symbols.
+    static const uint32_t *codelen_symbols() {
+      static const struct symbols {
+        uint32_t entries[19];
+        symbols() {
+          for (unsigned i = 0; i != 19; ++i) entries[i] = codelen_table::make(codelen_table::literal, 1, i);
         }
-      }
+      } table;
+      return table.entries;
     }
 
-    unsigned decode_fixed(uint8_t *&dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max, unsigned bitptr) const {
-      return decode_lz77(dest, dest_max, src, src_max, bitptr, &fixed_);
+    /// The fixed code of block type 1.
+    void build_fixed() {
+      uint8_t lengths[288 + 32];
+      memset(lengths +   0, 8, 144 - 0);
+      memset(lengths + 144, 9, 256-144);
+      memset(lengths + 256, 7, 280-256);
+      memset(lengths + 280, 8, 288-280);
+      memset(lengths + 288, 5, 32);
+      litlen.build(lengths, 288, litlen_symbols());
+      litlen.pair_literals();
+      dist.build(lengths + 288, 32, dist_symbols());
     }
 
-    unsigned decode_variable(uint8_t *&dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max, unsigned bitptr) const {
-      unsigned num_lit_codes = peek(src, bitptr, 5, "num_lit_codes") + 257;
-      unsigned num_dist_codes = peek(src, bitptr+5, 5, "num_dist_codes") + 1;
-      unsigned num_length_codes = peek(src, bitptr+10, 4, "num_length_codes") + 4;
-      
-      bitptr += 14;
+    /// Read the code lengths of a dynamic block (type 2) and build the tables.
+    bool build_dynamic(deflate_bit_reader &in) {
+      in.refill();
+      unsigned num_lit_codes = in.get(5) + 257;
+      unsigned num_dist_codes = in.get(5) + 1;
+      unsigned num_length_codes = in.get(4) + 4;
+      if (num_lit_codes > 286 || num_dist_codes > 30) return false;
 
       uint8_t lengths[288 + 32];
-      memset(lengths, 0, 20);
-      if (src + bitptr/8 + num_length_codes > src_max ) return ~0;
+      memset(lengths, 0, 19);
       for (unsigned i = 0; i != num_length_codes; ++i) {
         static const uint8_t order[] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
-        lengths[order[i]] = peek(src, bitptr, 3, "length code lenghs");
-        bitptr += 3;
+        in.refill();
+        lengths[order[i]] = (uint8_t)in.get(3);
       }
-      
-      uint16_t codes[19];
-      uint16_t limits[18];
-      uint16_t base[18];
-      uint8_t min_length;
-      uint8_t max_length;
-      if (!build_huffman(lengths, 19, min_length, max_length, codes, limits, base)) return ~0;
-      
+
+      codelen_table codelen;
+      if (!codelen.build(lengths, 19, codelen_symbols())) return false;
+
       unsigned todo = num_lit_codes + num_dist_codes;
-      for(unsigned done = 0; done < todo;) {
-        if (src + bitptr/8 + max_length > src_max ) return ~0;
-        unsigned peek16 = peek(src, bitptr, 16, NULL);
-        unsigned value = rev16(peek16);
-        unsigned index = 0;
-        while (value > limits[index]) {
-          index++;
-        }
-        unsigned length = min_length + index;
-        unsigned offset = ( value >> ( 16 - length ) );
-        unsigned code = codes[offset - base[index]];
-        bitptr += length;
-        if (debug) dump_bits(peek16, length, "length");
-        //fprintf(source_.debug(), "code=%03x\n", code);
+      for (unsigned done = 0; done < todo;) {
+        in.refill();
+        uint32_t entry = codelen.lookup(in.bits());
+        if (codelen_table::kind(entry) != codelen_table::literal) return false;
+        in.consume(codelen_table::length(entry));
+        unsigned code = codelen_table::value(entry);
         unsigned copy = 1;
         if (code < 16) {
-        } else if(code == 16) {
-          if (src + (bitptr+2)/8 > src_max ) return ~0;
-          copy = peek(src, bitptr, 2, NULL) + 3;
-          bitptr += 2;
-          if (done == 0) return ~0;
-          code = lengths[ done-1 ];
-        } else if(code == 17) {
-          if (src + (bitptr+3)/8 > src_max ) return ~0;
-          copy = peek(src, bitptr, 3, NULL) + 3;
-          bitptr += 3;
-          code = 0;
-        } else if(code == 18) {
-          if (src + (bitptr+7)/8 > src_max ) return ~0;
-          copy = peek(src, bitptr, 7, NULL) + 11;
-          bitptr += 7;
+        } else if (code == 16) {
+          if (done == 0) return false;
+          copy = in.get(2) + 3;
+          code = lengths[done-1];
+        } else if (code == 17) {
+          copy = in.get(3) + 3;
           code = 0;
         } else {
-          return ~0;
+          copy = in.get(7) + 11;
+          code = 0;
         }
-        if (done + copy > todo) return ~0;
-        do {
-          lengths[done++] = code;
-        } while( --copy );
+        if (done + copy > todo) return false;
+        memset(lengths + done, (int)code, copy);
+        done += copy;
       }
 
-      if (debug) printf("lengths done\n");
+      // A block without an end code can never finish.
+      if (!in.ok() || lengths[256] == 0) return false;
 
-      huffman_table var;
-      if(
-        !build_huffman(lengths, num_lit_codes, var.min_lit_length, var.max_lit_length, var.lit_codes, var.lit_limits, var.lit_base) ||
-        !build_huffman(lengths+num_lit_codes, num_dist_codes, var.min_dist_length, var.max_dist_length, var.dist_codes, var.dist_limits, var.dist_base)
+      if (
+        !litlen.build(lengths, num_lit_codes, litlen_symbols()) ||
+        !dist.build(lengths + num_lit_codes, num_dist_codes, dist_symbols())
       ) {
-        return ~0;
+        return false;
+      }
+      litlen.pair_literals();
+      return true;
+    }
+  };
+
+  class deflate_decoder {
+    deflate_block_tables fixed_;
+
+    static bool decode_uncompressed(uint8_t *&dest, uint8_t *dest_max, deflate_bit_reader &in) {
+      in.align();
+      in.refill();
+      unsigned bytes_to_copy = in.get(16);
+      unsigned clength = in.get(16);
+      if (!in.ok() || bytes_to_copy != (clength^0xffff)) return false;
+
+      const uint8_t *src = in.byte_position();
+      if (dest_max - dest < (ptrdiff_t)bytes_to_copy) return false;
+      if (in.src_max() - src < (ptrdiff_t)bytes_to_copy) return false;
+
+      if (bytes_to_copy) memcpy(dest, src, bytes_to_copy);
+      dest += bytes_to_copy;
+      in.reset(src + bytes_to_copy);
+      return true;
+    }
+
+    static bool decode_lz77(uint8_t *&dest, uint8_t *dest_begin, uint8_t *dest_max, deflate_bit_reader &in, const deflate_block_tables &tables) {
+      typedef deflate_block_tables::litlen_table litlen_table;
+      typedef deflate_block_tables::dist_table dist_table;
+
+      for(;;) {
+        // 56 bits is enough for a length code, a distance code and their extra bits.
+        in.refill();
+        uint32_t entry = tables.litlen.lookup(in.bits());
+        in.consume(litlen_table::length(entry));
+        unsigned kind = litlen_table::kind(entry);
+
+        if (kind == litlen_table::literal) {
+          unsigned count = litlen_table::field(entry);
+          unsigned value = litlen_table::value(entry);
+          if (dest_max - dest < (ptrdiff_t)count) return false;
+          dest[0] = (uint8_t)value;
+          if (count == 2) dest[1] = (uint8_t)(value >> 8);
+          dest += count;
+        } else if (kind == litlen_table::match) {
+          unsigned block_length = litlen_table::value(entry) + in.get(litlen_table::field(entry));
+
+          uint32_t dist_entry = tables.dist.lookup(in.bits());
+          if (dist_table::kind(dist_entry) != dist_table::match) return false;
+          in.consume(dist_table::length(dist_entry));
+          unsigned distance = dist_table::value(dist_entry) + in.get(dist_table::field(dist_entry));
+
+          if ((ptrdiff_t)distance > dest - dest_begin) return false;
+          if (dest_max - dest < (ptrdiff_t)block_length) return false;
+
+          dest = copy_match(dest, dest_max, distance, block_length);
+        } else if (kind == litlen_table::end) {
+          return in.ok();
+        } else {
+          return false;
+        }
       }
-      return decode_lz77(dest, dest_max, src, src_max, bitptr, &var);
+    }
+
+    bool decode_fixed(uint8_t *&dest, uint8_t *dest_begin, uint8_t *dest_max, deflate_bit_reader &in) const {
+      return decode_lz77(dest, dest_begin, dest_max, in, fixed_);
+    }
+
+    static bool decode_variable(uint8_t *&dest, uint8_t *dest_begin, uint8_t *dest_max, deflate_bit_reader &in) {
+      deflate_block_tables var;
+      if (!var.build_dynamic(in)) return false;
+      return decode_lz77(dest, dest_begin, dest_max, in, var);
     }
   public:
     deflate_decoder() {
-      uint8_t lit_lengths[288];
-      uint8_t dist_lengths[32];
-      memset(lit_lengths +   0, 8, 144 - 0);
-      memset(lit_lengths + 144, 9, 256-144);
-      memset(lit_lengths + 256, 7, 280-256);
-      memset(lit_lengths + 280, 8, 288-280);
-      memset(dist_lengths, 5, 32);
-      build_huffman(lit_lengths, 288, fixed_.min_lit_length, fixed_.max_lit_length, fixed_.lit_codes, fixed_.lit_limits, fixed_.lit_base);
-      build_huffman(dist_lengths, 32, fixed_.min_dist_length, fixed_.max_dist_length, fixed_.dist_codes, fixed_.dist_limits, fixed_.dist_base);
+      fixed_.build_fixed();
     }
 
+    /// Decode a raw deflate stream (RFC1951). The output must be exactly dest_max - dest bytes.
     bool decode(uint8_t *dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max) const {
-      unsigned bitptr = 0;
-      unsigned is_last_block;
+      uint8_t *dest_begin = dest;
+      deflate_bit_reader in(src, src_max);
+      bool is_last_block;
+      bool ok;
 
       // for each "deflate" block:
       do {
-        // prevent (bitptr / 8) from overflowing (>512Mib)
-        src += bitptr / 8;
-        bitptr %= 8;
-
         // three bits determine kind and exit condition
-        is_last_block = peek(src, bitptr, 1, "deflate last") != 0;
-        unsigned kind = peek(src, bitptr + 1, 2, "deflate kind");
+        in.refill();
+        is_last_block = in.get(1) != 0;
+        unsigned kind = in.get(2);
 
-        bitptr += 3;
         switch (kind) {
-        case 0: bitptr = decode_uncompressed(dest, dest_max, src, src_max, bitptr); break;
-        case 1: bitptr = decode_fixed(dest, dest_max, src, src_max, bitptr); break;
-        case 2: bitptr = decode_variable(dest, dest_max, src, src_max, bitptr); break;
+        case 0: ok = decode_uncompressed(dest, dest_max, in); break;
+        case 1: ok = decode_fixed(dest, dest_begin, dest_max, in); break;
+        case 2: ok = decode_variable(dest, dest_begin, dest_max, in); break;
         default: return false;
         }
-      } while( !is_last_block && bitptr != ~0);
-      if (debug) printf("%p %p\n", dest, dest_max);
-      if (debug) printf("%p %p\n", src + bitptr / 8, src_max);
-      return is_last_block && bitptr != ~0 && dest == dest_max;
+      } while( !is_last_block && ok);
+      return ok && in.ok() && dest == dest_max;
+    }
+  };
+
+  /// Resumable deflate decoder for streams too big to hold in memory.
+  ///
+  /// Input may arrive in chunks of any size and output is produced into a caller
+  /// buffer of any size. Output is decoded into a 64KB window which keeps the 32KB
+  /// of history that matches refer to, then copied to the caller.
+  ///
+  ///   andyzip::deflate_stream_decoder dec;
+  ///   for (;;) {
+  ///     auto status = dec.decode(src, src_max, dest, dest_max);
+  ///     if (status == need_more_input) { get more input }
+  ///     else if (status == need_more_output) { use and reset dest }
+  ///     else break;
+  ///   }
+  ///
+  class deflate_stream_decoder {
+  public:
+    enum class status {
+      done,
+      need_more_input,
+      need_more_output,
+      error,
+    };
+
+    deflate_stream_decoder() {
+      fixed_.build_fixed();
+    }
+
+    /// Start a new stream.
+    void reset() {
+      state_ = state::header;
+      is_last_block_ = false;
+      input_.clear();
+      bit_position_ = 0;
+      window_pos_ = 0;
+      flushed_ = 0;
+      total_out_ = 0;
+    }
+
+    /// Decode as much as possible. src and dest are advanced past the input
+    /// consumed and the output produced. Unused bits of the input are kept
+    /// internally, so src is advanced to src_max unless the output fills up first.
+    status decode(const uint8_t *&src, const uint8_t *src_max, uint8_t *&dest, uint8_t *dest_max) {
+      take_input(src, src_max);
+
+      for (;;) {
+        flush(dest, dest_max);
+        if (flushed_ != window_pos_) return status::need_more_output;
+        if (state_ == state::done) return status::done;
+        if (state_ == state::error) return status::error;
+
+        // Everything has been copied out, so slide the window to make room.
+        if (window_pos_ > window_size - max_match) {
+          memmove(window_, window_ + window_pos_ - history_size, history_size);
+          window_pos_ = flushed_ = history_size;
+        }
+
+        status result = run();
+        // Only ask for more input once all of src has been taken.
+        if (result == status::need_more_input && take_input(src, src_max)) {
+          continue;
+        }
+        if (result != status::need_more_output) {
+          flush(dest, dest_max);
+          if (result != status::error && flushed_ != window_pos_) return status::need_more_output;
+          return result;
+        }
+      }
     }
+
+    /// Total bytes of output produced.
+    uint64_t total_out() const { return total_out_; }
+
+    /// After status::done, the number of bytes taken from the input that follow
+    /// the end of the stream, such as a gzip footer.
+    size_t unused_input() const { return input_.size() - ((bit_position_ + 7) >> 3); }
+
+  private:
+    enum class state {
+      header,
+      stored,
+      huffman,
+      done,
+      error,
+    };
+
+    enum : size_t {
+      history_size = 32768,
+      window_size = 65536,
+      max_match = 258,
+      max_input = 65536,
+    };
+
+    // Move input from src, keeping a bounded amount of unconsumed input.
+    // Returns false if none was taken.
+    bool take_input(const uint8_t *&src, const uint8_t *src_max) {
+      input_.erase(input_.begin(), input_.begin() + (bit_position_ >> 3));
+      bit_position_ &= 7;
+      size_t take = input_.size() < max_input ? std::min((size_t)(src_max - src), max_input - input_.size()) : 0;
+      input_.insert(input_.end(), src, src + take);
+      src += take;
+      return take != 0;
+    }
+
+    typedef deflate_block_tables::litlen_table litlen_table;
+    typedef deflate_block_tables::dist_table dist_table;
+
+    // Copy decoded bytes to the caller.
+    void flush(uint8_t *&dest, uint8_t *dest_max) {
+      size_t bytes = std::min((size_t)(dest_max - dest), window_pos_ - flushed_);
+      memcpy(dest, window_ + flushed_, bytes);
+      dest += bytes;
+      flushed_ += bytes;
+    }
+
+    // Decode until the window is full (need_more_output), the input runs out or the stream ends.
+    // Each header and symbol is a checkpoint: if it needed bits we don't have yet,
+    // the bit reader is rolled back to the start of it.
+    status run() {
+      const uint8_t *base = input_.data();
+      deflate_bit_reader in(base + (bit_position_ >> 3), base + input_.size());
+      in.refill();
+      in.consume(bit_position_ & 7);
+
+      status result;
+      for (;;) {
+        if (state_ == state::header) {
+          if (is_last_block_) {
+            state_ = state::done;
+            result = status::done;
+            break;
+          }
+          deflate_bit_reader saved = in;
+          in.refill();
+          bool is_last_block = in.get(1) != 0;
+          unsigned kind = in.get(2);
+          bool ok = true;
+          state last_state = state_;
+          if (kind == 0) {
+            in.align();
+            in.refill();
+            stored_remaining_ = in.get(16);
+            ok = stored_remaining_ == (in.get(16) ^ 0xffff);
+            state_ = state::stored;
+          } else if (kind == 1) {
+            tables_ = &fixed_;
+            state_ = state::huffman;
+          } else if (kind == 2) {
+            ok = dynamic_.build_dynamic(in);
+            tables_ = &dynamic_;
+            state_ = state::huffman;
+          } else {
+            ok = false;
+          }
+          if (!in.ok()) {
+            in = saved;
+            state_ = last_state;
+            result = status::need_more_input;
+            break;
+          } else if (!ok) {
+            state_ = state::error;
+            result = status::error;
+            break;
+          }
+          is_last_block_ = is_last_block;
+        } else if (state_ == state::stored) {
+          const uint8_t *src = in.byte_position();
+          size_t bytes = std::min(std::min((size_t)stored_remaining_, (size_t)(in.src_max() - src)), window_size - window_pos_);
+          memcpy(window_ + window_pos_, src, bytes);
+          window_pos_ += bytes;
+          total_out_ += bytes;
+          stored_remaining_ -= (unsigned)bytes;
+          in.reset(src + bytes);
+          if (stored_remaining_ == 0) {
+            state_ = state::header;
+          } else {
+            result = window_pos_ == window_size ? status::need_more_output : status::need_more_input;
+            break;
+          }
+        } else {
+          result = decode_symbols(in);
+          if (state_ != state::header) break;
+        }
+      }
+
+      bit_position_ = in.bit_position(base);
+      return result;
+    }
+
+    // Decode literals and matches into the window until the end of the block.
+    status decode_symbols(deflate_bit_reader &in) {
+      uint8_t *dest = window_ + window_pos_;
+      uint8_t *dest_limit = window_ + window_size - max_match;
+      status result = status::need_more_output;
+
+      // Stop while there is still room for the longest match.
+      while (dest <= dest_limit) {
+        deflate_bit_reader saved = in;
+        in.refill();
+        uint32_t entry = tables_->litlen.lookup(in.bits());
+        in.consume(litlen_table::length(entry));
+        unsigned kind = litlen_table::kind(entry);
+
+        if (kind == litlen_table::literal) {
+          if (!in.ok()) { in = saved; result = status::need_more_input; break; }
+          unsigned value = litlen_table::value(entry);
+          dest[0] = (uint8_t)value;
+          dest[1] = (uint8_t)(value >> 8);
+          dest += litlen_table::field(entry);
+        } else if (kind == litlen_table::match) {
+          unsigned block_length = litlen_table::value(entry) + in.get(litlen_table::field(entry));
+          uint32_t dist_entry = tables_->dist.lookup(in.bits());
+          in.consume(dist_table::length(dist_entry));
+          unsigned distance = dist_table::value(dist_entry) + in.get(dist_table::field(dist_entry));
+          if (!in.ok()) { in = saved; result = status::need_more_input; break; }
+
+          // The window always holds at least 32KB of history once it has been slid.
+          if (dist_table::kind(dist_entry) != dist_table::match || distance > (size_t)(dest - window_)) {
+            result = status::error;
+            break;
+          }
+
+          // The window has a guard band for the overrun.
+          dest = copy_match_fast(dest, distance, block_length);
+        } else {
+          if (!in.ok()) { in = saved; result = status::need_more_input; break; }
+          if (kind == litlen_table::end) {
+            state_ = state::header;
+          } else {
+            result = status::error;
+          }
+          break;
+        }
+      }
+
+      if (result == status::error) state_ = state::error;
+      total_out_ += (dest - window_) - window_pos_;
+      window_pos_ = dest - window_;
+      return result;
+    }
+
+    deflate_block_tables fixed_;
+    deflate_block_tables dynamic_;
+    const deflate_block_tables *tables_ = nullptr;
+
+    state state_ = state::header;
+    bool is_last_block_ = false;
+    unsigned stored_remaining_ = 0;
+
+    // Unconsumed input and the position of the next bit in it.
+    std::vector<uint8_t> input_;
+    size_t bit_position_ = 0;
+
+    // Decoded bytes. Bytes before flushed_ have been copied out.
+    uint8_t window_[window_size + copy_match_overrun];
+    size_t window_pos_ = 0;
+    size_t flushed_ = 0;
+    uint64_t total_out_ = 0;
   };
 
 }
@@ -8,117 +8,211 @@
 #ifndef MINIZIP_DEFLATE_ENCODER_INCLUDED
 #define MINIZIP_DEFLATE_ENCODER_INCLUDED
 
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <memory>
 #include <algorithm>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <andyzip/huffman_table.hpp>
+#include <andyzip/parallel_for.hpp>
 
 namespace andyzip {
+  /// Suffix array with longest common prefixes.
+  /// addr(r) is the position of the suffix of rank r, rank(i) is the rank of the suffix at i and
+  /// lcp(r) is the length of the common prefix of the suffixes of ranks r-1 and r.
+  /// Rank zero is the empty suffix at the end of the input.
+  /// AddrType may be 32 or 64 bits; the input must be shorter than its largest value.
   template <class CharType=uint8_t, class AddrType=uint32_t, class Allocator=std::allocator<char>>
   class suffix_array {
 
   public:
     typedef AddrType addr_type;
     typedef CharType char_type;
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<addr_type> addr_allocator;
+    typedef std::vector<addr_type, addr_allocator> addr_vector;
 
-    suffix_array(const char_type *src, const char_type *src_max) {
+    /// Build in linear time with SA-IS. The LCP pass is split over num_threads threads
+    /// (0 = one per core) for inputs of a megabyte or more.
+    suffix_array(const char_type *src, const char_type *src_max, unsigned num_threads = 1) {
+      typedef typename std::make_unsigned<char_type>::type uchar_type;
       size_t size = src_max - src;
+      if (size >= (size_t)empty) {
+        throw std::length_error("suffix_array: input too large for addr_type");
+      }
 
-      struct sorter_t {
-        addr_type group;
-        addr_type next_group;
-        addr_type addr;
-      };
+      const uchar_type *text = (const uchar_type *)src;
+      size_t alphabet = 0;
+      for (size_t i = 0; i != size; ++i) {
+        alphabet = std::max(alphabet, (size_t)text[i] + 1);
+      }
 
-      std::vector<sorter_t, Allocator> sorter(size + 1);
-      addr_to_sa_.resize(size + 1);
+      addresses_.resize(size + 1);
+      addresses_[0] = (addr_type)size;
+      if (size) {
+        sais(text, addresses_.data() + 1, (addr_type)size, (addr_type)alphabet);
+      }
 
+      addr_to_sa_.resize(size + 1);
       for (size_t i = 0; i != size+1; ++i) {
-        sorter_t &s = sorter[i];
-        s.group = i == size ? 0 : src[i];
-        s.next_group = i == size ? 0 : 1;
-        s.addr = (addr_type)i;
+        addr_to_sa_[addresses_[i]] = (addr_type)i;
       }
 
-      auto sort_by_group_and_next = [](const sorter_t &a, const sorter_t &b) {
-        return a.group < b.group + (a.next_group < b.next_group);
-      };
-
-      auto debug_dump = [src, &sorter](const char *msg, size_t h) {
-        printf("\n%s h=%d\n", msg, (int)h);
-        for (size_t i = 0; i != sorter.size(); ++i) {
-        //for (size_t i = 0; i != 4; ++i) {
-          auto &s = sorter[i];
-          printf("%4d %12d %4d %4d %s\n", (int)i, (int)s.group, (int)s.next_group, (int)s.addr, (char*)src + s.addr);
+      // Kasai, T.; Lee, G.; Arimura, H.; Arikawa, S.; Park, K. (2001). Linear-Time Longest-Common-Prefix Computation in Suffix Arrays and Its Applications.
+      // Proceedings of the 12th Annual Symposium on Combinatorial Pattern Matching. Lecture Notes in Computer Science. 2089. pp. 181�192. doi:10.1007/3-540-48194-X_17. ISBN 978-3-540-42271-6.
+      // Each thread takes a range of positions. h only carries a lower bound from one
+      // position to the next, so each range can start again from zero.
+      longest_common_prefix_.resize(size+1);
+      size_t num_ranges = size >= 0x100000 ? std::max(1u, num_threads ? num_threads : std::thread::hardware_concurrency()) : 1;
+      parallel_for(num_ranges, [&](size_t range) {
+        size_t i = size * range / num_ranges;
+        size_t i_max = size * (range + 1) / num_ranges;
+        size_t h = 0;
+        for (; i != i_max; ++i) {
+          size_t r = addr_to_sa_[i];
+          size_t j = addresses_[r-1];
+          while (i+h < size && j+h < size && src[i+h] == src[j+h]) {
+            ++h;
+          }
+          longest_common_prefix_[r] = (addr_type)h;
+          h -= h > 0;
         }
-      };
+      }, (unsigned)num_ranges);
+    }
 
-      // todo: limit work to parts of the array not yet complete.
-      constexpr bool debug = false;
-      for (size_t h = 1; ; h *= 2) {
-        // sort by group
-        std::sort(sorter.begin(), sorter.end(), sort_by_group_and_next);
+    auto addr(size_t i) const { return addresses_[i]; }
+    auto lcp(size_t i) const { return longest_common_prefix_[i]; }
+    auto rank(size_t i) const { return addr_to_sa_[i]; }
 
-        int finished = 1;
-        for (size_t i = 0; i != size+1;) {
-          auto si = sorter[i];
-          size_t j = i+1;
-          sorter[i].group = (addr_type)i;
-          int done = 0;
-          for (; j != size+1 && sorter[j].group == si.group && sorter[j].next_group == si.next_group; ++j) {
-            sorter[j].group = (addr_type)i;
-            done = 1;
-          }
-          finished &= !done;
-          i = j;
-        }
+    /// Number of suffixes, including the empty one.
+    size_t size() const { return addresses_.size(); }
+  private:
+    static constexpr addr_type empty = ~(addr_type)0;
 
-        if (debug) debug_dump("built group numbers", h);
+    // Nong, G.; Zhang, S.; Chan, W. H. (2009). Linear Suffix Array Construction by Almost Pure Induced Sorting.
+    // Sort the n suffixes of text, whose characters are less than k, into sa.
+    // The end of the text is a virtual sentinel smaller than every character.
+    // Suffixes are S type if smaller than the next suffix, otherwise L type.
+    // LMS (leftmost S) suffixes are S type suffixes after an L type one.
+    template <class Char>
+    static void sais(const Char *text, addr_type *sa, addr_type n, addr_type k) {
+      std::vector<uint8_t> stype(n);
+      stype[n-1] = 0;
+      for (addr_type i = n - 1; i-- != 0;) {
+        stype[i] = text[i] < text[i+1] || (text[i] == text[i+1] && stype[i+1]);
+      }
+      auto is_lms = [&stype](addr_type i) { return i != 0 && stype[i] && !stype[i-1]; };
 
-        for (size_t i = 0; i != size+1; ++i) {
-          addr_to_sa_[sorter[i].addr] = i;
+      addr_vector count(k);
+      addr_vector bucket(k);
+      for (addr_type i = 0; i != n; ++i) {
+        count[text[i]]++;
+      }
+      auto bucket_starts = [&]() {
+        addr_type sum = 0;
+        for (addr_type c = 0; c != k; ++c) {
+          bucket[c] = sum;
+          sum += count[c];
         }
+      };
+      auto bucket_ends = [&]() {
+        addr_type sum = 0;
+        for (addr_type c = 0; c != k; ++c) {
+          sum += count[c];
+          bucket[c] = sum;
+        }
+      };
 
-        if (finished) break;
-
-        for (size_t i = 0; i != size+1; ++i) {
-          sorter_t &s = sorter[i];
-          s.next_group = s.addr < size - h ? sorter[addr_to_sa_[s.addr + h]].group : 0;
+      // Given the LMS suffixes at the ends of their buckets, sort the L type suffixes
+      // from the left, then the S type suffixes from the right.
+      auto induce = [&]() {
+        bucket_starts();
+        sa[bucket[text[n-1]]++] = n - 1;
+        for (addr_type i = 0; i != n; ++i) {
+          addr_type j = sa[i];
+          if (j != empty && j != 0 && !stype[j-1]) {
+            sa[bucket[text[j-1]]++] = j - 1;
+          }
         }
+        bucket_ends();
+        for (addr_type i = n; i-- != 0;) {
+          addr_type j = sa[i];
+          if (j != empty && j != 0 && stype[j-1]) {
+            sa[--bucket[text[j-1]]] = j - 1;
+          }
+        }
+      };
 
-        if (debug) debug_dump("set next_group", h);
+      // Sort the LMS substrings by inducing from the LMS suffixes in text order.
+      std::fill(sa, sa + n, empty);
+      bucket_ends();
+      for (addr_type i = 1; i != n; ++i) {
+        if (is_lms(i)) sa[--bucket[text[i]]] = i;
       }
+      induce();
 
-      addresses_.resize(size+1);
-      for (size_t i = 0; i != size+1; ++i) {
-        addresses_[i] = sorter[i].addr;
+      // Gather the sorted LMS substrings and name them, equal substrings getting equal names.
+      addr_type num_lms = 0;
+      for (addr_type i = 0; i != n; ++i) {
+        if (is_lms(sa[i])) sa[num_lms++] = sa[i];
       }
+      std::fill(sa + num_lms, sa + n, empty);
 
-      sorter.resize(0);
-      sorter.shrink_to_fit();
-
-      // Kasai, T.; Lee, G.; Arimura, H.; Arikawa, S.; Park, K. (2001). Linear-Time Longest-Common-Prefix Computation in Suffix Arrays and Its Applications.
-      // Proceedings of the 12th Annual Symposium on Combinatorial Pattern Matching. Lecture Notes in Computer Science. 2089. pp. 181192. doi:10.1007/3-540-48194-X_17. ISBN 978-3-540-42271-6.
-      longest_common_prefix_.resize(size+1);
-      addr_type h = 0;
-      for (size_t i = 0; i != sorter.size(); ++i) {
-        addr_type r = addr_to_sa_[i];
-        if (r > 0) {
-          addr_type j = addresses_[r-1];
-          while (src[i+h] == src[j+h]) {
-            ++h;
+      addr_type num_names = 0;
+      addr_type prev = empty;
+      for (addr_type i = 0; i != num_lms; ++i) {
+        addr_type pos = sa[i];
+        bool same = prev != empty;
+        for (addr_type d = 0; same; ++d) {
+          if (pos + d == n || prev + d == n || text[pos+d] != text[prev+d] || stype[pos+d] != stype[prev+d]) {
+            same = false;
+          } else if (d != 0 && (is_lms(pos+d) || is_lms(prev+d))) {
+            same = is_lms(pos+d) && is_lms(prev+d);
+            break;
           }
-          longest_common_prefix_[r] = h;
-          h -= h > 0;
         }
+        if (!same) ++num_names;
+        prev = pos;
+        // LMS positions are at least two apart, so this can't collide.
+        sa[num_lms + pos / 2] = num_names - 1;
       }
-    }
 
-    auto addr(size_t i) const { return addresses_[i]; }
-    auto lcp(size_t i) const { return longest_common_prefix_[i]; }
-    auto rank(size_t i) const { return addr_to_sa_[i]; }
-  private:
+      // Sort the LMS suffixes by sorting the string of names, recursing if there are duplicates.
+      addr_type *reduced = sa + n - num_lms;
+      for (addr_type i = n, j = n; i-- != num_lms;) {
+        if (sa[i] != empty) sa[--j] = sa[i];
+      }
+      if (num_names < num_lms) {
+        sais(reduced, sa, num_lms, num_names);
+      } else {
+        for (addr_type i = 0; i != num_lms; ++i) {
+          sa[reduced[i]] = i;
+        }
+      }
+
+      // Put the sorted LMS suffixes at the ends of their buckets and induce the rest.
+      for (addr_type i = 1, j = 0; i != n; ++i) {
+        if (is_lms(i)) reduced[j++] = i;
+      }
+      for (addr_type i = 0; i != num_lms; ++i) {
+        sa[i] = reduced[sa[i]];
+      }
+      std::fill(sa + num_lms, sa + n, empty);
+      bucket_ends();
+      for (addr_type i = num_lms; i-- != 0;) {
+        addr_type j = sa[i];
+        sa[i] = empty;
+        sa[--bucket[text[j]]] = j;
+      }
+      induce();
+    }
 
-    std::vector<addr_type, Allocator> addresses_;
-    std::vector<addr_type, Allocator> longest_common_prefix_;
-    std::vector<addr_type, Allocator> addr_to_sa_;
+    addr_vector addresses_;
+    addr_vector longest_common_prefix_;
+    addr_vector addr_to_sa_;
   };
 
   class old_suffix_array {
@@ -204,7 +298,7 @@ namespace andyzip {
 
 
       // Kasai, T.; Lee, G.; Arimura, H.; Arikawa, S.; Park, K. (2001). Linear-Time Longest-Common-Prefix Computation in Suffix Arrays and Its Applications.
-      // Proceedings of the 12th Annual Symposium on Combinatorial Pattern Matching. Lecture Notes in Computer Science. 2089. pp. 181192. doi:10.1007/3-540-48194-X_17. ISBN 978-3-540-42271-6.
+      // Proceedings of the 12th Annual Symposium on Combinatorial Pattern Matching. Lecture Notes in Computer Science. 2089. pp. 181�192. doi:10.1007/3-540-48194-X_17. ISBN 978-3-540-42271-6.
       auto pos = [this](size_t i) -> addr_type & { return sorter[i].addr; };
       auto rank = [this](size_t i) -> addr_type & { return sorter[i].group; };
       auto height = [this](size_t i) -> addr_type & { return sorter[i].next_group; };
@@ -237,34 +331,700 @@ namespace andyzip {
     std::vector<sorter_t> sorter;
   };
 
+  /// Bit writer for deflate streams. Bits are packed from the least significant end of each byte.
+  class deflate_bit_writer {
+  public:
+    /// Write the low bits of value. bits must be 32 or less.
+    void put(uint32_t value, unsigned bits) {
+      acc_ |= (uint64_t)value << count_;
+      count_ += bits;
+      if (count_ >= 32) {
+        uint8_t word[4] = { (uint8_t)acc_, (uint8_t)(acc_ >> 8), (uint8_t)(acc_ >> 16), (uint8_t)(acc_ >> 24) };
+        bytes_.insert(bytes_.end(), word, word + 4);
+        acc_ >>= 32;
+        count_ -= 32;
+      }
+    }
+
+    /// Pad with zero bits to a byte boundary.
+    void align() {
+      put(0, (0u - count_) & 7);
+      for (; count_; count_ -= 8) {
+        bytes_.push_back((uint8_t)acc_);
+        acc_ >>= 8;
+      }
+    }
+
+    /// Write whole bytes after padding to a byte boundary.
+    void put_bytes(const uint8_t *src, size_t size) {
+      align();
+      bytes_.insert(bytes_.end(), src, src + size);
+    }
+
+    /// Append the first bit_count bits of another stream.
+    void append(const uint8_t *src, size_t bit_count) {
+      size_t size = bit_count >> 3;
+      size_t i = 0;
+      for (; i + 4 <= size; i += 4) {
+        put(src[i] | src[i+1] << 8 | src[i+2] << 16 | (uint32_t)src[i+3] << 24, 32);
+      }
+      for (; i != size; ++i) {
+        put(src[i], 8);
+      }
+      if (bit_count & 7) {
+        put(src[size] & ((1u << (bit_count & 7)) - 1), bit_count & 7);
+      }
+    }
+
+    size_t bit_count() const { return bytes_.size() * 8 + count_; }
+
+    void clear() {
+      bytes_.clear();
+      acc_ = 0;
+      count_ = 0;
+    }
+
+    /// Pad the last byte and return the stream.
+    std::vector<uint8_t> &finish() {
+      align();
+      return bytes_;
+    }
+
+  private:
+    std::vector<uint8_t> bytes_;
+    uint64_t acc_ = 0;
+    unsigned count_ = 0;
+  };
+
+  /// Canonical Huffman code for the encoder.
+  /// The codes are bit reversed as deflate sends them most significant bit first.
+  template <unsigned NumSymbols>
+  struct deflate_code {
+    uint8_t lengths[NumSymbols];
+    uint16_t codes[NumSymbols];
+
+    /// Build code lengths of at most max_length bits by package-merge.
+    /// Unused symbols get no code, but at least two symbols are always coded
+    /// as zlib rejects incomplete codes.
+    void build(const uint32_t *freq, unsigned max_length) {
+      struct item {
+        uint64_t weight;
+        int symbol; // -1 for a package of two items of the previous level
+      };
+
+      std::vector<item> leaves;
+      for (unsigned i = 0; i != NumSymbols; ++i) {
+        if (freq[i]) leaves.push_back(item{freq[i], (int)i});
+      }
+      for (unsigned i = 0; leaves.size() < 2; ++i) {
+        if (!freq[i]) leaves.push_back(item{0, (int)i});
+      }
+      std::sort(leaves.begin(), leaves.end(), [](const item &a, const item &b) {
+        return a.weight < b.weight || (a.weight == b.weight && a.symbol < b.symbol);
+      });
+
+      // Each level is the leaves merged with pairs of items from the level below.
+      std::vector<std::vector<item>> levels(max_length);
+      levels[0] = leaves;
+      for (unsigned l = 1; l != max_length; ++l) {
+        const std::vector<item> &prev = levels[l-1];
+        std::vector<item> &list = levels[l];
+        size_t num_packages = prev.size() / 2;
+        list.reserve(leaves.size() + num_packages);
+        for (size_t i = 0, k = 0; i != leaves.size() || k != num_packages;) {
+          uint64_t package = k != num_packages ? prev[k*2].weight + prev[k*2+1].weight : 0;
+          if (k == num_packages || (i != leaves.size() && leaves[i].weight <= package)) {
+            list.push_back(leaves[i++]);
+          } else {
+            list.push_back(item{package, -1});
+            ++k;
+          }
+        }
+      }
+
+      // Take the cheapest 2n-2 items of the top level. Every leaf taken at any level adds one bit.
+      memset(lengths, 0, sizeof(lengths));
+      size_t take = leaves.size() * 2 - 2;
+      for (unsigned l = max_length; l-- != 0;) {
+        size_t packages = 0;
+        for (size_t i = 0; i != take; ++i) {
+          const item &it = levels[l][i];
+          if (it.symbol >= 0) {
+            lengths[it.symbol]++;
+          } else {
+            packages++;
+          }
+        }
+        take = packages * 2;
+      }
+
+      make_codes();
+    }
+
+    /// Assign canonical codes from the code lengths.
+    void make_codes() {
+      unsigned count[16] = {0};
+      for (unsigned i = 0; i != NumSymbols; ++i) {
+        count[lengths[i]]++;
+      }
+      count[0] = 0;
+
+      unsigned next[16];
+      unsigned code = 0;
+      for (unsigned len = 1; len != 16; ++len) {
+        code = (code + count[len-1]) << 1;
+        next[len] = code;
+      }
+
+      for (unsigned i = 0; i != NumSymbols; ++i) {
+        unsigned len = lengths[i];
+        codes[i] = len ? rev16((uint16_t)next[len]++) >> (16 - len) : 0;
+      }
+    }
+
+    /// Bits needed to code symbols with these frequencies.
+    uint64_t cost(const uint32_t *freq) const {
+      uint64_t result = 0;
+      for (unsigned i = 0; i != NumSymbols; ++i) {
+        result += (uint64_t)freq[i] * lengths[i];
+      }
+      return result;
+    }
+  };
+
+  /// Deflate compressor.
+  /// Matches are found by walking the neighbours of each position in a suffix array
+  /// of the block and the 32k window before it.
+  /// Each 64k block of input is compressed independently, so blocks are compressed in
+  /// parallel and then joined bit by bit. The output does not depend on the number of threads.
   class deflate_encoder {
   public:
-    deflate_encoder() {
+    /// level 0 stores the data, 1-3 parse greedily, 4-7 lazily and 8-9 optimally.
+    /// num_threads = 0 uses one thread per core.
+    deflate_encoder(int level = 6, unsigned num_threads = 0) : level_(std::min(std::max(level, 0), 9)), num_threads_(num_threads) {
+    }
+
+    /// Largest possible output for size bytes of input.
+    /// No block is coded in more bits than storing it, which is 42 bits of header and
+    /// padding for each piece of at most 65535 bytes: two pieces for a whole 64k block.
+    /// The two extra bytes cover the final block of an empty input.
+    static size_t bound(size_t size) {
+      size_t pieces = size / block_size * 2 + (size % block_size != 0);
+      return size + (pieces * 42 + 7) / 8 + 2;
+    }
+
+    /// Compress to dest and advance dest. Returns false if dest is too small.
+    bool encode(uint8_t *&dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max) const {
+      std::vector<uint8_t> result = encode(src, src_max);
+      if (result.size() > (size_t)(dest_max - dest)) {
+        return false;
+      }
+      memcpy(dest, result.data(), result.size());
+      dest += result.size();
+      return true;
     }
 
-    bool encode(uint8_t *dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max) const {
-      size_t block_size = 0x10000;
-      FILE *log = fopen("1.txt", "wb");
-
-      while (src != src_max) {
-        size_t size = std::min((size_t)(src_max - src), block_size);
-        suffix_array<uint8_t, uint32_t> sa(src, src + size);
-        for (size_t i = 0; i != size; ++i) {
-          size_t addr = sa.addr(i);
-          char buf[12];
-          size_t k = 0;
-          for (size_t j = std::max(1u, addr)-1; k != 10 && j != size; ++j) {
-            buf[k++] = src[j] < ' ' || src[j] >= 0x7f  ? '.' : src[j];
+    /// Compress to a new vector.
+    std::vector<uint8_t> encode(const uint8_t *src, const uint8_t *src_max) const {
+      size_t size = src_max - src;
+      size_t num_blocks = (size + block_size - 1) / block_size;
+
+      std::vector<block> blocks(num_blocks);
+      parallel_for(num_blocks, [&](size_t i) {
+        const uint8_t *b = src + i * block_size;
+        encode_block(blocks[i], src, b, b + std::min(block_size, (size_t)(src_max - b)));
+      }, num_threads_);
+
+      deflate_bit_writer out;
+      if (num_blocks == 0) {
+        // A final fixed block with just an end code.
+        out.put(1, 1);
+        out.put(1, 2);
+        out.put(0, 7);
+      }
+
+      for (size_t i = 0; i != num_blocks; ++i) {
+        block &blk = blocks[i];
+        bool is_last = i == num_blocks - 1;
+        if (blk.bit_count) {
+          blk.bytes[0] |= is_last ? 1 : 0;
+          out.append(blk.bytes.data(), blk.bit_count);
+        } else {
+          const uint8_t *b = src + i * block_size;
+          const uint8_t *e = b + std::min(block_size, (size_t)(src_max - b));
+          for (; b != e;) {
+            unsigned len = (unsigned)std::min((size_t)(e - b), (size_t)65535);
+            out.put(is_last && b + len == e ? 1 : 0, 1);
+            out.put(0, 2);
+            out.align();
+            out.put(len, 16);
+            out.put(~len & 0xffff, 16);
+            out.put_bytes(b, len);
+            b += len;
           }
-          buf[k] = 0;
-          fprintf(log, "%8d <%s>\n", i, buf);
         }
-        break;
-        src += size;
       }
-      return false;
+      return std::move(out.finish());
     }
+
   private:
+    static constexpr size_t block_size = 0x10000;
+    static constexpr size_t window_size = 0x8000;
+    static constexpr unsigned min_match = 3;
+    static constexpr unsigned max_match = 258;
+    // Length three matches further away than this usually cost more than three literals.
+    static constexpr unsigned too_far = 4096;
+
+    typedef suffix_array<uint8_t, uint32_t> sa_type;
+
+    // A literal if length is zero, otherwise a match.
+    struct token {
+      uint16_t length;
+      uint16_t value;
+    };
+
+    struct match {
+      uint16_t length;
+      uint16_t distance;
+    };
+
+    // Compressed block including its three bit header. bit_count is zero for a stored block.
+    struct block {
+      std::vector<uint8_t> bytes;
+      size_t bit_count = 0;
+    };
+
+    struct params {
+      unsigned max_steps;   // suffix array neighbours to visit in each direction
+      unsigned nice_length; // stop looking for better matches at this length
+      unsigned passes;      // optimal parsing passes, zero for greedy or lazy
+      bool lazy;
+    };
+
+    const params &level_params() const {
+      static const params table[10] = {
+        {   0,   0, 0, false },
+        {   4,  16, 0, false },
+        {   8,  32, 0, false },
+        {  16,  64, 0, false },
+        {   8,  32, 0, true },
+        {  16,  64, 0, true },
+        {  32, 128, 0, true },
+        {  64, 258, 0, true },
+        { 128, 258, 1, true },
+        { 256, 258, 2, true },
+      };
+      return table[level_];
+    }
+
+    struct symbol_tables {
+      uint8_t length_code[max_match + 1];
+      uint8_t dist_code[512];
+      uint16_t length_base[29];
+      uint8_t length_extra[29];
+      uint16_t dist_base[30];
+      uint8_t dist_extra[30];
+
+      symbol_tables() {
+        static const uint16_t lbase[] = {
+          3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+          35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+        };
+        static const uint8_t lextra[] = {
+          0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+        };
+        static const uint16_t dbase[] = {
+          1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+        };
+        static const uint8_t dextra[] = {
+          0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+        };
+        memcpy(length_base, lbase, sizeof(lbase));
+        memcpy(length_extra, lextra, sizeof(lextra));
+        memcpy(dist_base, dbase, sizeof(dbase));
+        memcpy(dist_extra, dextra, sizeof(dextra));
+
+        // 258 has its own code although 227 + 31 would also fit code 284.
+        for (unsigned c = 0; c != 29; ++c) {
+          for (unsigned l = lbase[c]; l != lbase[c] + (1u << lextra[c]) && l <= max_match; ++l) {
+            length_code[l] = (uint8_t)c;
+          }
+        }
+
+        for (unsigned c = 0; c != 30; ++c) {
+          for (unsigned d = dbase[c] - 1; d != dbase[c] - 1 + (1u << dextra[c]); ++d) {
+            dist_code[d < 256 ? d : 256 + (d >> 7)] = (uint8_t)c;
+          }
+        }
+      }
+
+      unsigned dist(unsigned distance) const {
+        unsigned d = distance - 1;
+        return dist_code[d < 256 ? d : 256 + (d >> 7)];
+      }
+    };
+
+    static const symbol_tables &tables() {
+      static const symbol_tables t;
+      return t;
+    }
+
+    struct fixed_codes {
+      deflate_code<288> litlen;
+      deflate_code<30> dist;
+
+      fixed_codes() {
+        memset(litlen.lengths +   0, 8, 144 - 0);
+        memset(litlen.lengths + 144, 9, 256-144);
+        memset(litlen.lengths + 256, 7, 280-256);
+        memset(litlen.lengths + 280, 8, 288-280);
+        memset(dist.lengths, 5, 30);
+        litlen.make_codes();
+        dist.make_codes();
+      }
+    };
+
+    static const fixed_codes &fixed() {
+      static const fixed_codes f;
+      return f;
+    }
+
+    // Find matches for the suffix at pos by walking outwards from its rank in the suffix array.
+    // The length of a match is the minimum LCP between the two ranks.
+    // Only earlier positions in the window count. Returns the longest match at each distance
+    // that is nearer than all longer matches, longest first.
+    static unsigned find_matches(match *result, const sa_type &sa, size_t pos, size_t size, unsigned max_steps) {
+      match up[max_match + 1];
+      match down[max_match + 1];
+      unsigned max_length = (unsigned)std::min(size - pos, (size_t)max_match);
+      size_t rank = sa.rank(pos);
+
+      auto add = [pos](match *list, unsigned &n, size_t addr, unsigned length) {
+        if (addr < pos && pos - addr <= window_size) {
+          uint16_t distance = (uint16_t)(pos - addr);
+          if (n && list[n-1].length == length) {
+            list[n-1].distance = std::min(list[n-1].distance, distance);
+          } else if (n == 0 || distance < list[n-1].distance) {
+            list[n++] = match{(uint16_t)length, distance};
+          }
+        }
+      };
+
+      unsigned num_up = 0;
+      unsigned length = max_length;
+      for (size_t r = rank, step = 0; r != 0 && step != max_steps; --r, ++step) {
+        length = std::min(length, (unsigned)sa.lcp(r));
+        if (length < min_match) break;
+        add(up, num_up, sa.addr(r - 1), length);
+      }
+
+      unsigned num_down = 0;
+      length = max_length;
+      for (size_t r = rank + 1, step = 0; r <= size && step != max_steps; ++r, ++step) {
+        length = std::min(length, (unsigned)sa.lcp(r));
+        if (length < min_match) break;
+        add(down, num_down, sa.addr(r), length);
+      }
+
+      unsigned n = 0;
+      for (unsigned i = 0, j = 0; i != num_up || j != num_down;) {
+        bool take_up = j == num_down || (i != num_up && (
+          up[i].length > down[j].length || (up[i].length == down[j].length && up[i].distance < down[j].distance)
+        ));
+        match m = take_up ? up[i++] : down[j++];
+        if (n == 0 || m.distance < result[n-1].distance) {
+          result[n++] = m;
+        }
+      }
+      return n;
+    }
+
+    // Take the longest match at each position or, if lazy, a literal when the
+    // next position has a longer match.
+    void parse_lazy(std::vector<token> &tokens, const sa_type &sa, const uint8_t *base, size_t begin, size_t end, const params &p) const {
+      match found[max_match + 1];
+      auto best = [&](size_t pos) {
+        unsigned n = pos != end ? find_matches(found, sa, pos, end, p.max_steps) : 0;
+        if (n == 0 || (found[0].length == min_match && found[0].distance > too_far)) {
+          return match{0, 0};
+        }
+        return found[0];
+      };
+
+      size_t pos = begin;
+      match cur = best(pos);
+      while (pos != end) {
+        if (cur.length) {
+          if (p.lazy && cur.length < p.nice_length) {
+            match next = best(pos + 1);
+            if (next.length > cur.length) {
+              tokens.push_back(token{0, base[pos]});
+              ++pos;
+              cur = next;
+              continue;
+            }
+          }
+          tokens.push_back(token{cur.length, cur.distance});
+          pos += cur.length;
+        } else {
+          tokens.push_back(token{0, base[pos]});
+          ++pos;
+        }
+        cur = best(pos);
+      }
+    }
+
+    // Count symbol frequencies and extra bits of the tokens. The end code is counted once.
+    static uint64_t count_symbols(uint32_t *litlen_freq, uint32_t *dist_freq, const std::vector<token> &tokens) {
+      const symbol_tables &t = tables();
+      uint64_t extra_bits = 0;
+      memset(litlen_freq, 0, sizeof(uint32_t) * 288);
+      memset(dist_freq, 0, sizeof(uint32_t) * 30);
+      for (auto &tok : tokens) {
+        if (tok.length == 0) {
+          litlen_freq[tok.value]++;
+        } else {
+          unsigned lc = t.length_code[tok.length];
+          unsigned dc = t.dist(tok.value);
+          litlen_freq[257 + lc]++;
+          dist_freq[dc]++;
+          extra_bits += t.length_extra[lc] + t.dist_extra[dc];
+        }
+      }
+      litlen_freq[256] = 1;
+      return extra_bits;
+    }
+
+    // Find the cheapest path through the block by dynamic programming, costing symbols
+    // with the Huffman code of the previous parse. The first parse is greedy.
+    void parse_optimal(std::vector<token> &tokens, const sa_type &sa, const uint8_t *base, size_t begin, size_t end, const params &p) const {
+      const symbol_tables &t = tables();
+      size_t n = end - begin;
+
+      // Positions inside a match of nice_length or more are not searched.
+      std::vector<uint32_t> first(n + 1);
+      std::vector<match> candidates;
+      match found[max_match + 1];
+      for (size_t i = 0, skip_to = 0; i != n; ++i) {
+        first[i] = (uint32_t)candidates.size();
+        if (i < skip_to) continue;
+        unsigned num = find_matches(found, sa, begin + i, end, p.max_steps);
+        candidates.insert(candidates.end(), found, found + num);
+        if (num && found[0].length >= p.nice_length) skip_to = i + found[0].length;
+      }
+      first[n] = (uint32_t)candidates.size();
+
+      for (size_t i = 0; i != n;) {
+        const match *m = candidates.data() + first[i];
+        if (first[i] != first[i+1] && !(m->length == min_match && m->distance > too_far)) {
+          tokens.push_back(token{m->length, m->distance});
+          i += m->length;
+        } else {
+          tokens.push_back(token{0, base[begin + i]});
+          ++i;
+        }
+      }
+
+      std::vector<uint32_t> cost(n + 1);
+      std::vector<match> from(n + 1);
+      for (unsigned pass = 0; pass != p.passes; ++pass) {
+        uint32_t litlen_freq[288], dist_freq[30];
+        count_symbols(litlen_freq, dist_freq, tokens);
+        deflate_code<288> litlen;
+        deflate_code<30> dist;
+        litlen.build(litlen_freq, 15);
+        dist.build(dist_freq, 15);
+
+        // Symbols not used by the last parse are costed as long codes.
+        uint32_t literal_cost[256], length_cost[max_match + 1], dist_cost[30];
+        for (unsigned i = 0; i != 256; ++i) {
+          literal_cost[i] = litlen.lengths[i] ? litlen.lengths[i] : 15;
+        }
+        for (unsigned l = min_match; l <= max_match; ++l) {
+          unsigned lc = t.length_code[l];
+          length_cost[l] = (litlen.lengths[257 + lc] ? litlen.lengths[257 + lc] : 15) + t.length_extra[lc];
+        }
+        for (unsigned i = 0; i != 30; ++i) {
+          dist_cost[i] = (dist.lengths[i] ? dist.lengths[i] : 15) + t.dist_extra[i];
+        }
+
+        std::fill(cost.begin(), cost.end(), ~0u);
+        cost[0] = 0;
+        for (size_t i = 0; i != n; ++i) {
+          uint32_t c = cost[i];
+          uint32_t lit = c + literal_cost[base[begin + i]];
+          if (lit < cost[i+1]) {
+            cost[i+1] = lit;
+            from[i+1] = match{1, 0};
+          }
+
+          // Shorter candidates are nearer, so use each one for lengths down to the next.
+          unsigned prev_length = min_match - 1;
+          for (size_t k = first[i+1]; k-- != first[i];) {
+            const match &m = candidates[k];
+            uint32_t cd = c + dist_cost[t.dist(m.distance)];
+            for (unsigned l = prev_length + 1; l <= m.length; ++l) {
+              uint32_t cm = cd + length_cost[l];
+              if (cm < cost[i+l]) {
+                cost[i+l] = cm;
+                from[i+l] = match{(uint16_t)l, m.distance};
+              }
+            }
+            prev_length = m.length;
+          }
+        }
+
+        tokens.clear();
+        for (size_t i = n; i != 0;) {
+          match m = from[i];
+          i -= m.length;
+          tokens.push_back(m.distance ? token{m.length, m.distance} : token{0, base[begin + i]});
+        }
+        std::reverse(tokens.begin(), tokens.end());
+      }
+    }
+
+    // Write the code lengths of a dynamic block, run length coded with a third Huffman code.
+    static void write_dynamic_header(deflate_bit_writer &out, const deflate_code<288> &litlen, const deflate_code<30> &dist) {
+      unsigned num_lit = 286;
+      while (num_lit > 257 && !litlen.lengths[num_lit-1]) --num_lit;
+      unsigned num_dist = 30;
+      while (num_dist > 1 && !dist.lengths[num_dist-1]) --num_dist;
+
+      uint8_t lengths[286 + 30];
+      memcpy(lengths, litlen.lengths, num_lit);
+      memcpy(lengths + num_lit, dist.lengths, num_dist);
+      unsigned num_lengths = num_lit + num_dist;
+
+      // Symbols 0-15 are lengths, 16 repeats the previous length 3-6 times,
+      // 17 and 18 are runs of 3-10 and 11-138 zeros.
+      struct rle_code {
+        uint8_t symbol;
+        uint8_t extra;
+      };
+      std::vector<rle_code> rle;
+      for (unsigned i = 0; i != num_lengths;) {
+        unsigned value = lengths[i];
+        unsigned run = 1;
+        while (i + run != num_lengths && lengths[i + run] == value) ++run;
+        i += run;
+        if (value == 0) {
+          for (; run >= 11; ) {
+            unsigned r = std::min(run, 138u);
+            rle.push_back(rle_code{18, (uint8_t)(r - 11)});
+            run -= r;
+          }
+          if (run >= 3) {
+            rle.push_back(rle_code{17, (uint8_t)(run - 3)});
+            run = 0;
+          }
+        } else {
+          rle.push_back(rle_code{(uint8_t)value, 0});
+          --run;
+          for (; run >= 3; ) {
+            unsigned r = std::min(run, 6u);
+            rle.push_back(rle_code{16, (uint8_t)(r - 3)});
+            run -= r;
+          }
+        }
+        for (; run; --run) {
+          rle.push_back(rle_code{(uint8_t)value, 0});
+        }
+      }
+
+      uint32_t codelen_freq[19] = {0};
+      for (auto &r : rle) codelen_freq[r.symbol]++;
+      deflate_code<19> codelen;
+      codelen.build(codelen_freq, 7);
+
+      static const uint8_t order[] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+      unsigned num_codelen = 19;
+      while (num_codelen > 4 && !codelen.lengths[order[num_codelen-1]]) --num_codelen;
+
+      out.put(num_lit - 257, 5);
+      out.put(num_dist - 1, 5);
+      out.put(num_codelen - 4, 4);
+      for (unsigned i = 0; i != num_codelen; ++i) {
+        out.put(codelen.lengths[order[i]], 3);
+      }
+
+      static const uint8_t extra_bits[] = {2, 3, 7};
+      for (auto &r : rle) {
+        out.put(codelen.codes[r.symbol], codelen.lengths[r.symbol]);
+        if (r.symbol >= 16) out.put(r.extra, extra_bits[r.symbol - 16]);
+      }
+    }
+
+    static void write_tokens(deflate_bit_writer &out, const std::vector<token> &tokens, const deflate_code<288> &litlen, const deflate_code<30> &dist) {
+      const symbol_tables &t = tables();
+      for (auto &tok : tokens) {
+        if (tok.length == 0) {
+          out.put(litlen.codes[tok.value], litlen.lengths[tok.value]);
+        } else {
+          unsigned lc = t.length_code[tok.length];
+          out.put(litlen.codes[257 + lc], litlen.lengths[257 + lc]);
+          out.put(tok.length - t.length_base[lc], t.length_extra[lc]);
+          unsigned dc = t.dist(tok.value);
+          out.put(dist.codes[dc], dist.lengths[dc]);
+          out.put(tok.value - t.dist_base[dc], t.dist_extra[dc]);
+        }
+      }
+      out.put(litlen.codes[256], litlen.lengths[256]);
+    }
+
+    // Compress one block using up to 32k of the preceding input as history.
+    // The cheapest of dynamic, fixed and stored coding is used.
+    void encode_block(block &blk, const uint8_t *src, const uint8_t *block_begin, const uint8_t *block_end) const {
+      if (level_ == 0) return;
+
+      const params &p = level_params();
+      size_t history = std::min((size_t)(block_begin - src), window_size);
+      const uint8_t *base = block_begin - history;
+      size_t size = block_end - base;
+      sa_type sa(base, block_end);
+
+      std::vector<token> tokens;
+      tokens.reserve(block_end - block_begin);
+      if (p.passes) {
+        parse_optimal(tokens, sa, base, history, size, p);
+      } else {
+        parse_lazy(tokens, sa, base, history, size, p);
+      }
+
+      uint32_t litlen_freq[288], dist_freq[30];
+      uint64_t extra_bits = count_symbols(litlen_freq, dist_freq, tokens);
+      deflate_code<288> litlen;
+      deflate_code<30> dist;
+      litlen.build(litlen_freq, 15);
+      dist.build(dist_freq, 15);
+
+      deflate_bit_writer out;
+      out.put(0, 1);
+      out.put(2, 2);
+      write_dynamic_header(out, litlen, dist);
+
+      uint64_t dynamic_bits = out.bit_count() + litlen.cost(litlen_freq) + dist.cost(dist_freq) + extra_bits;
+      uint64_t fixed_bits = 3 + fixed().litlen.cost(litlen_freq) + fixed().dist.cost(dist_freq) + extra_bits;
+      size_t pieces = (block_end - block_begin + 65534) / 65535;
+      uint64_t stored_bits = (uint64_t)(block_end - block_begin) * 8 + pieces * 42;
+
+      if (stored_bits < std::min(dynamic_bits, fixed_bits)) {
+        return;
+      } else if (fixed_bits < dynamic_bits) {
+        out.clear();
+        out.put(0, 1);
+        out.put(1, 2);
+        write_tokens(out, tokens, fixed().litlen, fixed().dist);
+      } else {
+        write_tokens(out, tokens, litlen, dist);
+      }
+
+      blk.bit_count = out.bit_count();
+      blk.bytes = std::move(out.finish());
+    }
+
+    int level_;
+    unsigned num_threads_;
   };
 }
 
@@ -0,0 +1,221 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2016
+//
+// gzip (RFC1952) decoder.
+//
+// A gzip file is a sequence of members, each a deflate stream between a header
+// and a CRC and size footer. Members are independent, so once we know where they
+// start they can be decoded in parallel into their own parts of the output.
+// Member sizes come from the BGZF "BC" extra field written by gzip_encoder and bgzip.
+// Members without one are decoded in turn to find where they end.
+//
+
+#ifndef ANDYZIP_GZIP_DECODER_HPP_
+#define ANDYZIP_GZIP_DECODER_HPP_
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+#include <andyzip/deflate_decoder.hpp>
+#include <andyzip/crc32.hpp>
+#include <andyzip/parallel_for.hpp>
+
+namespace andyzip {
+  /// Fields of a gzip member header.
+  struct gzip_header {
+    const uint8_t *data = nullptr;  ///< the deflate stream
+    size_t member_size = 0;         ///< size of the whole member from a BGZF extra field, or zero
+    uint32_t mtime = 0;
+    std::string_view name;
+  };
+
+  /// Parse the header of a member starting at p. Returns false if it is not valid.
+  static inline bool gzip_parse_header(gzip_header &h, const uint8_t *p, const uint8_t *end) {
+    enum { fhcrc = 2, fextra = 4, fname = 8, fcomment = 16, reserved = 0xe0 };
+
+    if (end - p < 10 || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 || (p[3] & reserved)) {
+      return false;
+    }
+    unsigned flags = p[3];
+    h = gzip_header();
+    h.mtime = p[4] | p[5] << 8 | p[6] << 16 | (uint32_t)p[7] << 24;
+    const uint8_t *q = p + 10;
+
+    if (flags & fextra) {
+      if (end - q < 2) return false;
+      size_t xlen = q[0] | q[1] << 8;
+      q += 2;
+      if ((size_t)(end - q) < xlen) return false;
+
+      // Subfields are two id bytes, a two byte length and the data.
+      const uint8_t *x = q;
+      q += xlen;
+      while (q - x >= 4) {
+        size_t len = x[2] | x[3] << 8;
+        if ((size_t)(q - x - 4) < len) return false;
+        if (x[0] == 'B' && x[1] == 'C' && len == 2) {
+          h.member_size = (size_t)(x[4] | x[5] << 8) + 1;
+        }
+        x += 4 + len;
+      }
+    }
+
+    if (flags & fname) {
+      const uint8_t *name = q;
+      while (q != end && *q) ++q;
+      if (q == end) return false;
+      h.name = std::string_view((const char *)name, q - name);
+      ++q;
+    }
+
+    if (flags & fcomment) {
+      while (q != end && *q) ++q;
+      if (q == end) return false;
+      ++q;
+    }
+
+    if (flags & fhcrc) {
+      if (end - q < 2) return false;
+      uint32_t crc = crc32(p, q - p);
+      if ((crc & 0xffff) != (uint32_t)(q[0] | q[1] << 8)) return false;
+      q += 2;
+    }
+
+    h.data = q;
+    return true;
+  }
+
+  /// Decoder for gzip files of one or more members.
+  ///
+  ///   andyzip::gzip_decoder dec;
+  ///   std::vector<uint8_t> data = dec.decode(src, src_max);
+  ///
+  class gzip_decoder {
+  public:
+    /// num_threads = 0 uses one thread per core.
+    gzip_decoder(unsigned num_threads = 0) : num_threads_(num_threads) {
+    }
+
+    /// Decode all the members and check their CRCs.
+    /// Throws std::runtime_error if the file is not gzip or is corrupt.
+    std::vector<uint8_t> decode(const uint8_t *src, const uint8_t *src_max) const {
+      std::vector<member> members = index(src, src_max);
+
+      size_t total = 0;
+      for (member &m : members) {
+        if (m.size > SIZE_MAX - total) {
+          throw std::runtime_error("gzip: file too large");
+        }
+        m.offset = total;
+        total += m.size;
+      }
+
+      std::vector<uint8_t> result(total);
+      parallel_for(members.size(), [&](size_t i) {
+        const member &m = members[i];
+        uint8_t *dest = result.data() + m.offset;
+        if (!m.decoded.empty()) {
+          memcpy(dest, m.decoded.data(), m.size);
+        } else if (!decoder_.decode(dest, dest + m.size, m.data, m.data_end)) {
+          throw std::runtime_error("gzip: bad deflate data");
+        }
+        if (crc32(dest, m.size) != m.crc) {
+          throw std::runtime_error("gzip: crc mismatch");
+        }
+      }, num_threads_);
+      return result;
+    }
+
+  private:
+    struct member {
+      const uint8_t *data;
+      const uint8_t *data_end;
+      size_t size;
+      size_t offset;
+      uint32_t crc;
+      std::vector<uint8_t> decoded;  // members without a size field, decoded while indexing
+    };
+
+    // Most uncompressed data in a BGZF member.
+    static constexpr uint32_t bgzf_max_size = 0x10000;
+
+    static uint32_t u4(const uint8_t *p) {
+      return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+    }
+
+    // Find the members and their footers.
+    static std::vector<member> index(const uint8_t *src, const uint8_t *src_max) {
+      std::vector<member> members;
+      for (const uint8_t *p = src; p != src_max; ) {
+        gzip_header h;
+        if (!gzip_parse_header(h, p, src_max)) {
+          throw std::runtime_error("gzip: bad header");
+        }
+
+        member m;
+        m.data = h.data;
+        if (h.member_size) {
+          if (h.member_size > (size_t)(src_max - p) || h.member_size < (size_t)(h.data - p) + 8) {
+            throw std::runtime_error("gzip: bad member size");
+          }
+          m.data_end = p + h.member_size - 8;
+        } else {
+          m.data_end = decode_serial(m.decoded, h.data, src_max);
+          if (src_max - m.data_end < 8) {
+            throw std::runtime_error("gzip: truncated");
+          }
+        }
+
+        m.crc = u4(m.data_end);
+        uint32_t isize = u4(m.data_end + 4);
+        if (h.member_size) {
+          // The footer is untrusted and the output is allocated before decoding,
+          // so hold BGZF members to the 64K block size that BGZF allows.
+          if (isize > bgzf_max_size) {
+            throw std::runtime_error("gzip: bad member size");
+          }
+          m.size = isize;
+        } else {
+          m.size = m.decoded.size();
+          if ((uint32_t)m.size != isize) {
+            throw std::runtime_error("gzip: size mismatch");
+          }
+        }
+        members.push_back(std::move(m));
+        p = members.back().data_end + 8;
+      }
+
+      if (members.empty()) {
+        throw std::runtime_error("gzip: empty file");
+      }
+      return members;
+    }
+
+    // Decode a member whose size we don't know and return the address of its footer.
+    static const uint8_t *decode_serial(std::vector<uint8_t> &out, const uint8_t *src, const uint8_t *src_max) {
+      std::unique_ptr<deflate_stream_decoder> dec(new deflate_stream_decoder());
+      for (;;) {
+        size_t size = out.size();
+        out.resize(size + 0x10000);
+        uint8_t *dest = out.data() + size;
+        auto status = dec->decode(src, src_max, dest, out.data() + out.size());
+        out.resize(dest - out.data());
+        if (status == deflate_stream_decoder::status::done) {
+          return src - dec->unused_input();
+        } else if (status == deflate_stream_decoder::status::error || (status == deflate_stream_decoder::status::need_more_input && src == src_max)) {
+          throw std::runtime_error("gzip: bad deflate data");
+        }
+      }
+    }
+
+    deflate_decoder decoder_;
+    unsigned num_threads_;
+  };
+}
+
+#endif
@@ -0,0 +1,85 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2016
+//
+// gzip (RFC1952) encoder.
+//
+// The output is BGZF: a sequence of gzip members of at most 64K each, with the
+// compressed size of each member in a "BC" extra field. Any gzip reader can read it,
+// and gzip_decoder can find every member without decoding and decode them in parallel.
+//
+
+#ifndef ANDYZIP_GZIP_ENCODER_HPP_
+#define ANDYZIP_GZIP_ENCODER_HPP_
+
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <vector>
+#include <andyzip/deflate_encoder.hpp>
+#include <andyzip/crc32.hpp>
+#include <andyzip/parallel_for.hpp>
+
+namespace andyzip {
+  /// Encoder for gzip files in independently decodable members.
+  ///
+  ///   andyzip::gzip_encoder enc(9);
+  ///   std::vector<uint8_t> gz = enc.encode(src, src_max);
+  ///
+  class gzip_encoder {
+  public:
+    /// level is as for deflate_encoder. num_threads = 0 uses one thread per core.
+    gzip_encoder(int level = 6, unsigned num_threads = 0) : encoder_(level, 1), num_threads_(num_threads) {
+    }
+
+    /// Compress to a new vector, ending with an empty member as an end of file marker.
+    std::vector<uint8_t> encode(const uint8_t *src, const uint8_t *src_max) const {
+      size_t size = src_max - src;
+      size_t num_members = (size + member_input - 1) / member_input;
+      std::vector<std::vector<uint8_t>> members(num_members + 1);
+
+      parallel_for(members.size(), [&](size_t i) {
+        const uint8_t *b = src + std::min(i * member_input, size);
+        const uint8_t *e = src + std::min((i + 1) * member_input, size);
+        encode_member(members[i], b, e);
+      }, num_threads_);
+
+      size_t total = 0;
+      for (auto &m : members) total += m.size();
+      std::vector<uint8_t> result;
+      result.reserve(total);
+      for (auto &m : members) result.insert(result.end(), m.begin(), m.end());
+      return result;
+    }
+
+  private:
+    // Input per member. Incompressible data must still fit in the 16 bit size field.
+    static const size_t member_input = 0xff00;
+
+    void encode_member(std::vector<uint8_t> &out, const uint8_t *src, const uint8_t *src_max) const {
+      std::vector<uint8_t> data = encoder_.encode(src, src_max);
+      size_t size = src_max - src;
+      size_t member_size = 18 + data.size() + 8;
+      uint32_t crc = crc32(src, size);
+
+      // ID1 ID2 CM FLG=FEXTRA, MTIME=0, XFL=0, OS=unknown, XLEN=6, "BC" LEN=2 BSIZE.
+      static const uint8_t header[] = { 0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0 };
+      out.reserve(member_size);
+      out.assign(header, header + sizeof(header));
+      out.push_back((uint8_t)(member_size - 1));
+      out.push_back((uint8_t)((member_size - 1) >> 8));
+      out.insert(out.end(), data.begin(), data.end());
+      put4(out, crc);
+      put4(out, (uint32_t)size);
+    }
+
+    static void put4(std::vector<uint8_t> &out, uint32_t value) {
+      for (int i = 0; i != 4; ++i) out.push_back((uint8_t)(value >> (i * 8)));
+    }
+
+    deflate_encoder encoder_;
+    unsigned num_threads_;
+  };
+}
+
+#endif
@@ -0,0 +1,135 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2016
+//
+// Read only memory mapped file.
+//
+
+#ifndef ANDYZIP_MAPPED_FILE_HPP_
+#define ANDYZIP_MAPPED_FILE_HPP_
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <stdexcept>
+#include <utility>
+
+#ifdef _WIN32
+  #ifndef NOMINMAX
+    #define NOMINMAX
+  #endif
+  #ifndef WIN32_LEAN_AND_MEAN
+    #define WIN32_LEAN_AND_MEAN
+  #endif
+  #include <windows.h>
+#else
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+
+namespace andyzip {
+  /// Map a whole file into memory for reading. Pages are loaded by the OS on demand,
+  /// so large archives can be opened without reading them.
+  class mapped_file {
+  public:
+    mapped_file() {
+    }
+
+    /// Map a file. Throws std::runtime_error if it can't be opened.
+    mapped_file(const std::string &filename) {
+      #ifdef _WIN32
+        file_ = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file_ == INVALID_HANDLE_VALUE) {
+          throw std::runtime_error("mapped_file: cannot open " + filename);
+        }
+        LARGE_INTEGER size;
+        GetFileSizeEx(file_, &size);
+        size_ = (size_t)size.QuadPart;
+        if (size_) {
+          mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+          void *view = mapping_ ? MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0) : nullptr;
+          if (!view) {
+            close();
+            throw std::runtime_error("mapped_file: cannot map " + filename);
+          }
+          begin_ = (const uint8_t *)view;
+        }
+      #else
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+          throw std::runtime_error("mapped_file: cannot open " + filename);
+        }
+        struct stat st = {};
+        if (fstat(fd, &st) == 0 && st.st_size) {
+          void *view = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+          if (view != MAP_FAILED) {
+            begin_ = (const uint8_t *)view;
+            size_ = (size_t)st.st_size;
+          }
+        }
+        ::close(fd);
+        if (!begin_ && st.st_size) {
+          throw std::runtime_error("mapped_file: cannot map " + filename);
+        }
+      #endif
+    }
+
+    mapped_file(const mapped_file &) = delete;
+    mapped_file &operator=(const mapped_file &) = delete;
+
+    mapped_file(mapped_file &&rhs) {
+      *this = std::move(rhs);
+    }
+
+    mapped_file &operator=(mapped_file &&rhs) {
+      if (this != &rhs) {
+        close();
+        begin_ = rhs.begin_;
+        size_ = rhs.size_;
+        rhs.begin_ = nullptr;
+        rhs.size_ = 0;
+        #ifdef _WIN32
+          file_ = rhs.file_;
+          mapping_ = rhs.mapping_;
+          rhs.file_ = INVALID_HANDLE_VALUE;
+          rhs.mapping_ = nullptr;
+        #endif
+      }
+      return *this;
+    }
+
+    ~mapped_file() {
+      close();
+    }
+
+    const uint8_t *begin() const { return begin_; }
+    const uint8_t *end() const { return begin_ + size_; }
+    size_t size() const { return size_; }
+
+  private:
+    void close() {
+      #ifdef _WIN32
+        if (begin_) UnmapViewOfFile(begin_);
+        if (mapping_) CloseHandle(mapping_);
+        if (file_ != INVALID_HANDLE_VALUE) CloseHandle(file_);
+        file_ = INVALID_HANDLE_VALUE;
+        mapping_ = nullptr;
+      #else
+        if (begin_) munmap((void *)begin_, size_);
+      #endif
+      begin_ = nullptr;
+      size_ = 0;
+    }
+
+    const uint8_t *begin_ = nullptr;
+    size_t size_ = 0;
+    #ifdef _WIN32
+      HANDLE file_ = INVALID_HANDLE_VALUE;
+      HANDLE mapping_ = nullptr;
+    #endif
+  };
+}
+
+#endif
@@ -0,0 +1,61 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2016
+//
+// Run independent jobs on all cores.
+//
+
+#ifndef ANDYZIP_PARALLEL_FOR_HPP_
+#define ANDYZIP_PARALLEL_FOR_HPP_
+
+#include <cstddef>
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace andyzip {
+  /// Call fn(i) for i in [0, count) on up to num_threads threads (0 = one per core).
+  /// Indices are handed out one at a time so that uneven jobs balance out.
+  /// The first exception thrown by fn is rethrown on the calling thread.
+  template <class Fn>
+  void parallel_for(size_t count, Fn fn, unsigned num_threads = 0) {
+    if (num_threads == 0) num_threads = std::max(1u, std::thread::hardware_concurrency());
+    num_threads = (unsigned)std::min((size_t)num_threads, count);
+
+    if (num_threads <= 1) {
+      for (size_t i = 0; i != count; ++i) fn(i);
+      return;
+    }
+
+    std::atomic<size_t> next(0);
+    std::exception_ptr error;
+    std::mutex mutex;
+    auto worker = [&]() {
+      for (;;) {
+        size_t i = next++;
+        if (i >= count) break;
+        try {
+          fn(i);
+        } catch (...) {
+          std::lock_guard<std::mutex> lock(mutex);
+          if (!error) error = std::current_exception();
+          next = count;
+        }
+      }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i != num_threads; ++i) {
+      threads.emplace_back(worker);
+    }
+    worker();
+    for (auto &t : threads) t.join();
+
+    if (error) std::rethrow_exception(error);
+  }
+}
+
+#endif
@@ -5,16 +5,207 @@
 // Zipfile reader class
 //
 
+#ifndef ANDYZIP_ZIPFILE_READER_HPP_
+#define ANDYZIP_ZIPFILE_READER_HPP_
 
 #include <vector>
+#include <string>
+#include <string_view>
+#include <unordered_map>
 #include <stdexcept>
 #include <cstring>
+#include <memory>
 #include <andyzip/deflate_decoder.hpp>
+#include <andyzip/crc32.hpp>
+#include <andyzip/mapped_file.hpp>
+#include <andyzip/parallel_for.hpp>
 
 // Simple zipfile reader. Allows extraction of files in a mapped zipfile.
+// The central directory is indexed once on construction, so lookups by name are O(1).
+// ZIP64 archives are supported. Extracted files are checked against their CRC-32.
 class zipfile_reader {
 public:
-  zipfile_reader(const uint8_t *begin, const uint8_t *end) : begin_(begin), end_(end) {
+  // A file in the archive, from its central directory header.
+  struct entry {
+    std::string_view name;
+    const uint8_t *dir;   // central directory header
+    const uint8_t *local; // local file header
+    uint64_t compressed_size;
+    uint64_t uncompressed_size;
+    uint32_t crc;
+    uint16_t method;
+    uint16_t flags;
+  };
+
+  // Map a zipfile from disk.
+  zipfile_reader(const std::string &filename) : file_(std::make_shared<andyzip::mapped_file>(filename)) {
+    index(file_->begin(), file_->end());
+  }
+
+  // Use a zipfile already in memory. The memory must outlive the reader.
+  zipfile_reader(const uint8_t *begin, const uint8_t *end) {
+    index(begin, end);
+  }
+
+  // Get a list of filenames.
+  std::vector<std::string> filenames() const {
+    std::vector<std::string> names;
+    names.reserve(entries_.size());
+    for (auto &e : entries_) {
+      names.emplace_back(e.name);
+    }
+    return names;
+  }
+
+  // Get a list of directory entries.
+  std::vector<const uint8_t *> dir_entries() const {
+    std::vector<const uint8_t *> result;
+    result.reserve(entries_.size());
+    for (auto &e : entries_) {
+      result.push_back(e.local);
+    }
+    return result;
+  }
+
+  // All entries in directory order.
+  const std::vector<entry> &entries() const {
+    return entries_;
+  }
+
+  // Find an entry by filename. Returns nullptr if there is none.
+  const entry *find(std::string_view filename) const {
+    auto i = by_name_.find(filename);
+    return i == by_name_.end() ? nullptr : &entries_[i->second];
+  }
+
+  // Read a file by filename.
+  std::vector<uint8_t> read(const std::string &filename) const {
+    const entry *e = find(filename);
+    if (!e) {
+      throw std::runtime_error("file not found");
+    }
+    return read(*e);
+  }
+
+  // Read a file by directory entry.
+  std::vector<uint8_t> read_entry(const uint8_t *p) const {
+    return read(entry_at(p));
+  }
+
+  // Read a file into a new vector.
+  std::vector<uint8_t> read(const entry &e) const {
+    std::vector<uint8_t> result((size_t)e.uncompressed_size);
+    extract(e, result.data(), result.size());
+    return result;
+  }
+
+  // Check the CRC-32 of extracted files (the default) and throw on a mismatch.
+  void verify_crc(bool enable) {
+    verify_crc_ = enable;
+  }
+
+  // Extract a file into a caller's buffer, such as a mapped staging buffer,
+  // which must hold at least e.uncompressed_size bytes.
+  // The CRC is checked straight after inflating, at several GB/s.
+  void extract(const entry &e, uint8_t *dest, size_t dest_size) const {
+    if (dest_size < e.uncompressed_size) {
+      throw std::runtime_error("buffer too small");
+    }
+
+    const uint8_t *b = data(e);
+    const uint8_t *end = b + e.compressed_size;
+    if (e.method == 8) {
+      if (!dec_.decode(dest, dest + e.uncompressed_size, b, end)) {
+        throw std::runtime_error("deflate decode failure");
+      }
+    } else if (e.method == 0) {
+      if (e.compressed_size != e.uncompressed_size) {
+        throw std::runtime_error("bad stored size");
+      }
+      if (e.uncompressed_size) memcpy(dest, b, (size_t)e.uncompressed_size);
+    } else {
+      throw std::runtime_error("unsupported compression method");
+    }
+
+    if (verify_crc_ && andyzip::crc32(dest, (size_t)e.uncompressed_size) != e.crc) {
+      throw std::runtime_error("crc mismatch");
+    }
+  }
+
+  // Extract files[i] into dests[i] for all i, spread over num_threads threads (0 = one per core).
+  // The first failure is rethrown after all threads have stopped.
+  void extract(const std::vector<const entry *> &files, const std::vector<uint8_t *> &dests, unsigned num_threads = 0) const {
+    if (files.size() != dests.size()) {
+      throw std::runtime_error("extract: files and dests differ in size");
+    }
+    andyzip::parallel_for(files.size(), [&](size_t i) {
+      extract(*files[i], dests[i], (size_t)files[i]->uncompressed_size);
+    }, num_threads);
+  }
+
+  // Read a file by directory entry in chunks without holding the whole file in memory.
+  // fn(const uint8_t *data, size_t size) is called for each piece of output in order.
+  // The CRC is updated while each chunk is in cache and checked after the last one.
+  template <class Fn>
+  void read_entry_chunked(const uint8_t *p, Fn fn, size_t chunk_size = 65536) const {
+    read_chunked(entry_at(p), fn, chunk_size);
+  }
+
+  template <class Fn>
+  void read_chunked(const entry &e, Fn fn, size_t chunk_size = 65536) const {
+    const uint8_t *b = data(e);
+    const uint8_t *end = b + e.compressed_size;
+    uint32_t crc = 0;
+    uint64_t total = 0;
+    auto emit = [&](const uint8_t *p, size_t size) {
+      if (verify_crc_) crc = andyzip::crc32(p, size, crc);
+      total += size;
+      fn(p, size);
+    };
+
+    if (e.method == 8) {
+      typedef andyzip::deflate_stream_decoder::status status;
+      // The decoder holds a 64k window, so keep it off the stack.
+      auto dec = std::make_unique<andyzip::deflate_stream_decoder>();
+      std::vector<uint8_t> buffer(chunk_size);
+      for (;;) {
+        uint8_t *dest = buffer.data();
+        status st = dec->decode(b, end, dest, buffer.data() + buffer.size());
+        if (dest != buffer.data()) {
+          emit(buffer.data(), (size_t)(dest - buffer.data()));
+        }
+        if (st == status::done) {
+          break;
+        } else if (st == status::error || (st == status::need_more_input && b == end)) {
+          throw std::runtime_error("deflate decode failure");
+        }
+      }
+    } else if (e.method == 0) {
+      for (; b < end; b += chunk_size) {
+        emit(b, std::min((size_t)(end - b), chunk_size));
+      }
+    } else {
+      throw std::runtime_error("unsupported compression method");
+    }
+
+    if (total != e.uncompressed_size) {
+      throw std::runtime_error("bad uncompressed size");
+    }
+    if (verify_crc_ && crc != e.crc) {
+      throw std::runtime_error("crc mismatch");
+    }
+  }
+
+  // Convert a filename to a directory entry.
+  const uint8_t *get_dir_entry(const std::string &filename) const {
+    const entry *e = find(filename);
+    return e ? e->local : nullptr;
+  }
+private:
+  void index(const uint8_t *begin, const uint8_t *end) {
+    begin_ = begin;
+    end_ = end;
+
     // https://pkware.cachefly.net/webdocs/casestudies/APPNOTE.TXT
     // end of central dir signature    4 bytes  (0x06054b50)
     // number of this disk             2 bytes
@@ -23,29 +214,68 @@ public:
     // total number of entries in the
     // central directory on this disk  2 bytes
     // total number of entries in
-    // the central directory           2 bytes
-    // size of the central directory   4 bytes
+    // the central directory           2 bytes (+10)
+    // size of the central directory   4 bytes (+12)
     // offset of start of central
     // directory with respect to
-    // the starting disk number        4 bytes
+    // the starting disk number        4 bytes (+16)
     // .ZIP file comment length        2 bytes
     // .ZIP file comment       (variable size)
 
     const uint8_t *p = end_ - 22;
-    central_dir_begin_ = nullptr;
-    central_dir_end_ = nullptr;
-    for (; p >= begin_; --p) {
+    for (; p >= begin_ && end_ - begin_ >= 22; --p) {
       if (*p == 'P' && u4(p) == 0x06054b50) break;
     }
-    if (p < begin_ || p - u4(p + 12) < begin_) {
+    if (p < begin_ || end_ - begin_ < 22) {
       throw std::runtime_error("cannot find central directory");
     }
-    central_dir_begin_ = p - u4(p + 12);
-    central_dir_end_ = p;
-  }
 
-  // Get a list of filenames.
-  std::vector<std::string> filenames() const {
+    uint64_t num_entries = u2(p + 10);
+    uint64_t dir_size = u4(p + 12);
+    uint64_t dir_offset = u4(p + 16);
+    const uint8_t *dir_end = p;
+
+    // A ZIP64 end of central directory locator comes just before the end record.
+    // zip64 end of central dir locator signature    4 bytes  (0x07064b50)
+    // number of the disk with the start of the
+    // zip64 end of central directory               4 bytes
+    // relative offset of the zip64 end of
+    // central directory record                     8 bytes (+8)
+    // total number of disks                        4 bytes
+    if (p - begin_ >= 20 && u4(p - 20) == 0x07064b50) {
+      // zip64 end of central dir signature  4 bytes  (0x06064b50)
+      // ...
+      // total number of entries in the
+      // central directory                   8 bytes (+32)
+      // size of the central directory       8 bytes (+40)
+      // offset of start of central directory 8 bytes (+48)
+      // The record is usually just before the locator, even if the offsets have been moved.
+      uint64_t offset = u8(p - 12);
+      const uint8_t *z = nullptr;
+      if (end_ - begin_ >= 56 && offset <= (uint64_t)(end_ - begin_) - 56 && u4(begin_ + offset) == 0x06064b50) {
+        z = begin_ + offset;
+      } else if (p - begin_ >= 20 + 56 && u4(p - 20 - 56) == 0x06064b50) {
+        z = p - 20 - 56;
+      } else {
+        throw std::runtime_error("cannot find zip64 central directory");
+      }
+      num_entries = u8(z + 32);
+      dir_size = u8(z + 40);
+      dir_offset = u8(z + 48);
+      dir_end = z;
+    }
+
+    // Offsets are relative to the start of the archive, which may not be the start of the file.
+    if (dir_size > (uint64_t)(dir_end - begin_)) {
+      throw std::runtime_error("cannot find central directory");
+    }
+    central_dir_begin_ = dir_end - dir_size;
+    central_dir_end_ = dir_end;
+    if (dir_offset > (uint64_t)(central_dir_begin_ - begin_)) {
+      throw std::runtime_error("cannot find central directory");
+    }
+    const uint8_t *archive = central_dir_begin_ - dir_offset;
+
     // central file header signature   4 bytes  (0x02014b50)
     // version made by                 2 bytes (+4)
     // version needed to extract       2 bytes (+6)
@@ -69,143 +299,114 @@ public:
     // extra field (variable size)
     // file comment (variable size)
 
-    std::vector<std::string> names;
-    for (const uint8_t *p = central_dir_begin_; p < central_dir_end_; ++p) {
-      if (u4(p) != 0x02014b50) {
+    entries_.reserve((size_t)std::min(num_entries, dir_size / 46));
+    by_name_.reserve(entries_.capacity());
+    for (const uint8_t *q = central_dir_begin_; q < central_dir_end_;) {
+      if (central_dir_end_ - q < 46 || u4(q) != 0x02014b50) {
+        throw std::runtime_error("bad directory entry");
+      }
+      uint16_t filename_len = u2(q + 28);
+      uint16_t extra_len = u2(q + 30);
+      uint16_t comment_len = u2(q + 32);
+      const uint8_t *next = q + 46 + filename_len + extra_len + comment_len;
+      if (next > central_dir_end_) {
         throw std::runtime_error("bad directory entry");
       }
-      uint16_t filename_len = u2(p + 28);
-      uint16_t extra_len = u2(p + 30);
-      uint16_t comment_len = u2(p + 32);
-      names.emplace_back((const char*)p + 46, (const char*)p + 46 + filename_len);
-      p += 46 + filename_len + extra_len + comment_len;
-    }
-    return names;
-  }
 
-  // Get a list of directory entries.
-  // todo: make a class for a directory entry that wraps the pointer.
-  std::vector<const uint8_t *> dir_entries() const {
-    // central file header signature   4 bytes  (0x02014b50)
-    // version made by                 2 bytes (+4)
-    // version needed to extract       2 bytes (+6)
-    // general purpose bit flag        2 bytes (+8)
-    // compression method              2 bytes (+10)
-    // last mod file time              2 bytes (+12)
-    // last mod file date              2 bytes (+14)
-    // crc-32                          4 bytes (+16)
-    // compressed size                 4 bytes (+20)
-    // uncompressed size               4 bytes (+24)
-    // file name length                2 bytes (+28)
-    // extra field length              2 bytes (+30)
-    // file comment length             2 bytes (+32)
-    // disk number start               2 bytes (+34)
-    // internal file attributes        2 bytes (+36)
-    // external file attributes        4 bytes (+38)
-    // relative offset of local header 4 bytes (+42)
-    //                                         (+46)
+      entry e;
+      e.name = std::string_view((const char *)q + 46, filename_len);
+      e.dir = q;
+      e.flags = u2(q + 8);
+      e.method = u2(q + 10);
+      e.crc = u4(q + 16);
+      e.compressed_size = u4(q + 20);
+      e.uncompressed_size = u4(q + 24);
+      uint64_t local_offset = u4(q + 42);
 
-    // file name (variable size)
-    // extra field (variable size)
-    // file comment (variable size)
+      // The ZIP64 extended information extra field (0x0001) holds the sizes and offset
+      // that are 0xffffffff in the header, in this order.
+      const uint8_t *x = q + 46 + filename_len;
+      const uint8_t *x_end = x + extra_len;
+      for (; x_end - x >= 4; x += 4 + u2(x + 2)) {
+        const uint8_t *f = x + 4;
+        const uint8_t *f_end = f + std::min((ptrdiff_t)u2(x + 2), x_end - f);
+        if (u2(x) != 0x0001) continue;
+        if (e.uncompressed_size == 0xffffffff && f_end - f >= 8) { e.uncompressed_size = u8(f); f += 8; }
+        if (e.compressed_size == 0xffffffff && f_end - f >= 8) { e.compressed_size = u8(f); f += 8; }
+        if (local_offset == 0xffffffff && f_end - f >= 8) { local_offset = u8(f); f += 8; }
+      }
 
-    std::vector<const uint8_t *> result;
-    for (const uint8_t *p = central_dir_begin_; p < central_dir_end_; ++p) {
-      if (u4(p) != 0x02014b50) {
+      if (local_offset > (uint64_t)(end_ - archive)) {
         throw std::runtime_error("bad directory entry");
       }
-      uint16_t filename_len = u2(p + 28);
-      uint16_t extra_len = u2(p + 30);
-      uint16_t comment_len = u2(p + 32);
-      result.emplace_back(begin_ + u4(p + 42));
-      p += 46 + filename_len + extra_len + comment_len;
+      e.local = archive + local_offset;
+
+      by_name_.emplace(e.name, entries_.size());
+      by_local_.emplace(e.local, entries_.size());
+      entries_.push_back(e);
+      q = next;
     }
-    return result;
   }
 
-  // Read a file by filename.
-  std::vector<uint8_t> read(const std::string &filename) const {
-    const uint8_t *p = get_dir_entry(filename);
-    if (!p || u4(p + 0) != 0x04034b50) {
-      throw std::runtime_error("file not found");
+  const entry &entry_at(const uint8_t *p) const {
+    auto i = by_local_.find(p);
+    if (i == by_local_.end()) {
+      throw std::runtime_error("bad directory entry");
     }
-
-    return read_entry(p);
+    return entries_[i->second];
   }
 
-  // Read a file by directory entry.
-  std::vector<uint8_t> read_entry(const uint8_t *p) const {
+  // Find the file data after the local header.
+  // The sizes come from the central directory as the local header may not have them.
+  const uint8_t *data(const entry &e) const {
     // https://en.wikipedia.org/wiki/Zip_(file_format)
     //  0 4 Local file header signature = 0x04034b50 (read as a little-endian number)
-    uint32_t sig = u4(p + 0);
     //  4 2 Version needed to extract (minimum)
-    uint16_t version = u2(p + 4);
     //  6 2 General purpose bit flag
-    uint16_t flags = u2(p + 6);
     //  8 2 Compression method
-    uint16_t method = u2(p + 8);
     // 10 2 File last modification time
-    uint16_t time = u2(p + 10);
     // 12 2 File last modification date
-    uint16_t date = u2(p + 12);
     // 14 4 CRC-32
-    uint32_t crc = u4(p + 14);
     // 18 4 Compressed size
-    uint32_t csize = u4(p + 18);
     // 22 4 Uncompressed size
-    uint32_t usize = u4(p + 22);
     // 26 2 File name length (n)
-    uint16_t namelen = u2(p + 26);
     // 28 2 Extra field length (m)
+    const uint8_t *p = e.local;
+    if (end_ - p < 30 || u4(p + 0) != 0x04034b50) {
+      throw std::runtime_error("bad local header");
+    }
+    uint16_t namelen = u2(p + 26);
     uint16_t extlen = u2(p + 28);
 
     const uint8_t *b = p + 30 + namelen + extlen;
-    const uint8_t *e = b + csize;
-
-    std::vector<uint8_t> result(usize);
-    if (method == 8) {
-      if (!dec_.decode(result.data(), result.data() + result.size(), b, e)) {
-        result.resize(0);
-        throw std::runtime_error("deflate decode failure");
-      }
-    } else if (method == 0) {
-      memcpy(result.data(), b, usize);
-    } else {
-      result.resize(0);
-      throw std::runtime_error("unsupported compression method");
+    if (b > end_ || (uint64_t)(end_ - b) < e.compressed_size) {
+      throw std::runtime_error("truncated file");
     }
-    return result;
+    return b;
   }
 
-  // Convert a filename to a directory entry.
-  const uint8_t *get_dir_entry(const std::string &filename) const {
-    uint8_t c0 = filename[0];
-    uint16_t len = (uint16_t)filename.size();
-    for (const uint8_t *p = central_dir_begin_; p < central_dir_end_; ++p) {
-      if (u2(p + 28) == len) {
-        if (!memcmp(filename.data(), p + 46, u2(p + 28))) {
-          return begin_ + u4(p + 42);
-        }
-      }
-      uint16_t filename_len = u2(p + 28);
-      uint16_t extra_len = u2(p + 30);
-      uint16_t comment_len = u2(p + 32);
-      p += 46 + filename_len + extra_len + comment_len;
-    }
-    return nullptr;
-  }
-private:
   static inline unsigned u4(const uint8_t *p) {
-    return (p[3] << 24) | (p[2] << 16) | (p[1] << 8) | (p[0] << 0);
+    return ((unsigned)p[3] << 24) | (p[2] << 16) | (p[1] << 8) | (p[0] << 0);
   }
 
   static inline unsigned u2(const uint8_t *p) {
     return (p[1] << 8) | (p[0] << 0);
   }
 
+  static inline uint64_t u8(const uint8_t *p) {
+    return (uint64_t)u4(p + 4) << 32 | u4(p);
+  }
+
+  std::shared_ptr<andyzip::mapped_file> file_;
   const uint8_t *begin_;
   const uint8_t *end_;
   const uint8_t *central_dir_begin_;
   const uint8_t *central_dir_end_;
+  std::vector<entry> entries_;
+  std::unordered_map<std::string_view, size_t> by_name_;
+  std::unordered_map<const uint8_t *, size_t> by_local_;
   andyzip::deflate_decoder dec_;
+  bool verify_crc_ = true;
 };
+
+#endif
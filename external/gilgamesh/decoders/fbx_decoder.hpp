@@ -15,9 +15,11 @@
 #include <string>
 //#include <filesystem>
 #include <vector>
+#include <algorithm>
 
 #include <gilgamesh/scene.hpp>
 #include <andyzip/deflate_decoder.hpp>
+#include <andyzip/parallel_for.hpp>
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
@@ -35,19 +37,20 @@ namespace gilgamesh {
 
     // Load a scene from a file
     // note that this is not thread safe!
+    // Arrays are inflated and meshes built on up to num_threads threads (0 = one per core).
     template<class MeshType>
-    bool loadScene(gilgamesh::scene &scene, const std::string &filename) {
+    bool loadScene(gilgamesh::scene &scene, const std::string &filename, unsigned num_threads = 0) {
       std::vector<char> bytes;
       init(bytes, filename);
-      return load<MeshType>(scene);
+      return load<MeshType>(scene, num_threads);
     }
 
     // Load a scene from memory
     // note that this is not thread safe!
     template<class MeshType>
-    bool loadScene(gilgamesh::scene &scene, const char *begin, const char *end) {
+    bool loadScene(gilgamesh::scene &scene, const char *begin, const char *end, unsigned num_threads = 0) {
       init(begin, end);
-      return load<MeshType>(scene);
+      return load<MeshType>(scene, num_threads);
     }
 
     // dump the structure of a file.
@@ -78,7 +81,7 @@ namespace gilgamesh {
 
     static inline std::uint32_t u4(const char *p) {
       const unsigned char *q = (const unsigned char *)p;
-      std::uint32_t res = q[0] + q[1] * 0x100 + q[2] * 0x10000 + q[3] * 0x1000000;
+      std::uint32_t res = q[0] + q[1] * 0x100 + q[2] * 0x10000 + (std::uint32_t)q[3] * 0x1000000;
       return res;
     }
 
@@ -232,6 +235,13 @@ namespace gilgamesh {
         return 0;
       }
 
+      // Bytes taken by the data of an array property in the file.
+      size_t arrayBytes() const {
+        const char *p = begin_ + offset + 1;
+        size_t elem_size = kind() == 'd' || kind() == 'l' ? 8 : kind() == 'b' ? 1 : 4;
+        return u4(p+4) ? u4(p+8) : u4(p) * elem_size;
+      }
+
       uint64_t getLong() {
         if (kind() == 'L') {
           return u8(begin_ + offset + 1);
@@ -261,7 +271,7 @@ namespace gilgamesh {
               return decoder.decode(dest, dest_max, src+2, src_max);
             }
           } else {
-            memcpy(dest, p, al*sizeof(Type));
+            if (al) memcpy(dest, p, al*sizeof(Type));
             return true;
           }
         }
@@ -272,16 +282,27 @@ namespace gilgamesh {
       const char *begin_;
     };
 
-    template<class MeshType>
-    bool load(gilgamesh::scene &scene) {
-      std::vector<double> fbxVertices;
-      std::vector<double> fbxNormals;
-      std::vector<double> fbxUVs;
-      std::vector<double> fbxColors;
-      std::vector<int32_t> fbxUVIndices;
-      std::vector<int32_t> fbxColorIndices;
-      std::vector<int32_t> fbxNormalIndices;
-      std::vector<int32_t> fbxIndices;
+    // An array property found by the walk of the file, to be inflated later.
+    template <class Type, char Kind>
+    struct deferred_array {
+      prop source;
+      bool found = false;
+      std::vector<Type> values;
+
+      void find(const prop &p) { source = p; found = true; }
+      bool inflate(const andyzip::deflate_decoder &decoder) { return !found || source.getArray<Type, Kind>(values, decoder); }
+    };
+
+    // The arrays and layer mappings of a Geometry object and the vertices built from them.
+    struct geometry {
+      deferred_array<double, 'd'> fbxVertices;
+      deferred_array<double, 'd'> fbxNormals;
+      deferred_array<double, 'd'> fbxUVs;
+      deferred_array<double, 'd'> fbxColors;
+      deferred_array<int32_t, 'i'> fbxUVIndices;
+      deferred_array<int32_t, 'i'> fbxColorIndices;
+      deferred_array<int32_t, 'i'> fbxNormalIndices;
+      deferred_array<int32_t, 'i'> fbxIndices;
       std::string fbxNormalMapping;
       std::string fbxUVMapping;
       std::string fbxColorMapping;
@@ -289,6 +310,22 @@ namespace gilgamesh {
       std::string fbxUVRef;
       std::string fbxColorRef;
 
+      std::vector<glm::vec3> pos;
+      std::vector<glm::vec3> normal;
+      std::vector<glm::vec2> uv;
+      std::vector<glm::vec4> color;
+
+      // Polygon number at the start of each chunk of polygon vertices.
+      std::vector<size_t> chunkPolygons;
+    };
+
+    // Polygon vertices converted by one job.
+    enum { chunk_size = 0x10000 };
+
+    template<class MeshType>
+    bool load(gilgamesh::scene &scene, unsigned num_threads) {
+      std::vector<geometry> geometries;
+
       std::vector<uint64_t> geometryIds;
       std::vector<uint64_t> modelIds;
       std::vector<glm::mat4> transforms;
@@ -301,23 +338,25 @@ namespace gilgamesh {
             if (obj.name_is("Geometry")) {
               auto ovp = obj.get_props().begin();
               geometryIds.push_back(ovp.getLong());
+              geometries.emplace_back();
+              geometry &geom = geometries.back();
               for (auto comp : obj) {
                 auto vp = comp.get_props().begin();
                 if (debug) printf("%s %c\n", comp.name().c_str(), vp.kind());
                 if (comp.name_is("Vertices")) {
-                  vp.getArray<double, 'd'>(fbxVertices, decoder_);
+                  geom.fbxVertices.find(vp);
                 } else if (comp.name_is("LayerElementNormal")) {
                   for (auto sub : comp) {
                     auto vp = sub.get_props().begin();
                     if (debug) printf("  %s %c\n", sub.name().c_str(), vp.kind());
                     if (sub.name_is("MappingInformationType")) {
-                      vp.getString(fbxNormalMapping);
+                      vp.getString(geom.fbxNormalMapping);
                     } else if (sub.name_is("ReferenceInformationType")) {
-                      vp.getString(fbxNormalRef);
+                      vp.getString(geom.fbxNormalRef);
                     } else if (sub.name_is("NormalIndex")) {
-                      vp.getArray<int32_t, 'i'>(fbxNormalIndices, decoder_);
+                      geom.fbxNormalIndices.find(vp);
                     } else if (sub.name_is("Normals")) {
-                      vp.getArray<double, 'd'>(fbxNormals, decoder_);
+                      geom.fbxNormals.find(vp);
                     }
                   }
                 } else if (comp.name_is("LayerElementUV")) {
@@ -325,13 +364,13 @@ namespace gilgamesh {
                     auto vp = sub.get_props().begin();
                     if (debug) printf("  %s %c\n", sub.name().c_str(), vp.kind());
                     if (sub.name_is("MappingInformationType")) {
-                      vp.getString(fbxUVMapping);
+                      vp.getString(geom.fbxUVMapping);
                     } else if (sub.name_is("ReferenceInformationType")) {
-                      vp.getString(fbxUVRef);
+                      vp.getString(geom.fbxUVRef);
                     } else if (sub.name_is("UVIndex")) {
-                      vp.getArray<int32_t, 'i'>(fbxUVIndices, decoder_);
+                      geom.fbxUVIndices.find(vp);
                     } else if (sub.name_is("UV")) {
-                      vp.getArray<double, 'd'>(fbxUVs, decoder_);
+                      geom.fbxUVs.find(vp);
                     }
                   }
                 } else if (comp.name_is("LayerElementColor")) {
@@ -339,91 +378,19 @@ namespace gilgamesh {
                     auto vp = sub.get_props().begin();
                     if (debug) printf("  %s %c\n", sub.name().c_str(), vp.kind());
                     if (sub.name_is("MappingInformationType")) {
-                      vp.getString(fbxColorMapping);
+                      vp.getString(geom.fbxColorMapping);
                     } else if (sub.name_is("ReferenceInformationType")) {
-                      vp.getString(fbxColorRef);
+                      vp.getString(geom.fbxColorRef);
                     } else if (sub.name_is("ColorIndex")) {
-                      vp.getArray<int32_t, 'i'>(fbxColorIndices, decoder_);
+                      geom.fbxColorIndices.find(vp);
                     } else if (sub.name_is("Colors")) {
-                      vp.getArray<double, 'd'>(fbxColors, decoder_);
+                      geom.fbxColors.find(vp);
                     }
                   }
                 } else if (comp.name_is("PolygonVertexIndex")) {
-                  vp.getArray<int32_t, 'i'>(fbxIndices, decoder_);
+                  geom.fbxIndices.find(vp);
                 }
               }
-
-              auto normalMapping = fbx_decoder::decodeMapping(fbxNormalMapping);
-              auto uvMapping = fbx_decoder::decodeMapping(fbxUVMapping);
-              auto cMapping = fbx_decoder::decodeMapping(fbxColorMapping);
-              auto normalRef = fbx_decoder::decodeRef(fbxNormalRef);
-              auto uvRef = fbx_decoder::decodeRef(fbxUVRef);
-              auto cRef = fbx_decoder::decodeRef(fbxColorRef);
-
-              if (fbxNormals.empty()) {
-                fbxNormals.resize(3);
-              }
-              if (fbxUVs.empty()) {
-                fbxUVs.resize(2);
-              }
-              if (fbxColors.empty()) {
-                fbxColors.resize(4);
-                fbxColors[0] = fbxColors[1] = fbxColors[2] = fbxColors[3] = 1;
-              }
-
-              // https://banexdevblog.wordpress.com/2014/06/23/a-quick-tutorial-about-the-fbx-ascii-format/
-              if (debug) printf("%s %s\n", fbxNormalMapping.c_str(), fbxUVMapping.c_str());
-              if (debug) printf("%s %s\n", fbxNormalRef.c_str(), fbxUVRef.c_str());
-              if (debug) printf("%d vertices %d indices %d normals %d uvs %d colors %d uvindices\n", (int)fbxVertices.size(), (int)fbxIndices.size(), (int)fbxNormals.size(), (int)fbxUVs.size(), (int)fbxColors.size(), (int)fbxUVIndices.size());
-
-              std::vector<glm::vec3> pos;
-              std::vector<glm::vec3> normal;
-              std::vector<glm::vec2> uv;
-              std::vector<glm::vec4> color;
-              std::vector<int> material;
-
-              // map the fbx data to real vertices
-              size_t pi = 0;
-              for (size_t i = 0; i != fbxIndices.size(); ++i) {
-                size_t ni = normalRef == fbx_decoder::Ref::IndexToDirect ? fbxNormalIndices[i] : i;
-                size_t uvi = uvRef == fbx_decoder::Ref::IndexToDirect ? fbxUVIndices[i] : i;
-                size_t ci = cRef == fbx_decoder::Ref::IndexToDirect ? fbxColorIndices[i] : i;
-                int32_t vi = fbxIndices[i];
-                if (vi < 0) vi = -1 - vi;
-
-                size_t nj = map(normalMapping, pi, ni, vi);
-                size_t uvj = map(uvMapping, pi, uvi, vi);
-                size_t cj = map(cMapping, pi, ci, vi);
-
-                glm::vec3 vpos(fbxVertices[vi*3+0], fbxVertices[vi*3+1], fbxVertices[vi*3+2]);
-                glm::vec3 vnormal = glm::vec3(fbxNormals[nj*3+0], fbxNormals[nj*3+1], fbxNormals[nj*3+2]);
-                glm::vec2 vuv = glm::vec2(fbxUVs[uvj*2+0], fbxUVs[uvj*2+1]);
-                glm::vec4 vcolor = glm::vec4(fbxColors[cj*4+0], fbxColors[cj*4+1], fbxColors[cj*4+2], fbxColors[cj*4+3]);
-
-                pos.push_back(vpos);
-                normal.push_back(vnormal);
-                uv.push_back(vuv);
-                color.push_back(vcolor);
-
-                pi += fbxIndices[i] < 0;
-              }
-
-              // map the fbx data to real indices
-              // todo: add a function to re-index
-              std::vector<uint32_t> indices;
-              for (size_t i = 0, j = 0; i != fbxIndices.size(); ++i) {
-                if (fbxIndices[i] < 0) {
-                  for (size_t k = j+2; k <= i; ++k) {
-                    indices.push_back((uint32_t)j);
-                    indices.push_back((uint32_t)k-1);
-                    indices.push_back((uint32_t)k);
-                  }
-                  j = i + 1;
-                }
-              }
-
-              MeshType *mesh = new MeshType(pos, normal, uv, color, indices);
-              scene.addMesh(mesh);
             } else if (obj.name_is("Model")) {
               auto ovp = obj.get_props().begin();
               modelIds.push_back(ovp.getLong());
@@ -483,6 +450,10 @@ namespace gilgamesh {
               meshIdxs.push_back(0);
             }
           }
+          if (!buildMeshes<MeshType>(scene, geometries, num_threads)) {
+            return false;
+          }
+          geometries.clear();
         } else if (section.name_is("Connections")) {
           std::string kind;
           for (auto connection : section) {
@@ -506,6 +477,150 @@ namespace gilgamesh {
       return true;
     }
 
+    // Inflate all the arrays of the geometries in parallel, then convert their vertices
+    // in chunks and build a mesh for each geometry, also in parallel.
+    template<class MeshType>
+    bool buildMeshes(gilgamesh::scene &scene, std::vector<geometry> &geometries, unsigned num_threads) const {
+      // Largest arrays first, so that the threads finish together.
+      struct inflate_job {
+        size_t bytes;
+        deferred_array<double, 'd'> *doubles;
+        deferred_array<int32_t, 'i'> *ints;
+      };
+      std::vector<inflate_job> inflate_jobs;
+      for (auto &g : geometries) {
+        for (auto a : { &g.fbxVertices, &g.fbxNormals, &g.fbxUVs, &g.fbxColors }) {
+          if (a->found) inflate_jobs.push_back(inflate_job{a->source.arrayBytes(), a, nullptr});
+        }
+        for (auto a : { &g.fbxUVIndices, &g.fbxColorIndices, &g.fbxNormalIndices, &g.fbxIndices }) {
+          if (a->found) inflate_jobs.push_back(inflate_job{a->source.arrayBytes(), nullptr, a});
+        }
+      }
+      std::stable_sort(inflate_jobs.begin(), inflate_jobs.end(), [](const inflate_job &a, const inflate_job &b) { return a.bytes > b.bytes; });
+
+      std::vector<char> ok(inflate_jobs.size());
+      andyzip::parallel_for(inflate_jobs.size(), [&](size_t i) {
+        auto &job = inflate_jobs[i];
+        ok[i] = job.doubles ? job.doubles->inflate(decoder_) : job.ints->inflate(decoder_);
+      }, num_threads);
+      if (std::find(ok.begin(), ok.end(), 0) != ok.end()) {
+        return false;
+      }
+
+      struct convert_job {
+        geometry *geom;
+        size_t chunk;
+      };
+      std::vector<convert_job> convert_jobs;
+      for (auto &g : geometries) {
+        if (g.fbxNormals.values.empty()) {
+          g.fbxNormals.values.resize(3);
+        }
+        if (g.fbxUVs.values.empty()) {
+          g.fbxUVs.values.resize(2);
+        }
+        if (g.fbxColors.values.empty()) {
+          g.fbxColors.values.resize(4);
+          g.fbxColors.values[0] = g.fbxColors.values[1] = g.fbxColors.values[2] = g.fbxColors.values[3] = 1;
+        }
+
+        // https://banexdevblog.wordpress.com/2014/06/23/a-quick-tutorial-about-the-fbx-ascii-format/
+        if (debug) printf("%s %s\n", g.fbxNormalMapping.c_str(), g.fbxUVMapping.c_str());
+        if (debug) printf("%s %s\n", g.fbxNormalRef.c_str(), g.fbxUVRef.c_str());
+        if (debug) printf("%d vertices %d indices %d normals %d uvs %d colors %d uvindices\n", (int)g.fbxVertices.values.size(), (int)g.fbxIndices.values.size(), (int)g.fbxNormals.values.size(), (int)g.fbxUVs.values.size(), (int)g.fbxColors.values.size(), (int)g.fbxUVIndices.values.size());
+
+        const std::vector<int32_t> &fbxIndices = g.fbxIndices.values;
+        g.pos.resize(fbxIndices.size());
+        g.normal.resize(fbxIndices.size());
+        g.uv.resize(fbxIndices.size());
+        g.color.resize(fbxIndices.size());
+
+        // The ends of polygons are negative indices, so count them to find the first polygon of each chunk.
+        size_t pi = 0;
+        for (size_t i = 0; i != fbxIndices.size(); ++i) {
+          if (i % chunk_size == 0) {
+            convert_jobs.push_back(convert_job{&g, g.chunkPolygons.size()});
+            g.chunkPolygons.push_back(pi);
+          }
+          pi += fbxIndices[i] < 0;
+        }
+      }
+
+      andyzip::parallel_for(convert_jobs.size(), [&](size_t i) {
+        convert(*convert_jobs[i].geom, convert_jobs[i].chunk);
+      }, num_threads);
+
+      std::vector<MeshType *> meshes(geometries.size());
+      andyzip::parallel_for(geometries.size(), [&](size_t m) {
+        geometry &g = geometries[m];
+        const std::vector<int32_t> &fbxIndices = g.fbxIndices.values;
+
+        // map the fbx data to real indices
+        // todo: add a function to re-index
+        std::vector<uint32_t> indices;
+        for (size_t i = 0, j = 0; i != fbxIndices.size(); ++i) {
+          if (fbxIndices[i] < 0) {
+            for (size_t k = j+2; k <= i; ++k) {
+              indices.push_back((uint32_t)j);
+              indices.push_back((uint32_t)k-1);
+              indices.push_back((uint32_t)k);
+            }
+            j = i + 1;
+          }
+        }
+
+        meshes[m] = new MeshType(g.pos, g.normal, g.uv, g.color, indices);
+
+        // Release the arrays of this geometry as soon as its mesh is built.
+        g = geometry();
+      }, num_threads);
+
+      for (auto mesh : meshes) {
+        scene.addMesh(mesh);
+      }
+      return true;
+    }
+
+    // map the fbx data to real vertices for one chunk of polygon vertices
+    static void convert(geometry &g, size_t chunk) {
+      const std::vector<double> &fbxVertices = g.fbxVertices.values;
+      const std::vector<double> &fbxNormals = g.fbxNormals.values;
+      const std::vector<double> &fbxUVs = g.fbxUVs.values;
+      const std::vector<double> &fbxColors = g.fbxColors.values;
+      const std::vector<int32_t> &fbxUVIndices = g.fbxUVIndices.values;
+      const std::vector<int32_t> &fbxColorIndices = g.fbxColorIndices.values;
+      const std::vector<int32_t> &fbxNormalIndices = g.fbxNormalIndices.values;
+      const std::vector<int32_t> &fbxIndices = g.fbxIndices.values;
+
+      auto normalMapping = fbx_decoder::decodeMapping(g.fbxNormalMapping);
+      auto uvMapping = fbx_decoder::decodeMapping(g.fbxUVMapping);
+      auto cMapping = fbx_decoder::decodeMapping(g.fbxColorMapping);
+      auto normalRef = fbx_decoder::decodeRef(g.fbxNormalRef);
+      auto uvRef = fbx_decoder::decodeRef(g.fbxUVRef);
+      auto cRef = fbx_decoder::decodeRef(g.fbxColorRef);
+
+      size_t pi = g.chunkPolygons[chunk];
+      size_t end = std::min(fbxIndices.size(), (chunk + 1) * chunk_size);
+      for (size_t i = chunk * chunk_size; i != end; ++i) {
+        size_t ni = normalRef == fbx_decoder::Ref::IndexToDirect ? fbxNormalIndices[i] : i;
+        size_t uvi = uvRef == fbx_decoder::Ref::IndexToDirect ? fbxUVIndices[i] : i;
+        size_t ci = cRef == fbx_decoder::Ref::IndexToDirect ? fbxColorIndices[i] : i;
+        int32_t vi = fbxIndices[i];
+        if (vi < 0) vi = -1 - vi;
+
+        size_t nj = map(normalMapping, pi, ni, vi);
+        size_t uvj = map(uvMapping, pi, uvi, vi);
+        size_t cj = map(cMapping, pi, ci, vi);
+
+        g.pos[i] = glm::vec3(fbxVertices[vi*3+0], fbxVertices[vi*3+1], fbxVertices[vi*3+2]);
+        g.normal[i] = glm::vec3(fbxNormals[nj*3+0], fbxNormals[nj*3+1], fbxNormals[nj*3+2]);
+        g.uv[i] = glm::vec2(fbxUVs[uvj*2+0], fbxUVs[uvj*2+1]);
+        g.color[i] = glm::vec4(fbxColors[cj*4+0], fbxColors[cj*4+1], fbxColors[cj*4+2], fbxColors[cj*4+3]);
+
+        pi += fbxIndices[i] < 0;
+      }
+    }
+
     void init(std::vector<char> &bytes, const std::string &filename) {
       std::ifstream file(filename, std::ios_base::binary);
       begin_ = end_ = nullptr;
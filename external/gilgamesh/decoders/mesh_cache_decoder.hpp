@@ -0,0 +1,360 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2016
+//
+// gilgamesh: binary mesh cache decoder
+//
+// A mesh cache holds meshes ready for the GPU: vertex streams, indices, levels of detail,
+// bounds and a node hierarchy. It is written by mesh_cache_encoder and memory mapped here,
+// so opening one reads only the tables; vertex and index data are paged in as they are used.
+//
+// File layout, all little endian:
+//
+//   mesh_cache_header at offset 0
+//   sections, each starting at a multiple of header.alignment
+//   the section table, header.num_sections mesh_cache_sections
+//
+// The tables of meshes, streams, attributes, lods and nodes are sections too, one of each kind.
+// Any section may be deflated. Stored sections are uploaded from the mapping without a copy:
+//
+//   gilgamesh::mesh_cache_decoder cache;
+//   if (!cache.open("teapot.gmc")) ...
+//   auto &m = cache.meshes()[0];
+//   auto bytes = cache.view(cache.streams(m)[0].section);
+//   vku::VertexBuffer vbo(device, memprops, bytes.size());
+//   vbo.upload(device, memprops, commandPool, queue, bytes.data(), bytes.size());
+//   pm.vertexFormat(cache.vertexFormat(m));
+//
+// Deflated sections have empty views and are inflated with read() instead.
+//
+
+#ifndef MESHUTILS_MESH_CACHE_DECODER_INCLUDED
+#define MESHUTILS_MESH_CACHE_DECODER_INCLUDED
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <string>
+#include <span>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <gilgamesh/mesh.hpp>
+#include <gilgamesh/scene.hpp>
+#include <andyzip/mapped_file.hpp>
+#include <andyzip/deflate_decoder.hpp>
+#include <andyzip/parallel_for.hpp>
+
+namespace gilgamesh {
+
+enum : uint32_t {
+  mesh_cache_version = 1,
+
+  // Sections are aligned for any buffer copy or storage buffer offset.
+  mesh_cache_alignment = 256,
+
+  // section kinds
+  mesh_cache_meshes = 1,
+  mesh_cache_streams,
+  mesh_cache_attributes,
+  mesh_cache_lods,
+  mesh_cache_nodes,
+  mesh_cache_vertices,
+  mesh_cache_indices,
+
+  // section compression
+  mesh_cache_stored = 0,
+  mesh_cache_deflate = 1,
+};
+
+struct mesh_cache_header {
+  char magic[8];                // "GMSHCACH"
+  uint32_t version;             // mesh_cache_version
+  uint32_t alignment;           // of every section
+  uint64_t section_table;       // file offset of the section table
+  uint32_t num_sections;
+  uint32_t reserved[9];
+};
+
+struct mesh_cache_section {
+  uint32_t kind;
+  uint32_t compression;
+  uint64_t offset;              // from the start of the file
+  uint64_t size;                // bytes in the file
+  uint64_t uncompressed_size;
+};
+
+struct mesh_cache_mesh {
+  glm::vec3 bounds_min;         // bounding box of the positions
+  glm::vec3 bounds_max;
+  glm::vec3 center;             // bounding sphere
+  float radius;
+  uint32_t num_vertices;
+  uint32_t first_stream;        // entries in the stream table
+  uint32_t num_streams;
+  uint32_t index_section;
+  uint32_t index_size;          // 2 or 4 bytes
+  uint32_t num_indices;
+  uint32_t first_lod;           // entries in the lod table
+  uint32_t num_lods;
+};
+
+// A vertex stream, uploaded to one vertex buffer binding.
+struct mesh_cache_stream {
+  uint32_t section;
+  uint32_t stride;
+  uint32_t first_attribute;     // entries in the attribute table
+  uint32_t num_attributes;
+};
+
+// As gilgamesh::attribute, with its offset in the stream.
+struct mesh_cache_attribute {
+  char name[16];
+  uint32_t number_of_channels;
+  char type;
+  char reserved[3];
+  uint32_t offset;
+  uint32_t reserved2;
+};
+
+// As gilgamesh::lod.
+struct mesh_cache_lod {
+  uint32_t first_index;
+  uint32_t index_count;
+  float error;
+  uint32_t reserved;
+};
+
+// As the nodes of gilgamesh::scene.
+struct mesh_cache_node {
+  glm::mat4 transform;
+  int32_t parent;               // -1 for none
+  int32_t mesh;                 // -1 for none
+  uint32_t reserved[2];
+};
+
+class mesh_cache_decoder {
+public:
+  mesh_cache_decoder() {
+  }
+
+  // Map a file and check its tables. Returns false if it can't be read or is not a mesh cache
+  // of this version, in which case the cache should be rebuilt.
+  bool open(const std::string &filename) {
+    try {
+      file_ = andyzip::mapped_file(filename);
+    } catch (const std::runtime_error &) {
+      return false;
+    }
+    return open(file_.begin(), file_.end());
+  }
+
+  // Use a cache in memory, aligned to at least 16 bytes, which must outlive the decoder.
+  bool open(const uint8_t *begin, const uint8_t *end) {
+    begin_ = begin;
+    end_ = end;
+    if (!parse()) {
+      begin_ = end_ = nullptr;
+      sections_ = {};
+      meshes_ = {};
+      streams_ = {};
+      attributes_ = {};
+      lods_ = {};
+      nodes_ = {};
+      return false;
+    }
+    return true;
+  }
+
+  std::span<const mesh_cache_section> sections() const { return sections_; }
+  const mesh_cache_section &section(uint32_t i) const { return sections_[i]; }
+
+  std::span<const mesh_cache_mesh> meshes() const { return meshes_; }
+  std::span<const mesh_cache_node> nodes() const { return nodes_; }
+
+  std::span<const mesh_cache_stream> streams(const mesh_cache_mesh &mesh) const {
+    return streams_.subspan(mesh.first_stream, mesh.num_streams);
+  }
+
+  std::span<const mesh_cache_attribute> attributes(const mesh_cache_stream &stream) const {
+    return attributes_.subspan(stream.first_attribute, stream.num_attributes);
+  }
+
+  std::span<const mesh_cache_lod> lods(const mesh_cache_mesh &mesh) const {
+    return lods_.subspan(mesh.first_lod, mesh.num_lods);
+  }
+
+  // The bytes of a stored section in the file, or an empty span if it is deflated.
+  std::span<const uint8_t> view(uint32_t i) const {
+    const mesh_cache_section &s = sections_[i];
+    if (s.compression != mesh_cache_stored) return {};
+    return std::span<const uint8_t>(begin_ + s.offset, (size_t)s.size);
+  }
+
+  // Copy or inflate section i to uncompressed_size bytes at dest, eg. a mapped staging buffer.
+  // Returns false if a deflated section is corrupt.
+  bool read(uint32_t i, uint8_t *dest) const {
+    const mesh_cache_section &s = sections_[i];
+    const uint8_t *src = begin_ + s.offset;
+    if (s.compression == mesh_cache_stored) {
+      memcpy(dest, src, (size_t)s.size);
+      return true;
+    }
+    return decoder_.decode(dest, dest + s.uncompressed_size, src, src + s.size);
+  }
+
+  // Vertex input for the streams of a mesh, bound to first_binding onwards.
+  vertex_format vertexFormat(const mesh_cache_mesh &mesh, uint32_t first_binding = 0) const {
+    vertex_format result;
+    uint32_t location = 0;
+    for (auto &stream : streams(mesh)) {
+      uint32_t binding = first_binding + (uint32_t)result.bindings.size();
+      result.bindings.push_back(vertex_binding{binding, stream.stride});
+      for (auto &a : attributes(stream)) {
+        result.attributes.push_back(vertex_attribute{a.name, (int)a.number_of_channels, a.type, location++, binding, a.offset});
+      }
+    }
+    return result;
+  }
+
+  // Load mesh i into a basic_mesh. Returns false if its vertices are not one stream
+  // in the format of MeshTraits, or its indices are not index_t.
+  template <class MeshTraits>
+  bool loadMesh(basic_mesh<MeshTraits> &mesh, size_t i) const {
+    typedef typename MeshTraits::vertex_t vertex_t;
+    typedef typename MeshTraits::index_t index_t;
+    const mesh_cache_mesh &m = meshes_[i];
+    if (m.num_streams != 1 || m.index_size != sizeof(index_t)) return false;
+
+    const mesh_cache_stream &stream = streams_[m.first_stream];
+    vertex_format format = interleaved_format(MeshTraits::getFormat());
+    auto attrs = attributes(stream);
+    if (stream.stride != sizeof(vertex_t) || format.bindings[0].stride != sizeof(vertex_t) || attrs.size() != format.attributes.size()) return false;
+    for (size_t a = 0; a != attrs.size(); ++a) {
+      const vertex_attribute &f = format.attributes[a];
+      if (strcmp(attrs[a].name, f.name) || (int)attrs[a].number_of_channels != f.number_of_channels || attrs[a].type != f.type || attrs[a].offset != f.offset) return false;
+    }
+
+    mesh.vertices().resize(m.num_vertices);
+    mesh.indices().resize(m.num_indices);
+    return read(stream.section, (uint8_t *)mesh.vertices().data()) && read(m.index_section, (uint8_t *)mesh.indices().data());
+  }
+
+  // Add all the meshes and nodes to a scene, loading meshes in parallel.
+  // As with fbx_decoder, the scene does not own the new meshes.
+  template <class MeshType>
+  bool loadScene(gilgamesh::scene &scene, unsigned num_threads = 0) const {
+    std::vector<MeshType *> meshes(meshes_.size());
+    std::vector<char> ok(meshes_.size());
+    andyzip::parallel_for(meshes.size(), [&](size_t i) {
+      meshes[i] = new MeshType();
+      ok[i] = loadMesh(*meshes[i], i);
+    }, num_threads);
+
+    if (std::find(ok.begin(), ok.end(), 0) != ok.end()) {
+      for (auto m : meshes) delete m;
+      return false;
+    }
+
+    int first_mesh = (int)scene.meshes().size();
+    for (auto m : meshes) {
+      scene.addMesh(m);
+    }
+    int first_node = (int)scene.transforms().size();
+    for (auto &n : nodes_) {
+      scene.addNode(n.transform, n.parent < 0 ? -1 : first_node + n.parent, n.mesh < 0 ? -1 : first_mesh + n.mesh);
+    }
+    return true;
+  }
+
+private:
+  // A table section, viewed in place if it is stored or inflated to storage if not.
+  template <class Type>
+  bool table(std::span<const Type> &result, uint32_t kind, std::vector<uint8_t> &storage) {
+    result = {};
+    for (uint32_t i = 0; i != sections_.size(); ++i) {
+      const mesh_cache_section &s = sections_[i];
+      if (s.kind != kind) continue;
+      if (s.uncompressed_size % sizeof(Type)) return false;
+      const uint8_t *data = begin_ + s.offset;
+      if (s.compression != mesh_cache_stored) {
+        storage.resize((size_t)s.uncompressed_size);
+        if (!read(i, storage.data())) return false;
+        data = storage.data();
+      }
+      result = std::span<const Type>((const Type *)data, (size_t)(s.uncompressed_size / sizeof(Type)));
+      return true;
+    }
+    return true;
+  }
+
+  bool parse() {
+    size_t file_size = end_ - begin_;
+    mesh_cache_header header;
+    if (file_size < sizeof(header) || (uintptr_t)begin_ % 16) return false;
+    memcpy(&header, begin_, sizeof(header));
+    if (memcmp(header.magic, "GMSHCACH", 8) || header.version != mesh_cache_version) return false;
+    if (header.section_table > file_size || header.num_sections > (file_size - header.section_table) / sizeof(mesh_cache_section)) return false;
+    if (header.section_table % alignof(mesh_cache_section)) return false;
+    sections_ = std::span<const mesh_cache_section>((const mesh_cache_section *)(begin_ + header.section_table), header.num_sections);
+
+    for (auto &s : sections_) {
+      if (s.offset > file_size || s.size > file_size - s.offset || s.offset % mesh_cache_alignment) return false;
+      if (s.compression == mesh_cache_stored ? s.size != s.uncompressed_size : s.compression != mesh_cache_deflate) return false;
+      // Deflate expands by at most 1032 times, so a larger size is corrupt. Checking it
+      // here bounds every size that the tables and loadMesh allocate from.
+      if (s.compression == mesh_cache_deflate && s.uncompressed_size > s.size * 1032 + 1024) return false;
+    }
+
+    if (!table(meshes_, mesh_cache_meshes, mesh_storage_)) return false;
+    if (!table(streams_, mesh_cache_streams, stream_storage_)) return false;
+    if (!table(attributes_, mesh_cache_attributes, attribute_storage_)) return false;
+    if (!table(lods_, mesh_cache_lods, lod_storage_)) return false;
+    if (!table(nodes_, mesh_cache_nodes, node_storage_)) return false;
+
+    // Check every reference so that users of the tables need not.
+    auto data_section = [&](uint32_t i, uint32_t kind, uint64_t size) {
+      return i < sections_.size() && sections_[i].kind == kind && sections_[i].uncompressed_size == size;
+    };
+    for (auto &m : meshes_) {
+      if (m.first_stream > streams_.size() || m.num_streams > streams_.size() - m.first_stream) return false;
+      if (m.first_lod > lods_.size() || m.num_lods > lods_.size() - m.first_lod) return false;
+      if ((m.index_size != 2 && m.index_size != 4) || !data_section(m.index_section, mesh_cache_indices, (uint64_t)m.num_indices * m.index_size)) return false;
+      for (auto &s : streams(m)) {
+        if (!data_section(s.section, mesh_cache_vertices, (uint64_t)m.num_vertices * s.stride)) return false;
+        if (s.first_attribute > attributes_.size() || s.num_attributes > attributes_.size() - s.first_attribute) return false;
+        for (auto &a : attributes(s)) {
+          if (!memchr(a.name, 0, sizeof(a.name))) return false;
+        }
+      }
+      for (auto &l : lods(m)) {
+        if (l.first_index > m.num_indices || l.index_count > m.num_indices - l.first_index) return false;
+      }
+    }
+    for (auto &n : nodes_) {
+      if (n.parent >= (int32_t)nodes_.size() || n.mesh >= (int32_t)meshes_.size()) return false;
+    }
+    return true;
+  }
+
+  andyzip::mapped_file file_;
+  const uint8_t *begin_ = nullptr;
+  const uint8_t *end_ = nullptr;
+  andyzip::deflate_decoder decoder_;
+
+  std::span<const mesh_cache_section> sections_;
+  std::span<const mesh_cache_mesh> meshes_;
+  std::span<const mesh_cache_stream> streams_;
+  std::span<const mesh_cache_attribute> attributes_;
+  std::span<const mesh_cache_lod> lods_;
+  std::span<const mesh_cache_node> nodes_;
+  std::vector<uint8_t> mesh_storage_;
+  std::vector<uint8_t> stream_storage_;
+  std::vector<uint8_t> attribute_storage_;
+  std::vector<uint8_t> lod_storage_;
+  std::vector<uint8_t> node_storage_;
+};
+
+} // gilgamesh
+
+#endif
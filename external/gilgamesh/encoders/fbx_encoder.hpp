@@ -14,18 +14,20 @@
 #include <vector>
 #include <exception>
 #include <cstring>
+#include <span>
 #include <iostream>
 
 #include <glm/glm.hpp>
 #include <gilgamesh/mesh.hpp>
 #include <gilgamesh/scene.hpp>
+#include <andyzip/deflate_encoder.hpp>
 
 // see https://code.blender.org/2013/08/fbx-binary-file-format-specification/
 // and https://banexdevblog.wordpress.com/2014/06/23/a-quick-tutorial-about-the-fbx-ascii-format/
 
 namespace gilgamesh {
   template<class ValueType, class IdxType>
-  void make_index(std::vector<ValueType> &values_out, std::vector<IdxType> &idx_out, const std::vector<ValueType> &values_in) {
+  void make_index(std::vector<ValueType> &values_out, std::vector<IdxType> &idx_out, std::span<const ValueType> values_in) {
     struct evec_t {
       ValueType v;
       size_t original_idx;
@@ -59,7 +61,8 @@ namespace gilgamesh {
 
   class fbx_encoder {
   public:
-    fbx_encoder() {
+    /// Arrays are zlib compressed if compressionLevel is 1-9.
+    fbx_encoder(int compressionLevel = 0) : compression_level_(compressionLevel) {
     }
 
     void saveMesh(gilgamesh::mesh &mesh, const std::string &filename) {
@@ -1327,10 +1330,23 @@ namespace gilgamesh {
     }
 
     void writeGeometry(const mesh &mesh, size_t index) {
-      std::vector<uint32_t> indices = mesh.indices32();
-      std::vector<glm::vec3> pos = mesh.pos();
-      std::vector<glm::vec3> normal = mesh.normal();
-      std::vector<glm::vec4> color = mesh.color();
+      // Use the mesh's arrays directly if it has them, or copies if not.
+      std::vector<uint32_t> indices_copy;
+      std::vector<glm::vec3> pos_copy;
+      std::vector<glm::vec3> normal_copy;
+      std::vector<glm::vec4> color_copy;
+      std::span<const uint32_t> indices = mesh.indexView();
+      std::span<const glm::vec3> pos = mesh.posView();
+      std::span<const glm::vec3> normal = mesh.normalView();
+      std::span<const glm::vec4> color = mesh.colorView();
+      if (indices.empty()) indices = indices_copy = mesh.indices32();
+      if (pos.empty()) pos = pos_copy = mesh.pos();
+      if (normal.empty()) normal = normal_copy = mesh.normal();
+      if (color.empty()) color = color_copy = mesh.color();
+
+      // Meshes without normals or colours get the defaults of basic_mesh.
+      if (normal.size() != pos.size()) normal = normal_copy = std::vector<glm::vec3>(pos.size(), glm::vec3(1, 0, 0));
+      if (color.size() != pos.size()) color = color_copy = std::vector<glm::vec4>(pos.size(), glm::vec4(1, 1, 1, 1));
 
       std::vector<glm::vec3> epos;
       std::vector<glm::vec4> ecolor;
@@ -1722,6 +1738,7 @@ namespace gilgamesh {
     std::vector<uint8_t> bytes_;
     std::vector<node> nodes;
     bool just_ended = false;
+    int compression_level_ = 0;
 
     void u1(int value) {
       bytes_.push_back((uint8_t)value);
@@ -1845,6 +1862,7 @@ namespace gilgamesh {
 
     void f(const float *value, size_t size) {
       prop('f');
+      size_t header = bytes_.size();
       u4((int)size);
       u4(0);
       u4((int)size * 4);
@@ -1853,11 +1871,13 @@ namespace gilgamesh {
         u.f = *value++;
         u4(u.v);
       }
+      compressArray(header);
       propend();
     }
 
     void d(const double *value, size_t size) {
       prop('d');
+      size_t header = bytes_.size();
       u4((int)size);
       u4(0);
       u4((int)size * 8);
@@ -1866,42 +1886,83 @@ namespace gilgamesh {
         u.f = *value++;
         u8(u.v);
       }
+      compressArray(header);
       propend();
     }
 
     void l(const uint64_t *value, size_t size) {
       prop('l');
+      size_t header = bytes_.size();
       u4((int)size);
       u4(0);
       u4((int)size * 8);
       while (size--) {
         u8(*value++);
       }
+      compressArray(header);
       propend();
     }
 
     void i(const uint32_t *value, size_t size) {
       prop('i');
+      size_t header = bytes_.size();
       u4((int)size);
       u4(0);
       u4((int)size * 4);
       while (size--) {
         u4(*value++);
       }
+      compressArray(header);
       propend();
     }
 
     void b(const int *value, size_t size) {
       prop('b');
+      size_t header = bytes_.size();
       u4((int)size);
       u4(0);
       u4((int)size * 4);
       while (size--) {
         u4(*value++);
       }
+      compressArray(header);
       propend();
     }
 
+    // Replace the array data after the length, encoding and size fields at header
+    // with a zlib stream if that is smaller.
+    void compressArray(size_t header) {
+      if (compression_level_ <= 0) return;
+
+      const uint8_t *data = bytes_.data() + header + 12;
+      size_t size = bytes_.size() - header - 12;
+      andyzip::deflate_encoder encoder(compression_level_);
+      std::vector<uint8_t> deflated = encoder.encode(data, data + size);
+      if (deflated.size() + 6 >= size) return;
+
+      uint32_t a = 1, b = 0;
+      for (size_t i = 0; i != size; ++i) {
+        a = (a + data[i]) % 65521;
+        b = (b + a) % 65521;
+      }
+
+      bytes_.resize(header + 12);
+      // deflate with a 32k window, default level.
+      u1(0x78);
+      u1(0x9c);
+      bytes_.insert(bytes_.end(), deflated.begin(), deflated.end());
+      uint32_t adler = b << 16 | a;
+      for (int shift = 24; shift >= 0; shift -= 8) {
+        u1(adler >> shift);
+      }
+
+      uint32_t csize = (uint32_t)(deflated.size() + 6);
+      for (int i = 0; i != 4; ++i) {
+        bytes_[header + 4 + i] = (uint8_t)(i == 0);
+        bytes_[header + 8 + i] = (uint8_t)(csize >> (i * 8));
+      }
+    }
+
     void S(const char *value) {
       size_t size = strlen(value);
       S(value, size);
@@ -0,0 +1,249 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2016
+//
+// gilgamesh: binary mesh cache encoder
+//
+// Writes meshes, their levels of detail and a node hierarchy in the format read
+// by mesh_cache_decoder. See decoders/mesh_cache_decoder.hpp for the layout.
+//
+//   gilgamesh::mesh_cache_encoder encoder(6);
+//   int m = encoder.addMesh(mesh, gilgamesh::build_lods(mesh));
+//   encoder.addNode(glm::mat4(1), -1, m);
+//   encoder.save("teapot.gmc");
+//
+
+#ifndef MESHUTILS_MESH_CACHE_ENCODER_INCLUDED
+#define MESHUTILS_MESH_CACHE_ENCODER_INCLUDED
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <string>
+#include <span>
+#include <fstream>
+#include <cstdint>
+#include <cstring>
+#include <gilgamesh/mesh.hpp>
+#include <gilgamesh/soa_mesh.hpp>
+#include <gilgamesh/scene.hpp>
+#include <gilgamesh/simplifier.hpp>
+#include <gilgamesh/decoders/mesh_cache_decoder.hpp>
+#include <andyzip/deflate_encoder.hpp>
+
+namespace gilgamesh {
+
+class mesh_cache_encoder {
+public:
+  // Sections are deflated if compression_level is 1-9 and that makes them at least
+  // an eighth smaller. Level 0 leaves all sections stored so that they can be viewed in place.
+  mesh_cache_encoder(int compression_level = 0, unsigned num_threads = 0) : compression_level_(compression_level), num_threads_(num_threads) {
+  }
+
+  // Add a mesh with its vertices in one interleaved stream. Returns its number.
+  template <class MeshTraits>
+  int addMesh(const basic_mesh<MeshTraits> &mesh, const std::vector<lod> &lods = {}) {
+    auto &vertices = mesh.vertices();
+    auto &indices = mesh.indices();
+    std::vector<glm::vec3> pos;
+    pos.reserve(vertices.size());
+    for (auto &v : vertices) pos.push_back(v.pos());
+
+    mesh_cache_mesh m = begin_mesh(pos, vertices.size(), lods);
+    add_stream(m, interleaved_format(MeshTraits::getFormat()), vertices.data(), vertices.size() * sizeof(vertices[0]));
+    return end_mesh(m, indices.data(), indices.size(), sizeof(indices[0]));
+  }
+
+  // Add a mesh with one stream for each array. Returns its number.
+  template <class MeshTraits>
+  int addMesh(const soa_mesh<MeshTraits> &mesh, const std::vector<lod> &lods = {}) {
+    auto &indices = mesh.indices();
+    mesh_cache_mesh m = begin_mesh(mesh.posView(), mesh.numVertices(), lods);
+
+    // Each array's attribute, in a format of its own.
+    vertex_format format = mesh.vertexFormat();
+    for (auto &a : format.attributes) {
+      vertex_format stream;
+      stream.bindings.push_back(vertex_binding{0, format.bindings[a.binding].stride});
+      stream.attributes.push_back(a);
+      stream.attributes[0].binding = 0;
+      const void *data = nullptr;
+      if (!strcmp(a.name, "pos")) data = mesh.posView().data();
+      if (!strcmp(a.name, "normal")) data = mesh.normalView().data();
+      if (!strcmp(a.name, "uv")) data = mesh.uvView(0).data();
+      if (!strcmp(a.name, "color")) data = mesh.colorView().data();
+      add_stream(m, stream, data, mesh.numVertices() * stream.bindings[0].stride);
+    }
+    return end_mesh(m, indices.data(), indices.size(), sizeof(indices[0]));
+  }
+
+  // Add a node to the hierarchy. parent is a node and mesh a mesh number, or -1 for none.
+  int addNode(const glm::mat4 &transform, int parent, int mesh) {
+    mesh_cache_node n = {};
+    n.transform = transform;
+    n.parent = parent;
+    n.mesh = mesh;
+    nodes_.push_back(n);
+    return (int)nodes_.size() - 1;
+  }
+
+  // Add the meshes and nodes of a scene whose meshes are all MeshType, eg. from fbx_decoder.
+  // Returns false, adding nothing, if a mesh is not a MeshType.
+  template <class MeshType>
+  bool addScene(const gilgamesh::scene &scene) {
+    std::vector<const MeshType *> meshes;
+    for (auto m : scene.meshes()) {
+      meshes.push_back(dynamic_cast<const MeshType *>(m));
+      if (!meshes.back()) return false;
+    }
+
+    int first_mesh = (int)meshes_.size();
+    int first_node = (int)nodes_.size();
+    for (auto m : meshes) {
+      addMesh(*m);
+    }
+    for (size_t i = 0; i != scene.transforms().size(); ++i) {
+      int parent = scene.parent_transforms()[i];
+      int mesh = scene.mesh_indices()[i];
+      addNode(scene.transforms()[i], parent < 0 ? -1 : first_node + parent, mesh < 0 ? -1 : first_mesh + mesh);
+    }
+    return true;
+  }
+
+  // Build the file in memory.
+  std::vector<uint8_t> encode() const {
+    section_data tables[] = {
+      table(mesh_cache_meshes, meshes_),
+      table(mesh_cache_streams, streams_),
+      table(mesh_cache_attributes, attributes_),
+      table(mesh_cache_lods, lods_),
+      table(mesh_cache_nodes, nodes_),
+    };
+    std::vector<const section_data *> sections;
+    for (auto &s : sections_) sections.push_back(&s);
+    for (auto &s : tables) sections.push_back(&s);
+
+    std::vector<uint8_t> bytes(sizeof(mesh_cache_header));
+    std::vector<mesh_cache_section> entries;
+    andyzip::deflate_encoder encoder(compression_level_, num_threads_);
+    for (auto p : sections) {
+      const section_data &s = *p;
+      mesh_cache_section e = {};
+      e.kind = s.kind;
+      e.compression = mesh_cache_stored;
+      e.uncompressed_size = s.bytes.size();
+
+      std::vector<uint8_t> deflated;
+      if (compression_level_ > 0 && !s.bytes.empty()) {
+        deflated = encoder.encode(s.bytes.data(), s.bytes.data() + s.bytes.size());
+        if (deflated.size() <= s.bytes.size() - s.bytes.size() / 8) {
+          e.compression = mesh_cache_deflate;
+        }
+      }
+      const std::vector<uint8_t> &data = e.compression == mesh_cache_deflate ? deflated : s.bytes;
+
+      bytes.resize((bytes.size() + mesh_cache_alignment - 1) & ~(size_t)(mesh_cache_alignment - 1));
+      e.offset = bytes.size();
+      e.size = data.size();
+      bytes.insert(bytes.end(), data.begin(), data.end());
+      entries.push_back(e);
+    }
+
+    bytes.resize((bytes.size() + mesh_cache_alignment - 1) & ~(size_t)(mesh_cache_alignment - 1));
+    mesh_cache_header header = {};
+    memcpy(header.magic, "GMSHCACH", 8);
+    header.version = mesh_cache_version;
+    header.alignment = mesh_cache_alignment;
+    header.section_table = bytes.size();
+    header.num_sections = (uint32_t)entries.size();
+    memcpy(bytes.data(), &header, sizeof(header));
+    const uint8_t *table_bytes = (const uint8_t *)entries.data();
+    bytes.insert(bytes.end(), table_bytes, table_bytes + entries.size() * sizeof(mesh_cache_section));
+    return bytes;
+  }
+
+  // Write the file. Returns false if it can't be written.
+  bool save(const std::string &filename) const {
+    std::vector<uint8_t> bytes = encode();
+    std::ofstream fout(filename, std::ios_base::binary);
+    fout.write((const char *)bytes.data(), bytes.size());
+    return (bool)fout;
+  }
+
+private:
+  struct section_data {
+    uint32_t kind;
+    std::vector<uint8_t> bytes;
+  };
+
+  template <class Type>
+  static section_data table(uint32_t kind, const std::vector<Type> &values) {
+    const uint8_t *p = (const uint8_t *)values.data();
+    return section_data{kind, std::vector<uint8_t>(p, p + values.size() * sizeof(Type))};
+  }
+
+  uint32_t add_section(uint32_t kind, const void *data, size_t size) {
+    const uint8_t *p = (const uint8_t *)data;
+    sections_.push_back(section_data{kind, std::vector<uint8_t>(p, p + size)});
+    return (uint32_t)sections_.size() - 1;
+  }
+
+  // Bounds and levels of detail of a new mesh.
+  mesh_cache_mesh begin_mesh(std::span<const glm::vec3> pos, size_t num_vertices, const std::vector<lod> &lods) {
+    mesh_cache_mesh m = {};
+    for (size_t v = 0; v != pos.size(); ++v) {
+      m.bounds_min = v ? glm::min(m.bounds_min, pos[v]) : pos[v];
+      m.bounds_max = v ? glm::max(m.bounds_max, pos[v]) : pos[v];
+    }
+    m.center = (m.bounds_min + m.bounds_max) * 0.5f;
+    for (auto &p : pos) {
+      m.radius = std::max(m.radius, glm::length(p - m.center));
+    }
+    m.num_vertices = (uint32_t)num_vertices;
+    m.first_stream = (uint32_t)streams_.size();
+    m.first_lod = (uint32_t)lods_.size();
+    m.num_lods = (uint32_t)lods.size();
+    for (auto &l : lods) {
+      lods_.push_back(mesh_cache_lod{(uint32_t)l.first_index, (uint32_t)l.index_count, l.error, 0});
+    }
+    return m;
+  }
+
+  void add_stream(mesh_cache_mesh &m, const vertex_format &format, const void *data, size_t size) {
+    mesh_cache_stream s = {};
+    s.section = add_section(mesh_cache_vertices, data, size);
+    s.stride = format.bindings[0].stride;
+    s.first_attribute = (uint32_t)attributes_.size();
+    s.num_attributes = (uint32_t)format.attributes.size();
+    for (auto &a : format.attributes) {
+      mesh_cache_attribute ca = {};
+      strncpy(ca.name, a.name, sizeof(ca.name) - 1);
+      ca.number_of_channels = a.number_of_channels;
+      ca.type = a.type;
+      ca.offset = a.offset;
+      attributes_.push_back(ca);
+    }
+    streams_.push_back(s);
+    m.num_streams++;
+  }
+
+  int end_mesh(mesh_cache_mesh &m, const void *indices, size_t num_indices, size_t index_size) {
+    m.index_section = add_section(mesh_cache_indices, indices, num_indices * index_size);
+    m.index_size = (uint32_t)index_size;
+    m.num_indices = (uint32_t)num_indices;
+    meshes_.push_back(m);
+    return (int)meshes_.size() - 1;
+  }
+
+  int compression_level_;
+  unsigned num_threads_;
+  std::vector<section_data> sections_;
+  std::vector<mesh_cache_mesh> meshes_;
+  std::vector<mesh_cache_stream> streams_;
+  std::vector<mesh_cache_attribute> attributes_;
+  std::vector<mesh_cache_lod> lods_;
+  std::vector<mesh_cache_node> nodes_;
+};
+
+} // gilgamesh
+
+#endif
@@ -16,7 +16,11 @@
 #include <ostream>
 #include <algorithm>
 #include <memory>
+#include <span>
+#include <thread>
+#include <type_traits>
 #include <stdio.h>
+#include <andyzip/parallel_for.hpp>
 
 namespace gilgamesh {
 
@@ -26,6 +30,116 @@ struct attribute {
   char type; // see https://docs.python.org/2/library/struct.html
 };
 
+// Size in bytes of one channel of an attribute type.
+inline uint32_t attribute_type_size(char type) {
+  switch (type) {
+    case 'b': case 'B': return 1;
+    case 'h': case 'H': case 'e': return 2;
+    case 'i': case 'I': case 'f': return 4;
+    case 'd': return 8;
+  }
+  return 0;
+}
+
+// Where an attribute lives in GPU vertex memory.
+// These map to vku::PipelineMaker::vertexAttribute with vku::vertexAttributeFormat().
+struct vertex_attribute {
+  const char *name;
+  int number_of_channels;
+  char type;
+  uint32_t location;
+  uint32_t binding;
+  uint32_t offset;
+};
+
+// A vertex buffer binding and the size of each of its vertices.
+struct vertex_binding {
+  uint32_t binding;
+  uint32_t stride;
+};
+
+// Vertex input description of a mesh. Use vku::PipelineMaker::vertexFormat() to add it to a pipeline.
+struct vertex_format {
+  std::vector<vertex_binding> bindings;
+  std::vector<vertex_attribute> attributes;
+};
+
+// All attributes of a format interleaved in one binding, as in basic_mesh.
+inline vertex_format interleaved_format(const attribute *format, uint32_t binding = 0) {
+  vertex_format result;
+  uint32_t offset = 0;
+  for (uint32_t location = 0; format[location].name; ++location) {
+    const attribute &a = format[location];
+    result.attributes.push_back(vertex_attribute{a.name, a.number_of_channels, a.type, location, binding, offset});
+    offset += a.number_of_channels * attribute_type_size(a.type);
+  }
+  result.bindings.push_back(vertex_binding{binding, offset});
+  return result;
+}
+
+// Each attribute of a format in its own binding, first_binding onwards, as in soa_mesh.
+inline vertex_format separate_format(const attribute *format, uint32_t first_binding = 0) {
+  vertex_format result;
+  for (uint32_t location = 0; format[location].name; ++location) {
+    const attribute &a = format[location];
+    uint32_t binding = first_binding + location;
+    result.attributes.push_back(vertex_attribute{a.name, a.number_of_channels, a.type, location, binding, 0});
+    result.bindings.push_back(vertex_binding{binding, a.number_of_channels * attribute_type_size(a.type)});
+  }
+  return result;
+}
+
+// Open addressing hash table that numbers distinct keys in order of first insertion.
+// Keys are hashed and compared by their bytes, so they must not contain padding.
+template <class Key>
+class weld_table {
+public:
+  // The table is sized for at most max_keys keys.
+  weld_table(size_t max_keys) {
+    size_t capacity = 16;
+    while (capacity < max_keys * 2) capacity *= 2;
+    slots_.assign(capacity, empty);
+    keys_.reserve(max_keys);
+  }
+
+  // Return the id of key, giving it the next id if it is new.
+  uint32_t insert(const Key &key) {
+    size_t mask = slots_.size() - 1;
+    for (size_t i = hash(key) & mask; ; i = (i + 1) & mask) {
+      uint32_t id = slots_[i];
+      if (id == empty) {
+        id = (uint32_t)keys_.size();
+        slots_[i] = id;
+        keys_.push_back(key);
+        return id;
+      } else if (!memcmp(&keys_[id], &key, sizeof(Key))) {
+        return id;
+      }
+    }
+  }
+
+  size_t size() const { return keys_.size(); }
+  const std::vector<Key> &keys() const { return keys_; }
+
+private:
+  enum : uint32_t { empty = ~0u };
+
+  static size_t hash(const Key &key) {
+    const unsigned char *p = (const unsigned char *)&key;
+    uint64_t h = 0;
+    for (size_t i = 0; i < sizeof(Key); i += 4) {
+      uint32_t word = 0;
+      memcpy(&word, p + i, std::min(sizeof(Key) - i, (size_t)4));
+      h = (h ^ word) * 0x9e3779b97f4a7c15ull;
+      h ^= h >> 32;
+    }
+    return (size_t)h;
+  }
+
+  std::vector<uint32_t> slots_;
+  std::vector<Key> keys_;
+};
+
 // base class for all meshes.
 class mesh {
 public:
@@ -42,6 +156,14 @@ public:
   virtual std::vector<glm::vec4> color() const = 0;
   virtual std::vector<uint32_t> indices32() const = 0;
 
+  // Views of attributes that are stored contiguously, without copying.
+  // These are empty if the mesh does not store an attribute that way; use the bulk reads instead.
+  virtual std::span<const glm::vec3> posView() const { return {}; }
+  virtual std::span<const glm::vec3> normalView() const { return {}; }
+  virtual std::span<const glm::vec2> uvView(int index) const { return {}; }
+  virtual std::span<const glm::vec4> colorView() const { return {}; }
+  virtual std::span<const uint32_t> indexView() const { return {}; }
+
   virtual size_t addVertexTransformed(const glm::mat4 &transform, const glm::vec3 &pos, const glm::vec3 &normal, const glm::vec2 &uv, const glm::vec4 &color) = 0;
   virtual size_t addIndex(size_t index) = 0;
 };
@@ -76,6 +198,7 @@ public:
   std::vector<glm::vec2> uv(int index) const override { return fetch<glm::vec2>(2); }
   std::vector<glm::vec4> color() const override { return fetch<glm::vec4>(3); }
   std::vector<uint32_t> indices32() const override { return indices_; }
+  std::span<const uint32_t> indexView() const override { return indices_; }
 
 private:
   template <class Type>
@@ -123,6 +246,7 @@ public:
   // bulk read operations
   std::vector<glm::vec3> pos() const override {
     std::vector<glm::vec3> result;
+    result.reserve(vertices_.size());
     for (auto &v : vertices_) {
       result.push_back(v.pos());
     }
@@ -131,6 +255,7 @@ public:
 
   std::vector<glm::vec3> normal() const override {
     std::vector<glm::vec3> result;
+    result.reserve(vertices_.size());
     for (auto &v : vertices_) {
       result.push_back(v.normal());
     }
@@ -139,6 +264,7 @@ public:
 
   std::vector<glm::vec4> color() const override {
     std::vector<glm::vec4> result;
+    result.reserve(vertices_.size());
     for (auto &v : vertices_) {
       result.push_back(v.color());
     }
@@ -148,6 +274,7 @@ public:
   std::vector<glm::vec2> uv(int index) const override {
     std::vector<glm::vec2> result;
     if (index == 0) {
+      result.reserve(vertices_.size());
       for (auto &v : vertices_) {
         result.push_back(v.uv());
       }
@@ -157,12 +284,22 @@ public:
 
   std::vector<uint32_t> indices32() const override {
     std::vector<glm::uint32_t> result;
+    result.reserve(indices_.size());
     for (auto i : indices_) {
       result.push_back((uint32_t)i);
     }
     return std::move(result);
   }
 
+  // Vertices are interleaved, but 32 bit indices can be viewed directly.
+  std::span<const uint32_t> indexView() const override {
+    if constexpr (std::is_same_v<index_t, uint32_t>) {
+      return indices_;
+    } else {
+      return {};
+    }
+  }
+
   std::vector<vertex_t> &vertices() { return vertices_; }
   const std::vector<vertex_t> &vertices() const { return vertices_; }
   size_t vertexSize() const { return sizeof(vertex_t); }
@@ -196,64 +333,99 @@ public:
     return MeshTraits::getFormat();
   }
 
-  void reindex(bool recalcNormals = false) {
-    if (recalcNormals) {
-      // zero all normals
-      for (size_t i = 0; i < vertices_.size(); ++i) {
-        vertices_[i].normal(glm::vec3(0, 0, 0));
-      }
+  // Vertex input description for vertices() uploaded to a single vertex buffer.
+  vertex_format vertexFormat(uint32_t binding = 0) const {
+    return interleaved_format(MeshTraits::getFormat(), binding);
+  }
 
-      // accumulate normals on shared vertices
-      for (size_t i = 0; i+2 < indices_.size(); i += 3) {
-        size_t i0 = indices_[i+0];
-        size_t i1 = indices_[i+1];
-        size_t i2 = indices_[i+2];
-        auto &v0 = vertices_[i0];
-        auto &v1 = vertices_[i1];
-        auto &v2 = vertices_[i2];
-        glm::vec3 p0 = v0.pos();
-        glm::vec3 p1 = v1.pos();
-        glm::vec3 p2 = v2.pos();
-        glm::vec3 normal = glm::normalize(glm::cross(p1-p0, p2-p0));
-        v0.normal(v0.normal() + normal);
-        v1.normal(v1.normal() + normal);
-        v2.normal(v2.normal() + normal);
-      }
-    }
+  // Weld identical vertices and drop unused ones. Vertices are kept in order of first use.
+  // If recalcNormals is true, normals are recalculated and smoothed over vertices with the same position.
+  // If epsilon > 0, positions are snapped to a grid of this size before comparing them.
+  void reindex(bool recalcNormals = false, float epsilon = 0, unsigned num_threads = 0) {
+    size_t num_vertices = vertices_.size();
+    size_t num_indices = indices_.size() - indices_.size() % 3;
+    auto key_pos = [epsilon](const glm::vec3 &pos) {
+      // Adding zero turns -0 into +0 so that the bytes compare equal.
+      return epsilon > 0 ? glm::round(pos / epsilon) * epsilon + glm::vec3(0) : pos;
+    };
 
-    std::vector<expandedVertex> expanded = expand();
     if (recalcNormals) {
-      std::sort(
-        expanded.begin(), expanded.end(),
-        [](const expandedVertex &a, const expandedVertex &b) {
-          glm::vec3 apos = a.vtx.pos();
-          glm::vec3 bpos = b.vtx.pos();
-          return memcmp(&apos, &bpos, sizeof(apos)) < 0;
-        }
-      );
-
-      size_t imax = expanded.size();
-      for (size_t i = 0, idx = 0; i != imax; ) {
-        auto &v0 = expanded[i];
-        glm::vec3 normal = v0.vtx.normal();
-        glm::vec3 pos = v0.vtx.pos();
-        size_t j = i + 1;
-        for (; j < imax && pos == expanded[j].vtx.pos(); ++j) {
-          normal += expanded[j].vtx.normal();
+      std::vector<glm::vec3> face(num_indices / 3);
+      par_chunks(face.size(), num_threads, [&](size_t begin, size_t end) {
+        for (size_t t = begin; t != end; ++t) {
+          glm::vec3 p0 = vertices_[indices_[t*3+0]].pos();
+          glm::vec3 p1 = vertices_[indices_[t*3+1]].pos();
+          glm::vec3 p2 = vertices_[indices_[t*3+2]].pos();
+          face[t] = glm::normalize(glm::cross(p1-p0, p2-p0));
         }
+      });
 
-        normal = glm::normalize(normal);
+      // List the corners of each vertex so that vertices can sum their normals in parallel.
+      std::vector<uint32_t> first(num_vertices + 1), corners(num_indices);
+      for (size_t c = 0; c != num_indices; ++c) {
+        first[indices_[c] + 1]++;
+      }
+      for (size_t v = 0; v != num_vertices; ++v) {
+        first[v + 1] += first[v];
+      }
+      {
+        std::vector<uint32_t> next(first.begin(), first.end() - 1);
+        for (size_t c = 0; c != num_indices; ++c) {
+          corners[next[indices_[c]]++] = (uint32_t)c;
+        }
+      }
 
-        while (i < j) {
-          expanded[i++].vtx.normal(normal);
+      std::vector<glm::vec3> normal(num_vertices);
+      par_chunks(num_vertices, num_threads, [&](size_t begin, size_t end) {
+        for (size_t v = begin; v != end; ++v) {
+          glm::vec3 sum(0, 0, 0);
+          for (uint32_t k = first[v]; k != first[v+1]; ++k) {
+            sum += face[corners[k] / 3];
+          }
+          normal[v] = sum;
+        }
+      });
+
+      // Sum over vertices with the same position, once for each use.
+      std::vector<uint32_t> group(num_vertices, ~0u);
+      weld_table<glm::vec3> positions(num_vertices);
+      std::vector<glm::vec3> smooth;
+      for (size_t v = 0; v != num_vertices; ++v) {
+        uint32_t uses = first[v+1] - first[v];
+        if (uses) {
+          group[v] = positions.insert(key_pos(vertices_[v].pos()));
+          if (group[v] == smooth.size()) smooth.emplace_back(0, 0, 0);
+          smooth[group[v]] += normal[v] * (float)uses;
         }
       }
+
+      par_chunks(num_vertices, num_threads, [&](size_t begin, size_t end) {
+        for (size_t v = begin; v != end; ++v) {
+          if (group[v] != ~0u) vertices_[v].normal(glm::normalize(smooth[group[v]]));
+        }
+      });
     }
 
-    compact(expanded);
+    // Weld vertices whose bytes are equal.
+    weld_table<vertex_t> table(num_vertices);
+    std::vector<uint32_t> remap(num_vertices, ~0u);
+    std::vector<vertex_t> welded;
+    for (auto &i : indices_) {
+      uint32_t &r = remap[i];
+      if (r == ~0u) {
+        vertex_t key = vertices_[i];
+        key.pos(key_pos(key.pos()));
+        r = table.insert(key);
+        if (r == welded.size()) welded.push_back(vertices_[i]);
+      }
+      i = (index_t)r;
+    }
+    vertices_ = std::move(welded);
   }
 
   basic_mesh(std::vector<glm::vec3> &pos, std::vector<glm::vec3> &normal, std::vector<glm::vec2> &uv, std::vector<glm::vec4> &color, std::vector<uint32_t> &indices) {
+    vertices_.reserve(pos.size());
+    indices_.reserve(indices.size());
     for (size_t i = 0; i != pos.size(); ++i) {
       glm::vec3 vnormal = normal.empty() ? glm::vec3(1, 0, 0) : normal[i];
       glm::vec2 vuv = uv.empty() ? glm::vec2(0, 0) : uv[i];
@@ -267,10 +439,146 @@ public:
 
   // Generate an implicit basic_mesh from a function (ie. marching cubes).
   // Vertices will be generated where the function changes sign.
+  //
+  // fn is either a point sampler, float fn(int i, int j, int k), or a row sampler,
+  // void fn(float *dest, int count, int j, int k), which sets dest[i] to the value at (i, j, k)
+  // for i in [0, count) so that the field can be evaluated with SIMD.
+  //
+  // The volume is split into slabs of z slices which are built in parallel on num_threads
+  // threads (0 = one per core), so fn and vertex_generator must be thread safe.
+  // The result is the same for any number of threads.
   template<class Function, class Generator>
-  basic_mesh(int xdim, int ydim, int zdim, Function fn, Generator vertex_generator) {
-    // Now build the marching cubes triangles.
+  basic_mesh(int xdim, int ydim, int zdim, Function fn, Generator vertex_generator, unsigned num_threads = 0) {
+    if (xdim <= 0 || ydim <= 0 || zdim <= 0) return;
+    if (num_threads == 0) num_threads = std::max(1u, std::thread::hardware_concurrency());
+
+    // A few slabs per thread balances out slabs with more surface in them.
+    int slab_depth = num_threads == 1 ? zdim : std::max(8, zdim / (int)(num_threads * 4));
+    size_t num_slabs = (zdim + slab_depth - 1) / slab_depth;
+    std::vector<mc_slab> slabs(num_slabs);
+    andyzip::parallel_for(num_slabs, [&](size_t s) {
+      int z0 = (int)s * slab_depth;
+      mc_build_slab(slabs[s], xdim, ydim, zdim, z0, std::min(z0 + slab_depth, zdim), fn, vertex_generator);
+    }, num_threads);
+
+    // Concatenate the slabs, giving the vertices of each slab's top edges their final numbers.
+    std::vector<size_t> vertex_base(num_slabs + 1), index_base(num_slabs + 1);
+    for (size_t s = 0; s != num_slabs; ++s) {
+      vertex_base[s + 1] = vertex_base[s] + slabs[s].vertices.size();
+      index_base[s + 1] = index_base[s] + slabs[s].indices.size();
+    }
+    vertices_.resize(vertex_base[num_slabs]);
+    indices_.resize(index_base[num_slabs]);
+    andyzip::parallel_for(num_slabs, [&](size_t s) {
+      mc_slab &slab = slabs[s];
+      std::copy(slab.vertices.begin(), slab.vertices.end(), vertices_.begin() + vertex_base[s]);
+      index_t *dest = indices_.data() + index_base[s];
+      for (uint32_t i : slab.indices) {
+        size_t base = i & mc_next_slab ? vertex_base[s + 1] : vertex_base[s];
+        *dest++ = (index_t)(base + (i & ~mc_next_slab));
+      }
+      slab = mc_slab();
+    }, num_threads);
+  }
+
+  // write the mesh as a CSV file
+  const basic_mesh &writeCSV(const std::string &filename) const {
+    std::ofstream file(filename, std::ios_base::binary);
+    return writeCSV(file);
+  }
+
+  // write the mesh as a CSV file
+  const basic_mesh &writeCSV(std::ostream &os) const {
+    auto format = getFormat();
+    char buf[256];
+    {
+      char *dp = buf, *ep = buf + sizeof(buf) - 1;
+      for (auto fp = format; fp->name; ++fp) {
+        for (auto p = fp->name; *p; ++p) { *dp++ = *p; }
+        int n = fp->number_of_channels;
+        while (n--) if (dp != ep && (fp[1].name || n)) { *dp++ = ','; }
+      }
+      if (dp != ep) *dp++ = '\n';
+      os.write(buf, dp - buf);
+    }
+
+    for (size_t i = 0; i != indices_.size(); ++i) {
+      const void *sp = (const char *)&vertices_[indices_[i]];
+      char *dp = buf, *ep = buf + sizeof(buf) - 1;
+      for (auto fp = format; fp->name; ++fp) {
+        int n = fp->number_of_channels;
+        switch (fp->type) {
+          case 'f': {
+            while (n--) {
+              float value = *((float*&)sp)++;
+              dp += ::snprintf(dp, ep-dp, "%f", value);
+              if (dp != ep && (fp[1].name || n)) { *dp++ = ','; }
+            }
+          } break;
+        }
+      }
+      if (dp != ep) *dp++ = '\n';
+      if (i % 3 == 2 && dp != ep) *dp++ = '\n';
+      os.write(buf, dp - buf);
+    }
+    return *this;
+  }
+
+  const basic_mesh &clear() {
+    vertices_.clear();
+    indices_.clear();
+    return *this;
+  }
 
+private:
+  // Call fn(begin, end) on ranges of [0, count) in parallel.
+  template <class Fn>
+  static void par_chunks(size_t count, unsigned num_threads, Fn fn) {
+    const size_t chunk = 0x4000;
+    andyzip::parallel_for((count + chunk - 1) / chunk, [&](size_t i) {
+      fn(i * chunk, std::min(count, (i + 1) * chunk));
+    }, num_threads);
+  }
+
+  // Vertices and triangles of slices [z0, z1) of a marching cubes volume.
+  struct mc_slab {
+    std::vector<vertex_t> vertices;
+    std::vector<uint32_t> indices;  // mc_next_slab is set for vertices of the next slab
+  };
+
+  enum : uint32_t { mc_empty = ~0u, mc_next_slab = 0x80000000u };
+
+  // Fill a slice of values from a point sampler or a row sampler.
+  // The sign of each row is 0 if all values are positive, 1 if all are negative and 2 if mixed.
+  template <class Function>
+  static void mc_sample_slice(float *dest, uint8_t *row_sign, int xdim, int ydim, int k, Function &fn) {
+    for (int j = 0; j != ydim; ++j) {
+      float *row = dest + j * xdim;
+      if constexpr (std::is_invocable<Function&, float*, int, int, int>::value) {
+        fn(row, xdim, j, k);
+      } else {
+        for (int i = 0; i != xdim; ++i) {
+          row[i] = fn(i, j, k);
+        }
+      }
+      int negative = 0;
+      for (int i = 0; i != xdim; ++i) {
+        negative += row[i] < 0;
+      }
+      row_sign[j] = negative == 0 ? 0 : negative == xdim ? 1 : 2;
+    }
+  }
+
+  // True if two rows may have a sign change between them.
+  static bool mc_mixed(uint8_t a, uint8_t b) {
+    return a != b || a == 2;
+  }
+
+  // Build the vertices of slices [z0, z1) and the cubes between slices z0 and min(z1, zdim-1).
+  // The x and y edges of slice z1 belong to the next slab, but we number them here exactly as
+  // the next slab does, so the triangles can be stitched without waiting for it.
+  template<class Function, class Generator>
+  static void mc_build_slab(mc_slab &slab, int xdim, int ydim, int zdim, int z0, int z1, Function &fn, Generator &vertex_generator) {
     // This reproduced the vertex order of Paul Bourke's (borrowed) table.
     // The indices in edge_indices have the following offsets.
     //
@@ -287,95 +595,92 @@ public:
     int dy = xdim * 3;
     int dz = xdim * ydim * 3;
     int vdz = xdim * ydim;
-    int vertex_index = (int)vertices_.size();
-        
+    int last = std::min(z1, zdim - 1);
+
     // Each cube owns three edges 0->1 0->3 0->4
     // We need two slices of cube edges to make all the cubes in a slice.
-    std::vector<int> edge_indices(dz*2);
+    std::vector<uint32_t> edge_indices(dz*2);
 
     // We need three slices in values[]
     std::vector<float> values(vdz * 3);
     float *valm1 = values.data() + vdz * 2;
     float *val0 = values.data() + vdz * 0;
     float *val1 = values.data() + vdz * 1;
-    //int offm1 = vdz * 2, off0 = vdz * 0, off1 = vdz * 1;
 
-    // fill first slices of edges and values
-    for (int i = 0; i != dz; ++i) {
-      edge_indices[dz+i] = -1;
-    }
+    // Most rows of a volume are empty space. Skip them using the sign of each row.
+    std::vector<uint8_t> signs(ydim * 3);
+    uint8_t *sm1 = signs.data() + ydim * 2;
+    uint8_t *s0 = signs.data() + ydim * 0;
+    uint8_t *s1 = signs.data() + ydim * 1;
 
-    for (int j = 0; j != ydim; ++j) {
-      for (int i = 0; i != xdim; ++i) {
-        int idx = j * xdim + i;
-        val0[idx] = fn(i, j, 0);
-      }
-    }
+    mc_sample_slice(val0, s0, xdim, ydim, z0, fn);
 
     // Build the vertices first. One for each edge that changes sign.
-    for (int k = 0; k != zdim; ++k) {
+    uint32_t vertex_index = 0, next_index = mc_next_slab;
+    auto crossing = [](float v0, float v1, float &lambda) {
+      if ((v0 < 0) == (v1 < 0)) return false;
+      lambda = v0 / (v0 - v1);
+      return lambda >= 0 && lambda <= 1;
+    };
+
+    for (int k = z0; k <= last; ++k) {
       int odd = k & 1, even = 1 - odd;
-      for (int i = 0; i != dz; ++i) {
-        edge_indices[dz*odd+i] = -1;
-      }
+      bool owned = k != z1;
+      uint32_t *edges = edge_indices.data() + odd*dz;
+      std::fill(edges, edges + dz, mc_empty);
 
       if (k != zdim-1) {
-        for (int j = 0; j != ydim; ++j) {
-          for (int i = 0; i != xdim; ++i) {
-            int idx = j * xdim + i;
-            val1[idx] = fn(i, j, k+1);
-          }
-        }
+        mc_sample_slice(val1, s1, xdim, ydim, k+1, fn);
       }
 
       for (int j = 0; j != ydim; ++j) {
+        bool x_edges = s0[j] == 2;
+        bool y_edges = j != ydim-1 && mc_mixed(s0[j], s0[j+1]);
+        bool z_edges = k != zdim-1 && mc_mixed(s0[j], s1[j]);
+        if (!x_edges && !y_edges && !z_edges) continue;
+
         for (int i = 0; i != xdim; ++i) {
           int idx = j * xdim + i;
           float v0 = val0[idx];
           float fi = (float)i;
           float fj = (float)j;
           float fk = (float)k;
+          float lambda;
 
           // x edges
-          if (i != xdim-1) {
-            float v1 = val0[idx + 1];
-            if ((v0 < 0) != (v1 < 0)) {
-              float lambda = v0 / (v0 - v1);
-              if (lambda >= 0 && lambda <= 1) {
-                edge_indices[odd*dz + idx*3+0] = vertex_index++;
-                vertices_.push_back(vertex_generator(fi + lambda, fj, fk));
-              }
+          if (i != xdim-1 && crossing(v0, val0[idx + 1], lambda)) {
+            if (owned) {
+              edges[idx*3+0] = vertex_index++;
+              slab.vertices.push_back(vertex_generator(fi + lambda, fj, fk));
+            } else {
+              edges[idx*3+0] = next_index++;
             }
           }
 
           // y edges
-          if (j != ydim-1) {
-            float v1 = val0[idx + xdim];
-            if ((v0 < 0) != (v1 < 0)) {
-              float lambda = v0 / (v0 - v1);
-              if (lambda >= 0 && lambda <= 1) {
-                edge_indices[odd*dz + idx*3+1] = vertex_index++;
-                vertices_.push_back(vertex_generator(fi, fj + lambda, fk));
-              }
+          if (j != ydim-1 && crossing(v0, val0[idx + xdim], lambda)) {
+            if (owned) {
+              edges[idx*3+1] = vertex_index++;
+              slab.vertices.push_back(vertex_generator(fi, fj + lambda, fk));
+            } else {
+              edges[idx*3+1] = next_index++;
             }
           }
 
           // z edges
-          if (k != zdim-1) {
-            float v1 = val1[idx];
-            if ((v0 < 0) != (v1 < 0)) {
-              float lambda = v0 / (v0 - v1);
-              if (lambda >= 0 && lambda <= 1) {
-                edge_indices[odd*dz + idx*3+2] = vertex_index++;
-                vertices_.push_back(vertex_generator(fi, fj, fk + lambda));
-              }
+          if (k != zdim-1 && crossing(v0, val1[idx], lambda)) {
+            if (owned) {
+              edges[idx*3+2] = vertex_index++;
+              slab.vertices.push_back(vertex_generator(fi, fj, fk + lambda));
+            } else {
+              next_index++;
             }
           }
         }
       }
 
       // Build the indices. Use the mc_triangles table to choose triangles depending on sign.
-      if (k != 0) {
+      if (k != z0) {
         int edge_offsets[16] = {
           0 * dx + 0 * dy + even * dz + 0,  // 0,1, (this cube, x component)
           1 * dx + 0 * dy + even * dz + 1,  // 1,2,
@@ -393,31 +698,24 @@ public:
         };
 
         for (int j = 0; j != ydim-1; ++j) {
+          if (!mc_mixed(s0[j], s0[j+1]) && !mc_mixed(s0[j], sm1[j]) && !mc_mixed(s0[j], sm1[j+1])) continue;
+
           for (int i = 0; i != xdim-1; ++i) {
             // Mask of vertices outside the isosurface (values are negative)
             // Example:
             //   00000001 means only vertex 0 is outside the surface.
             //   10000000 means only vertex 7 is outside the surface.
             //   11111111 all vertices are outside the surface.
-            // todo: the mask can be built incrementally.
             int idx = j * xdim + i;
-            float v000 = valm1[idx];
-            float v100 = valm1[idx + 1];
-            float v010 = valm1[idx + xdim];
-            float v110 = valm1[idx + xdim + 1];
-            float v001 = val0[idx];
-            float v101 = val0[idx + 1];
-            float v011 = val0[idx + xdim];
-            float v111 = val0[idx + xdim + 1];
-
-            int mask = (v011 < 0);
-            mask = mask * 2 + (v111 < 0);
-            mask = mask * 2 + (v101 < 0);
-            mask = mask * 2 + (v001 < 0);
-            mask = mask * 2 + (v010 < 0);
-            mask = mask * 2 + (v110 < 0);
-            mask = mask * 2 + (v100 < 0);
-            mask = mask * 2 + (v000 < 0);
+            int mask = (val0[idx + xdim] < 0);
+            mask = mask * 2 + (val0[idx + xdim + 1] < 0);
+            mask = mask * 2 + (val0[idx + 1] < 0);
+            mask = mask * 2 + (val0[idx] < 0);
+            mask = mask * 2 + (valm1[idx + xdim] < 0);
+            mask = mask * 2 + (valm1[idx + xdim + 1] < 0);
+            mask = mask * 2 + (valm1[idx + 1] < 0);
+            mask = mask * 2 + (valm1[idx] < 0);
+            if (mask == 0 || mask == 0xff) continue;
 
             uint64_t triangles = mc_triangles()[mask];
             while ((triangles >> 60) != 0xc) {
@@ -428,13 +726,13 @@ public:
               triangles <<= 4;
               int t2 = triangles >> 60;
               triangles <<= 4;
-              int i0 = edge_indices [idx*3 + edge_offsets [t0]];
-              int i1 = edge_indices [idx*3 + edge_offsets [t1]];
-              int i2 = edge_indices [idx*3 + edge_offsets [t2]];
-              if (i0 >= 0 && i1 >= 0 && i2 >= 0) {
-                indices_.push_back((index_t)i0);
-                indices_.push_back((index_t)i1);
-                indices_.push_back((index_t)i2);
+              uint32_t i0 = edge_indices [idx*3 + edge_offsets [t0]];
+              uint32_t i1 = edge_indices [idx*3 + edge_offsets [t1]];
+              uint32_t i2 = edge_indices [idx*3 + edge_offsets [t2]];
+              if (i0 != mc_empty && i1 != mc_empty && i2 != mc_empty) {
+                slab.indices.push_back(i0);
+                slab.indices.push_back(i1);
+                slab.indices.push_back(i2);
               }
             }
           }
@@ -446,96 +744,15 @@ public:
       val0 = val1;
       val1 = valm1;
       valm1 = t;
+      uint8_t *ts = s0;
+      s0 = s1;
+      s1 = sm1;
+      sm1 = ts;
     }
   }
 
-  // write the mesh as a CSV file
-  const basic_mesh &writeCSV(const std::string &filename) const {
-    std::ofstream file(filename, std::ios_base::binary);
-    return writeCSV(file);
-  }
-
-  // write the mesh as a CSV file
-  const basic_mesh &writeCSV(std::ostream &os) const {
-    auto format = getFormat();
-    char buf[256];
-    {
-      char *dp = buf, *ep = buf + sizeof(buf) - 1;
-      for (auto fp = format; fp->name; ++fp) {
-        for (auto p = fp->name; *p; ++p) { *dp++ = *p; }
-        int n = fp->number_of_channels;
-        while (n--) if (dp != ep && (fp[1].name || n)) { *dp++ = ','; }
-      }
-      if (dp != ep) *dp++ = '\n';
-      os.write(buf, dp - buf);
-    }
-
-    for (size_t i = 0; i != indices_.size(); ++i) {
-      const void *sp = (const char *)&vertices_[indices_[i]];
-      char *dp = buf, *ep = buf + sizeof(buf) - 1;
-      for (auto fp = format; fp->name; ++fp) {
-        int n = fp->number_of_channels;
-        switch (fp->type) {
-          case 'f': {
-            while (n--) {
-              float value = *((float*&)sp)++;
-              dp += ::snprintf(dp, ep-dp, "%f", value);
-              if (dp != ep && (fp[1].name || n)) { *dp++ = ','; }
-            }
-          } break;
-        }
-      }
-      if (dp != ep) *dp++ = '\n';
-      if (i % 3 == 2 && dp != ep) *dp++ = '\n';
-      os.write(buf, dp - buf);
-    }
-    return *this;
-  }
-
-  const basic_mesh &clear() {
-    vertices_.clear();
-    indices_.clear();
-    return *this;
-  }
-
-private:
-  struct expandedVertex {
-    vertex_t vtx;
-    size_t order;
-  };
-
-  // convert the indexed form to the expanded form.
-  std::vector<expandedVertex> expand() const {
-    std::vector<expandedVertex> result;
-    result.reserve(indices_.size());
-    for (size_t i = 0; i != indices_.size(); ++i) {
-      result.push_back(expandedVertex{vertices_[indices_[i]], i});
-    }
-    return std::move(result);
-  }
-
-  // convert the expanded form to the indexed form.
-  void compact(std::vector<expandedVertex> &expanded) {
-    std::sort(
-      expanded.begin(), expanded.end(),
-      [](const expandedVertex &a, const expandedVertex &b) {
-        return memcmp(&a.vtx, &b.vtx, sizeof(a.vtx)) < 0;
-      }
-    );
-
-    vertices_.resize(0);
-    size_t imax = expanded.size();
-    for (size_t i = 0; i != imax; ) {
-      auto &v0 = expanded[i];
-      size_t idx = vertices_.size();
-      vertices_.emplace_back(expanded[i].vtx);
-      indices_[expanded[i].order] = (index_t)idx;
-      for (++i; i < imax && !memcmp(&v0.vtx, &expanded[i].vtx, sizeof(v0.vtx)); ++i) {
-        indices_[expanded[i].order] = (index_t)idx;
-      }
-    }
-  }
-
+public:
+  // Marching cubes triangle table, also used by vku::MarchingCubes.
   static const uint64_t *mc_triangles() {
     // marching cubes edge lists
     // see http://paulbourke.net/geometry/polygonise/marchingsource.cpp for original.
@@ -577,6 +794,7 @@ private:
     return values;
   }
 
+private:
   std::vector<vertex_t> vertices_;
   std::vector<index_t> indices_;
 };
@@ -0,0 +1,283 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2016
+//
+// gilgamesh: meshlet builder
+//
+// Splits a mesh into small clusters of triangles (meshlets) for mesh shaders and
+// cluster culling. Each meshlet has its own small vertex list and triangles that
+// index it with 8 bit numbers, and a bounding sphere and normal cone for culling.
+//
+// The result is three arrays ready to upload to storage buffers:
+//
+//   gilgamesh::meshlet_mesh mm = gilgamesh::build_meshlets(mesh);
+//   vku::StorageBuffer meshlets(device, memprops, mm.meshlets.size() * sizeof(gilgamesh::meshlet));
+//   meshlets.upload(device, memprops, commandPool, queue, mm.meshlets);
+//
+
+#ifndef MESHUTILS_MESHLETS_INCLUDED
+#define MESHUTILS_MESHLETS_INCLUDED
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include <gilgamesh/mesh.hpp>
+#include <andyzip/parallel_for.hpp>
+
+namespace gilgamesh {
+
+// One meshlet. The layout matches a std430 struct of the same members.
+//
+// The meshlet can be skipped if its bounding sphere is outside the frustum, or if
+// all its triangles face away from the camera:
+//
+//   vec3 d = center - camera_pos;
+//   if (dot(d, cone_axis) >= cone_cutoff * (length(d) + radius) + radius) cull();
+//
+struct meshlet {
+  glm::vec3 center;
+  float radius;
+  glm::vec3 cone_axis;        // average triangle normal
+  float cone_cutoff;          // sine of the cone's half angle, or 1 for no cone
+  uint32_t vertex_offset;     // first entry in meshlet_mesh::vertices
+  uint32_t triangle_offset;   // first entry in meshlet_mesh::triangles
+  uint32_t vertex_count;
+  uint32_t triangle_count;
+};
+
+// Meshlets of a mesh in GPU layout.
+struct meshlet_mesh {
+  std::vector<meshlet> meshlets;
+  std::vector<uint32_t> vertices;       // mesh vertex of each meshlet vertex
+  std::vector<uint32_t> triangles;      // meshlet vertex numbers, 8 bits each in bits 0-23
+  std::vector<uint32_t> submesh_first;  // first meshlet of each sub-mesh, and the total
+};
+
+// A range of the index array built into meshlets on its own.
+struct index_range {
+  size_t first;
+  size_t count;
+};
+
+namespace detail {
+  // Ritter's bounding sphere: start with the widest of the axis extremes, then grow.
+  static inline glm::vec4 bounding_sphere(const glm::vec3 *pos, const uint32_t *verts, size_t count) {
+    if (!count) return glm::vec4(0);
+    size_t lo[3] = {0, 0, 0}, hi[3] = {0, 0, 0};
+    for (size_t i = 0; i != count; ++i) {
+      glm::vec3 p = pos[verts[i]];
+      for (int a = 0; a != 3; ++a) {
+        if (p[a] < pos[verts[lo[a]]][a]) lo[a] = i;
+        if (p[a] > pos[verts[hi[a]]][a]) hi[a] = i;
+      }
+    }
+    int axis = 0;
+    float best = -1;
+    for (int a = 0; a != 3; ++a) {
+      float d = glm::length(pos[verts[hi[a]]] - pos[verts[lo[a]]]);
+      if (d > best) { best = d; axis = a; }
+    }
+    glm::vec3 center = (pos[verts[lo[axis]]] + pos[verts[hi[axis]]]) * 0.5f;
+    float radius = best * 0.5f;
+    for (size_t i = 0; i != count; ++i) {
+      glm::vec3 p = pos[verts[i]];
+      float d = glm::length(p - center);
+      if (d > radius) {
+        float r = (radius + d) * 0.5f;
+        center += (p - center) * ((r - radius) / d);
+        radius = r;
+      }
+    }
+    return glm::vec4(center, radius);
+  }
+
+  // Build meshlets for one range. Vertex numbers in the result are mesh vertices.
+  template <class Index>
+  static void build_meshlets_range(meshlet_mesh &result, const Index *indices, size_t index_count, const glm::vec3 *pos, unsigned max_vertices, unsigned max_triangles) {
+    size_t num_tris = index_count / 3;
+
+    // Number the vertices of this range from zero.
+    weld_table<uint32_t> table(index_count);
+    std::vector<uint32_t> tri(num_tris * 3);
+    for (size_t c = 0; c != num_tris * 3; ++c) {
+      tri[c] = table.insert((uint32_t)indices[c]);
+    }
+    const std::vector<uint32_t> &global = table.keys();
+    size_t num_vertices = global.size();
+
+    std::vector<uint32_t> first(num_vertices + 1), adjacent(num_tris * 3), live(num_vertices);
+    for (size_t c = 0; c != num_tris * 3; ++c) {
+      first[tri[c] + 1]++;
+    }
+    for (size_t v = 0; v != num_vertices; ++v) {
+      live[v] = first[v + 1];
+      first[v + 1] += first[v];
+    }
+    {
+      std::vector<uint32_t> next(first.begin(), first.end() - 1);
+      for (size_t c = 0; c != num_tris * 3; ++c) {
+        adjacent[next[tri[c]]++] = (uint32_t)(c / 3);
+      }
+    }
+
+    std::vector<uint8_t> emitted(num_tris);
+    std::vector<uint32_t> slot(num_vertices, ~0u);
+    std::vector<uint32_t> verts, packed;
+    std::vector<glm::vec3> normals;
+    size_t cursor = 0;
+
+    auto extra = [&](uint32_t t) {
+      return (slot[tri[t*3+0]] == ~0u) + (slot[tri[t*3+1]] == ~0u) + (slot[tri[t*3+2]] == ~0u);
+    };
+
+    auto add = [&](uint32_t t) {
+      emitted[t] = 1;
+      uint32_t local[3];
+      for (int j = 0; j != 3; ++j) {
+        uint32_t v = tri[t*3+j];
+        if (slot[v] == ~0u) {
+          slot[v] = (uint32_t)verts.size();
+          verts.push_back(v);
+        }
+        live[v]--;
+        local[j] = slot[v];
+      }
+      packed.push_back(local[0] | local[1] << 8 | local[2] << 16);
+      glm::vec3 p0 = pos[global[tri[t*3+0]]], p1 = pos[global[tri[t*3+1]]], p2 = pos[global[tri[t*3+2]]];
+      normals.push_back(glm::cross(p1 - p0, p2 - p0));
+    };
+
+    for (;;) {
+      while (cursor != num_tris && emitted[cursor]) ++cursor;
+      if (cursor == num_tris) break;
+
+      verts.clear();
+      packed.clear();
+      normals.clear();
+      add((uint32_t)cursor);
+
+      // Grow by the neighbouring triangle that adds the fewest vertices.
+      while (packed.size() < max_triangles) {
+        uint32_t best = ~0u;
+        int best_extra = 3;
+        for (size_t i = 0; i != verts.size() && best_extra; ++i) {
+          uint32_t v = verts[i];
+          if (!live[v]) continue;
+          for (uint32_t k = first[v]; k != first[v + 1]; ++k) {
+            uint32_t t = adjacent[k];
+            if (emitted[t]) continue;
+            int e = extra(t);
+            if (e < best_extra && verts.size() + e <= max_vertices) {
+              best = t;
+              best_extra = e;
+              if (!e) break;
+            }
+          }
+        }
+        if (best == ~0u) break;
+        add(best);
+      }
+
+      meshlet m;
+      m.vertex_offset = (uint32_t)result.vertices.size();
+      m.triangle_offset = (uint32_t)result.triangles.size();
+      m.vertex_count = (uint32_t)verts.size();
+      m.triangle_count = (uint32_t)packed.size();
+      for (uint32_t &v : verts) {
+        slot[v] = ~0u;
+        v = global[v];
+      }
+      result.vertices.insert(result.vertices.end(), verts.begin(), verts.end());
+      result.triangles.insert(result.triangles.end(), packed.begin(), packed.end());
+
+      glm::vec4 sphere = bounding_sphere(pos, verts.data(), verts.size());
+      m.center = glm::vec3(sphere);
+      m.radius = sphere.w;
+
+      // The normal cone contains the normals of all the triangles.
+      glm::vec3 axis(0, 0, 0);
+      for (glm::vec3 &n : normals) {
+        float len = glm::length(n);
+        n = len > 0 ? n / len : glm::vec3(0);
+        axis += n;
+      }
+      float len = glm::length(axis);
+      float min_dot = 1;
+      if (len > 0) {
+        axis /= len;
+        for (const glm::vec3 &n : normals) {
+          if (n != glm::vec3(0)) min_dot = std::min(min_dot, glm::dot(n, axis));
+        }
+      }
+      if (len > 0 && min_dot > 0) {
+        m.cone_axis = axis;
+        m.cone_cutoff = std::sqrt(1 - min_dot * min_dot);
+      } else {
+        m.cone_axis = glm::vec3(0);
+        m.cone_cutoff = 1;
+      }
+      result.meshlets.push_back(m);
+    }
+  }
+}
+
+// Build meshlets of at most max_vertices vertices and max_triangles triangles (up to 256 each).
+// Each range of indices is built separately, in parallel on num_threads threads (0 = one per core).
+// Meshlets follow the index order, so run optimize_vertex_cache first for compact meshlets.
+template <class Index>
+meshlet_mesh build_meshlets(const Index *indices, const std::vector<index_range> &ranges, const glm::vec3 *pos, unsigned max_vertices = 64, unsigned max_triangles = 124, unsigned num_threads = 0) {
+  max_vertices = std::min(std::max(max_vertices, 3u), 256u);
+  max_triangles = std::min(std::max(max_triangles, 1u), 256u);
+
+  std::vector<meshlet_mesh> parts(ranges.size());
+  andyzip::parallel_for(ranges.size(), [&](size_t i) {
+    detail::build_meshlets_range(parts[i], indices + ranges[i].first, ranges[i].count, pos, max_vertices, max_triangles);
+  }, num_threads);
+
+  meshlet_mesh result;
+  size_t num_meshlets = 0, num_vertices = 0, num_triangles = 0;
+  for (auto &p : parts) {
+    num_meshlets += p.meshlets.size();
+    num_vertices += p.vertices.size();
+    num_triangles += p.triangles.size();
+  }
+  result.meshlets.reserve(num_meshlets);
+  result.vertices.reserve(num_vertices);
+  result.triangles.reserve(num_triangles);
+
+  for (auto &p : parts) {
+    uint32_t vertex_base = (uint32_t)result.vertices.size();
+    uint32_t triangle_base = (uint32_t)result.triangles.size();
+    result.submesh_first.push_back((uint32_t)result.meshlets.size());
+    for (meshlet m : p.meshlets) {
+      m.vertex_offset += vertex_base;
+      m.triangle_offset += triangle_base;
+      result.meshlets.push_back(m);
+    }
+    result.vertices.insert(result.vertices.end(), p.vertices.begin(), p.vertices.end());
+    result.triangles.insert(result.triangles.end(), p.triangles.begin(), p.triangles.end());
+  }
+  result.submesh_first.push_back((uint32_t)result.meshlets.size());
+  return result;
+}
+
+// Build meshlets for a whole mesh. Large meshes are split into sub-meshes of
+// submesh_triangles triangles so that they build in parallel.
+template <class MeshTraits>
+meshlet_mesh build_meshlets(const basic_mesh<MeshTraits> &mesh, unsigned max_vertices = 64, unsigned max_triangles = 124, size_t submesh_triangles = 0x10000, unsigned num_threads = 0) {
+  const auto &indices = mesh.indices();
+  std::vector<glm::vec3> pos = mesh.pos();
+  std::vector<index_range> ranges;
+  size_t step = std::max(submesh_triangles, (size_t)1) * 3;
+  size_t num_indices = indices.size() - indices.size() % 3;
+  for (size_t first = 0; first < num_indices; first += step) {
+    ranges.push_back(index_range{first, std::min(step, num_indices - first)});
+  }
+  return build_meshlets(indices.data(), ranges, pos.data(), max_vertices, max_triangles, num_threads);
+}
+
+} // gilgamesh
+
+#endif
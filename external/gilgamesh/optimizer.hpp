@@ -0,0 +1,296 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2016
+//
+// gilgamesh: index and vertex order optimisation for rendering
+//
+// optimize_vertex_cache reorders triangles so that the GPU's post-transform cache
+// is reused (Tipsify, Sander, Nehab and Barczak, "Fast Triangle Reordering for
+// Vertex Locality and Reduced Overdraw", 2007).
+// optimize_overdraw then sorts clusters of those triangles so that outward facing
+// ones are drawn first, without losing much of the cache locality.
+// optimize_vertex_fetch renumbers vertices in the order they are first used.
+//
+
+#ifndef MESHUTILS_OPTIMIZER_INCLUDED
+#define MESHUTILS_OPTIMIZER_INCLUDED
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <gilgamesh/mesh.hpp>
+
+namespace gilgamesh {
+
+// Results of running indices through a FIFO post-transform cache.
+struct vertex_cache_stats {
+  size_t triangles = 0;
+  size_t vertices = 0;     // distinct vertices used
+  size_t transformed = 0;  // vertex shader invocations
+  float acmr = 0;          // average cache miss ratio: transformed / triangles (0.5 is ideal, 3 is worst)
+  float atvr = 0;          // average transformed vertex ratio: transformed / vertices (1 is ideal)
+};
+
+// Simulate a FIFO cache of cache_size vertices.
+template <class Index>
+vertex_cache_stats analyze_vertex_cache(const Index *indices, size_t index_count, size_t vertex_count, unsigned cache_size = 16) {
+  vertex_cache_stats result;
+  // A vertex is in the cache if it was added in the last cache_size misses.
+  std::vector<uint32_t> time(vertex_count, 0);
+  uint32_t now = cache_size + 1;
+  for (size_t i = 0; i != index_count; ++i) {
+    Index v = indices[i];
+    if (time[v] == 0) result.vertices++;
+    if (now - time[v] > cache_size) {
+      time[v] = now++;
+      result.transformed++;
+    }
+  }
+  result.triangles = index_count / 3;
+  result.acmr = result.triangles ? (float)result.transformed / result.triangles : 0;
+  result.atvr = result.vertices ? (float)result.transformed / result.vertices : 0;
+  return result;
+}
+
+// Reorder triangles for a post-transform cache of cache_size vertices (Tipsify).
+// Triangles are emitted in fans around a vertex, choosing the next vertex of the fan
+// from those still in the cache. dest may be the same as indices.
+template <class Index>
+void optimize_vertex_cache(Index *dest, const Index *indices, size_t index_count, size_t vertex_count, unsigned cache_size = 16) {
+  std::vector<Index> copy;
+  if (dest == indices) {
+    copy.assign(indices, indices + index_count);
+    indices = copy.data();
+  }
+  size_t num_tris = index_count / 3;
+
+  // Triangles using each vertex.
+  std::vector<uint32_t> first(vertex_count + 1), adjacent(num_tris * 3);
+  for (size_t c = 0; c != num_tris * 3; ++c) {
+    first[indices[c] + 1]++;
+  }
+  for (size_t v = 0; v != vertex_count; ++v) {
+    first[v + 1] += first[v];
+  }
+  std::vector<uint32_t> live(vertex_count);
+  for (size_t v = 0; v != vertex_count; ++v) {
+    live[v] = first[v + 1] - first[v];
+  }
+  {
+    std::vector<uint32_t> next(first.begin(), first.end() - 1);
+    for (size_t c = 0; c != num_tris * 3; ++c) {
+      adjacent[next[indices[c]]++] = (uint32_t)(c / 3);
+    }
+  }
+
+  std::vector<uint32_t> time(vertex_count, 0);
+  std::vector<uint8_t> emitted(num_tris);
+  std::vector<uint32_t> dead_end;
+  std::vector<uint32_t> candidates;
+  uint32_t now = cache_size + 1;
+  size_t cursor = 0;
+  size_t out = 0;
+
+  // When the fan runs out, go back to a recently used vertex or find a new one.
+  auto skip_dead_end = [&]() -> uint32_t {
+    while (!dead_end.empty()) {
+      uint32_t v = dead_end.back();
+      dead_end.pop_back();
+      if (live[v]) return v;
+    }
+    for (; cursor != vertex_count; ++cursor) {
+      if (live[cursor]) return (uint32_t)cursor;
+    }
+    return ~0u;
+  };
+
+  for (uint32_t fan = skip_dead_end(); fan != ~0u; ) {
+    candidates.clear();
+    for (uint32_t k = first[fan]; k != first[fan + 1]; ++k) {
+      uint32_t t = adjacent[k];
+      if (emitted[t]) continue;
+      emitted[t] = 1;
+      for (int j = 0; j != 3; ++j) {
+        Index v = indices[t * 3 + j];
+        dest[out++] = v;
+        dead_end.push_back((uint32_t)v);
+        candidates.push_back((uint32_t)v);
+        live[v]--;
+        if (now - time[v] > cache_size) time[v] = now++;
+      }
+    }
+
+    // Prefer the oldest vertex that will still be in the cache after its fan.
+    uint32_t best = ~0u;
+    int best_priority = -1;
+    for (uint32_t v : candidates) {
+      if (live[v]) {
+        int priority = 0;
+        if (now - time[v] + 2 * live[v] <= cache_size) priority = (int)(now - time[v]);
+        if (priority > best_priority) {
+          best_priority = priority;
+          best = v;
+        }
+      }
+    }
+    fan = best != ~0u ? best : skip_dead_end();
+  }
+
+  // Copy any partial triangle at the end.
+  for (size_t i = num_tris * 3; i != index_count; ++i) {
+    dest[i] = indices[i];
+  }
+}
+
+// Sort clusters of a cache optimised index list to reduce overdraw.
+// Clusters start where the cache order has a discontinuity and are split further while
+// their cache miss ratio stays within threshold of the whole cluster's. Clusters facing
+// away from the centre of the mesh are drawn first as they tend to hide the others.
+// dest may be the same as indices.
+template <class Index>
+void optimize_overdraw(Index *dest, const Index *indices, size_t index_count, const glm::vec3 *pos, size_t vertex_count, float threshold = 1.05f, unsigned cache_size = 16) {
+  std::vector<Index> copy;
+  if (dest == indices) {
+    copy.assign(indices, indices + index_count);
+    indices = copy.data();
+  }
+  size_t num_tris = index_count / 3;
+
+  std::vector<uint32_t> time(vertex_count, 0);
+  uint32_t now = cache_size + 1;
+  auto misses = [&](size_t t) {
+    unsigned result = 0;
+    for (int j = 0; j != 3; ++j) {
+      Index v = indices[t * 3 + j];
+      if (now - time[v] > cache_size) {
+        time[v] = now++;
+        result++;
+      }
+    }
+    return result;
+  };
+  auto flush = [&]() { now += cache_size + 1; };
+
+  // Hard boundaries are triangles with no vertices in the cache.
+  std::vector<size_t> hard;
+  for (size_t t = 0; t != num_tris; ++t) {
+    if (misses(t) == 3) hard.push_back(t);
+  }
+  hard.push_back(num_tris);
+
+  std::vector<size_t> clusters;
+  for (size_t h = 0; h + 1 < hard.size(); ++h) {
+    size_t begin = hard[h], end = hard[h + 1];
+    flush();
+    size_t total = 0;
+    for (size_t t = begin; t != end; ++t) total += misses(t);
+    float cluster_acmr = (float)total / (end - begin);
+
+    flush();
+    clusters.push_back(begin);
+    size_t start = begin, missed = 0;
+    for (size_t t = begin; t != end; ++t) {
+      missed += misses(t);
+      if (t + 1 != end && (float)missed / (t + 1 - start) <= cluster_acmr * threshold) {
+        clusters.push_back(t + 1);
+        start = t + 1;
+        missed = 0;
+        flush();
+      }
+    }
+  }
+  clusters.push_back(num_tris);
+
+  // Area weighted centroid and normal of each cluster.
+  struct cluster {
+    size_t begin, end;
+    float key;
+  };
+  std::vector<cluster> sorted;
+  std::vector<glm::vec3> centroid, normal;
+  glm::vec3 mesh_centroid(0, 0, 0);
+  float mesh_area = 0;
+  for (size_t c = 0; c + 1 < clusters.size(); ++c) {
+    glm::vec3 csum(0, 0, 0), nsum(0, 0, 0);
+    float area = 0;
+    for (size_t t = clusters[c]; t != clusters[c + 1]; ++t) {
+      glm::vec3 p0 = pos[indices[t*3+0]], p1 = pos[indices[t*3+1]], p2 = pos[indices[t*3+2]];
+      glm::vec3 n = glm::cross(p1 - p0, p2 - p0);
+      float a = glm::length(n);
+      csum += (p0 + p1 + p2) * (a / 3);
+      nsum += n;
+      area += a;
+    }
+    centroid.push_back(area > 0 ? csum / area : pos[indices[clusters[c]*3]]);
+    normal.push_back(nsum);
+    mesh_centroid += csum;
+    mesh_area += area;
+    sorted.push_back(cluster{clusters[c], clusters[c + 1], 0});
+  }
+  if (mesh_area > 0) mesh_centroid /= mesh_area;
+
+  for (size_t c = 0; c != sorted.size(); ++c) {
+    float len = glm::length(normal[c]);
+    sorted[c].key = len > 0 ? glm::dot(centroid[c] - mesh_centroid, normal[c] / len) : 0;
+  }
+  std::stable_sort(sorted.begin(), sorted.end(), [](const cluster &a, const cluster &b) { return a.key > b.key; });
+
+  size_t out = 0;
+  for (auto &c : sorted) {
+    for (size_t i = c.begin * 3; i != c.end * 3; ++i) dest[out++] = indices[i];
+  }
+  for (size_t i = num_tris * 3; i != index_count; ++i) {
+    dest[i] = indices[i];
+  }
+}
+
+// Renumber vertices in order of first use so that vertex fetches are sequential.
+// Indices are rewritten in place. remap[old] is the new vertex number, or ~0u if unused.
+// Returns the number of vertices used.
+template <class Index>
+size_t optimize_vertex_fetch_remap(std::vector<uint32_t> &remap, Index *indices, size_t index_count, size_t vertex_count) {
+  remap.assign(vertex_count, ~0u);
+  uint32_t next = 0;
+  for (size_t i = 0; i != index_count; ++i) {
+    uint32_t &r = remap[indices[i]];
+    if (r == ~0u) r = next++;
+    indices[i] = (Index)r;
+  }
+  return next;
+}
+
+// Vertex cache results before and after optimize().
+struct optimize_stats {
+  vertex_cache_stats before;
+  vertex_cache_stats after;
+};
+
+// Optimise a mesh for rendering: cache order, then overdraw, then vertex fetch order.
+// Unused vertices are removed.
+template <class MeshTraits>
+optimize_stats optimize(basic_mesh<MeshTraits> &mesh, float overdraw_threshold = 1.05f, unsigned cache_size = 16) {
+  auto &vertices = mesh.vertices();
+  auto &indices = mesh.indices();
+  optimize_stats stats;
+  stats.before = analyze_vertex_cache(indices.data(), indices.size(), vertices.size(), cache_size);
+
+  optimize_vertex_cache(indices.data(), indices.data(), indices.size(), vertices.size(), cache_size);
+  std::vector<glm::vec3> pos = mesh.pos();
+  optimize_overdraw(indices.data(), indices.data(), indices.size(), pos.data(), vertices.size(), overdraw_threshold, cache_size);
+
+  std::vector<uint32_t> remap;
+  size_t used = optimize_vertex_fetch_remap(remap, indices.data(), indices.size(), vertices.size());
+  std::vector<typename MeshTraits::vertex_t> fetched(used);
+  for (size_t v = 0; v != vertices.size(); ++v) {
+    if (remap[v] != ~0u) fetched[remap[v]] = vertices[v];
+  }
+  vertices = std::move(fetched);
+
+  stats.after = analyze_vertex_cache(indices.data(), indices.size(), vertices.size(), cache_size);
+  return stats;
+}
+
+} // gilgamesh
+
+#endif
@@ -0,0 +1,287 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2016
+//
+// gilgamesh: packed vertex formats
+//
+// Vertex traits with compact attributes for the GPU:
+//
+//   packed_mesh_traits     float pos, octahedral snorm16 normal, half uv, RGBA8 color: 24 bytes
+//   quantized_mesh_traits  unorm16 pos in the mesh's bounding box, octahedral snorm16 normal,
+//                          unorm16 uv, RGBA8 color: 20 bytes
+//
+// compared with 32 bytes for simple_mesh_traits and 48 for color_mesh_traits.
+// The getFormat() of each maps to vk::Formats with vku::vertexAttributeFormat(),
+// so vku::PipelineMaker::vertexFormat(mesh.vertexFormat()) sets up the vertex input.
+//
+// Normals arrive in the shader as two channels, decoded with:
+//
+//   vec3 octDecode(vec2 e) {
+//     vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+//     float t = max(-n.z, 0.0);
+//     n.xy += mix(vec2(t), vec2(-t), greaterThanEqual(n.xy, vec2(0.0)));
+//     return normalize(n);
+//   }
+//
+// Quantized positions arrive in [0, 1] with w = 1, so position_quantization::matrix()
+// can be multiplied into the model matrix.
+//
+// Error bounds, for unit normals and uvs and colors in [0, 1]:
+//   pos:    none for packed; half a step (1/131070) of the box size on each axis, plus float
+//           rounding, for quantized.
+//   normal: about 0.0025 degrees.
+//   uv:     2^-11 of the uv's magnitude for half; half a step (1/131070) for unorm16.
+//   color:  half a step (1/510).
+//
+
+#ifndef MESHUTILS_PACKED_MESH_INCLUDED
+#define MESHUTILS_PACKED_MESH_INCLUDED
+
+#include <glm/glm.hpp>
+#include <glm/gtc/packing.hpp>
+#include <glm/gtc/type_precision.hpp>
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include <gilgamesh/mesh.hpp>
+
+namespace gilgamesh {
+
+// Map a unit vector to the octahedron and unfold it onto the square [-1, 1]^2.
+inline glm::vec2 oct_encode(const glm::vec3 &n) {
+  float sum = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+  if (sum == 0) return glm::vec2(0, 0);
+  glm::vec2 p = glm::vec2(n.x, n.y) / sum;
+  if (n.z < 0) {
+    glm::vec2 sign(p.x >= 0 ? 1.0f : -1.0f, p.y >= 0 ? 1.0f : -1.0f);
+    p = (glm::vec2(1, 1) - glm::abs(glm::vec2(p.y, p.x))) * sign;
+  }
+  return p;
+}
+
+inline glm::vec3 oct_decode(const glm::vec2 &e) {
+  glm::vec3 n(e.x, e.y, 1 - std::abs(e.x) - std::abs(e.y));
+  float t = std::max(-n.z, 0.0f);
+  n.x += n.x >= 0 ? -t : t;
+  n.y += n.y >= 0 ? -t : t;
+  return glm::normalize(n);
+}
+
+// Octahedral encoding in two snorm16s.
+// Of the four nearest encodings, the one that decodes closest to n is chosen.
+inline glm::i16vec2 pack_oct_snorm16(const glm::vec3 &n) {
+  glm::vec2 e = glm::clamp(oct_encode(n), -1.0f, 1.0f) * 32767.0f;
+  glm::vec2 lo = glm::floor(e);
+  glm::i16vec2 best(0, 0);
+  float best_error = 1e30f;
+  for (int i = 0; i != 4; ++i) {
+    glm::vec2 c = glm::clamp(lo + glm::vec2(i & 1, i >> 1), -32767.0f, 32767.0f);
+    // Squared distance, as the cosine of such small angles rounds to one.
+    glm::vec3 d = oct_decode(c * (1.0f / 32767)) - n;
+    float error = glm::dot(d, d);
+    if (error < best_error) {
+      best_error = error;
+      best = glm::i16vec2(c);
+    }
+  }
+  return best;
+}
+
+inline glm::vec3 unpack_oct_snorm16(const glm::i16vec2 &p) {
+  return oct_decode(glm::unpackSnorm<float>(p));
+}
+
+// float position, octahedral normal, half uv and RGBA8 color
+struct packed_mesh_traits {
+  class vertex_t {
+  public:
+    vertex_t() {}
+
+    vertex_t(const glm::vec3 &pos, const glm::vec3 &normal, const glm::vec2 &uv, const glm::vec4 &color = glm::vec4(1.0f)) {
+      pos_ = pos;
+      normal_ = pack_oct_snorm16(normal);
+      uv_ = glm::packHalf(uv);
+      color_ = glm::packUnorm<uint8_t>(color);
+    }
+
+    // Lerp constructor.
+    vertex_t(const vertex_t &lhs, const vertex_t &rhs, float lambda) :
+      vertex_t(
+        glm::mix(lhs.pos(), rhs.pos(), lambda),
+        glm::mix(lhs.normal(), rhs.normal(), lambda),
+        glm::mix(lhs.uv(), rhs.uv(), lambda),
+        glm::mix(lhs.color(), rhs.color(), lambda)
+      ) {
+    }
+
+    glm::vec3 pos() const { return pos_; }
+    glm::vec3 normal() const { return unpack_oct_snorm16(normal_); }
+    glm::vec2 uv() const { return glm::unpackHalf(uv_); }
+    glm::vec4 color() const { return glm::unpackUnorm<float>(color_); }
+
+    vertex_t &pos(const glm::vec3 &value) { pos_ = value; return *this; }
+    vertex_t &normal(const glm::vec3 &value) { normal_ = pack_oct_snorm16(value); return *this; }
+    vertex_t &uv(const glm::vec2 &value) { uv_ = glm::packHalf(value); return *this; }
+    vertex_t &color(const glm::vec4 &value) { color_ = glm::packUnorm<uint8_t>(value); return *this; }
+  private:
+    // The physical layout of these data are reflected in the result of getFormat()
+    glm::vec3 pos_;
+    glm::i16vec2 normal_;
+    glm::u16vec2 uv_;
+    glm::u8vec4 color_;
+  };
+
+  static const attribute *getFormat() {
+    static const attribute format[] = {
+      {"pos", 3, 'f'},
+      {"normal", 2, 'h'},
+      {"uv", 2, 'e'},
+      {"color", 4, 'B'},
+      {nullptr, 0, '\0'}
+    };
+    return format;
+  }
+
+  typedef uint32_t index_t;
+};
+
+// unorm16 position, octahedral normal, unorm16 uv and RGBA8 color
+//
+// Positions are in [0, 1] across the bounding box of the mesh; see quantize_mesh().
+// uvs are clamped to [0, 1], so use packed_mesh_traits for wrapped textures.
+struct quantized_mesh_traits {
+  class vertex_t {
+  public:
+    vertex_t() {}
+
+    vertex_t(const glm::vec3 &pos, const glm::vec3 &normal, const glm::vec2 &uv, const glm::vec4 &color = glm::vec4(1.0f)) {
+      pos_ = glm::packUnorm<uint16_t>(glm::vec4(pos, 1.0f));
+      normal_ = pack_oct_snorm16(normal);
+      uv_ = glm::packUnorm<uint16_t>(uv);
+      color_ = glm::packUnorm<uint8_t>(color);
+    }
+
+    // Lerp constructor.
+    vertex_t(const vertex_t &lhs, const vertex_t &rhs, float lambda) :
+      vertex_t(
+        glm::mix(lhs.pos(), rhs.pos(), lambda),
+        glm::mix(lhs.normal(), rhs.normal(), lambda),
+        glm::mix(lhs.uv(), rhs.uv(), lambda),
+        glm::mix(lhs.color(), rhs.color(), lambda)
+      ) {
+    }
+
+    glm::vec3 pos() const { return glm::vec3(glm::unpackUnorm<float>(pos_)); }
+    glm::vec3 normal() const { return unpack_oct_snorm16(normal_); }
+    glm::vec2 uv() const { return glm::unpackUnorm<float>(uv_); }
+    glm::vec4 color() const { return glm::unpackUnorm<float>(color_); }
+
+    vertex_t &pos(const glm::vec3 &value) { pos_ = glm::packUnorm<uint16_t>(glm::vec4(value, 1.0f)); return *this; }
+    vertex_t &normal(const glm::vec3 &value) { normal_ = pack_oct_snorm16(value); return *this; }
+    vertex_t &uv(const glm::vec2 &value) { uv_ = glm::packUnorm<uint16_t>(value); return *this; }
+    vertex_t &color(const glm::vec4 &value) { color_ = glm::packUnorm<uint8_t>(value); return *this; }
+  private:
+    // The physical layout of these data are reflected in the result of getFormat()
+    // pos_.w is always one.
+    glm::u16vec4 pos_;
+    glm::i16vec2 normal_;
+    glm::u16vec2 uv_;
+    glm::u8vec4 color_;
+  };
+
+  static const attribute *getFormat() {
+    static const attribute format[] = {
+      {"pos", 4, 'H'},
+      {"normal", 2, 'h'},
+      {"uv", 2, 'H'},
+      {"color", 4, 'B'},
+      {nullptr, 0, '\0'}
+    };
+    return format;
+  }
+
+  typedef uint32_t index_t;
+};
+
+typedef basic_mesh<packed_mesh_traits> packed_mesh;
+typedef basic_mesh<quantized_mesh_traits> quantized_mesh;
+
+// The box that quantized positions are relative to: pos = offset + scale * quantized.
+struct position_quantization {
+  glm::vec3 offset = glm::vec3(0, 0, 0);
+  glm::vec3 scale = glm::vec3(1, 1, 1);
+
+  glm::vec3 encode(const glm::vec3 &pos) const {
+    glm::vec3 r;
+    for (int i = 0; i != 3; ++i) {
+      r[i] = scale[i] > 0 ? (pos[i] - offset[i]) / scale[i] : 0.0f;
+    }
+    return r;
+  }
+
+  glm::vec3 decode(const glm::vec3 &quantized) const {
+    return offset + scale * quantized;
+  }
+
+  // Quantized to model space, to multiply into the model matrix.
+  glm::mat4 matrix() const {
+    return glm::mat4(
+      scale.x, 0, 0, 0,
+      0, scale.y, 0, 0,
+      0, 0, scale.z, 0,
+      offset.x, offset.y, offset.z, 1
+    );
+  }
+};
+
+// Convert the vertices of a mesh to other traits, eg. to pack a color_mesh.
+template <class DestTraits, class SrcTraits>
+basic_mesh<DestTraits> convert_mesh(const basic_mesh<SrcTraits> &src) {
+  basic_mesh<DestTraits> result;
+  result.vertices().reserve(src.vertices().size());
+  for (auto &v : src.vertices()) {
+    result.vertices().emplace_back(v.pos(), v.normal(), v.uv(), v.color());
+  }
+  result.indices().assign(src.indices().begin(), src.indices().end());
+  return result;
+}
+
+// Quantize a mesh to its bounding box, which is returned in quantization.
+template <class SrcTraits>
+quantized_mesh quantize_mesh(const basic_mesh<SrcTraits> &src, position_quantization &quantization) {
+  glm::vec3 lo(0, 0, 0), hi(0, 0, 0);
+  if (!src.vertices().empty()) {
+    lo = hi = src.vertices()[0].pos();
+    for (auto &v : src.vertices()) {
+      lo = glm::min(lo, v.pos());
+      hi = glm::max(hi, v.pos());
+    }
+  }
+  quantization.offset = lo;
+  quantization.scale = hi - lo;
+
+  quantized_mesh result;
+  result.vertices().reserve(src.vertices().size());
+  for (auto &v : src.vertices()) {
+    result.vertices().emplace_back(quantization.encode(v.pos()), v.normal(), v.uv(), v.color());
+  }
+  result.indices().assign(src.indices().begin(), src.indices().end());
+  return result;
+}
+
+// Undo quantize_mesh, converting to other traits.
+template <class DestTraits>
+basic_mesh<DestTraits> dequantize_mesh(const quantized_mesh &src, const position_quantization &quantization) {
+  basic_mesh<DestTraits> result;
+  result.vertices().reserve(src.vertices().size());
+  for (auto &v : src.vertices()) {
+    result.vertices().emplace_back(quantization.decode(v.pos()), v.normal(), v.uv(), v.color());
+  }
+  result.indices().assign(src.indices().begin(), src.indices().end());
+  return result;
+}
+
+} // gilgamesh
+
+#endif
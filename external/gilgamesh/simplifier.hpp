@@ -0,0 +1,305 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2016
+//
+// gilgamesh: mesh simplification and LOD chains
+//
+// Edge collapse simplification driven by quadric error metrics (Garland and
+// Heckbert, "Surface Simplification Using Quadric Error Metrics", 1997).
+// Vertices are collapsed onto their neighbours rather than moved, so every
+// level of detail indexes the same vertex buffer.
+//
+
+#ifndef MESHUTILS_SIMPLIFIER_INCLUDED
+#define MESHUTILS_SIMPLIFIER_INCLUDED
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include <gilgamesh/mesh.hpp>
+
+namespace gilgamesh {
+
+namespace detail {
+  // Sum of squared distances to a set of planes, weighted by triangle area.
+  struct quadric {
+    double a00 = 0, a01 = 0, a02 = 0, a11 = 0, a12 = 0, a22 = 0;
+    double b0 = 0, b1 = 0, b2 = 0, c = 0;
+    double area = 0;
+
+    void add_plane(const glm::vec3 &n, float d, double w) {
+      a00 += w * n.x * n.x; a01 += w * n.x * n.y; a02 += w * n.x * n.z;
+      a11 += w * n.y * n.y; a12 += w * n.y * n.z; a22 += w * n.z * n.z;
+      b0 += w * n.x * d; b1 += w * n.y * d; b2 += w * n.z * d;
+      c += w * d * d;
+      area += w;
+    }
+
+    quadric &operator+=(const quadric &q) {
+      a00 += q.a00; a01 += q.a01; a02 += q.a02; a11 += q.a11; a12 += q.a12; a22 += q.a22;
+      b0 += q.b0; b1 += q.b1; b2 += q.b2; c += q.c;
+      area += q.area;
+      return *this;
+    }
+
+    double eval(const glm::vec3 &p) const {
+      double x = p.x, y = p.y, z = p.z;
+      double r = a00*x*x + a11*y*y + a22*z*z + 2*(a01*x*y + a02*x*z + a12*y*z) + 2*(b0*x + b1*y + b2*z) + c;
+      return std::max(r, 0.0);
+    }
+  };
+}
+
+// Simplify triangles to target_index_count indices or fewer, stopping early if the error would
+// exceed target_error. Errors are relative to the size of the mesh (0.01 is 1% of its extent).
+//
+// attributes, if not null, has attribute_count floats per vertex starting at attributes + vertex * attribute_stride.
+// Differences in attributes across a collapse add to its error, scaled by attribute_weights.
+//
+// Vertices on open or non-manifold edges, including attribute seams, are never moved.
+// Returns the number of indices written to dest, which must have room for index_count.
+// dest may be the same as indices. result_error receives the largest error of any collapse.
+template <class Index>
+size_t simplify(Index *dest, const Index *indices, size_t index_count, const glm::vec3 *pos, size_t vertex_count, size_t target_index_count, float target_error = 0.01f, float *result_error = nullptr, const float *attributes = nullptr, size_t attribute_stride = 0, const float *attribute_weights = nullptr, size_t attribute_count = 0) {
+  std::vector<uint32_t> tris(indices, indices + index_count - index_count % 3);
+  double max_error = 0;
+
+  // Work in units of the mesh's extent.
+  glm::vec3 lo(0), hi(0);
+  for (size_t i = 0; i != tris.size(); ++i) {
+    glm::vec3 p = pos[tris[i]];
+    lo = i ? glm::min(lo, p) : p;
+    hi = i ? glm::max(hi, p) : p;
+  }
+  glm::vec3 size = hi - lo;
+  float extent = std::max(std::max(size.x, size.y), size.z);
+  float scale = extent > 0 ? 1 / extent : 1;
+  auto P = [&](uint32_t v) { return (pos[v] - lo) * scale; };
+
+  // Lock vertices on edges that do not have exactly one triangle on each side.
+  std::vector<uint8_t> locked(vertex_count, 0);
+  {
+    weld_table<uint64_t> edges(tris.size());
+    std::vector<int> count;
+    for (size_t t = 0; t < tris.size(); t += 3) {
+      for (int j = 0; j != 3; ++j) {
+        uint64_t a = tris[t + j], b = tris[t + (j + 1) % 3];
+        uint64_t key = a < b ? a << 32 | b : b << 32 | a;
+        uint32_t id = edges.insert(key);
+        if (id == count.size()) count.push_back(0);
+        count[id] += a < b ? 1 : 1 << 16;
+      }
+    }
+    for (size_t id = 0; id != count.size(); ++id) {
+      if (count[id] != (1 | 1 << 16)) {
+        uint64_t key = edges.keys()[id];
+        locked[key >> 32] = locked[key & 0xffffffff] = 1;
+      }
+    }
+  }
+
+  std::vector<detail::quadric> quadrics(vertex_count);
+  for (size_t t = 0; t < tris.size(); t += 3) {
+    glm::vec3 p0 = P(tris[t]), p1 = P(tris[t+1]), p2 = P(tris[t+2]);
+    glm::vec3 n = glm::cross(p1 - p0, p2 - p0);
+    float len = glm::length(n);
+    if (len == 0) continue;
+    n /= len;
+    float d = -glm::dot(n, p0);
+    for (int j = 0; j != 3; ++j) quadrics[tris[t + j]].add_plane(n, d, len * 0.5);
+  }
+
+  auto attribute_error = [&](uint32_t v, uint32_t t) {
+    double e = 0;
+    for (size_t k = 0; k != attribute_count; ++k) {
+      double d = attributes[v * attribute_stride + k] - attributes[t * attribute_stride + k];
+      e += attribute_weights[k] * d * d;
+    }
+    return e;
+  };
+
+  // Squared error of collapsing v onto t.
+  auto cost = [&](uint32_t v, uint32_t t) {
+    detail::quadric q = quadrics[v];
+    q += quadrics[t];
+    double e = q.eval(P(t));
+    if (attributes) e += attribute_error(v, t) * quadrics[v].area;
+    return q.area > 0 ? e / q.area : e;
+  };
+
+  double limit = (double)target_error * target_error;
+  std::vector<uint32_t> remap(vertex_count), first, adjacent;
+  std::vector<uint8_t> touched(vertex_count);
+  struct collapse {
+    double cost;
+    uint32_t v, t;
+  };
+  std::vector<collapse> collapses;
+  std::vector<uint32_t> ring;
+
+  while (tris.size() > target_index_count) {
+    // Triangles of each vertex.
+    first.assign(vertex_count + 1, 0);
+    adjacent.resize(tris.size());
+    for (uint32_t v : tris) first[v + 1]++;
+    for (size_t v = 0; v != vertex_count; ++v) first[v + 1] += first[v];
+    {
+      std::vector<uint32_t> next(first.begin(), first.end() - 1);
+      for (size_t c = 0; c != tris.size(); ++c) adjacent[next[tris[c]]++] = (uint32_t)(c / 3);
+    }
+
+    // Each interior edge appears once in each direction.
+    collapses.clear();
+    for (size_t t = 0; t < tris.size(); t += 3) {
+      for (int j = 0; j != 3; ++j) {
+        uint32_t a = tris[t + j], b = tris[t + (j + 1) % 3];
+        if (!locked[a] && a != b) collapses.push_back(collapse{cost(a, b), a, b});
+      }
+    }
+    // Each collapse removes two triangles, so only the cheapest few are needed in order.
+    size_t goal = (tris.size() - target_index_count) / 3, removed = 0;
+    size_t applied = 0;
+    auto cheaper = [](const collapse &a, const collapse &b) {
+      return a.cost < b.cost || (a.cost == b.cost && (a.v < b.v || (a.v == b.v && a.t < b.t)));
+    };
+    auto end = collapses.begin() + std::min(collapses.size(), goal * 2);
+    std::nth_element(collapses.begin(), end, collapses.end(), cheaper);
+    std::sort(collapses.begin(), end, cheaper);
+    collapses.erase(end, collapses.end());
+
+    for (size_t v = 0; v != vertex_count; ++v) remap[v] = (uint32_t)v;
+    std::fill(touched.begin(), touched.end(), 0);
+
+    for (const collapse &c : collapses) {
+      if (removed >= goal || c.cost > limit) break;
+      uint32_t v = c.v, t = c.t;
+      if (touched[v] || touched[t]) continue;
+
+      // The collapse must not flip triangles, and v and t must share exactly two neighbours.
+      bool ok = true;
+      size_t shared = 0;
+      ring.clear();
+      for (uint32_t k = first[v]; k != first[v + 1] && ok; ++k) {
+        uint32_t tri = adjacent[k];
+        uint32_t i[3] = { remap[tris[tri*3]], remap[tris[tri*3+1]], remap[tris[tri*3+2]] };
+        if (i[0] == i[1] || i[1] == i[2] || i[2] == i[0]) continue;
+        for (uint32_t x : i) {
+          if (x != v && std::find(ring.begin(), ring.end(), x) == ring.end()) ring.push_back(x);
+        }
+        if (i[0] == t || i[1] == t || i[2] == t) {
+          shared++;
+          continue;
+        }
+        glm::vec3 p[3], q[3];
+        for (int j = 0; j != 3; ++j) {
+          p[j] = P(i[j]);
+          q[j] = i[j] == v ? P(t) : p[j];
+        }
+        glm::vec3 n0 = glm::cross(p[1] - p[0], p[2] - p[0]);
+        glm::vec3 n1 = glm::cross(q[1] - q[0], q[2] - q[0]);
+        if (glm::dot(n0, n1) <= 1e-2f * glm::length(n0) * glm::length(n1)) ok = false;
+      }
+      if (!ok || shared != 2) continue;
+
+      size_t common = 0;
+      for (uint32_t k = first[t]; k != first[t + 1]; ++k) {
+        uint32_t tri = adjacent[k];
+        for (int j = 0; j != 3; ++j) {
+          uint32_t x = remap[tris[tri*3+j]];
+          auto it = std::find(ring.begin(), ring.end(), x);
+          if (x != t && it != ring.end()) {
+            common++;
+            *it = ~0u;
+          }
+        }
+      }
+      if (common != 2) continue;
+
+      remap[v] = t;
+      quadrics[t] += quadrics[v];
+      touched[v] = touched[t] = 1;
+      max_error = std::max(max_error, c.cost);
+      removed += shared;
+      applied++;
+    }
+    if (!applied) break;
+
+    size_t out = 0;
+    for (size_t t = 0; t < tris.size(); t += 3) {
+      uint32_t a = remap[tris[t]], b = remap[tris[t+1]], c = remap[tris[t+2]];
+      if (a != b && b != c && c != a) {
+        tris[out++] = a;
+        tris[out++] = b;
+        tris[out++] = c;
+      }
+    }
+    tris.resize(out);
+  }
+
+  for (size_t i = 0; i != tris.size(); ++i) dest[i] = (Index)tris[i];
+  if (result_error) *result_error = (float)std::sqrt(max_error);
+  return tris.size();
+}
+
+// A level of detail: a range of the index buffer and its error in mesh units.
+struct lod {
+  size_t first_index;
+  size_t index_count;
+  float error;
+};
+
+// Append simplified levels of detail to the mesh's indices, each about ratio times the size
+// of the one before, until max_lods levels exist or the error passes max_error
+// (relative to the mesh's extent). Level 0 is the original indices.
+// normal_weight and uv_weight scale the attribute error of collapses.
+// A renderer can pick the first level whose error projects to less than a pixel.
+template <class MeshTraits>
+std::vector<lod> build_lods(basic_mesh<MeshTraits> &mesh, size_t max_lods = 8, float ratio = 0.5f, float max_error = 0.05f, float normal_weight = 0.01f, float uv_weight = 0.01f) {
+  auto &indices = mesh.indices();
+  std::vector<glm::vec3> pos = mesh.pos(), normal = mesh.normal();
+  std::vector<glm::vec2> uv = mesh.uv(0);
+
+  const size_t stride = 5;
+  std::vector<float> attributes(pos.size() * stride, 0.0f);
+  for (size_t v = 0; v != pos.size(); ++v) {
+    float *a = attributes.data() + v * stride;
+    a[0] = normal[v].x; a[1] = normal[v].y; a[2] = normal[v].z;
+    if (v < uv.size()) { a[3] = uv[v].x; a[4] = uv[v].y; }
+  }
+  const float weights[stride] = { normal_weight, normal_weight, normal_weight, uv_weight, uv_weight };
+
+  glm::vec3 lo(0), hi(0);
+  for (size_t v = 0; v != pos.size(); ++v) {
+    lo = v ? glm::min(lo, pos[v]) : pos[v];
+    hi = v ? glm::max(hi, pos[v]) : pos[v];
+  }
+  glm::vec3 size = hi - lo;
+  float extent = std::max(std::max(size.x, size.y), size.z);
+
+  std::vector<lod> lods;
+  lods.push_back(lod{0, indices.size() - indices.size() % 3, 0.0f});
+  std::vector<typename MeshTraits::index_t> next;
+  while (lods.size() < max_lods) {
+    // Each level is simplified from the one before, so their errors add up.
+    const lod &prev = lods.back();
+    float budget = max_error - (extent > 0 ? prev.error / extent : 0);
+    if (budget <= 0) break;
+    size_t target = (size_t)(prev.index_count / 3 * ratio) * 3;
+    next.resize(prev.index_count);
+    float error = 0;
+    size_t count = simplify(next.data(), indices.data() + prev.first_index, prev.index_count, pos.data(), pos.size(), target, budget, &error, attributes.data(), stride, weights, stride);
+
+    // Stop when simplification no longer makes much difference.
+    if (count == 0 || count > prev.index_count - prev.index_count / 8) break;
+    lod l{indices.size(), count, prev.error + error * extent};
+    indices.insert(indices.end(), next.begin(), next.begin() + count);
+    lods.push_back(l);
+  }
+  return lods;
+}
+
+} // gilgamesh
+
+#endif
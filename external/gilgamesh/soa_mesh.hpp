@@ -0,0 +1,201 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2016
+//
+// gilgamesh: structure of arrays mesh
+//
+// soa_mesh stores each vertex attribute in its own contiguous array, so that the
+// bulk readers of gilgamesh::mesh can be replaced by views that do not copy, and
+// each array can be uploaded to its own vertex buffer as it is:
+//
+//   gilgamesh::soa_mesh<gilgamesh::simple_mesh_traits> soa = gilgamesh::deinterleave(mesh);
+//   vku::VertexBuffer pos(device, memprops, soa.posView().size_bytes());
+//   ...
+//   pm.vertexFormat(soa.vertexFormat());
+//
+// The attributes stored are those named in the traits' getFormat(), kept as floats.
+//
+
+#ifndef MESHUTILS_SOA_MESH_INCLUDED
+#define MESHUTILS_SOA_MESH_INCLUDED
+
+#include <glm/glm.hpp>
+#include <vector>
+#include <span>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <gilgamesh/mesh.hpp>
+
+namespace gilgamesh {
+
+template <class MeshTraits>
+class soa_mesh : public mesh {
+public:
+  typedef MeshTraits traits_t;
+  typedef typename MeshTraits::vertex_t vertex_t;
+  typedef typename MeshTraits::index_t index_t;
+
+  // empty soa_mesh
+  soa_mesh() {
+  }
+
+  // mesh virtual methods
+  // bulk read operations, which copy the arrays.
+  std::vector<glm::vec3> pos() const override { return pos_; }
+  std::vector<glm::vec3> normal() const override { return normal_; }
+  std::vector<glm::vec2> uv(int index) const override { return index == 0 ? uv_ : std::vector<glm::vec2>{}; }
+  std::vector<glm::vec4> color() const override { return color_; }
+
+  std::vector<uint32_t> indices32() const override {
+    return std::vector<uint32_t>(indices_.begin(), indices_.end());
+  }
+
+  // Views of the arrays. An attribute that is not in the format has an empty view.
+  std::span<const glm::vec3> posView() const override { return pos_; }
+  std::span<const glm::vec3> normalView() const override { return normal_; }
+  std::span<const glm::vec2> uvView(int index) const override { return index == 0 ? std::span<const glm::vec2>(uv_) : std::span<const glm::vec2>{}; }
+  std::span<const glm::vec4> colorView() const override { return color_; }
+
+  std::span<const uint32_t> indexView() const override {
+    if constexpr (std::is_same_v<index_t, uint32_t>) {
+      return indices_;
+    } else {
+      return {};
+    }
+  }
+
+  // Writable views of the arrays.
+  std::span<glm::vec3> posView() { return pos_; }
+  std::span<glm::vec3> normalView() { return normal_; }
+  std::span<glm::vec2> uvView() { return uv_; }
+  std::span<glm::vec4> colorView() { return color_; }
+
+  std::vector<index_t> &indices() { return indices_; }
+  const std::vector<index_t> &indices() const { return indices_; }
+
+  size_t numVertices() const { return pos_.size(); }
+
+  // Gather one vertex. Attributes not in the format get the defaults of basic_mesh.
+  vertex_t vertex(size_t i) const {
+    return vertex_t(
+      pos_[i],
+      normal_.empty() ? glm::vec3(1, 0, 0) : normal_[i],
+      uv_.empty() ? glm::vec2(0, 0) : uv_[i],
+      color_.empty() ? glm::vec4(1, 1, 1, 1) : color_[i]
+    );
+  }
+
+  index_t addVertex(const vertex_t &vtx) {
+    index_t result = (index_t)pos_.size();
+    pos_.push_back(vtx.pos());
+    if (has_normal()) normal_.push_back(vtx.normal());
+    if (has_uv()) uv_.push_back(vtx.uv());
+    if (has_color()) color_.push_back(vtx.color());
+    return result;
+  }
+
+  size_t addVertexTransformed(const glm::mat4 &transform, const glm::vec3 &pos, const glm::vec3 &normal, const glm::vec2 &uv, const glm::vec4 &color) override {
+    glm::vec3 tpos = (glm::vec3)(transform * glm::vec4(pos.x, pos.y, pos.z, 1.0f));
+    glm::vec3 tnormal = glm::normalize((glm::vec3)(transform * glm::vec4(normal.x, normal.y, normal.z, 0.0f)));
+    size_t result = pos_.size();
+    pos_.push_back(tpos);
+    if (has_normal()) normal_.push_back(tnormal);
+    if (has_uv()) uv_.push_back(uv);
+    if (has_color()) color_.push_back(color);
+    return result;
+  }
+
+  size_t addIndex(size_t index) override {
+    size_t result = indices_.size();
+    indices_.push_back((index_t)index);
+    return result;
+  }
+
+  void reserve(size_t num_vertices, size_t num_indices) {
+    pos_.reserve(num_vertices);
+    if (has_normal()) normal_.reserve(num_vertices);
+    if (has_uv()) uv_.reserve(num_vertices);
+    if (has_color()) color_.reserve(num_vertices);
+    indices_.reserve(num_indices);
+  }
+
+  // Layout of the arrays: the attributes of the traits, in the same order, as floats.
+  static const attribute *getFormat() {
+    static const std::vector<attribute> format = make_format();
+    return format.data();
+  }
+
+  // Vertex input description for each array uploaded to its own vertex buffer,
+  // bound to first_binding onwards in the order of getFormat().
+  vertex_format vertexFormat(uint32_t first_binding = 0) const {
+    return separate_format(getFormat(), first_binding);
+  }
+
+  static bool has_normal() { return has_attribute("normal"); }
+  static bool has_uv() { return has_attribute("uv"); }
+  static bool has_color() { return has_attribute("color"); }
+
+private:
+  static bool has_attribute(const char *name) {
+    for (const attribute *a = MeshTraits::getFormat(); a->name; ++a) {
+      if (!strcmp(a->name, name)) return true;
+    }
+    return false;
+  }
+
+  static std::vector<attribute> make_format() {
+    static const attribute arrays[] = {
+      {"pos", 3, 'f'},
+      {"normal", 3, 'f'},
+      {"uv", 2, 'f'},
+      {"color", 4, 'f'},
+    };
+    std::vector<attribute> result;
+    for (const attribute *a = MeshTraits::getFormat(); a->name; ++a) {
+      for (auto &array : arrays) {
+        if (!strcmp(a->name, array.name)) result.push_back(array);
+      }
+    }
+    result.push_back(attribute{nullptr, 0, '\0'});
+    return result;
+  }
+
+  std::vector<glm::vec3> pos_;
+  std::vector<glm::vec3> normal_;
+  std::vector<glm::vec2> uv_;
+  std::vector<glm::vec4> color_;
+  std::vector<index_t> indices_;
+};
+
+// Split the vertices of a basic_mesh into arrays.
+template <class MeshTraits>
+soa_mesh<MeshTraits> deinterleave(const basic_mesh<MeshTraits> &mesh) {
+  soa_mesh<MeshTraits> result;
+  result.reserve(mesh.vertices().size(), mesh.indices().size());
+  for (auto &v : mesh.vertices()) {
+    result.addVertex(v);
+  }
+  result.indices() = mesh.indices();
+  return result;
+}
+
+// Gather the arrays of a soa_mesh into a basic_mesh.
+template <class MeshTraits>
+basic_mesh<MeshTraits> interleave(const soa_mesh<MeshTraits> &mesh) {
+  basic_mesh<MeshTraits> result;
+  result.vertices().reserve(mesh.numVertices());
+  for (size_t i = 0; i != mesh.numVertices(); ++i) {
+    result.vertices().push_back(mesh.vertex(i));
+  }
+  result.indices() = mesh.indices();
+  return result;
+}
+
+typedef soa_mesh<pos_mesh_traits> pos_soa_mesh;
+typedef soa_mesh<simple_mesh_traits> simple_soa_mesh;
+typedef soa_mesh<color_mesh_traits> color_soa_mesh;
+
+} // gilgamesh
+
+#endif
@@ -28,6 +28,12 @@
 #include <chrono>
 #include <functional>
 #include <cstddef>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
 
 #ifdef VOOKOO_SPIRV_SUPPORT
   #include <unified1/spirv.hpp11>
@@ -58,6 +64,18 @@ inline int findMemoryTypeIndex(const vk::PhysicalDeviceMemoryProperties &memprop
   return -1;
 }
 
+/// Memory flags for buffers the CPU reads back from the GPU.
+/// Host cached memory is much faster to read, but not every device has it.
+inline vk::MemoryPropertyFlags readbackMemoryFlags(const vk::PhysicalDeviceMemoryProperties &memprops) {
+  vk::MemoryPropertyFlags cached = vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCached;
+  for (uint32_t i = 0; i != memprops.memoryTypeCount; ++i) {
+    if ((memprops.memoryTypes[i].propertyFlags & cached) == cached) {
+      return cached;
+    }
+  }
+  return vk::MemoryPropertyFlagBits::eHostVisible;
+}
+
 /// Execute commands immediately and wait for the device to finish.
 inline void executeImmediately(vk::Device device, vk::CommandPool commandPool, vk::Queue queue, const std::function<void (vk::CommandBuffer cb)> &func) {
   vk::CommandBufferAllocateInfo cbai{ commandPool, vk::CommandBufferLevel::ePrimary, 1 };
@@ -76,6 +94,130 @@ inline void executeImmediately(vk::Device device, vk::CommandPool commandPool, v
   device.freeCommandBuffers(commandPool, cbs);
 }
 
+/// Hand out short lived command buffers from per-frame, per-thread pools.
+/// Each (frame, thread) pair owns a transient pool. When the frame's fence has signalled,
+/// beginFrame() resets the whole pool in one call and returns its command buffers to a
+/// free list, so at steady state recording a command buffer costs no driver allocation.
+/// A pool must only be used by one thread at a time; pass your worker's index as "thread".
+class CommandBufferAllocator {
+public:
+  CommandBufferAllocator() {
+  }
+
+  /// Make pools for numFrames frames in flight and numThreads recording threads.
+  CommandBufferAllocator(vk::Device device, uint32_t queueFamilyIndex, uint32_t numFrames, uint32_t numThreads = 1) {
+    s.device = device;
+    s.numThreads = numThreads;
+
+    // One extra set of pools for executeImmediately().
+    s.pools.resize((numFrames + 1) * numThreads);
+
+    vk::CommandPoolCreateInfo cpci{ vk::CommandPoolCreateFlagBits::eTransient, queueFamilyIndex };
+    for (auto &p : s.pools) {
+      p.pool = device.createCommandPoolUnique(cpci);
+    }
+  }
+
+  /// Wait for the previous use of this frame to finish (if a fence is given) and recycle all
+  /// the command buffers allocated for it. The fence is not reset.
+  void beginFrame(uint32_t frame, vk::Fence fence = vk::Fence{}) {
+    if (fence) {
+      s.device.waitForFences(fence, VK_TRUE, std::numeric_limits<uint64_t>::max());
+    }
+
+    for (uint32_t thread = 0; thread != s.numThreads; ++thread) {
+      recycle(pool(frame, thread));
+    }
+  }
+
+  /// Get an unrecorded command buffer for this frame and thread.
+  /// It is valid until the next beginFrame() for the same frame.
+  vk::CommandBuffer allocate(uint32_t frame, uint32_t thread = 0, vk::CommandBufferLevel level = vk::CommandBufferLevel::ePrimary) {
+    return allocate(pool(frame, thread), level);
+  }
+
+  /// Record and run a primary command buffer, waiting for it to complete.
+  /// Like vku::executeImmediately, but only waits on its own fence and re-uses command buffers.
+  void executeImmediately(vk::Queue queue, const std::function<void (vk::CommandBuffer cb)> &func, uint32_t thread = 0) {
+    Pool &p = pool(numFrames(), thread);
+    vk::CommandBuffer cb = allocate(p, vk::CommandBufferLevel::ePrimary);
+
+    cb.begin(vk::CommandBufferBeginInfo{vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+    func(cb);
+    cb.end();
+
+    if (!p.fence) {
+      p.fence = s.device.createFenceUnique(vk::FenceCreateInfo{});
+    }
+
+    vk::SubmitInfo submit;
+    submit.commandBufferCount = 1;
+    submit.pCommandBuffers = &cb;
+    queue.submit(submit, *p.fence);
+    s.device.waitForFences(*p.fence, VK_TRUE, std::numeric_limits<uint64_t>::max());
+    s.device.resetFences(*p.fence);
+
+    recycle(p);
+  }
+
+  /// Return the number of frames in flight.
+  uint32_t numFrames() const { return s.numThreads ? (uint32_t)s.pools.size() / s.numThreads - 1 : 0; }
+
+  /// Return the number of recording threads.
+  uint32_t numThreads() const { return s.numThreads; }
+
+  /// Return the command pool for a frame and thread.
+  vk::CommandPool commandPool(uint32_t frame, uint32_t thread = 0) { return *pool(frame, thread).pool; }
+
+private:
+  // Command buffers are kept in two lists per level.
+  // "free" buffers may be handed out, "used" buffers are waiting for the pool reset.
+  struct Pool {
+    vk::UniqueCommandPool pool;
+    vk::UniqueFence fence;
+    std::vector<vk::CommandBuffer> free[2];
+    std::vector<vk::CommandBuffer> used[2];
+  };
+
+  Pool &pool(uint32_t frame, uint32_t thread) {
+    return s.pools[frame * s.numThreads + thread];
+  }
+
+  vk::CommandBuffer allocate(Pool &p, vk::CommandBufferLevel level) {
+    int l = level == vk::CommandBufferLevel::ePrimary ? 0 : 1;
+    auto &free = p.free[l];
+    if (free.empty()) {
+      // Grow the pool in batches to amortise the cost of allocation.
+      uint32_t count = std::max((uint32_t)p.used[l].size(), (uint32_t)4);
+      vk::CommandBufferAllocateInfo cbai{ *p.pool, level, count };
+      free = s.device.allocateCommandBuffers(cbai);
+    }
+    vk::CommandBuffer cb = free.back();
+    free.pop_back();
+    p.used[l].push_back(cb);
+    return cb;
+  }
+
+  void recycle(Pool &p) {
+    if (p.used[0].empty() && p.used[1].empty()) return;
+
+    // Resetting the pool resets all of its command buffers at once.
+    s.device.resetCommandPool(*p.pool, vk::CommandPoolResetFlags{});
+    for (int l = 0; l != 2; ++l) {
+      p.free[l].insert(p.free[l].end(), p.used[l].begin(), p.used[l].end());
+      p.used[l].clear();
+    }
+  }
+
+  struct State {
+    vk::Device device;
+    uint32_t numThreads = 0;
+    std::vector<Pool> pools;
+  };
+
+  State s;
+};
+
 /// Scale a value by mip level, but do not reduce to zero.
 inline uint32_t mipScale(uint32_t value, uint32_t mipLevel) {
   return std::max(value >> mipLevel, (uint32_t)1);
@@ -301,6 +443,26 @@ inline BlockParams getBlockParams(vk::Format format) {
   return BlockParams{0, 0, 0};
 }
 
+/// Vertex attribute format from a channel count (1-4) and a python struct type character,
+/// as used by gilgamesh::attribute. 8 and 16 bit integers are normalised.
+inline vk::Format vertexAttributeFormat(int channels, char type) {
+  static const vk::Format formats[][4] = {
+    {vk::Format::eR32Sfloat, vk::Format::eR32G32Sfloat, vk::Format::eR32G32B32Sfloat, vk::Format::eR32G32B32A32Sfloat},
+    {vk::Format::eR16Sfloat, vk::Format::eR16G16Sfloat, vk::Format::eR16G16B16Sfloat, vk::Format::eR16G16B16A16Sfloat},
+    {vk::Format::eR16Snorm, vk::Format::eR16G16Snorm, vk::Format::eR16G16B16Snorm, vk::Format::eR16G16B16A16Snorm},
+    {vk::Format::eR16Unorm, vk::Format::eR16G16Unorm, vk::Format::eR16G16B16Unorm, vk::Format::eR16G16B16A16Unorm},
+    {vk::Format::eR8Snorm, vk::Format::eR8G8Snorm, vk::Format::eR8G8B8Snorm, vk::Format::eR8G8B8A8Snorm},
+    {vk::Format::eR8Unorm, vk::Format::eR8G8Unorm, vk::Format::eR8G8B8Unorm, vk::Format::eR8G8B8A8Unorm},
+    {vk::Format::eR32Sint, vk::Format::eR32G32Sint, vk::Format::eR32G32B32Sint, vk::Format::eR32G32B32A32Sint},
+    {vk::Format::eR32Uint, vk::Format::eR32G32Uint, vk::Format::eR32G32B32Uint, vk::Format::eR32G32B32A32Uint},
+    {vk::Format::eR64Sfloat, vk::Format::eR64G64Sfloat, vk::Format::eR64G64B64Sfloat, vk::Format::eR64G64B64A64Sfloat},
+  };
+  static const char types[] = "fehHbBiId";
+  const char *t = type ? strchr(types, type) : nullptr;
+  if (!t || channels < 1 || channels > 4) return vk::Format::eUndefined;
+  return formats[t - types][channels - 1];
+}
+
 /// Factory for instances.
 class InstanceMaker {
 public:
@@ -483,6 +645,13 @@ public:
 	return *this;
   }
   
+  DeviceMaker &enableDrawIndirectFirstInstance ()
+  {
+	// assert !pdfs_.empty()
+	pdfs_.back().setDrawIndirectFirstInstance(true);
+	return *this;
+  }
+  
   DeviceMaker &multiviewFeatures (const vk::PhysicalDeviceMultiviewFeatures &v = {})
   {
 	mvfs_.push_back(v);
@@ -496,6 +665,21 @@ public:
 	return *this;
   }
 
+  /// Add Vulkan 1.2 features. Requires an instance made with apiVersion(VK_API_VERSION_1_2).
+  DeviceMaker &vulkan12Features (const vk::PhysicalDeviceVulkan12Features &v = {})
+  {
+	v12fs_.push_back(v);
+	return *this;
+  }
+
+  /// Enable drawIndirectCount and drawIndexedIndirectCount.
+  DeviceMaker &enableDrawIndirectCount ()
+  {
+	// assert !v12fs_.empty()
+	v12fs_.back().setDrawIndirectCount(true);
+	return *this;
+  }
+
   /// Create a new logical device.
   vk::UniqueDevice createUnique(vk::PhysicalDevice physical_device) {
     auto dci = vk::DeviceCreateInfo{
@@ -509,9 +693,20 @@ public:
     if (!pdfs_.empty())
 		dci.setPEnabledFeatures(&pdfs_.front());
 
+    // Chain the extended feature structures.
+    void *pNext = nullptr;
+    if (!v12fs_.empty()) {
+      v12fs_.front().pNext = pNext;
+      pNext = &v12fs_.front();
+    }
+
     // required to enable and use multiview
-    if (!mvfs_.empty())
-		dci.pNext = &mvfs_.front();
+    if (!mvfs_.empty()) {
+      mvfs_.front().pNext = pNext;
+      pNext = &mvfs_.front();
+    }
+
+    dci.pNext = pNext;
 
     return physical_device.createDeviceUnique(dci);
   }
@@ -522,6 +717,7 @@ private:
   std::vector<vk::DeviceQueueCreateInfo> qci_;
   std::vector<vk::PhysicalDeviceFeatures> pdfs_;
   std::vector<vk::PhysicalDeviceMultiviewFeatures> mvfs_;
+  std::vector<vk::PhysicalDeviceVulkan12Features> v12fs_;
 
   vk::ApplicationInfo app_info_;
 };
@@ -810,6 +1006,79 @@ public:
   }
 #endif
 
+  /// Workgroup size of a compute shader.
+  /// specId[i] is the specialization constant id of dimension i (local_size_x_id etc.)
+  /// or -1 if the size is fixed in the shader.
+  struct LocalSize {
+    uint32_t size[3] = {1, 1, 1};
+    int32_t specId[3] = {-1, -1, -1};
+  };
+
+  /// Find the workgroup size of a compute shader.
+  /// This does not need VOOKOO_SPIRV_SUPPORT, the few opcodes are decoded here.
+  LocalSize localSize() const {
+    enum {
+      OpExecutionMode = 16, OpConstant = 43, OpConstantComposite = 44,
+      OpSpecConstant = 50, OpSpecConstantComposite = 51, OpDecorate = 71,
+      ExecutionModeLocalSize = 17, ExecutionModeLocalSizeId = 38,
+      DecorationSpecId = 1, DecorationBuiltIn = 11, BuiltInWorkgroupSize = 25
+    };
+
+    LocalSize result;
+    if (s.opcodes_.size() < 5) return result;
+
+    std::unordered_map<uint32_t, uint32_t> values;
+    std::unordered_map<uint32_t, int32_t> specIds;
+    std::unordered_map<uint32_t, std::vector<uint32_t>> composites;
+    uint32_t workgroupSize = 0;
+    uint32_t sizeIds[3] = {0, 0, 0};
+
+    for (size_t i = 5; i < s.opcodes_.size(); ) {
+      const uint32_t *op = s.opcodes_.data() + i;
+      uint32_t wordCount = op[0] >> 16;
+      if (wordCount == 0 || i + wordCount > s.opcodes_.size()) break;
+      switch (op[0] & 0xffff) {
+        case OpExecutionMode: {
+          if (wordCount == 6 && op[2] == ExecutionModeLocalSize) {
+            for (int j = 0; j != 3; ++j) result.size[j] = op[3+j];
+          } else if (wordCount == 6 && op[2] == ExecutionModeLocalSizeId) {
+            for (int j = 0; j != 3; ++j) sizeIds[j] = op[3+j];
+          }
+        } break;
+        case OpDecorate: {
+          if (wordCount >= 4 && op[2] == DecorationSpecId) {
+            specIds[op[1]] = (int32_t)op[3];
+          } else if (wordCount >= 4 && op[2] == DecorationBuiltIn && op[3] == BuiltInWorkgroupSize) {
+            workgroupSize = op[1];
+          }
+        } break;
+        case OpConstant: case OpSpecConstant: {
+          if (wordCount >= 4) values[op[2]] = op[3];
+        } break;
+        case OpConstantComposite: case OpSpecConstantComposite: {
+          composites[op[2]].assign(op + 3, op + wordCount);
+        } break;
+      }
+      i += wordCount;
+    }
+
+    // The WorkgroupSize builtin overrides the execution mode.
+    auto set = [&](int j, uint32_t id) {
+      auto v = values.find(id);
+      if (v != values.end()) result.size[j] = v->second;
+      auto sid = specIds.find(id);
+      if (sid != specIds.end()) result.specId[j] = sid->second;
+    };
+
+    auto c = composites.find(workgroupSize);
+    if (workgroupSize && c != composites.end() && c->second.size() == 3) {
+      for (int j = 0; j != 3; ++j) set(j, c->second[j]);
+    } else if (sizeIds[0]) {
+      for (int j = 0; j != 3; ++j) set(j, sizeIds[j]);
+    }
+    return result;
+  }
+
   bool ok() const { return s.ok_; }
   VkShaderModule module() const { return *s.module_; }
 
@@ -1118,6 +1387,19 @@ public:
     return *this;
   }
 
+  /// Add the bindings and attributes of a vertex format description, eg. gilgamesh::vertex_format.
+  /// Bindings need binding and stride, attributes need location, binding, number_of_channels, type and offset.
+  template <class VertexFormat>
+  PipelineMaker& vertexFormat(const VertexFormat &format, vk::VertexInputRate inputRate_ = vk::VertexInputRate::eVertex) {
+    for (auto &b : format.bindings) {
+      vertexBinding(b.binding, b.stride, inputRate_);
+    }
+    for (auto &a : format.attributes) {
+      vertexAttribute(a.location, a.binding, vertexAttributeFormat(a.number_of_channels, a.type), a.offset);
+    }
+    return *this;
+  }
+
   /// Specify the topology of the pipeline.
   /// Usually this is a triangle list, but points and lines are possible too.
   PipelineMaker &topology( vk::PrimitiveTopology topology ) { inputAssemblyState_.topology = topology; return *this; }
@@ -1283,6 +1565,18 @@ public:
     return *this;
   }
 
+  /// Add a shader module with specialized constants to the pipeline.
+  ComputePipelineMaker& shader(vk::ShaderStageFlagBits stage, vku::ShaderModule &shader,
+                 PipelineMaker::SpecData specConstants,
+                 const char *entryPoint = "main") {
+    spec_ = std::unique_ptr<PipelineMaker::SpecData>{new PipelineMaker::SpecData{std::move(specConstants)}};
+    stage_.module = shader.module();
+    stage_.pName = entryPoint;
+    stage_.stage = stage;
+    stage_.pSpecializationInfo = &spec_->specializationInfo_;
+    return *this;
+  }
+
   /// Set the compute shader module.
   ComputePipelineMaker &module(const vk::PipelineShaderStageCreateInfo &value) {
     stage_ = value;
@@ -1302,6 +1596,7 @@ public:
   }
 private:
   vk::PipelineShaderStageCreateInfo stage_;
+  std::unique_ptr<PipelineMaker::SpecData> spec_;
 };
 
 /// A generic buffer that may be used as a vertex buffer, uniform buffer or other kinds of memory resident data.
@@ -1364,6 +1659,40 @@ public:
     upload(device, memprops, commandPool, queue, &value, sizeof(value));
   }
 
+  /// For a purely device local buffer, copy the buffer object to memory immediately.
+  /// The buffer needs eTransferSrc usage. Like upload() this stalls the pipeline,
+  /// use vku::ReadbackRing to read results back without waiting.
+  void download(vk::Device device, const vk::PhysicalDeviceMemoryProperties &memprops, vk::CommandPool commandPool, vk::Queue queue, void *value, vk::DeviceSize size, vk::DeviceSize offset = 0) const {
+    if (size == 0) return;
+    using buf = vk::BufferUsageFlagBits;
+    using psfb = vk::PipelineStageFlagBits;
+    using afb = vk::AccessFlagBits;
+    auto tmp = vku::GenericBuffer(device, memprops, buf::eTransferDst, size, vku::readbackMemoryFlags(memprops));
+
+    vku::executeImmediately(device, commandPool, queue, [&](vk::CommandBuffer cb) {
+      // Wait for any earlier writes to this buffer, eg. from a compute shader.
+      vk::MemoryBarrier before{afb::eMemoryWrite, afb::eTransferRead};
+      cb.pipelineBarrier(psfb::eAllCommands, psfb::eTransfer, {}, before, nullptr, nullptr);
+
+      vk::BufferCopy bc{offset, 0, size};
+      cb.copyBuffer(*buffer_, tmp.buffer(), bc);
+
+      vk::MemoryBarrier after{afb::eTransferWrite, afb::eHostRead};
+      cb.pipelineBarrier(psfb::eTransfer, psfb::eHost, {}, after, nullptr, nullptr);
+    });
+
+    // Non-coherent memory must be invalidated before the CPU reads it.
+    void *ptr = tmp.map(device);
+    tmp.invalidate(device);
+    memcpy(value, ptr, (size_t)size);
+    tmp.unmap(device);
+  }
+
+  template<typename T>
+  void download(vk::Device device, const vk::PhysicalDeviceMemoryProperties &memprops, vk::CommandPool commandPool, vk::Queue queue, std::vector<T> &value) const {
+    download(device, memprops, commandPool, queue, value.data(), value.size() * sizeof(T));
+  }
+
   void barrier(vk::CommandBuffer cb, vk::PipelineStageFlags srcStageMask, vk::PipelineStageFlags dstStageMask, vk::DependencyFlags dependencyFlags, vk::AccessFlags srcAccessMask, vk::AccessFlags dstAccessMask, uint32_t srcQueueFamilyIndex, uint32_t dstQueueFamilyIndex) const {
     vk::BufferMemoryBarrier bmb{srcAccessMask, dstAccessMask, srcQueueFamilyIndex, dstQueueFamilyIndex, *buffer_, 0, size_};
     cb.pipelineBarrier(srcStageMask, dstStageMask, dependencyFlags, nullptr, bmb, nullptr);
@@ -1447,6 +1776,29 @@ public:
   }
 };
 
+/// This class is a specialisation of GenericBuffer for GPU generated indirect draw and dispatch commands.
+/// Compute shaders write the commands (and an optional draw count) through a storage buffer binding.
+class IndirectBuffer : public GenericBuffer {
+public:
+  IndirectBuffer() {
+  }
+
+  IndirectBuffer(const vk::Device &device, const vk::PhysicalDeviceMemoryProperties &memprops, vk::DeviceSize size) : GenericBuffer(device, memprops, vk::BufferUsageFlagBits::eIndirectBuffer | vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst, size, vk::MemoryPropertyFlagBits::eDeviceLocal) {
+  }
+};
+
+/// This class is a specialisation of GenericBuffer for per-instance data.
+/// It can be bound as an instance rate vertex buffer and read or written by compute shaders.
+/// You must upload the contents before use.
+class InstanceBuffer : public GenericBuffer {
+public:
+  InstanceBuffer() {
+  }
+
+  InstanceBuffer(const vk::Device &device, const vk::PhysicalDeviceMemoryProperties &memprops, vk::DeviceSize size) : GenericBuffer(device, memprops, vk::BufferUsageFlagBits::eVertexBuffer | vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst, size, vk::MemoryPropertyFlagBits::eDeviceLocal) {
+  }
+};
+
 /// This class is a specialisation of GenericBuffer for uniform buffers.
 class UniformBuffer : public GenericBuffer {
 public:
@@ -1458,6 +1810,18 @@ public:
   }
 };
 
+/// This class is a specialisation of GenericBuffer for shader storage buffers,
+/// such as meshlet descriptors and other data read by compute and mesh shaders.
+/// You must upload the contents before use.
+class StorageBuffer : public GenericBuffer {
+public:
+  StorageBuffer() {
+  }
+
+  StorageBuffer(const vk::Device &device, const vk::PhysicalDeviceMemoryProperties &memprops, vk::DeviceSize size) : GenericBuffer(device, memprops, vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst, size, vk::MemoryPropertyFlagBits::eDeviceLocal) {
+  }
+};
+
 /// Convenience class for updating descriptor sets (uniforms)
 class DescriptorSetUpdater {
 public:
@@ -1655,6 +2019,130 @@ private:
   State s;
 };
 
+/// A compute shader with its pipeline, pipeline layout and descriptor set.
+///
+/// The workgroup size is read from the shader. Dimensions declared with
+/// local_size_x_id, local_size_y_id or local_size_z_id are chosen to suit the
+/// device and set by specialization constants, so the same shader runs
+/// full workgroups everywhere.
+///
+///   layout(local_size_x_id = 0) in;
+///
+///   vku::ComputeKernel kernel(device, physicalDevice, cache, pool, shader, dslm, sizeof(PushConstants));
+///   kernel.bind(cb);
+///   kernel.pushConstants(cb, pc);
+///   kernel.dispatch(cb, N);
+///
+class ComputeKernel {
+public:
+  ComputeKernel() {
+  }
+
+  /// Make a kernel from a shader and the layout of its descriptor set.
+  /// dimensions (1, 2 or 3) is the shape of the problem, this decides the shape
+  /// of specialized workgroups.
+  ComputeKernel(vk::Device device, vk::PhysicalDevice physicalDevice, vk::PipelineCache cache, vk::DescriptorPool descriptorPool, vku::ShaderModule &shader, const vku::DescriptorSetLayoutMaker &dslm, uint32_t pushConstantSize = 0, uint32_t dimensions = 1) {
+    auto limits = physicalDevice.getProperties().limits;
+    auto ls = shader.localSize();
+
+    // Preferred shapes, trimmed to the device limits below.
+    static const uint32_t preferred[3][3] = { {256, 1, 1}, {16, 16, 1}, {8, 8, 4} };
+    const uint32_t *pref = preferred[std::min(std::max(dimensions, 1u), 3u) - 1];
+
+    std::vector<SpecConst> specConstants;
+    for (int i = 0; i != 3; ++i) {
+      if (ls.specId[i] >= 0) {
+        ls.size[i] = std::min(pref[i], limits.maxComputeWorkGroupSize[i]);
+      }
+    }
+    for (;;) {
+      uint32_t total = ls.size[0] * ls.size[1] * ls.size[2];
+      if (total <= limits.maxComputeWorkGroupInvocations) break;
+      int largest = -1;
+      for (int i = 0; i != 3; ++i) {
+        if (ls.specId[i] >= 0 && ls.size[i] > 1 && (largest == -1 || ls.size[i] > ls.size[largest])) largest = i;
+      }
+      if (largest == -1) break;
+      ls.size[largest] /= 2;
+    }
+    for (int i = 0; i != 3; ++i) {
+      s.localSize[i] = ls.size[i];
+      if (ls.specId[i] >= 0) {
+        specConstants.emplace_back((uint32_t)ls.specId[i], ls.size[i]);
+      }
+    }
+
+    s.descriptorSetLayout = dslm.createUnique(device);
+
+    vku::DescriptorSetMaker dsm{};
+    dsm.layout(*s.descriptorSetLayout);
+    s.descriptorSet = dsm.create(device, descriptorPool)[0];
+
+    vku::PipelineLayoutMaker plm{};
+    plm.descriptorSetLayout(*s.descriptorSetLayout);
+    if (pushConstantSize) {
+      plm.pushConstantRange(vk::ShaderStageFlagBits::eCompute, 0, pushConstantSize);
+    }
+    s.pipelineLayout = plm.createUnique(device);
+
+    vku::ComputePipelineMaker cpm{};
+    cpm.shader(vk::ShaderStageFlagBits::eCompute, shader, PipelineMaker::SpecData(specConstants));
+    s.pipeline = cpm.createUnique(device, cache, *s.pipelineLayout);
+  }
+
+  /// Number of workgroups needed to cover a problem of x * y * z items.
+  std::array<uint32_t, 3> groupCount(uint32_t x, uint32_t y = 1, uint32_t z = 1) const {
+    return {
+      (x + s.localSize[0] - 1) / s.localSize[0],
+      (y + s.localSize[1] - 1) / s.localSize[1],
+      (z + s.localSize[2] - 1) / s.localSize[2]
+    };
+  }
+
+  /// Bind the pipeline and descriptor set.
+  void bind(vk::CommandBuffer cb) const {
+    cb.bindPipeline(vk::PipelineBindPoint::eCompute, *s.pipeline);
+    cb.bindDescriptorSets(vk::PipelineBindPoint::eCompute, *s.pipelineLayout, 0, s.descriptorSet, nullptr);
+  }
+
+  /// Set the push constants.
+  template <class Type>
+  void pushConstants(vk::CommandBuffer cb, const Type &value) const {
+    cb.pushConstants(*s.pipelineLayout, vk::ShaderStageFlagBits::eCompute, 0, (uint32_t)sizeof(Type), &value);
+  }
+
+  /// Dispatch enough workgroups for x * y * z items.
+  /// The shader must check gl_GlobalInvocationID against the problem size.
+  void dispatch(vk::CommandBuffer cb, uint32_t x, uint32_t y = 1, uint32_t z = 1) const {
+    auto groups = groupCount(x, y, z);
+    cb.dispatch(groups[0], groups[1], groups[2]);
+  }
+
+  /// Dispatch with group counts read from a VkDispatchIndirectCommand in a buffer,
+  /// eg. written by a previous pass. The buffer needs eIndirectBuffer usage.
+  void dispatchIndirect(vk::CommandBuffer cb, vk::Buffer buffer, vk::DeviceSize offset = 0) const {
+    cb.dispatchIndirect(buffer, offset);
+  }
+
+  /// Workgroup size in dimension i, after specialization.
+  uint32_t localSize(int i) const { return s.localSize[i]; }
+  vk::Pipeline pipeline() const { return *s.pipeline; }
+  vk::PipelineLayout pipelineLayout() const { return *s.pipelineLayout; }
+  vk::DescriptorSetLayout descriptorSetLayout() const { return *s.descriptorSetLayout; }
+  vk::DescriptorSet descriptorSet() const { return s.descriptorSet; }
+
+private:
+  struct State {
+    vk::UniqueDescriptorSetLayout descriptorSetLayout;
+    vk::DescriptorSet descriptorSet;
+    vk::UniquePipelineLayout pipelineLayout;
+    vk::UniquePipeline pipeline;
+    uint32_t localSize[3] = {1, 1, 1};
+  };
+
+  State s;
+};
+
 /// Generic image with a view and memory object.
 /// Vulkan images need a memory object to hold the data and a view object for the GPU to access the data.
 class GenericImage {
@@ -1974,6 +2462,199 @@ public:
 private:
 };
 
+/// A persistently mapped ring of host memory for reading results back from the GPU
+/// without stalling the frame loop.
+///
+/// readback() records a copy into the ring and returns a future.
+/// submitted() tells the ring which fence covers the copies recorded so far.
+/// poll(), called once a frame, completes the futures whose fence has signalled.
+///
+///   auto result = ring.readback(cb, buffer.buffer(), 0, size);
+///   ... submit cb with a fence ...
+///   ring.submitted(fence);
+///   ...
+///   ring.poll();
+///   if (result.wait_for(std::chrono::seconds(0)) == std::future_status::ready) use(result.get());
+///
+class ReadbackRing {
+public:
+  ReadbackRing() {
+  }
+
+  /// Make a ring of at least size bytes.
+  /// nonCoherentAtomSize should come from the device limits, the default is the largest allowed.
+  ReadbackRing(vk::Device device, const vk::PhysicalDeviceMemoryProperties &memprops, vk::DeviceSize size, vk::DeviceSize nonCoherentAtomSize = 256) {
+    s.device = device;
+    s.atomSize = nonCoherentAtomSize;
+    s.size = roundUp(size, s.atomSize);
+    s.buffer = vku::GenericBuffer(device, memprops, vk::BufferUsageFlagBits::eTransferDst, s.size, vku::readbackMemoryFlags(memprops));
+    s.mapped = (const uint8_t*)s.buffer.map(device);
+  }
+
+  /// Record a copy of part of a buffer. The source needs eTransferSrc usage.
+  std::future<std::vector<uint8_t>> readback(vk::CommandBuffer cb, vk::Buffer buffer, vk::DeviceSize offset, vk::DeviceSize size) {
+    vk::DeviceSize dst = 0;
+    if (size != 0) {
+      dst = allocate(size, s.atomSize);
+      barrierBefore(cb);
+      vk::BufferCopy bc{offset, dst, size};
+      cb.copyBuffer(buffer, s.buffer.buffer(), bc);
+      barrierAfter(cb);
+    }
+    return add(dst, size);
+  }
+
+  /// Record a copy of one mip level and layer of an image, eg. for a screenshot.
+  /// Texels are tightly packed. The image needs eTransferSrc usage and is left in eTransferSrcOptimal.
+  std::future<std::vector<uint8_t>> readback(vk::CommandBuffer cb, vku::GenericImage &image, uint32_t mipLevel = 0, uint32_t arrayLayer = 0, vk::ImageAspectFlags aspectMask = vk::ImageAspectFlagBits::eColor) {
+    auto bp = getBlockParams(image.format());
+    auto width = mipScale(image.extent().width, mipLevel);
+    auto height = mipScale(image.extent().height, mipLevel);
+    auto depth = mipScale(image.extent().depth, mipLevel);
+    vk::DeviceSize size = vk::DeviceSize((width + bp.blockWidth - 1) / bp.blockWidth) * ((height + bp.blockHeight - 1) / bp.blockHeight) * depth * bp.bytesPerBlock;
+
+    // Buffer offsets for image copies must be a multiple of the texel size and of four.
+    vk::DeviceSize alignment = s.atomSize;
+    while (alignment % 4 || alignment % bp.bytesPerBlock) alignment += s.atomSize;
+
+    vk::DeviceSize dst = 0;
+    if (size != 0) {
+      dst = allocate(size, alignment);
+      barrierBefore(cb);
+      image.setLayout(cb, vk::ImageLayout::eTransferSrcOptimal, aspectMask);
+      vk::BufferImageCopy region{};
+      region.bufferOffset = dst;
+      region.imageSubresource = {aspectMask, mipLevel, arrayLayer, 1};
+      region.imageExtent = vk::Extent3D{width, height, depth};
+      cb.copyImageToBuffer(image.image(), vk::ImageLayout::eTransferSrcOptimal, s.buffer.buffer(), region);
+      barrierAfter(cb);
+    }
+    return add(dst, size);
+  }
+
+  /// The copies recorded since the last call will be complete when this fence signals.
+  /// The fence may be reused, but poll() must be called at least once per reuse.
+  void submitted(vk::Fence fence) {
+    for (auto &r : s.requests) {
+      if (!r.submitted) {
+        r.fence = fence;
+        r.submitted = true;
+      }
+    }
+  }
+
+  /// Complete the futures of finished copies and recycle their memory.
+  /// Returns the number of futures completed.
+  int poll() {
+    int completed = 0;
+    while (!s.requests.empty()) {
+      auto &r = s.requests.front();
+      if (r.size != 0) {
+        if (!r.submitted || s.device.getFenceStatus(r.fence) != vk::Result::eSuccess) break;
+
+        // Invalidate whole atoms around the copy (no-op for coherent memory).
+        vk::DeviceSize begin = r.offset / s.atomSize * s.atomSize;
+        vk::DeviceSize end = roundUp(r.offset + r.size, s.atomSize);
+        vk::MappedMemoryRange mr{s.buffer.mem(), begin, end - begin};
+        s.device.invalidateMappedMemoryRanges(mr);
+      }
+
+      r.promise.set_value(std::vector<uint8_t>(s.mapped + r.offset, s.mapped + r.offset + r.size));
+      s.requests.pop_front();
+      ++completed;
+    }
+    return completed;
+  }
+
+  /// Wait for every submitted copy and complete the futures.
+  void wait() {
+    for (auto &r : s.requests) {
+      if (r.submitted && r.size != 0) {
+        s.device.waitForFences(r.fence, VK_TRUE, std::numeric_limits<uint64_t>::max());
+      }
+    }
+    poll();
+  }
+
+  /// Number of copies not yet completed.
+  size_t pending() const { return s.requests.size(); }
+  vk::DeviceSize size() const { return s.size; }
+
+private:
+  static vk::DeviceSize roundUp(vk::DeviceSize value, vk::DeviceSize alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+  }
+
+  // Find space after the newest request, wrapping to the start if needed.
+  vk::DeviceSize allocate(vk::DeviceSize size, vk::DeviceSize alignment) {
+    vk::DeviceSize alignedSize = roundUp(size, s.atomSize);
+    vk::DeviceSize offset = 0;
+    bool ok = false;
+
+    // Requests are freed in order, so the live region runs from the oldest to head.
+    auto oldest = std::find_if(s.requests.begin(), s.requests.end(), [](const Request &r) { return r.size != 0; });
+    if (oldest == s.requests.end()) {
+      s.head = 0;
+      ok = alignedSize <= s.size;
+    } else if (s.head > oldest->offset) {
+      offset = roundUp(s.head, alignment);
+      ok = offset + alignedSize <= s.size;
+      if (!ok) {
+        offset = 0;
+        ok = alignedSize <= oldest->offset;
+      }
+    } else {
+      offset = roundUp(s.head, alignment);
+      ok = offset + alignedSize <= oldest->offset;
+    }
+
+    if (!ok) {
+      throw std::runtime_error("vku::ReadbackRing is full: call poll() more often or make the ring bigger");
+    }
+    s.head = offset + alignedSize;
+    return offset;
+  }
+
+  std::future<std::vector<uint8_t>> add(vk::DeviceSize offset, vk::DeviceSize size) {
+    s.requests.emplace_back();
+    s.requests.back().offset = offset;
+    s.requests.back().size = size;
+    return s.requests.back().promise.get_future();
+  }
+
+  // Make earlier writes, eg. from a compute shader, visible to the copy.
+  void barrierBefore(vk::CommandBuffer cb) {
+    vk::MemoryBarrier mb{vk::AccessFlagBits::eMemoryWrite, vk::AccessFlagBits::eTransferRead};
+    cb.pipelineBarrier(vk::PipelineStageFlagBits::eAllCommands, vk::PipelineStageFlagBits::eTransfer, {}, mb, nullptr, nullptr);
+  }
+
+  // Make the copy visible to the host.
+  void barrierAfter(vk::CommandBuffer cb) {
+    vk::MemoryBarrier mb{vk::AccessFlagBits::eTransferWrite, vk::AccessFlagBits::eHostRead};
+    cb.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eHost, {}, mb, nullptr, nullptr);
+  }
+
+  struct Request {
+    vk::DeviceSize offset = 0;
+    vk::DeviceSize size = 0;
+    vk::Fence fence;
+    bool submitted = false;
+    std::promise<std::vector<uint8_t>> promise;
+  };
+
+  struct State {
+    vk::Device device;
+    vku::GenericBuffer buffer;
+    const uint8_t *mapped = nullptr;
+    vk::DeviceSize size = 0;
+    vk::DeviceSize atomSize = 256;
+    vk::DeviceSize head = 0;
+    std::deque<Request> requests;
+  };
+
+  State s;
+};
+
 /// A class to help build samplers.
 /// Samplers tell the shader stages how to sample an image.
 /// They are used in combination with an image to make a combined image sampler
@@ -2048,6 +2729,498 @@ private:
   State s;
 };
 
+/// A min/max hierarchical Z buffer (Hi-Z) built from a depth attachment.
+///
+/// Mip 0 is a power of two at least half the size of the depth buffer. Each texel holds the
+/// (min, max) depth of all the depth texels it covers and each following mip reduces 2x2 texels
+/// of the one before. A compute shader can then reject a bounding sphere by comparing its nearest
+/// depth with the max depth of a few texels at the mip that matches its size on screen.
+///
+/// The chain is built by a single dispatch of a downsampling shader such as
+/// examples/gpuCulling/depthPyramid.comp. It must use these bindings:
+///   0: combined image sampler: the depth buffer
+///   1: storage image array[DepthPyramid::maxMipLevels]: the mip levels (rg32f)
+///   2: storage buffer: a uint work group counter
+/// and push constants { ivec2 depthSize; ivec2 size; int mipLevels; uint numGroups; }
+class DepthPyramid {
+public:
+  /// Enough for a 16384 x 16384 depth buffer.
+  static constexpr uint32_t maxMipLevels = 14;
+
+  DepthPyramid() {
+  }
+
+  DepthPyramid(vk::Device device, const vk::PhysicalDeviceMemoryProperties &memprops, vk::PipelineCache cache, vk::DescriptorPool descriptorPool, vku::ShaderModule &shader) {
+    s.device = device;
+    s.memprops = memprops;
+
+    vku::SamplerMaker sm{};
+    sm.addressModeU(vk::SamplerAddressMode::eClampToEdge);
+    sm.addressModeV(vk::SamplerAddressMode::eClampToEdge);
+    sm.maxLod((float)maxMipLevels);
+    s.sampler = sm.createUnique(device);
+
+    vku::DescriptorSetLayoutMaker dslm{};
+    dslm.image(0, vk::DescriptorType::eCombinedImageSampler, vk::ShaderStageFlagBits::eCompute, 1);
+    dslm.image(1, vk::DescriptorType::eStorageImage, vk::ShaderStageFlagBits::eCompute, maxMipLevels);
+    dslm.buffer(2, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute, 1);
+    s.descriptorSetLayout = dslm.createUnique(device);
+
+    vku::DescriptorSetMaker dsm{};
+    dsm.layout(*s.descriptorSetLayout);
+    s.descriptorSet = dsm.create(device, descriptorPool)[0];
+
+    vku::PipelineLayoutMaker plm{};
+    plm.descriptorSetLayout(*s.descriptorSetLayout);
+    plm.pushConstantRange(vk::ShaderStageFlagBits::eCompute, 0, sizeof(PushConstants));
+    s.pipelineLayout = plm.createUnique(device);
+
+    vku::ComputePipelineMaker cpm{};
+    cpm.shader(vk::ShaderStageFlagBits::eCompute, shader);
+    s.pipeline = cpm.createUnique(device, cache, *s.pipelineLayout);
+
+    s.counter = vku::GenericBuffer(device, memprops, vk::BufferUsageFlagBits::eStorageBuffer|vk::BufferUsageFlagBits::eTransferDst, sizeof(uint32_t));
+  }
+
+  /// Make the pyramid match the size of a depth buffer, eg. after Window::recreate().
+  /// Returns true if the pyramid was (re)created, in which case descriptor sets that use
+  /// imageView() must be updated. Call this before recording any commands that use the pyramid.
+  bool resize(uint32_t depthWidth, uint32_t depthHeight) {
+    if (depthWidth == s.depthWidth && depthHeight == s.depthHeight) return false;
+
+    // The old pyramid may still be in use by frames in flight. Resizes are rare.
+    if (s.image.image()) {
+      s.device.waitIdle();
+    }
+
+    s.depthWidth = depthWidth;
+    s.depthHeight = depthHeight;
+    s.width = previousPow2(std::max(depthWidth / 2, 1U));
+    s.height = previousPow2(std::max(depthHeight / 2, 1U));
+    if (s.width * 2 < depthWidth) s.width *= 2;
+    if (s.height * 2 < depthHeight) s.height *= 2;
+
+    s.mipLevels = 1;
+    while ((std::max(s.width, s.height) >> s.mipLevels) != 0 && s.mipLevels != maxMipLevels) {
+      ++s.mipLevels;
+    }
+
+    vk::ImageCreateInfo info;
+    info.imageType = vk::ImageType::e2D;
+    info.format = vk::Format::eR32G32Sfloat;
+    info.extent = vk::Extent3D{ s.width, s.height, 1U };
+    info.mipLevels = s.mipLevels;
+    info.arrayLayers = 1;
+    info.samples = vk::SampleCountFlagBits::e1;
+    info.tiling = vk::ImageTiling::eOptimal;
+    info.usage = vk::ImageUsageFlagBits::eStorage|vk::ImageUsageFlagBits::eSampled;
+    info.sharingMode = vk::SharingMode::eExclusive;
+    info.initialLayout = vk::ImageLayout::eUndefined;
+    s.image = vku::GenericImage(s.device, s.memprops, info, vk::ImageViewType::e2D, vk::ImageAspectFlagBits::eColor, false);
+
+    // The downsampler writes to one view per mip level.
+    s.mipViews.clear();
+    for (uint32_t mipLevel = 0; mipLevel != s.mipLevels; ++mipLevel) {
+      vk::ImageViewCreateInfo viewInfo{};
+      viewInfo.image = s.image.image();
+      viewInfo.viewType = vk::ImageViewType::e2D;
+      viewInfo.format = info.format;
+      viewInfo.subresourceRange = vk::ImageSubresourceRange{vk::ImageAspectFlagBits::eColor, mipLevel, 1, 0, 1};
+      s.mipViews.push_back(s.device.createImageViewUnique(viewInfo));
+    }
+
+    s.ready = false;
+    s.initialized = false;
+    return true;
+  }
+
+  /// Record commands to build the pyramid from a depth buffer. Call resize() first.
+  /// The depth buffer must be in eDepthStencilAttachmentOptimal layout, for example just after the
+  /// render pass that wrote it, and is returned to that layout.
+  void build(vk::CommandBuffer cb, vku::GenericImage &depth) {
+    vk::ImageAspectFlags aspect = vk::ImageAspectFlagBits::eDepth;
+    switch (depth.format()) {
+      case vk::Format::eD16UnormS8Uint: case vk::Format::eD24UnormS8Uint: case vk::Format::eD32SfloatS8Uint: aspect |= vk::ImageAspectFlagBits::eStencil; break;
+      default: break;
+    }
+
+    if (s.depthView != depth.imageView() || !s.initialized) {
+      // Point the shader at this depth buffer and the pyramid.
+      s.depthView = depth.imageView();
+      vku::DescriptorSetUpdater update(1, maxMipLevels + 1);
+      update.beginDescriptorSet(s.descriptorSet);
+      update.beginImages(0, 0, vk::DescriptorType::eCombinedImageSampler);
+      update.image(*s.sampler, s.depthView, vk::ImageLayout::eDepthStencilReadOnlyOptimal);
+      update.beginImages(1, 0, vk::DescriptorType::eStorageImage);
+      for (uint32_t mipLevel = 0; mipLevel != maxMipLevels; ++mipLevel) {
+        // Unused array elements repeat the last mip.
+        update.image(vk::Sampler{}, *s.mipViews[std::min(mipLevel, s.mipLevels - 1)], vk::ImageLayout::eGeneral);
+      }
+      update.beginBuffers(2, 0, vk::DescriptorType::eStorageBuffer);
+      update.buffer(s.counter.buffer(), 0, sizeof(uint32_t));
+      update.update(s.device);
+    }
+
+    vk::ImageMemoryBarrier depthBarrier{};
+    depthBarrier.srcAccessMask = vk::AccessFlagBits::eDepthStencilAttachmentWrite;
+    depthBarrier.dstAccessMask = vk::AccessFlagBits::eShaderRead;
+    depthBarrier.oldLayout = vk::ImageLayout::eDepthStencilAttachmentOptimal;
+    depthBarrier.newLayout = vk::ImageLayout::eDepthStencilReadOnlyOptimal;
+    depthBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    depthBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    depthBarrier.image = depth.image();
+    depthBarrier.subresourceRange = {aspect, 0, 1, 0, 1};
+
+    // The previous build (or anything else sampling the pyramid) must finish before we overwrite it.
+    vk::ImageMemoryBarrier pyramidBarrier{};
+    pyramidBarrier.srcAccessMask = vk::AccessFlagBits::eShaderRead;
+    pyramidBarrier.dstAccessMask = vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite;
+    pyramidBarrier.oldLayout = s.initialized ? vk::ImageLayout::eGeneral : vk::ImageLayout::eUndefined;
+    pyramidBarrier.newLayout = vk::ImageLayout::eGeneral;
+    pyramidBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    pyramidBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    pyramidBarrier.image = s.image.image();
+    pyramidBarrier.subresourceRange = {vk::ImageAspectFlagBits::eColor, 0, s.mipLevels, 0, 1};
+
+    if (!s.initialized) {
+      // The shader resets the counter after each build.
+      cb.fillBuffer(s.counter.buffer(), 0, sizeof(uint32_t), 0);
+      vk::BufferMemoryBarrier counterBarrier{vk::AccessFlagBits::eTransferWrite, vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite, VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED, s.counter.buffer(), 0, VK_WHOLE_SIZE};
+      cb.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eComputeShader, {}, nullptr, counterBarrier, nullptr);
+      s.initialized = true;
+    }
+
+    std::array<vk::ImageMemoryBarrier, 2> barriers{depthBarrier, pyramidBarrier};
+    cb.pipelineBarrier(vk::PipelineStageFlagBits::eEarlyFragmentTests|vk::PipelineStageFlagBits::eLateFragmentTests|vk::PipelineStageFlagBits::eComputeShader, vk::PipelineStageFlagBits::eComputeShader, {}, nullptr, nullptr, barriers);
+
+    uint32_t groupsX = (s.width + 31) / 32;
+    uint32_t groupsY = (s.height + 31) / 32;
+    PushConstants pc{};
+    pc.depthSize[0] = (int32_t)s.depthWidth;
+    pc.depthSize[1] = (int32_t)s.depthHeight;
+    pc.size[0] = (int32_t)s.width;
+    pc.size[1] = (int32_t)s.height;
+    pc.mipLevels = (int32_t)s.mipLevels;
+    pc.numGroups = groupsX * groupsY;
+
+    cb.bindPipeline(vk::PipelineBindPoint::eCompute, *s.pipeline);
+    cb.bindDescriptorSets(vk::PipelineBindPoint::eCompute, *s.pipelineLayout, 0, s.descriptorSet, nullptr);
+    cb.pushConstants(*s.pipelineLayout, vk::ShaderStageFlagBits::eCompute, 0, sizeof(pc), &pc);
+    cb.dispatch(groupsX, groupsY, 1);
+
+    // Make the pyramid visible to later compute shaders and give the depth buffer back to the render pass.
+    depthBarrier.srcAccessMask = vk::AccessFlagBits::eShaderRead;
+    depthBarrier.dstAccessMask = vk::AccessFlagBits::eDepthStencilAttachmentRead|vk::AccessFlagBits::eDepthStencilAttachmentWrite;
+    depthBarrier.oldLayout = vk::ImageLayout::eDepthStencilReadOnlyOptimal;
+    depthBarrier.newLayout = vk::ImageLayout::eDepthStencilAttachmentOptimal;
+    pyramidBarrier.srcAccessMask = vk::AccessFlagBits::eShaderWrite;
+    pyramidBarrier.dstAccessMask = vk::AccessFlagBits::eShaderRead;
+    pyramidBarrier.oldLayout = vk::ImageLayout::eGeneral;
+    barriers = {depthBarrier, pyramidBarrier};
+    cb.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader, vk::PipelineStageFlagBits::eComputeShader|vk::PipelineStageFlagBits::eEarlyFragmentTests|vk::PipelineStageFlagBits::eLateFragmentTests, {}, nullptr, nullptr, barriers);
+
+    s.ready = true;
+  }
+
+  /// The view of all the mip levels for sampling in shaders.
+  vk::ImageView imageView() const { return s.image.imageView(); }
+
+  /// A nearest, clamped sampler to use with imageView().
+  vk::Sampler sampler() const { return *s.sampler; }
+
+  /// The layout of the pyramid when sampled.
+  vk::ImageLayout layout() const { return vk::ImageLayout::eGeneral; }
+
+  /// Width of mip 0.
+  uint32_t width() const { return s.width; }
+
+  /// Height of mip 0.
+  uint32_t height() const { return s.height; }
+
+  uint32_t mipLevels() const { return s.mipLevels; }
+
+  /// True if build() has been recorded since the last resize.
+  bool ready() const { return s.ready; }
+
+private:
+  struct PushConstants {
+    int32_t depthSize[2];
+    int32_t size[2];
+    int32_t mipLevels;
+    uint32_t numGroups;
+  };
+
+  static uint32_t previousPow2(uint32_t value) {
+    uint32_t result = 1;
+    while (result * 2 <= value) result *= 2;
+    return result;
+  }
+
+  struct State {
+    vk::Device device;
+    vk::PhysicalDeviceMemoryProperties memprops;
+    vk::UniqueSampler sampler;
+    vk::UniqueDescriptorSetLayout descriptorSetLayout;
+    vk::DescriptorSet descriptorSet;
+    vk::UniquePipelineLayout pipelineLayout;
+    vk::UniquePipeline pipeline;
+    vku::GenericBuffer counter;
+    vku::GenericImage image;
+    std::vector<vk::UniqueImageView> mipViews;
+    vk::ImageView depthView;
+    uint32_t depthWidth = 0;
+    uint32_t depthHeight = 0;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t mipLevels = 0;
+    bool initialized = false;
+    bool ready = false;
+  };
+
+  State s;
+};
+
+/// Marching cubes on the GPU.
+///
+/// Polygonises a grid of float samples into device local vertex and index buffers and
+/// writes an indirect draw command, so an animated field can be drawn every frame without
+/// the mesh visiting the CPU. The surface is where the samples cross isoLevel and
+/// samples below it are outside. Vertices and triangles come out in the same order as
+/// the marching cubes of gilgamesh::basic_mesh, which makes the two easy to compare.
+///
+/// The passes are run by a compute shader such as examples/marchingCubes/marchingCubes.comp.
+/// It must use local_size_x_id = 0 and these bindings:
+///   0: uniform buffer: the triangle table as uvec4[128]
+///   1: storage buffer: float samples, x fastest
+///   2: storage buffer: uvec2 vertex and triangle counts being scanned
+///   3: storage buffer: uint first vertex of each sample
+///   4: storage buffer: the vertices (MarchingCubes::Vertex)
+///   5: storage buffer: uint32 indices
+///   6: storage buffer: MarchingCubes::Result
+/// and push constants laid out as MarchingCubes::PushConstants.
+///
+///   vku::MarchingCubes mc(device, fw.physicalDevice(), fw.memprops(), fw.pipelineCache(), fw.descriptorPool(), shader, table, 128, 128, 128);
+///   mc.samples().upload(device, fw.memprops(), commandPool, queue, values);
+///   mc.build(cb);     // outside a render pass
+///   mc.draw(cb);      // inside a render pass with a pipeline for MarchingCubes::Vertex
+///
+/// The samples and the first vertex of each sample take eight bytes per sample,
+/// the scan a little more than eight bytes per workgroup.
+class MarchingCubes {
+public:
+  /// One vertex: vertexBinding(0, sizeof(Vertex)) with two eR32G32B32Sfloat attributes.
+  struct Vertex {
+    float pos[3];
+    float normal[3];
+  };
+
+  /// The contents of indirectBuffer() after build().
+  struct Result {
+    vk::DrawIndexedIndirectCommand draw;
+    uint32_t drawCount;     ///< 1 if there are any triangles, for drawIndexedIndirectCount
+    uint32_t numVertices;   ///< vertices in the surface, which may be more than maxVertices
+    uint32_t numTriangles;  ///< triangles in the surface, which may be more than maxTriangles
+  };
+
+  /// Push constants of the shader (std430).
+  struct PushConstants {
+    int32_t size[3];
+    uint32_t mode;
+    float origin[3];
+    uint32_t count;
+    float scale[3];
+    uint32_t src;
+    uint32_t dst;
+    uint32_t maxVertices;
+    uint32_t maxTriangles;
+    float isoLevel;
+  };
+
+  MarchingCubes() {
+  }
+
+  /// Make the buffers for an xdim * ydim * zdim grid of samples.
+  /// triangleTable has 256 entries of triangles as 4 bit edge numbers from the top,
+  /// ending with 0xc, eg. gilgamesh::basic_mesh<>::mc_triangles().
+  /// Triangles past maxTriangles are dropped and ones using vertices past maxVertices
+  /// are left degenerate. Result says how many were needed.
+  MarchingCubes(vk::Device device, vk::PhysicalDevice physicalDevice, const vk::PhysicalDeviceMemoryProperties &memprops, vk::PipelineCache cache, vk::DescriptorPool descriptorPool, vku::ShaderModule &shader, const uint64_t *triangleTable, uint32_t xdim, uint32_t ydim, uint32_t zdim, uint32_t maxVertices = 0x100000, uint32_t maxTriangles = 0x200000) {
+    s.size[0] = std::max(xdim, 1U);
+    s.size[1] = std::max(ydim, 1U);
+    s.size[2] = std::max(zdim, 1U);
+    s.numSamples = s.size[0] * s.size[1] * s.size[2];
+    s.maxVertices = std::max(maxVertices, 1U);
+    s.maxTriangles = std::max(maxTriangles, 1U);
+
+    for (size_t i = 0; i != 256; ++i) {
+      s.table[i * 2 + 0] = (uint32_t)triangleTable[i];
+      s.table[i * 2 + 1] = (uint32_t)(triangleTable[i] >> 32);
+    }
+
+    vku::DescriptorSetLayoutMaker dslm{};
+    dslm.buffer(0, vk::DescriptorType::eUniformBuffer, vk::ShaderStageFlagBits::eCompute, 1);
+    for (uint32_t binding = 1; binding != 7; ++binding) {
+      dslm.buffer(binding, vk::DescriptorType::eStorageBuffer, vk::ShaderStageFlagBits::eCompute, 1);
+    }
+    s.kernel = vku::ComputeKernel(device, physicalDevice, cache, descriptorPool, shader, dslm, sizeof(PushConstants));
+
+    // Each level of the scan holds one sum per workgroup of the level below.
+    // The top level has one entry and its total goes in the slot after it.
+    uint32_t groupSize = s.kernel.localSize(0);
+    uint32_t offset = 0, count = s.numSamples;
+    do {
+      count = (count + groupSize - 1) / groupSize;
+      s.levels.push_back(Level{offset, count});
+      offset += count;
+    } while (count > 1);
+    s.totalOffset = offset;
+
+    using buf = vk::BufferUsageFlagBits;
+    s.tableBuffer = vku::UniformBuffer(device, memprops, sizeof(s.table));
+    s.samples = vku::GenericBuffer(device, memprops, buf::eStorageBuffer|buf::eTransferDst|buf::eTransferSrc, (vk::DeviceSize)s.numSamples * sizeof(float));
+    s.scan = vku::GenericBuffer(device, memprops, buf::eStorageBuffer, (vk::DeviceSize)(s.totalOffset + 1) * sizeof(uint32_t) * 2);
+    s.vertexBase = vku::GenericBuffer(device, memprops, buf::eStorageBuffer, (vk::DeviceSize)s.numSamples * sizeof(uint32_t));
+    s.vertices = vku::GenericBuffer(device, memprops, buf::eVertexBuffer|buf::eStorageBuffer|buf::eTransferSrc, (vk::DeviceSize)s.maxVertices * sizeof(Vertex));
+    s.indices = vku::GenericBuffer(device, memprops, buf::eIndexBuffer|buf::eStorageBuffer|buf::eTransferSrc, (vk::DeviceSize)s.maxTriangles * sizeof(uint32_t) * 3);
+    s.result = vku::GenericBuffer(device, memprops, buf::eIndirectBuffer|buf::eStorageBuffer|buf::eTransferSrc, sizeof(Result));
+
+    vku::DescriptorSetUpdater update(7, 0);
+    update.beginDescriptorSet(s.kernel.descriptorSet());
+    update.beginBuffers(0, 0, vk::DescriptorType::eUniformBuffer);
+    update.buffer(s.tableBuffer.buffer(), 0, s.tableBuffer.size());
+    const vku::GenericBuffer *storage[] = { &s.samples, &s.scan, &s.vertexBase, &s.vertices, &s.indices, &s.result };
+    for (uint32_t binding = 1; binding != 7; ++binding) {
+      update.beginBuffers(binding, 0, vk::DescriptorType::eStorageBuffer);
+      update.buffer(storage[binding - 1]->buffer(), 0, storage[binding - 1]->size());
+    }
+    update.update(device);
+  }
+
+  /// Record a copy of a 3D eR32Sfloat image the size of the grid to samples().
+  /// This leaves the image in eTransferSrcOptimal layout.
+  void copySamples(vk::CommandBuffer cb, vku::GenericImage &image) {
+    image.setLayout(cb, vk::ImageLayout::eTransferSrcOptimal);
+    vk::BufferImageCopy region{};
+    region.imageSubresource = {vk::ImageAspectFlagBits::eColor, 0, 0, 1};
+    region.imageExtent = vk::Extent3D{s.size[0], s.size[1], s.size[2]};
+    cb.copyImageToBuffer(image.image(), vk::ImageLayout::eTransferSrcOptimal, s.samples.buffer(), region);
+  }
+
+  /// Record commands to polygonise samples(). Call this outside a render pass.
+  /// Sample (i, j, k) becomes the point origin + scale * (i, j, k).
+  /// Earlier transfer and compute writes to samples() and earlier draws of the mesh
+  /// are waited for, and the mesh is ready for vertex input and indirect draws after.
+  void build(vk::CommandBuffer cb, const std::array<float, 3> &origin = {0, 0, 0}, const std::array<float, 3> &scale = {1, 1, 1}, float isoLevel = 0) {
+    using psfb = vk::PipelineStageFlagBits;
+    using afb = vk::AccessFlagBits;
+
+    if (!s.initialized) {
+      cb.updateBuffer(s.tableBuffer.buffer(), 0, sizeof(s.table), s.table.data());
+      s.initialized = true;
+    }
+
+    vk::MemoryBarrier before{afb::eTransferWrite|afb::eShaderWrite, afb::eUniformRead|afb::eShaderRead|afb::eShaderWrite};
+    cb.pipelineBarrier(psfb::eTransfer|psfb::eComputeShader|psfb::eDrawIndirect|psfb::eVertexInput, psfb::eComputeShader, {}, before, nullptr, nullptr);
+
+    PushConstants pc{};
+    for (int i = 0; i != 3; ++i) {
+      pc.size[i] = (int32_t)s.size[i];
+      pc.origin[i] = origin[i];
+      pc.scale[i] = scale[i];
+    }
+    pc.maxVertices = s.maxVertices;
+    pc.maxTriangles = s.maxTriangles;
+    pc.isoLevel = isoLevel;
+
+    s.kernel.bind(cb);
+    auto pass = [&](uint32_t mode, uint32_t count, uint32_t src, uint32_t dst) {
+      pc.mode = mode;
+      pc.count = count;
+      pc.src = src;
+      pc.dst = dst;
+      s.kernel.pushConstants(cb, pc);
+
+      // Spread the workgroups over y if there are more than the minimum limit in x.
+      uint32_t groups = (count + s.kernel.localSize(0) - 1) / s.kernel.localSize(0);
+      uint32_t groupsX = std::min(groups, 65535U);
+      cb.dispatch(groupsX, (groups + groupsX - 1) / groupsX, 1);
+
+      vk::MemoryBarrier mb{afb::eShaderWrite, afb::eShaderRead|afb::eShaderWrite};
+      cb.pipelineBarrier(psfb::eComputeShader, psfb::eComputeShader, {}, mb, nullptr, nullptr);
+    };
+
+    // Count, scan the counts and write the vertices before the triangles that use them.
+    size_t numLevels = s.levels.size();
+    pass(modeCount, s.numSamples, 0, s.levels[0].offset);
+    for (size_t level = 0; level != numLevels; ++level) {
+      uint32_t dst = level + 1 != numLevels ? s.levels[level + 1].offset : s.totalOffset;
+      pass(modeScan, s.levels[level].count, s.levels[level].offset, dst);
+    }
+    for (size_t level = numLevels - 1; level-- != 0; ) {
+      pass(modeAdd, s.levels[level].count, s.levels[level].offset, s.levels[level + 1].offset);
+    }
+    pass(modeVertices, s.numSamples, s.levels[0].offset, 0);
+    pass(modeTriangles, s.numSamples, s.levels[0].offset, 0);
+    pass(modeFinish, 1, s.totalOffset, 0);
+
+    vk::MemoryBarrier after{afb::eShaderWrite, afb::eVertexAttributeRead|afb::eIndexRead|afb::eIndirectCommandRead|afb::eTransferRead};
+    cb.pipelineBarrier(psfb::eComputeShader, psfb::eVertexInput|psfb::eDrawIndirect|psfb::eTransfer, {}, after, nullptr, nullptr);
+  }
+
+  /// Record a draw of the mesh. Bind a pipeline that takes MarchingCubes::Vertex at binding 0 first.
+  void draw(vk::CommandBuffer cb) const {
+    cb.bindVertexBuffers(0, s.vertices.buffer(), vk::DeviceSize(0));
+    cb.bindIndexBuffer(s.indices.buffer(), vk::DeviceSize(0), vk::IndexType::eUint32);
+    cb.drawIndexedIndirect(s.result.buffer(), 0, 1, sizeof(Result));
+  }
+
+  /// The samples, x fastest. Upload them, write them from a shader or use copySamples().
+  const vku::GenericBuffer &samples() const { return s.samples; }
+
+  /// MarchingCubes::Vertex array for vertex input or download().
+  const vku::GenericBuffer &vertexBuffer() const { return s.vertices; }
+
+  /// uint32 index array.
+  const vku::GenericBuffer &indexBuffer() const { return s.indices; }
+
+  /// The MarchingCubes::Result for drawIndexedIndirect or drawIndexedIndirectCount (at drawCountOffset()).
+  const vku::GenericBuffer &indirectBuffer() const { return s.result; }
+
+  static constexpr vk::DeviceSize drawCountOffset() { return offsetof(Result, drawCount); }
+
+  uint32_t maxVertices() const { return s.maxVertices; }
+  uint32_t maxTriangles() const { return s.maxTriangles; }
+
+private:
+  enum { modeCount, modeScan, modeAdd, modeVertices, modeTriangles, modeFinish };
+
+  struct Level {
+    uint32_t offset;
+    uint32_t count;
+  };
+
+  struct State {
+    vku::ComputeKernel kernel;
+    vku::UniformBuffer tableBuffer;
+    vku::GenericBuffer samples;
+    vku::GenericBuffer scan;
+    vku::GenericBuffer vertexBase;
+    vku::GenericBuffer vertices;
+    vku::GenericBuffer indices;
+    vku::GenericBuffer result;
+    std::array<uint32_t, 512> table;
+    std::vector<Level> levels;
+    uint32_t totalOffset = 0;
+    uint32_t size[3] = {0, 0, 0};
+    uint32_t numSamples = 0;
+    uint32_t maxVertices = 0;
+    uint32_t maxTriangles = 0;
+    bool initialized = false;
+  };
+
+  State s;
+};
+
 /// KTX files use OpenGL format values. This converts some common ones to Vulkan equivalents.
 inline vk::Format GLtoVKFormat(uint32_t glFormat) {
   switch (glFormat) {
@@ -138,6 +138,7 @@ public:
     poolSizes.emplace_back(vk::DescriptorType::eUniformBuffer, 128);
     poolSizes.emplace_back(vk::DescriptorType::eCombinedImageSampler, 128);
     poolSizes.emplace_back(vk::DescriptorType::eStorageBuffer, 128);
+    poolSizes.emplace_back(vk::DescriptorType::eStorageImage, 128);
 
     // Create an arbitrary number of descriptors in a pool.
     // Allow the descriptors to be freed, possibly not optimal behaviour.
@@ -325,6 +326,9 @@ public:
     vk::CommandPoolCreateInfo cpci{ ccbits::eTransient|ccbits::eResetCommandBuffer, graphicsQueueFamilyIndex };
     commandPool_ = device.createCommandPoolUnique(cpci);
 
+    // Transient command buffers for the dynamic callback, recycled per swap chain image.
+    commandBufferAllocator_ = vku::CommandBufferAllocator(device, graphicsQueueFamilyIndex, (uint32_t)framebuffers_.size());
+
     // Create static draw buffers
     vk::CommandBufferAllocateInfo cbai{ *commandPool_, vk::CommandBufferLevel::ePrimary, (uint32_t)framebuffers_.size() };
     staticDrawBuffers_ = device.allocateCommandBuffersUnique(cbai);
@@ -441,7 +445,7 @@ public:
     vk::Fence rpcbFence = dynamicCommandBufferFences_[imageIndex];
     device.waitForFences(rpcbFence, 1, umax);
     device.resetFences(rpcbFence);
-
+    commandBufferAllocator_.beginFrame(imageIndex);
 
     vk::ClearDepthStencilValue clearDepthValue{ 1.0f, 0 };
     std::array<vk::ClearValue, 2> clearColours{vk::ClearValue{clearColorValue()}, clearDepthValue};
@@ -544,6 +548,9 @@ public:
   /// Return the swap chain images
   const std::vector<vk::Image> &images() const { return images_; }
 
+  /// Return the depth buffer. This is replaced by recreate().
+  vku::DepthStencilImage &depthStencilImage() { return depthStencilImage_; }
+
   /// Return the static command buffers.
   const std::vector<vk::UniqueCommandBuffer> &commandBuffers() const { return staticDrawBuffers_; }
 
@@ -562,6 +569,11 @@ public:
   /// Return a defult command Pool to use to create new command buffers.
   vk::CommandPool commandPool() const { return *commandPool_; }
 
+  /// Return the allocator for transient command buffers.
+  /// Buffers allocated for an imageIndex in the dynamic callback of draw() are recycled
+  /// the next time that image is drawn.
+  vku::CommandBufferAllocator &commandBufferAllocator() { return commandBufferAllocator_; }
+
   /// Return the number of swap chain images.
   int numImageIndices() const { return (int)images_.size(); }
 
@@ -704,6 +716,7 @@ private:
   vk::UniqueSemaphore commandCompleteSemaphore_;
   vk::UniqueSemaphore dynamicSemaphore_;
   vk::UniqueCommandPool commandPool_;
+  vku::CommandBufferAllocator commandBufferAllocator_;
 
   std::vector<vk::ImageView> imageViews_;
   std::vector<vk::Image> images_;